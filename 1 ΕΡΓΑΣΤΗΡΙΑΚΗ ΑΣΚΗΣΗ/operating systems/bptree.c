@@ -0,0 +1,946 @@
+/* (Keep It) Simple Stupid Database: B+tree engine
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+/* Compile with BPTREE_TEST (and -lpthread) to build as a test program. */
+
+/* Like kissdb.c, integers are stored in host byte order, so files are
+ * only portable between machines of the same endianness. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "bptree.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Page 0 holds the file header:
+ *
+ * [0-3]   "KdBT"
+ * [4-7]   version
+ * [8-11]  page size
+ * [12-15] key size
+ * [16-19] value size
+ * [20-23] reserved (0)
+ * [24-31] root page
+ * [32-39] number of pages in the file
+ * [40-47] number of entries
+ *
+ * Every other page is a node:
+ *
+ * [0]     type (leaf or internal)
+ * [1]     reserved (0)
+ * [2-3]   number of cells
+ * [4-5]   offset of the lowest cell
+ * [6-7]   reserved (0)
+ * [8-15]  leaf: next leaf (0 if last); internal: leftmost child
+ * [16-]   2-byte offsets of the cells, in key order
+ *
+ * and cells are packed from the end of the page downwards. A leaf cell is
+ * [klen:2][vlen:2][key][value]; an internal cell is [klen:2][0:2][child:8]
+ * [key], where child holds the keys >= key (and < the next cell's key). */
+#define BPTREE_HEADER_SIZE 48
+#define BPTREE_NODE_HEADER_SIZE 16
+#define BPTREE_LEAF 1
+#define BPTREE_INTERNAL 2
+
+/* Room for cells and their offsets in one node */
+#define BPTREE_NODE_CAPACITY (BPTREE_PAGE_SIZE - BPTREE_NODE_HEADER_SIZE)
+
+/* The fewest page frames that a put (one path plus splits) can need */
+#define BPTREE_MIN_CACHE_PAGES 64
+
+/* One cell of a node being rebuilt */
+typedef struct {
+	const uint8_t *key;
+	unsigned long klen;
+	const uint8_t *value;
+	unsigned long vlen;
+	uint64_t child;
+} BPTREE_Cell;
+
+static inline unsigned long BPTREE_get16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v,p,sizeof(v));
+	return (unsigned long)v;
+}
+
+static inline void BPTREE_put16(uint8_t *p,unsigned long v)
+{
+	uint16_t x = (uint16_t)v;
+	memcpy(p,&x,sizeof(x));
+}
+
+static inline uint64_t BPTREE_get64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static inline void BPTREE_put64(uint8_t *p,uint64_t v)
+{
+	memcpy(p,&v,sizeof(v));
+}
+
+/* Byte order, shorter key first on a common prefix */
+static int BPTREE_compare(const void *a,unsigned long alen,const void *b,unsigned long blen)
+{
+	int c = memcmp(a,b,(alen < blen) ? alen : blen);
+	if (c)
+		return c;
+	return (alen < blen) ? -1 : ((alen > blen) ? 1 : 0);
+}
+
+/* Read exactly len bytes at offset, retrying short reads */
+static int BPTREE_pread(int fd,void *buf,size_t len,uint64_t offset)
+{
+	ssize_t n;
+	while (len) {
+		n = pread(fd,buf,len,(off_t)offset);
+		if (n > 0) {
+			buf = (void *)(((uint8_t *)buf) + n);
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return BPTREE_ERROR_IO;
+	}
+	return 0;
+}
+
+/* Write exactly len bytes at offset, retrying short writes */
+static int BPTREE_pwrite(int fd,const void *buf,size_t len,uint64_t offset)
+{
+	ssize_t n;
+	while (len) {
+		n = pwrite(fd,buf,len,(off_t)offset);
+		if (n > 0) {
+			buf = (const void *)(((const uint8_t *)buf) + n);
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return BPTREE_ERROR_IO;
+	}
+	return 0;
+}
+
+static int BPTREE_write_header(BPTREE *bt)
+{
+	uint8_t h[BPTREE_HEADER_SIZE];
+	uint32_t v;
+
+	memset(h,0,sizeof(h));
+	memcpy(h,"KdBT",4);
+	v = BPTREE_VERSION;
+	memcpy(h + 4,&v,4);
+	v = BPTREE_PAGE_SIZE;
+	memcpy(h + 8,&v,4);
+	v = (uint32_t)bt->key_size;
+	memcpy(h + 12,&v,4);
+	v = (uint32_t)bt->value_size;
+	memcpy(h + 16,&v,4);
+	BPTREE_put64(h + 24,bt->root);
+	BPTREE_put64(h + 32,bt->num_pages);
+	BPTREE_put64(h + 40,bt->count);
+	return BPTREE_pwrite(bt->fd,h,sizeof(h),0);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Page cache: a fixed set of frames, looked up by page number through a
+ * chained hash table and evicted with the CLOCK algorithm. Frames in use
+ * by an operation are pinned and never evicted. */
+
+static inline unsigned long BPTREE_bucket(BPTREE *bt,uint64_t page)
+{
+	return (unsigned long)((page * 0x9e3779b97f4a7c15ULL) >> 32) & (bt->num_buckets - 1);
+}
+
+static int BPTREE_frame_flush(BPTREE *bt,BPTREE_Frame *f)
+{
+	if ((f->page)&&(f->dirty)) {
+		if (BPTREE_pwrite(bt->fd,f->data,BPTREE_PAGE_SIZE,f->page * BPTREE_PAGE_SIZE))
+			return BPTREE_ERROR_IO;
+		f->dirty = 0;
+	}
+	return 0;
+}
+
+/* Get a pinned frame holding page; a fresh page is zeroed rather than read.
+ * Returns the frame, or NULL with *err set. */
+static BPTREE_Frame *BPTREE_fetch(BPTREE *bt,uint64_t page,int fresh,int *err)
+{
+	unsigned long b = BPTREE_bucket(bt,page);
+	unsigned long scanned;
+	BPTREE_Frame *f;
+	long i,*pp;
+
+	for(i=bt->buckets[b];i>=0;i=bt->frames[i].next) {
+		f = &(bt->frames[i]);
+		if (f->page == page) {
+			f->ref = 1;
+			++f->pins;
+			return f;
+		}
+	}
+
+	/* two sweeps clear every reference bit, so a third finding nothing
+	 * means every frame is pinned */
+	for(scanned=0;;++scanned) {
+		if (scanned >= (bt->num_frames * 3)) {
+			*err = BPTREE_ERROR_MALLOC;
+			return (BPTREE_Frame *)0;
+		}
+		i = (long)bt->hand;
+		bt->hand = (bt->hand + 1) % bt->num_frames;
+		f = &(bt->frames[i]);
+		if (f->pins)
+			continue;
+		if (f->ref) {
+			f->ref = 0;
+			continue;
+		}
+		break;
+	}
+
+	if (f->page) {
+		if ((*err = BPTREE_frame_flush(bt,f)))
+			return (BPTREE_Frame *)0;
+		pp = &(bt->buckets[BPTREE_bucket(bt,f->page)]);
+		while (*pp != i)
+			pp = &(bt->frames[*pp].next);
+		*pp = f->next;
+		f->page = 0;
+	}
+
+	if (fresh)
+		memset(f->data,0,BPTREE_PAGE_SIZE);
+	else if (BPTREE_pread(bt->fd,f->data,BPTREE_PAGE_SIZE,page * BPTREE_PAGE_SIZE)) {
+		*err = BPTREE_ERROR_IO;
+		return (BPTREE_Frame *)0;
+	}
+	f->page = page;
+	f->next = bt->buckets[b];
+	bt->buckets[b] = i;
+	f->pins = 1;
+	f->ref = 1;
+	f->dirty = fresh;
+	return f;
+}
+
+static inline void BPTREE_unpin(BPTREE_Frame *f)
+{
+	--f->pins;
+}
+
+/* Add a page at the end of the file */
+static BPTREE_Frame *BPTREE_new_page(BPTREE *bt,int *err)
+{
+	BPTREE_Frame *f = BPTREE_fetch(bt,bt->num_pages,1,err);
+	if (f)
+		++bt->num_pages;
+	return f;
+}
+
+/* ----------------------------------------------------------------------- */
+/* Nodes */
+
+static inline unsigned long BPTREE_node_count(const uint8_t *p)
+{
+	return BPTREE_get16(p + 2);
+}
+
+static inline const uint8_t *BPTREE_node_cell(const uint8_t *p,unsigned long i)
+{
+	return p + BPTREE_get16(p + BPTREE_NODE_HEADER_SIZE + (i * 2));
+}
+
+static inline const uint8_t *BPTREE_cell_key(const uint8_t *p,unsigned long i,unsigned long *klen)
+{
+	const uint8_t *c = BPTREE_node_cell(p,i);
+	*klen = BPTREE_get16(c);
+	return c + ((p[0] == BPTREE_LEAF) ? 4 : 12);
+}
+
+/* Number of cells with a key less than key (or at most key if upper) */
+static unsigned long BPTREE_node_search(const uint8_t *p,const void *key,unsigned long klen,int upper)
+{
+	unsigned long lo = 0,hi = BPTREE_node_count(p),mid,clen;
+	const uint8_t *ckey;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ckey = BPTREE_cell_key(p,mid,&clen);
+		c = BPTREE_compare(ckey,clen,key,klen);
+		if ((c < 0)||((upper)&&(!c)))
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Child of an internal node that covers key */
+static uint64_t BPTREE_node_child(const uint8_t *p,const void *key,unsigned long klen)
+{
+	unsigned long i = BPTREE_node_search(p,key,klen,1);
+	if (!i)
+		return BPTREE_get64(p + 8);
+	return BPTREE_get64(BPTREE_node_cell(p,i - 1) + 4);
+}
+
+static inline unsigned long BPTREE_cell_size(int type,const BPTREE_Cell *c)
+{
+	return 2 + ((type == BPTREE_LEAF) ? (4 + c->klen + c->vlen) : (12 + c->klen));
+}
+
+/* Read the cells of a node; they point into p, which must stay put */
+static unsigned long BPTREE_node_cells(const uint8_t *p,BPTREE_Cell *cells)
+{
+	unsigned long i,n = BPTREE_node_count(p);
+	const uint8_t *c;
+
+	for(i=0;i<n;++i) {
+		c = BPTREE_node_cell(p,i);
+		cells[i].klen = BPTREE_get16(c);
+		if (p[0] == BPTREE_LEAF) {
+			cells[i].vlen = BPTREE_get16(c + 2);
+			cells[i].key = c + 4;
+			cells[i].value = c + 4 + cells[i].klen;
+			cells[i].child = 0;
+		} else {
+			cells[i].vlen = 0;
+			cells[i].child = BPTREE_get64(c + 4);
+			cells[i].key = c + 12;
+			cells[i].value = (const uint8_t *)0;
+		}
+	}
+	return n;
+}
+
+/* Write a node made of the given cells, which must fit */
+static void BPTREE_node_build(uint8_t *p,int type,uint64_t link,const BPTREE_Cell *cells,unsigned long n)
+{
+	unsigned long i,end = BPTREE_PAGE_SIZE;
+	uint8_t *c;
+
+	memset(p,0,BPTREE_PAGE_SIZE);
+	p[0] = (uint8_t)type;
+	BPTREE_put16(p + 2,n);
+	BPTREE_put64(p + 8,link);
+	for(i=0;i<n;++i) {
+		end -= BPTREE_cell_size(type,&cells[i]) - 2;
+		c = p + end;
+		BPTREE_put16(c,cells[i].klen);
+		if (type == BPTREE_LEAF) {
+			BPTREE_put16(c + 2,cells[i].vlen);
+			memcpy(c + 4,cells[i].key,cells[i].klen);
+			memcpy(c + 4 + cells[i].klen,cells[i].value,cells[i].vlen);
+		} else {
+			BPTREE_put64(c + 4,cells[i].child);
+			memcpy(c + 12,cells[i].key,cells[i].klen);
+		}
+		BPTREE_put16(p + BPTREE_NODE_HEADER_SIZE + (i * 2),end);
+	}
+	BPTREE_put16(p + 4,end);
+}
+
+static unsigned long BPTREE_cells_size(int type,const BPTREE_Cell *cells,unsigned long n)
+{
+	unsigned long i,s = 0;
+	for(i=0;i<n;++i)
+		s += BPTREE_cell_size(type,&cells[i]);
+	return s;
+}
+
+/* Where to split n cells that don't fit one node: the first index at which
+ * the cells before it take half the bytes or more, kept within [1,n-1] */
+static unsigned long BPTREE_split_point(int type,const BPTREE_Cell *cells,unsigned long n)
+{
+	unsigned long total = BPTREE_cells_size(type,cells,n);
+	unsigned long k = 0,s = 0;
+
+	while ((k < n)&&((s * 2) < total))
+		s += BPTREE_cell_size(type,&cells[k++]);
+	if (k < 1)
+		k = 1;
+	if (k > (n - 1))
+		k = n - 1;
+	return k;
+}
+
+/* Insert or replace c in the subtree rooted at page. Returns 1 if the node
+ * split, with the first key of the new right node in sep/seplen and its
+ * page in *right; 0 if not; negative on error. *added is set if c was a
+ * new key rather than a replacement. */
+static int BPTREE_insert(BPTREE *bt,uint64_t page,const BPTREE_Cell *c,uint8_t *sep,unsigned long *seplen,uint64_t *right,int *added)
+{
+	BPTREE_Cell *cells = (BPTREE_Cell *)bt->cells;
+	BPTREE_Cell ins;
+	BPTREE_Frame *f,*rf;
+	uint8_t csep[BPTREE_PAGE_SIZE];
+	unsigned long csep_len,n,i,k;
+	uint64_t cright,link;
+	int type,r = 0,err = 0;
+
+	if (!(f = BPTREE_fetch(bt,page,0,&err)))
+		return err;
+	type = f->data[0];
+	if ((type != BPTREE_LEAF)&&(type != BPTREE_INTERNAL)) {
+		BPTREE_unpin(f);
+		return BPTREE_ERROR_CORRUPT_DBFILE;
+	}
+
+	if (type == BPTREE_LEAF) {
+		i = BPTREE_node_search(f->data,c->key,c->klen,0);
+		memcpy(bt->scratch,f->data,BPTREE_PAGE_SIZE);
+		n = BPTREE_node_cells(bt->scratch,cells);
+		if ((i < n)&&(!BPTREE_compare(cells[i].key,cells[i].klen,c->key,c->klen)))
+			cells[i] = *c;
+		else {
+			memmove(cells + i + 1,cells + i,sizeof(BPTREE_Cell) * (n - i));
+			cells[i] = *c;
+			++n;
+			*added = 1;
+		}
+	} else {
+		if ((r = BPTREE_insert(bt,BPTREE_node_child(f->data,c->key,c->klen),c,csep,&csep_len,&cright,added)) <= 0) {
+			BPTREE_unpin(f);
+			return r;
+		}
+		/* the child split: add a cell for its new right sibling */
+		ins.key = csep;
+		ins.klen = csep_len;
+		ins.value = (const uint8_t *)0;
+		ins.vlen = 0;
+		ins.child = cright;
+		i = BPTREE_node_search(f->data,csep,csep_len,1);
+		memcpy(bt->scratch,f->data,BPTREE_PAGE_SIZE);
+		n = BPTREE_node_cells(bt->scratch,cells);
+		memmove(cells + i + 1,cells + i,sizeof(BPTREE_Cell) * (n - i));
+		cells[i] = ins;
+		++n;
+	}
+
+	link = BPTREE_get64(bt->scratch + 8);
+	f->dirty = 1;
+	if (BPTREE_cells_size(type,cells,n) <= BPTREE_NODE_CAPACITY) {
+		BPTREE_node_build(f->data,type,link,cells,n);
+		BPTREE_unpin(f);
+		return 0;
+	}
+
+	/* split: the left half stays in this page, the right half moves to a
+	 * new one */
+	k = BPTREE_split_point(type,cells,n);
+	if (!(rf = BPTREE_new_page(bt,&err))) {
+		BPTREE_unpin(f);
+		return err;
+	}
+	*right = rf->page;
+	memcpy(sep,cells[k].key,cells[k].klen);
+	*seplen = cells[k].klen;
+	if (type == BPTREE_LEAF) {
+		BPTREE_node_build(rf->data,BPTREE_LEAF,link,cells + k,n - k);
+		BPTREE_node_build(f->data,BPTREE_LEAF,rf->page,cells,k);
+	} else {
+		/* the middle key moves up; its child becomes the right node's
+		 * leftmost child */
+		BPTREE_node_build(rf->data,BPTREE_INTERNAL,cells[k].child,cells + k + 1,n - k - 1);
+		BPTREE_node_build(f->data,BPTREE_INTERNAL,link,cells,k);
+	}
+	BPTREE_unpin(rf);
+	BPTREE_unpin(f);
+	return 1;
+}
+
+/* Pinned frame of the leaf that would hold key (the leftmost leaf if key
+ * is NULL) */
+static BPTREE_Frame *BPTREE_find_leaf(BPTREE *bt,const void *key,unsigned long klen,int *err)
+{
+	BPTREE_Frame *f;
+	uint64_t page = bt->root;
+	unsigned long depth;
+
+	for(depth=0;depth<64;++depth) {
+		if (!(f = BPTREE_fetch(bt,page,0,err)))
+			return f;
+		if (f->data[0] == BPTREE_LEAF)
+			return f;
+		if (f->data[0] != BPTREE_INTERNAL)
+			break;
+		page = key ? BPTREE_node_child(f->data,key,klen) : BPTREE_get64(f->data + 8);
+		BPTREE_unpin(f);
+		if ((!page)||(page >= bt->num_pages)) {
+			*err = BPTREE_ERROR_CORRUPT_DBFILE;
+			return (BPTREE_Frame *)0;
+		}
+	}
+	BPTREE_unpin(f);
+	*err = BPTREE_ERROR_CORRUPT_DBFILE;
+	return (BPTREE_Frame *)0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void BPTREE_free(BPTREE *bt)
+{
+	free(bt->frames);
+	free(bt->buckets);
+	free(bt->frame_data);
+	free(bt->scratch);
+	free(bt->cells);
+	bt->frames = (BPTREE_Frame *)0;
+	bt->buckets = (long *)0;
+	bt->frame_data = (uint8_t *)0;
+	bt->scratch = (uint8_t *)0;
+	bt->cells = (void *)0;
+}
+
+int BPTREE_open(
+	BPTREE *bt,
+	const char *path,
+	int mode,
+	unsigned long cache_pages,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	uint8_t h[BPTREE_HEADER_SIZE];
+	uint32_t v[4];
+	struct stat st;
+	unsigned long i;
+	BPTREE_Frame *f;
+	int flags,r = 0;
+
+	memset(bt,0,sizeof(BPTREE));
+	bt->fd = -1;
+
+	switch(mode) {
+		case BPTREE_OPEN_MODE_RDONLY: flags = O_RDONLY; break;
+		case BPTREE_OPEN_MODE_RDWR: flags = O_RDWR; break;
+		case BPTREE_OPEN_MODE_RWCREAT: flags = O_RDWR|O_CREAT; break;
+		case BPTREE_OPEN_MODE_RWREPLACE: flags = O_RDWR|O_CREAT|O_TRUNC; break;
+		default: return BPTREE_ERROR_INVALID_PARAMETERS;
+	}
+	bt->rdonly = (mode == BPTREE_OPEN_MODE_RDONLY);
+
+	if (!cache_pages)
+		cache_pages = BPTREE_DEFAULT_CACHE_PAGES;
+	if (cache_pages < BPTREE_MIN_CACHE_PAGES)
+		cache_pages = BPTREE_MIN_CACHE_PAGES;
+	bt->num_frames = cache_pages;
+	bt->num_buckets = 1;
+	while (bt->num_buckets < (cache_pages * 2))
+		bt->num_buckets <<= 1;
+	bt->frames = calloc(bt->num_frames,sizeof(BPTREE_Frame));
+	bt->buckets = malloc(sizeof(long) * bt->num_buckets);
+	bt->frame_data = malloc(bt->num_frames * BPTREE_PAGE_SIZE);
+	bt->scratch = malloc(BPTREE_PAGE_SIZE);
+	bt->cells = malloc(sizeof(BPTREE_Cell) * ((BPTREE_NODE_CAPACITY / 2) + 1));
+	if ((!bt->frames)||(!bt->buckets)||(!bt->frame_data)||(!bt->scratch)||(!bt->cells)) {
+		BPTREE_free(bt);
+		return BPTREE_ERROR_MALLOC;
+	}
+	for(i=0;i<bt->num_buckets;++i)
+		bt->buckets[i] = -1;
+	for(i=0;i<bt->num_frames;++i) {
+		bt->frames[i].data = bt->frame_data + (i * BPTREE_PAGE_SIZE);
+		bt->frames[i].next = -1;
+	}
+
+	if ((bt->fd = open(path,flags,0644)) < 0) {
+		BPTREE_free(bt);
+		return BPTREE_ERROR_IO;
+	}
+	if (fstat(bt->fd,&st)) {
+		r = BPTREE_ERROR_IO;
+		goto open_fail;
+	}
+
+	if (st.st_size < BPTREE_HEADER_SIZE) {
+		/* new database: a header page and an empty leaf as the root */
+		if ((bt->rdonly)||(st.st_size)) {
+			r = st.st_size ? BPTREE_ERROR_CORRUPT_DBFILE : BPTREE_ERROR_IO;
+			goto open_fail;
+		}
+		if ((!key_size)||(!value_size)||(key_size > 65535)||(value_size > 65535)||((key_size + value_size) > BPTREE_MAX_ENTRY)) {
+			r = BPTREE_ERROR_INVALID_PARAMETERS;
+			goto open_fail;
+		}
+		bt->key_size = key_size;
+		bt->value_size = value_size;
+		bt->root = 1;
+		bt->num_pages = 1;
+		if (!(f = BPTREE_new_page(bt,&r)))
+			goto open_fail;
+		BPTREE_node_build(f->data,BPTREE_LEAF,0,(const BPTREE_Cell *)0,0);
+		BPTREE_unpin(f);
+		if ((r = BPTREE_frame_flush(bt,f)))
+			goto open_fail;
+		if ((r = BPTREE_write_header(bt)))
+			goto open_fail;
+	} else {
+		if (BPTREE_pread(bt->fd,h,sizeof(h),0)) {
+			r = BPTREE_ERROR_IO;
+			goto open_fail;
+		}
+		memcpy(v,h + 4,sizeof(v));
+		if ((memcmp(h,"KdBT",4))||(v[0] != BPTREE_VERSION)||(v[1] != BPTREE_PAGE_SIZE)) {
+			r = BPTREE_ERROR_CORRUPT_DBFILE;
+			goto open_fail;
+		}
+		bt->key_size = v[2];
+		bt->value_size = v[3];
+		bt->root = BPTREE_get64(h + 24);
+		bt->num_pages = BPTREE_get64(h + 32);
+		bt->count = BPTREE_get64(h + 40);
+		if ((!bt->root)||(bt->root >= bt->num_pages)||((bt->key_size + bt->value_size) > BPTREE_MAX_ENTRY)) {
+			r = BPTREE_ERROR_CORRUPT_DBFILE;
+			goto open_fail;
+		}
+	}
+
+	pthread_mutex_init(&bt->lock,(const pthread_mutexattr_t *)0);
+	return 0;
+
+open_fail:
+	close(bt->fd);
+	bt->fd = -1;
+	BPTREE_free(bt);
+	return r;
+}
+
+/* Write out every changed page and then the header, syncing each step if
+ * sync is set */
+static int BPTREE_flush_all(BPTREE *bt,int sync)
+{
+	unsigned long i;
+
+	for(i=0;i<bt->num_frames;++i) {
+		if (BPTREE_frame_flush(bt,&(bt->frames[i])))
+			return BPTREE_ERROR_IO;
+	}
+	/* the header goes last, after the pages it points to are on disk */
+	if ((sync)&&(fdatasync(bt->fd)))
+		return BPTREE_ERROR_IO;
+	if (BPTREE_write_header(bt))
+		return BPTREE_ERROR_IO;
+	if ((sync)&&(fdatasync(bt->fd)))
+		return BPTREE_ERROR_IO;
+	return 0;
+}
+
+void BPTREE_close(BPTREE *bt)
+{
+	if (bt->fd >= 0) {
+		if (!bt->rdonly)
+			BPTREE_flush_all(bt,0);
+		close(bt->fd);
+		pthread_mutex_destroy(&bt->lock);
+	}
+	bt->fd = -1;
+	BPTREE_free(bt);
+}
+
+int BPTREE_sync(BPTREE *bt)
+{
+	int r = 0;
+
+	if (bt->rdonly)
+		return 0;
+	pthread_mutex_lock(&bt->lock);
+	r = BPTREE_flush_all(bt,1);
+	pthread_mutex_unlock(&bt->lock);
+	return r;
+}
+
+int BPTREE_get(BPTREE *bt,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	BPTREE_Frame *f;
+	const uint8_t *c;
+	unsigned long i,l;
+	int r = 0;
+
+	if (klen > bt->key_size)
+		return BPTREE_ERROR_INVALID_PARAMETERS;
+
+	pthread_mutex_lock(&bt->lock);
+	if ((f = BPTREE_find_leaf(bt,key,klen,&r))) {
+		i = BPTREE_node_search(f->data,key,klen,0);
+		r = 1; /* not found */
+		if (i < BPTREE_node_count(f->data)) {
+			c = BPTREE_node_cell(f->data,i);
+			l = BPTREE_get16(c);
+			if (!BPTREE_compare(c + 4,l,key,klen)) {
+				memcpy(vbuf,c + 4 + l,BPTREE_get16(c + 2));
+				if (vlen)
+					*vlen = BPTREE_get16(c + 2);
+				r = 0;
+			}
+		}
+		BPTREE_unpin(f);
+	}
+	pthread_mutex_unlock(&bt->lock);
+	return r;
+}
+
+int BPTREE_put(BPTREE *bt,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	BPTREE_Cell c,cells[1];
+	BPTREE_Frame *f;
+	uint8_t sep[BPTREE_PAGE_SIZE];
+	unsigned long seplen;
+	uint64_t right;
+	int added = 0,r;
+
+	if ((klen > bt->key_size)||(vlen > bt->value_size))
+		return BPTREE_ERROR_INVALID_PARAMETERS;
+	if (bt->rdonly)
+		return BPTREE_ERROR_IO;
+
+	c.key = (const uint8_t *)key;
+	c.klen = klen;
+	c.value = (const uint8_t *)value;
+	c.vlen = vlen;
+	c.child = 0;
+
+	pthread_mutex_lock(&bt->lock);
+	r = BPTREE_insert(bt,bt->root,&c,sep,&seplen,&right,&added);
+	if (r == 1) {
+		/* the root split: grow the tree by one level */
+		if ((f = BPTREE_new_page(bt,&r))) {
+			cells[0].key = sep;
+			cells[0].klen = seplen;
+			cells[0].value = (const uint8_t *)0;
+			cells[0].vlen = 0;
+			cells[0].child = right;
+			BPTREE_node_build(f->data,BPTREE_INTERNAL,bt->root,cells,1);
+			bt->root = f->page;
+			BPTREE_unpin(f);
+			r = 0;
+		}
+	}
+	if ((!r)&&(added))
+		++bt->count;
+	pthread_mutex_unlock(&bt->lock);
+	return r;
+}
+
+int BPTREE_delete(BPTREE *bt,const void *key,unsigned long klen)
+{
+	BPTREE_Cell *cells = (BPTREE_Cell *)bt->cells;
+	BPTREE_Frame *f;
+	unsigned long i,n;
+	int r = 0;
+
+	if (klen > bt->key_size)
+		return BPTREE_ERROR_INVALID_PARAMETERS;
+	if (bt->rdonly)
+		return BPTREE_ERROR_IO;
+
+	pthread_mutex_lock(&bt->lock);
+	if ((f = BPTREE_find_leaf(bt,key,klen,&r))) {
+		i = BPTREE_node_search(f->data,key,klen,0);
+		memcpy(bt->scratch,f->data,BPTREE_PAGE_SIZE);
+		n = BPTREE_node_cells(bt->scratch,cells);
+		if ((i < n)&&(!BPTREE_compare(cells[i].key,cells[i].klen,key,klen))) {
+			memmove(cells + i,cells + i + 1,sizeof(BPTREE_Cell) * (n - i - 1));
+			BPTREE_node_build(f->data,BPTREE_LEAF,BPTREE_get64(bt->scratch + 8),cells,n - 1);
+			f->dirty = 1;
+			--bt->count;
+		} else r = 1; /* not found */
+		BPTREE_unpin(f);
+	}
+	pthread_mutex_unlock(&bt->lock);
+	return r;
+}
+
+int BPTREE_range_scan(BPTREE *bt,const void *start,unsigned long slen,const void *end,unsigned long elen,BPTREE_Range_Callback cb,void *arg)
+{
+	BPTREE_Frame *f;
+	const uint8_t *c;
+	unsigned long i,n,klen;
+	uint64_t next;
+	int r = 0;
+
+	pthread_mutex_lock(&bt->lock);
+	if (!(f = BPTREE_find_leaf(bt,start,slen,&r))) {
+		pthread_mutex_unlock(&bt->lock);
+		return r;
+	}
+	i = start ? BPTREE_node_search(f->data,start,slen,0) : 0;
+	for(;;) {
+		n = BPTREE_node_count(f->data);
+		for(;i<n;++i) {
+			c = BPTREE_node_cell(f->data,i);
+			klen = BPTREE_get16(c);
+			if ((end)&&(BPTREE_compare(c + 4,klen,end,elen) > 0))
+				goto range_scan_out;
+			if ((r = cb(arg,c + 4,klen,c + 4 + klen,BPTREE_get16(c + 2))))
+				goto range_scan_out;
+		}
+		if (!(next = BPTREE_get64(f->data + 8)))
+			break;
+		BPTREE_unpin(f);
+		if ((next >= bt->num_pages)||(!(f = BPTREE_fetch(bt,next,0,&r)))) {
+			if (!r)
+				r = BPTREE_ERROR_CORRUPT_DBFILE;
+			pthread_mutex_unlock(&bt->lock);
+			return r;
+		}
+		i = 0;
+	}
+
+range_scan_out:
+	BPTREE_unpin(f);
+	pthread_mutex_unlock(&bt->lock);
+	return r;
+}
+
+#ifdef BPTREE_TEST
+
+#include <inttypes.h>
+
+static int BPTREE_test_collect(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	char **prev = (char **)arg;
+	char k[64];
+
+	memcpy(k,key,klen);
+	k[klen] = (char)0;
+	if ((prev[0][0])&&(strcmp(prev[0],k) >= 0)) {
+		printf("BPTREE_range_scan failed, out of order (%s after %s)\n",k,prev[0]);
+		return -100;
+	}
+	strcpy(prev[0],k);
+	++*((unsigned long *)prev[1]);
+	return 0;
+}
+
+int main(int argc,char **argv)
+{
+	BPTREE bt;
+	char kbuf[64],vbuf[1024],vexp[1024];
+	char last[64];
+	char *args[2];
+	unsigned long klen,vlen,n;
+	uint64_t i;
+	int r;
+
+	printf("Creating B+tree test.bpt and putting 20000 values in random order...\n");
+
+	if (BPTREE_open(&bt,"test.bpt",BPTREE_OPEN_MODE_RWREPLACE,64,64,1024)) {
+		printf("BPTREE_open failed\n");
+		return 1;
+	}
+	for(i=0;i<20000;++i) {
+		/* a permutation of 0..19999 */
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,(i * 7919) % 20000);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64,((i * 7919) % 20000) * 3);
+		if (((i * 7919) % 5) == 0) {
+			/* some large values, to split leaves with few entries */
+			memset(vbuf + vlen,'x',600);
+			vlen += 600;
+		}
+		if (BPTREE_put(&bt,kbuf,klen,vbuf,vlen)) {
+			printf("BPTREE_put failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<20000;i+=2) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"-overwritten",i);
+		if (BPTREE_put(&bt,kbuf,klen,vbuf,vlen)) {
+			printf("BPTREE_put (overwrite) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<20000;i+=10) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if (BPTREE_delete(&bt,kbuf,klen)) {
+			printf("BPTREE_delete failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (BPTREE_delete(&bt,"station.0",9) != 1) {
+		printf("BPTREE_delete deleted a missing key\n");
+		return 1;
+	}
+	BPTREE_close(&bt);
+
+	printf("Re-opening and getting 20000 values...\n");
+
+	if (BPTREE_open(&bt,"test.bpt",BPTREE_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("BPTREE_open failed\n");
+		return 1;
+	}
+	if (bt.count != 18000) {
+		printf("BPTREE_open read a bad entry count (%"PRIu64")\n",bt.count);
+		return 1;
+	}
+	for(i=0;i<20000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		r = BPTREE_get(&bt,kbuf,klen,vbuf,&vlen);
+		if ((i % 10) == 0) {
+			if (r != 1) {
+				printf("BPTREE_get found deleted key (%"PRIu64")\n",i);
+				return 1;
+			}
+			continue;
+		}
+		if ((i % 2) == 0)
+			n = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i);
+		else {
+			n = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64,i * 3);
+			if ((i % 5) == 0) {
+				memset(vexp + n,'x',600);
+				n += 600;
+			}
+		}
+		if ((r)||(vlen != n)||(memcmp(vbuf,vexp,n))) {
+			printf("BPTREE_get failed (%"PRIu64") (%d)\n",i,r);
+			return 1;
+		}
+	}
+
+	printf("Scanning the range station.10 to station.40 and the whole tree...\n");
+
+	last[0] = (char)0;
+	n = 0;
+	args[0] = last;
+	args[1] = (char *)&n;
+	if ((BPTREE_range_scan(&bt,"station.10",10,"station.40",10,BPTREE_test_collect,args))) {
+		printf("BPTREE_range_scan failed\n");
+		return 1;
+	}
+	/* in byte order that is station.1x, 1xx, 1xxx and 1xxxx (11110 keys),
+	 * 2, 2x, 2xx and 2xxx (1111), the same for 3, then 4 and 40; less
+	 * the 1334 multiples of 10 among them */
+	if (n != 12000) {
+		printf("BPTREE_range_scan failed (%lu entries)\n",n);
+		return 1;
+	}
+	last[0] = (char)0;
+	n = 0;
+	if ((BPTREE_range_scan(&bt,(const void *)0,0,(const void *)0,0,BPTREE_test_collect,args))||(n != 18000)) {
+		printf("BPTREE_range_scan failed (%lu entries)\n",n);
+		return 1;
+	}
+	BPTREE_close(&bt);
+
+	printf("All tests OK!\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,228 @@
+/* (Keep It) Simple Stupid Database: B+tree engine
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#ifndef ___BPTREE_H
+#define ___BPTREE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Version: 1
+ *
+ * File format identifier, stored in the first page of the file
+ */
+#define BPTREE_VERSION 1
+
+/**
+ * Size of every page in the file, in bytes
+ */
+#define BPTREE_PAGE_SIZE 4096
+
+/**
+ * Largest key_size + value_size a tree can be created with
+ *
+ * Any three leaf entries must fit in one page, so that a full page can
+ * always be split in two.
+ */
+#define BPTREE_MAX_ENTRY 1352
+
+/**
+ * Pages kept in memory unless BPTREE_open() is given another number
+ */
+#define BPTREE_DEFAULT_CACHE_PAGES 1024
+
+/**
+ * I/O error or file not found
+ */
+#define BPTREE_ERROR_IO -1
+
+/**
+ * Out of memory
+ */
+#define BPTREE_ERROR_MALLOC -2
+
+/**
+ * Invalid paramters (e.g. missing _size paramters on init to create database)
+ */
+#define BPTREE_ERROR_INVALID_PARAMETERS -3
+
+/**
+ * Database file appears corrupt
+ */
+#define BPTREE_ERROR_CORRUPT_DBFILE -4
+
+/**
+ * Open mode: read only
+ */
+#define BPTREE_OPEN_MODE_RDONLY 1
+
+/**
+ * Open mode: read/write
+ */
+#define BPTREE_OPEN_MODE_RDWR 2
+
+/**
+ * Open mode: read/write, create if doesn't exist
+ */
+#define BPTREE_OPEN_MODE_RWCREAT 3
+
+/**
+ * Open mode: truncate database, open for reading and writing
+ */
+#define BPTREE_OPEN_MODE_RWREPLACE 4
+
+/**
+ * A page held in memory
+ */
+typedef struct {
+	uint64_t page; /* 0 if the frame is unused */
+	uint8_t *data;
+	long next; /* next frame in the same lookup bucket, -1 at the end */
+	unsigned int pins;
+	int dirty;
+	int ref; /* CLOCK reference bit */
+} BPTREE_Frame;
+
+/**
+ * B+tree database state
+ *
+ * Keys are kept in byte order (shorter keys first on a common prefix), so
+ * that a range of keys can be read by walking the linked leaves. Every
+ * call takes the tree's mutex, so a BPTREE may be shared between threads.
+ */
+typedef struct {
+	unsigned long key_size;
+	unsigned long value_size;
+	uint64_t root;
+	uint64_t num_pages;
+	uint64_t count;
+	int fd;
+	int rdonly;
+	BPTREE_Frame *frames;
+	unsigned long num_frames;
+	unsigned long hand;
+	long *buckets;
+	unsigned long num_buckets;
+	uint8_t *frame_data;
+	uint8_t *scratch;
+	void *cells;
+	pthread_mutex_t lock;
+} BPTREE;
+
+/**
+ * Open database
+ *
+ * As with KISSDB_open(), the _size parameters must be given if the
+ * database could be created; if it exists they are read from the file.
+ *
+ * @param bt Database struct
+ * @param path Path to file
+ * @param mode One of the BPTREE_OPEN_MODE constants
+ * @param cache_pages Number of pages to keep in memory (0 for BPTREE_DEFAULT_CACHE_PAGES)
+ * @param key_size Maximum size of keys in bytes
+ * @param value_size Maximum size of values in bytes
+ * @return 0 on success, nonzero on error
+ */
+extern int BPTREE_open(
+	BPTREE *bt,
+	const char *path,
+	int mode,
+	unsigned long cache_pages,
+	unsigned long key_size,
+	unsigned long value_size);
+
+/**
+ * Write out all changes and close database
+ *
+ * @param bt Database struct
+ */
+extern void BPTREE_close(BPTREE *bt);
+
+/**
+ * Get an entry
+ *
+ * @param bt Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int BPTREE_get(BPTREE *bt,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Put an entry (overwriting it if it already exists)
+ *
+ * Changed pages stay in memory until they are evicted or BPTREE_sync() or
+ * BPTREE_close() is called.
+ *
+ * @param bt Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return -1 on I/O error, 0 on success
+ */
+extern int BPTREE_put(BPTREE *bt,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Delete an entry
+ *
+ * Pages are not merged when they empty out; their space is reused by
+ * later puts into the same key range.
+ *
+ * @param bt Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int BPTREE_delete(BPTREE *bt,const void *key,unsigned long klen);
+
+/**
+ * Called by BPTREE_range_scan() for each entry in the range
+ *
+ * The key and value point into a cached page and are only valid until the
+ * callback returns. The callback must not call into the same tree.
+ *
+ * @return 0 to continue, nonzero to stop the scan
+ */
+typedef int (*BPTREE_Range_Callback)(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Visit all entries with start <= key <= end, in key order
+ *
+ * @param bt Database struct
+ * @param start First key of the range, or NULL to start at the smallest key
+ * @param slen Length of start
+ * @param end Last key of the range, or NULL to go on to the largest key
+ * @param elen Length of end
+ * @param cb Function called for each entry
+ * @param arg Passed to cb
+ * @return Negative on error, 0 if the whole range was visited, or the nonzero value cb stopped with
+ */
+extern int BPTREE_range_scan(BPTREE *bt,const void *start,unsigned long slen,const void *end,unsigned long elen,BPTREE_Range_Callback cb,void *arg);
+
+/**
+ * Write all changed pages to the file and sync it
+ *
+ * The pages are synced before the header that points to them is written,
+ * and the header is synced after.
+ *
+ * @param bt Database struct
+ * @return 0 on success, negative on error
+ */
+extern int BPTREE_sync(BPTREE *bt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,7 @@ void print_usage() {
   fprintf(stderr, "                <operation>:\n");
   fprintf(stderr, "                PUT:key:value\n");
   fprintf(stderr, "                GET:key\n");
+  fprintf(stderr, "                DEL:key\n");
   fprintf(stderr, "-i <count>:     Specify the number of iterations.\n");
   fprintf(stderr, "-g:             Repeatedly send GET operations.\n");
   fprintf(stderr, "-p:             Repeatedly send PUT operations.\n");
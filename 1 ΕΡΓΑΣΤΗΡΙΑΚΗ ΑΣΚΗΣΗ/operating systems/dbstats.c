@@ -0,0 +1,156 @@
+/* dbstats.c
+
+   Prints the shape of KISSDB databases: how full and how deep their hash
+   table pages are and how much of each file is dead, to tell when the
+   hash table needs to be bigger or the database compacted.
+
+*/
+
+#include "kissdb_shard.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PAGES              4096  // pages listed with -p
+#define DEEP_CHAIN               64  // pages per bucket worth rebuilding for
+#define LOW_LOAD               0.25  // ...or load factor of that many pages
+
+
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+  fprintf(stderr, "Usage: dbstats [OPTION]... DATABASE...\n\n");
+  fprintf(stderr, "Prints statistics of KISSDB files or sharded databases (by manifest).\n\n");
+  fprintf(stderr, "Available Options:\n");
+  fprintf(stderr, "-h:             Print this help message.\n");
+  fprintf(stderr, "-p:             Also print the load factor of every hash table page.\n");
+  fprintf(stderr, "-c:             Hold the hash tables in compact form, to see the memory it saves.\n");
+}
+
+/**
+ * @name print_stats - Prints the statistics of one database file.
+ * @path: The file.
+ * @db: The open database.
+ * @pages: Whether to print the load factor of every page.
+ *
+ * @return 0 on success, 1 on error.
+ */
+int print_stats(const char *path, KISSDB *db, int pages) {
+  static uint64_t page_entries[MAX_PAGES];
+  KISSDB_Stats st;
+  unsigned long i, n;
+
+  if (KISSDB_stats(db, &st, page_entries, MAX_PAGES)) {
+    fprintf(stderr, "Error: Cannot get the statistics of %s.\n", path);
+    return 1;
+  }
+
+  printf("%s:\n", path);
+  printf("  file:         %llu bytes, %llu live, %llu dead, %llu in hash tables\n",
+         (unsigned long long)st.file_size, (unsigned long long)st.live_bytes,
+         (unsigned long long)st.dead_bytes, (unsigned long long)st.table_bytes);
+  printf("  hash tables:  %lu pages of %lu buckets, %llu entries, load factor %.3f\n",
+         st.num_hash_tables, st.hash_table_size, (unsigned long long)st.entries, st.load_factor);
+  printf("  probe depth:  %.2f pages for a stored key, %.2f for a missing one, %lu at most\n",
+         st.avg_probe, st.avg_probe_miss, st.max_probe);
+  printf("  index:        %llu entries in %llu slots\n",
+         (unsigned long long)st.index_entries, (unsigned long long)st.index_capacity);
+  printf("  memory:       %llu bytes of hash tables, %llu of index\n",
+         (unsigned long long)st.table_memory, (unsigned long long)st.index_memory);
+  printf("  opening:      %llu reads, %llu bytes read\n",
+         (unsigned long long)st.counters.reads, (unsigned long long)st.counters.bytes_read);
+
+  if (pages) {
+    n = (st.num_hash_tables < MAX_PAGES) ? st.num_hash_tables : MAX_PAGES;
+    printf("  page load:   ");
+    for (i = 0; i < n; i++)
+      printf(" %lu:%.3f", i, (double)page_entries[i] / (double)st.hash_table_size);
+    printf("%s\n", (n < st.num_hash_tables) ? " ..." : "");
+  }
+
+  // ti na kanoume
+  if (st.max_probe >= DEEP_CHAIN)
+    printf("  -> chains are %lu pages deep: rebuild with a larger hash table (loader)\n", st.max_probe);
+  else if ((st.num_hash_tables >= 4) && (st.load_factor < LOW_LOAD))
+    printf("  -> the hash table pages are mostly empty: rebuild to size them to the data (loader)\n");
+  if ((st.dead_bytes) && (st.dead_bytes >= st.live_bytes))
+    printf("  -> at least half of the entries are dead: compact\n");
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int option = 0;
+  int pages = 0;
+  int mode = KISSDB_OPEN_MODE_RDONLY;
+  int err = 0;
+  char magic[4];
+  char *spath;
+  KISSDB_Sharded sdb;
+  KISSDB db;
+  unsigned long i;
+  FILE *f;
+
+  // Parse user parameters.
+  while ((option = getopt(argc, argv,"hpc")) != -1) {
+    switch (option) {
+      case 'h':
+        print_usage();
+        exit(0);
+      case 'p':
+        pages = 1;
+        break;
+      case 'c':
+        mode |= KISSDB_OPEN_FLAG_COMPACT_TABLES;
+        break;
+      default:
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+
+  for (; optind < argc; optind++) {
+    if (!(f = fopen(argv[optind], "r"))) {
+      perror(argv[optind]);
+      err = 1;
+      continue;
+    }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic))
+      memset(magic, 0, sizeof(magic));
+    fclose(f);
+
+    // manifest sharded vasis: ta stats kathe kommatiou
+    if (!memcmp(magic, "KdBS", 4)) {
+      if (KISSDB_Sharded_open(&sdb, argv[optind], mode, 0, 0, 0, 0)) {
+        fprintf(stderr, "Error: Cannot open %s.\n", argv[optind]);
+        err = 1;
+        continue;
+      }
+      spath = malloc(strlen(argv[optind]) + 24);
+      for (i = 0; (spath) && (i < sdb.num_shards); i++) {
+        sprintf(spath, "%s.%lu", argv[optind], i);
+        err |= print_stats(spath, &sdb.shards[i].db, pages);
+      }
+      free(spath);
+      KISSDB_Sharded_close(&sdb);
+      continue;
+    }
+
+    if (KISSDB_open(&db, argv[optind], mode, 0, 0, 0)) {
+      fprintf(stderr, "Error: Cannot open %s.\n", argv[optind]);
+      err = 1;
+      continue;
+    }
+    err |= print_stats(argv[optind], &db, pages);
+    KISSDB_close(&db);
+  }
+
+  return err;
+}
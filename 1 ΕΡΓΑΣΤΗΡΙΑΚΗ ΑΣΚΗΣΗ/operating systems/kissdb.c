@@ -5,12 +5,16 @@
  *
  * http://creativecommons.org/publicdomain/zero/1.0/ */
 
-/* Compile with KISSDB_TEST to build as a test program. */
+/* Compile with KISSDB_TEST (and -lpthread) to build as a test program. */
 
 /* Note: big-endian systems will need changes to implement byte swapping
  * on hash table file I/O. Or you could just use it as-is if you don't care
  * that your database files will be unreadable on little-endian systems. */
 
+/* All file I/O is positional (pread/pwrite) on a raw descriptor, so there
+ * is no shared file position and concurrent readers don't interfere. */
+
+#define _GNU_SOURCE /* O_DIRECT */
 #define _FILE_OFFSET_BITS 64
 
 #include "kissdb.h"
@@ -18,16 +22,156 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
 
-#ifdef _WIN32
-#define fseeko _fseeki64
-#define ftello _ftelli64
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #define KISSDB_HEADER_SIZE ((sizeof(uint64_t) * 3) + 4)
 
+/* Version 4 and later headers are followed by a 64-bit hash seed */
+#define KISSDB_HEADER_SIZE_SEEDED (KISSDB_HEADER_SIZE + sizeof(uint64_t))
+#define KISSDB_HEADER_SIZE_OF(db) (((db)->version >= KISSDB_VERSION_SEEDED) ? KISSDB_HEADER_SIZE_SEEDED : KISSDB_HEADER_SIZE)
+
+/* Version 3 and 4 entries start with a 32-bit key length and value length */
+#define KISSDB_ENTRY_HEADER_SIZE (sizeof(uint32_t) * 2)
+
+/* Value length of a version 3 to 5 tombstone, which has a key but no value */
+#define KISSDB_TOMBSTONE 0xffffffffUL
+
+/* Version 5 values of 1 to 8 bytes are stored in 8, zero-padded */
+#define KISSDB_INLINE_MAX 8
+#define KISSDB_PADDED(db,vlen) (((db)->version == KISSDB_VERSION_INLINE)&&((vlen) > 0)&&((vlen) <= KISSDB_INLINE_MAX))
+
+/* Suffix of the file a compaction builds before it replaces the database */
+#define KISSDB_COMPACT_SUFFIX ".compact"
+
+/* Suffix of the write-ahead log kept next to the database */
+#define KISSDB_WAL_SUFFIX ".wal"
+
+/* Files kept next to the database start with a 4-byte magic and a 32-bit
+ * version and end with a CRC-32 of everything before it. They are written
+ * to path.suffix.tmp and then renamed into place. */
+#define KISSDB_SIDECAR_HEADER_SIZE 8
+#define KISSDB_SIDECAR_TMP_SUFFIX ".tmp"
+
+/* Suffix of the index checkpoint kept next to the database */
+#define KISSDB_IDX_SUFFIX ".idx"
+#define KISSDB_IDX_VERSION 2
+
+/* Index checkpoint ("KdBI"): 64-bit version, hash table size, key size,
+ * value size and hash seed of the database, the database size and inode it
+ * was taken at, the number of hash table pages, live bytes and number of
+ * records. The page offsets, the pages themselves and the records ([entry
+ * offset][full key hash], then on version 5 [inline value][index vlens]
+ * [key fingerprint], sorted by offset) follow. */
+#define KISSDB_IDX_HEADER_SIZE (KISSDB_SIDECAR_HEADER_SIZE + (sizeof(uint64_t) * 10))
+#define KISSDB_IDX_RECORD_WORDS(db) (((db)->version == KISSDB_VERSION_INLINE) ? 5 : 2)
+
+/* Log records: [crc32][type][key length][value length][key][value], where
+ * the CRC covers everything after itself. A batch record has the entries
+ * of a KISSDB_put_many(), as stored in the database, in place of its key. */
+#define KISSDB_WAL_RECORD_HEADER_SIZE (sizeof(uint32_t) * 4)
+#define KISSDB_WAL_PUT 1
+#define KISSDB_WAL_DELETE 2
+#define KISSDB_WAL_BATCH 3
+
+/* The value cache is split into this many independently locked shards */
+#define KISSDB_CACHE_SHARDS 16
+
+/* Reads of nearby entries are merged if they are at most this far apart,
+ * up to a total of KISSDB_READ_MAX_RUN bytes per read */
+#define KISSDB_READ_GAP 16384
+#define KISSDB_READ_MAX_RUN 1048576
+
+/* Sequential scans read the file in chunks of this many bytes */
+#define KISSDB_SCAN_CHUNK 4194304
+
+/* Checkpoint once this many bytes have been logged since the last one */
+#define KISSDB_WAL_CHECKPOINT_BYTES 67108864
+
+/* Suffix and version of the Bloom filter file kept next to the database */
+#define KISSDB_BLOOM_SUFFIX ".bloom"
+#define KISSDB_BLOOM_VERSION 2
+#define KISSDB_BLOOM_HEADER_SIZE (KISSDB_SIDECAR_HEADER_SIZE + (sizeof(uint64_t) * 8))
+
+/* Bloom filter block size, most bits set per key, and fewest keys a
+ * filter is sized for */
+#define KISSDB_BLOOM_BLOCK_BITS 512
+#define KISSDB_BLOOM_MAX_K 16
+#define KISSDB_BLOOM_MIN_KEYS 1024
+
+/* Write a new index checkpoint once the database has grown this much */
+#define KISSDB_IDX_CHECKPOINT_BYTES 67108864
+
+/* Shared state of a database opened by several processes: suffix and
+ * version of the file, and how many hash table changes its ring holds */
+#define KISSDB_SHM_SUFFIX ".shm"
+#define KISSDB_SHM_VERSION 1
+#define KISSDB_SHM_RING 4096
+#define KISSDB_SHM_NEW_PAGE 0xffffffffffffffffULL
+
+/* Mappings grow in steps of at least this many bytes */
+#define KISSDB_MMAP_MIN_GROWTH 1048576
+
+/* Direct I/O buffer pool: frames are this big and aligned to it, the pool
+ * has at least KISSDB_POOL_MIN_PAGES of them, and a victim is picked from
+ * a sample of KISSDB_POOL_SAMPLE frames. Dirty frames are written back
+ * every KISSDB_POOL_WRITEBACK_MS, or as soon as a quarter of the pool is
+ * dirty, up to KISSDB_POOL_WRITEBACK_BATCH at a time. */
+#define KISSDB_POOL_PAGE_SIZE 4096
+#define KISSDB_POOL_MIN_PAGES 64
+#define KISSDB_POOL_SAMPLE 16
+#define KISSDB_POOL_WRITEBACK_MS 100
+#define KISSDB_POOL_WRITEBACK_BATCH 64
+
+/* Index control bytes: full slots hold the low 7 bits of the hash */
+#define KISSDB_CTRL_EMPTY 0x80
+#define KISSDB_CTRL_DELETED 0xfe
+#define KISSDB_INDEX_GROUP 16
+
+/* Groups of the old index table moved to the new one per insert */
+#define KISSDB_INDEX_MIGRATE_GROUPS 8
+
+/* Index vlens of a deleted key; 0 means the value is only in the file */
+#define KISSDB_INLINE_DELETED 0xff
+
+/* Size and alignment of a huge page (KISSDB_OPEN_FLAG_HUGEPAGES) */
+#define KISSDB_HUGEPAGE_SIZE 2097152
+
+/* Compact hash table pages (KISSDB_OPEN_FLAG_COMPACT_TABLES): a dense page
+ * holds every bucket's offset in KISSDB_TABLE_OFFSET_BYTES, a sparse one a
+ * [bucket:4][offset:5] record per used bucket, sorted by bucket. Dense
+ * pages are carved out of blocks of up to KISSDB_TABLE_BLOCK_SIZE bytes. */
+#define KISSDB_TABLE_OFFSET_BYTES 5
+#define KISSDB_TABLE_RECORD_BYTES (sizeof(uint32_t) + KISSDB_TABLE_OFFSET_BYTES)
+#define KISSDB_TABLE_MAX_OFFSET 0xffffffffffULL
+#define KISSDB_TABLE_BLOCK_SIZE 2097152
+
+/* Bulk builds write to path.bulk in blocks of KISSDB_BULK_BUFFER bytes,
+ * and size the hash table for KISSDB_BULK_LOAD entries per bucket but at
+ * least KISSDB_BULK_MIN_BUCKETS buckets. Lookups go through the index, so
+ * deep buckets cost nothing, and a few deep pages take less room than
+ * many sparse ones. */
+#define KISSDB_BULK_SUFFIX ".bulk"
+#define KISSDB_BULK_BUFFER 4194304
+#define KISSDB_BULK_LOAD 16
+#define KISSDB_BULK_MIN_BUCKETS 1024
+
+/* Counters are bumped by gets running at the same time, so atomically */
+#define KISSDB_COUNT(c,field,n) __atomic_fetch_add(&((c)->field),(uint64_t)(n),__ATOMIC_RELAXED)
+
 /* djb2 hash function */
-static uint64_t KISSDB_hash(const void *b,unsigned long len)
+static uint64_t KISSDB_hash_djb2(const void *b,unsigned long len)
 {
 	unsigned long i;
 	uint64_t hash = 5381;
@@ -36,414 +180,6664 @@ static uint64_t KISSDB_hash(const void *b,unsigned long len)
 	return hash;
 }
 
-int KISSDB_open(
-	KISSDB *db,
-	const char *path,
-	int mode,
-	unsigned long hash_table_size,
-	unsigned long key_size,
-	unsigned long value_size)
+/* Multiply to 128 bits and fold the halves together */
+static uint64_t KISSDB_wymix(uint64_t a,uint64_t b)
 {
-	uint64_t tmp;
-	uint8_t tmp2[4];
-	uint64_t *httmp;
-	uint64_t *hash_tables_rea;
+	__uint128_t r = (__uint128_t)a * (__uint128_t)b;
+	return ((uint64_t)r) ^ ((uint64_t)(r >> 64));
+}
 
-#ifdef _WIN32
-	db->f = (FILE *)0;
-	fopen_s(&db->f,path,((mode == KISSDB_OPEN_MODE_RWREPLACE) ? "w+b" : (((mode == KISSDB_OPEN_MODE_RDWR)||(mode == KISSDB_OPEN_MODE_RWCREAT)) ? "r+b" : "rb")));
-#else
-	db->f = fopen(path,((mode == KISSDB_OPEN_MODE_RWREPLACE) ? "w+b" : (((mode == KISSDB_OPEN_MODE_RDWR)||(mode == KISSDB_OPEN_MODE_RWCREAT)) ? "r+b" : "rb")));
-#endif
-	if (!db->f) {
-		if (mode == KISSDB_OPEN_MODE_RWCREAT) {
-#ifdef _WIN32
-			db->f = (FILE *)0;
-			fopen_s(&db->f,path,"w+b");
-#else
-			db->f = fopen(path,"w+b");
-#endif
-		}
-		if (!db->f)
-			return KISSDB_ERROR_IO;
-	}
+#define KISSDB_WYP0 0xa0761d6478bd642fULL
+#define KISSDB_WYP1 0xe7037ed1a0b428dbULL
+#define KISSDB_WYP2 0x8ebc6af09c88c6e3ULL
 
-	if (fseeko(db->f,0,SEEK_END)) {
-		fclose(db->f);
-		return KISSDB_ERROR_IO;
-	}
-	if (ftello(db->f) < KISSDB_HEADER_SIZE) {
-		/* write header if not already present */
-		if ((hash_table_size)&&(key_size)&&(value_size)) {
-			if (fseeko(db->f,0,SEEK_SET)) { fclose(db->f); return KISSDB_ERROR_IO; }
-			tmp2[0] = 'K'; tmp2[1] = 'd'; tmp2[2] = 'B'; tmp2[3] = KISSDB_VERSION;
-			if (fwrite(tmp2,4,1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-			tmp = hash_table_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-			tmp = key_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-			tmp = value_size;
-			if (fwrite(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-			fflush(db->f);
-		} else {
-			fclose(db->f);
-			return KISSDB_ERROR_INVALID_PARAMETERS;
-		}
-	} else {
-		if (fseeko(db->f,0,SEEK_SET)) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if (fread(tmp2,4,1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if ((tmp2[0] != 'K')||(tmp2[1] != 'd')||(tmp2[2] != 'B')||(tmp2[3] != KISSDB_VERSION)) {
-			fclose(db->f);
-			return KISSDB_ERROR_CORRUPT_DBFILE;
-		}
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if (!tmp) {
-			fclose(db->f);
-			return KISSDB_ERROR_CORRUPT_DBFILE;
-		}
-		hash_table_size = (unsigned long)tmp;
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if (!tmp) {
-			fclose(db->f);
-			return KISSDB_ERROR_CORRUPT_DBFILE;
-		}
-		key_size = (unsigned long)tmp;
-		if (fread(&tmp,sizeof(uint64_t),1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if (!tmp) {
-			fclose(db->f);
-			return KISSDB_ERROR_CORRUPT_DBFILE;
-		}
-		value_size = (unsigned long)tmp;
+/* Seeded hash in the style of wyhash, consuming 16 bytes per round as
+ * two 64-bit words. The seed goes into both sides of every product, so no
+ * word of a key can cancel one side out without knowing it, and without
+ * the seed an attacker can't predict which keys collide. */
+static uint64_t KISSDB_hash_seeded(const void *b,unsigned long len,uint64_t seed)
+{
+	const uint8_t *p = (const uint8_t *)b;
+	unsigned long n = len;
+	uint64_t h = seed ^ KISSDB_WYP0;
+	uint64_t w0,w1;
+
+	while (n >= 16) {
+		memcpy(&w0,p,sizeof(uint64_t));
+		memcpy(&w1,p + 8,sizeof(uint64_t));
+		h = KISSDB_wymix(w0 ^ seed ^ KISSDB_WYP1,w1 ^ h ^ KISSDB_WYP2);
+		p += 16;
+		n -= 16;
 	}
+	w0 = 0;
+	w1 = 0;
+	if (n > 8) {
+		memcpy(&w0,p,sizeof(uint64_t));
+		memcpy(&w1,p + 8,n - 8);
+	} else memcpy(&w0,p,n);
+	h = KISSDB_wymix(w0 ^ seed ^ KISSDB_WYP1,w1 ^ h ^ KISSDB_WYP2);
+	return KISSDB_wymix(h ^ KISSDB_WYP2,(uint64_t)len ^ seed ^ KISSDB_WYP1);
+}
 
-	db->hash_table_size = hash_table_size;
-	db->key_size = key_size;
-	db->value_size = value_size;
-	db->hash_table_size_bytes = sizeof(uint64_t) * (hash_table_size + 1); /* [hash_table_size] == next table */
+/* Hash a key with whatever hash function db's file format uses */
+static uint64_t KISSDB_hash(const KISSDB *db,const void *b,unsigned long len)
+{
+	if (db->version >= KISSDB_VERSION_SEEDED)
+		return KISSDB_hash_seeded(b,len,db->hash_seed);
+	return KISSDB_hash_djb2(b,len);
+}
 
-	httmp = malloc(db->hash_table_size_bytes);
-	if (!httmp) {
-		fclose(db->f);
-		return KISSDB_ERROR_MALLOC;
-	}
-	db->num_hash_tables = 0;
-	db->hash_tables = (uint64_t *)0;
-	while (fread(httmp,db->hash_table_size_bytes,1,db->f) == 1) {
-		hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1));
-		if (!hash_tables_rea) {
-			KISSDB_close(db);
-			free(httmp);
-			return KISSDB_ERROR_MALLOC;
-		}
-		db->hash_tables = hash_tables_rea;
+/* CRC-32 (IEEE) of the write-ahead log records */
+static uint32_t KISSDB_crc_table[256];
+static pthread_once_t KISSDB_crc_once = PTHREAD_ONCE_INIT;
 
-		memcpy(((uint8_t *)db->hash_tables) + (db->hash_table_size_bytes * db->num_hash_tables),httmp,db->hash_table_size_bytes);
-		++db->num_hash_tables;
-		if (httmp[db->hash_table_size]) {
-			if (fseeko(db->f,httmp[db->hash_table_size],SEEK_SET)) {
-				KISSDB_close(db);
-				free(httmp);
-				return KISSDB_ERROR_IO;
-			}
-		} else break;
+static void KISSDB_crc_init(void)
+{
+	uint32_t c;
+	int i,j;
+	for(i=0;i<256;++i) {
+		c = (uint32_t)i;
+		for(j=0;j<8;++j)
+			c = (c & 1) ? (0xedb88320UL ^ (c >> 1)) : (c >> 1);
+		KISSDB_crc_table[i] = c;
 	}
-	free(httmp);
+}
 
-	return 0;
+static uint32_t KISSDB_crc32(uint32_t crc,const void *b,unsigned long len)
+{
+	unsigned long i;
+	pthread_once(&KISSDB_crc_once,KISSDB_crc_init);
+	crc = ~crc;
+	for(i=0;i<len;++i)
+		crc = KISSDB_crc_table[(crc ^ ((const uint8_t *)b)[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
 }
 
-void KISSDB_close(KISSDB *db)
+/* Buffer pool for direct I/O: the file is cached in page-sized frames,
+ * found through a chained hash of page numbers. Frames that hold part of
+ * a hash table page are kept over frames that only hold entries; among
+ * those the victim is the sampled frame whose second most recent use is
+ * the oldest (LRU-2), so pages a scan reads once go before pages that keep
+ * being read. Dirty frames are written back by a background thread. */
+typedef struct {
+	uint64_t page;
+	uint64_t last[2]; /* ticks of the two most recent uses, [0] the latest */
+	uint64_t gen; /* bumped every time the frame is dirtied */
+	long next; /* next frame in the hash chain, -1 at the end */
+	unsigned int pins;
+	uint8_t used;
+	uint8_t dirty;
+	uint8_t loading; /* being read in; wait on changed */
+	uint8_t writing; /* a copy is being written back; can't be evicted */
+	uint8_t table; /* holds part of a hash table page */
+} KISSDB_Pool_Frame;
+
+struct KISSDB_Pool {
+	int fd;
+	uint8_t *data;
+	KISSDB_Pool_Frame *frames;
+	unsigned long num_frames;
+	long *buckets;
+	unsigned long bucket_mask;
+	unsigned long hand; /* where the next victim sample starts */
+	unsigned long wb_hand; /* where the writer looks for dirty frames next */
+	uint64_t tick;
+	uint64_t disk_size; /* bytes in the file, including padding to a whole page */
+	unsigned long dirty;
+	uint8_t *wbuf; /* the writer's copies of the pages it writes */
+	uint64_t hits,misses,evictions,writebacks;
+	KISSDB_Counters *counters; /* the database's */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed; /* a frame was unpinned, read in or written back */
+	pthread_cond_t work; /* a quarter of the pool is dirty, or stop */
+	int stop;
+};
+
+static inline unsigned long KISSDB_pool_bucket(const KISSDB_Pool *p,uint64_t page)
 {
-	if (db->hash_tables)
-		free(db->hash_tables);
-	if (db->f)
-		fclose(db->f);
-	memset(db,0,sizeof(KISSDB));
+	return (unsigned long)((page * 0x9e3779b97f4a7c15ULL) >> 32) & p->bucket_mask;
 }
 
-int KISSDB_get(KISSDB *db,const void *key,void *vbuf)
+static long KISSDB_pool_lookup(const KISSDB_Pool *p,uint64_t page)
 {
-	uint8_t tmp[4096];
-	const uint8_t *kptr;
-	unsigned long klen,i;
-	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
-	uint64_t offset;
-	uint64_t *cur_hash_table;
-	long n;
+	long i;
+	for(i=p->buckets[KISSDB_pool_bucket(p,page)];i>=0;i=p->frames[i].next) {
+		if (p->frames[i].page == page)
+			return i;
+	}
+	return -1;
+}
 
-	cur_hash_table = db->hash_tables;
-	for(i=0;i<db->num_hash_tables;++i) {
-		offset = cur_hash_table[hash];
-		if (offset) {
-			if (fseeko(db->f,offset,SEEK_SET))
-				return KISSDB_ERROR_IO;
+static void KISSDB_pool_unlink(KISSDB_Pool *p,long i)
+{
+	long *ip = &(p->buckets[KISSDB_pool_bucket(p,p->frames[i].page)]);
+	while (*ip != i)
+		ip = &(p->frames[*ip].next);
+	*ip = p->frames[i].next;
+	p->frames[i].used = 0;
+}
 
-			kptr = (const uint8_t *)key;
-			klen = db->key_size;
-			while (klen) {
-				n = (long)fread(tmp,1,(klen > sizeof(tmp)) ? sizeof(tmp) : klen,db->f);
-				if (n > 0) {
-					if (memcmp(kptr,tmp,n))
-						goto get_no_match_next_hash_table;
-					kptr += n;
-					klen -= (unsigned long)n;
-				} else return 1; /* not found */
-			}
+/* Whether any hash table page overlaps the given page of the file; the
+ * pages are appended, so their offsets are in ascending order */
+static int KISSDB_pool_is_table(const KISSDB *db,uint64_t page)
+{
+	uint64_t start = page * KISSDB_POOL_PAGE_SIZE;
+	uint64_t end = start + KISSDB_POOL_PAGE_SIZE;
+	unsigned long lo = 0,hi = db->num_hash_tables,mid;
 
-			if (fread(vbuf,db->value_size,1,db->f) == 1)
-				return 0; /* success */
-			else return KISSDB_ERROR_IO;
-		} else return 1; /* not found */
-get_no_match_next_hash_table:
-		cur_hash_table += db->hash_table_size + 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (db->hash_table_offsets[mid] < end)
+			lo = mid + 1;
+		else hi = mid;
 	}
+	return ((lo)&&((db->hash_table_offsets[lo - 1] + db->hash_table_size_bytes) > start));
+}
 
-	return 1; /* not found */
+/* Keep the frames holding a hash table page just appended at offset */
+static void KISSDB_pool_mark_table(KISSDB *db,uint64_t offset)
+{
+	KISSDB_Pool *p = db->pool;
+	uint64_t page;
+	long i;
+
+	pthread_mutex_lock(&p->lock);
+	for(page=offset/KISSDB_POOL_PAGE_SIZE;(page * KISSDB_POOL_PAGE_SIZE)<(offset + db->hash_table_size_bytes);++page) {
+		if ((i = KISSDB_pool_lookup(p,page)) >= 0)
+			p->frames[i].table = 1;
+	}
+	pthread_mutex_unlock(&p->lock);
 }
 
-int KISSDB_put(KISSDB *db,const void *key,const void *value)
+/* Read or write one whole page of the file, bypassing the pool. Reads
+ * past the end of the file come back as zeros. */
+static int KISSDB_pool_read_page(KISSDB_Pool *p,uint8_t *buf,uint64_t page)
 {
-	uint8_t tmp[4096];
-	const uint8_t *kptr;
-	unsigned long klen,i;
-	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
-	uint64_t offset;
-	uint64_t htoffset,lasthtoffset;
-	uint64_t endoffset;
-	uint64_t *cur_hash_table;
-	uint64_t *hash_tables_rea;
-	long n;
+	ssize_t n;
+	while ((n = pread(p->fd,buf,KISSDB_POOL_PAGE_SIZE,(off_t)(page * KISSDB_POOL_PAGE_SIZE))) < 0) {
+		if (errno != EINTR)
+			return KISSDB_ERROR_IO;
+	}
+	KISSDB_COUNT(p->counters,reads,1);
+	KISSDB_COUNT(p->counters,bytes_read,n);
+	/* a direct read only comes up short at the end of the file */
+	memset(buf + n,0,KISSDB_POOL_PAGE_SIZE - (size_t)n);
+	return 0;
+}
 
-	lasthtoffset = htoffset = KISSDB_HEADER_SIZE;
-	cur_hash_table = db->hash_tables;
-	for(i=0;i<db->num_hash_tables;++i) {
-		offset = cur_hash_table[hash];
-		if (offset) {
-			/* rewrite if already exists */
-			if (fseeko(db->f,offset,SEEK_SET))
-				return KISSDB_ERROR_IO;
+static int KISSDB_pool_write_page(KISSDB_Pool *p,const uint8_t *buf,uint64_t page)
+{
+	ssize_t n;
+	while ((n = pwrite(p->fd,buf,KISSDB_POOL_PAGE_SIZE,(off_t)(page * KISSDB_POOL_PAGE_SIZE))) < 0) {
+		if (errno != EINTR)
+			return KISSDB_ERROR_IO;
+	}
+	KISSDB_COUNT(p->counters,writes,1);
+	KISSDB_COUNT(p->counters,bytes_written,n);
+	return (n == KISSDB_POOL_PAGE_SIZE) ? 0 : KISSDB_ERROR_IO;
+}
 
-			kptr = (const uint8_t *)key;
-			klen = db->key_size;
-			while (klen) {
-				n = (long)fread(tmp,1,(klen > sizeof(tmp)) ? sizeof(tmp) : klen,db->f);
-				if (n > 0) {
-					if (memcmp(kptr,tmp,n))
-						goto put_no_match_next_hash_table;
-					kptr += n;
-					klen -= (unsigned long)n;
-				}
-			}
+/* Pick a frame to reuse, or -1 if every frame is in use; called locked */
+static long KISSDB_pool_victim(KISSDB_Pool *p)
+{
+	const KISSDB_Pool_Frame *f,*b;
+	long best = -1,best_table = -1;
+	unsigned long n,sampled = 0;
+	long i;
 
-			/* C99 spec demands seek after fread(), required for Windows */
-			fseeko(db->f,0,SEEK_CUR);
- 
-			if (fwrite(value,db->value_size,1,db->f) == 1) {
-				fflush(db->f);
-				return 0; /* success */
-			} else return KISSDB_ERROR_IO;
+	for(n=0;n<p->num_frames;++n) {
+		i = (long)p->hand;
+		if (++p->hand == p->num_frames)
+			p->hand = 0;
+		f = &(p->frames[i]);
+		if (!f->used)
+			return i;
+		if ((f->pins)||(f->loading)||(f->writing))
+			continue;
+		if (f->table) {
+			b = (best_table >= 0) ? &(p->frames[best_table]) : (const KISSDB_Pool_Frame *)0;
+			if ((!b)||(f->last[1] < b->last[1])||((f->last[1] == b->last[1])&&(f->last[0] < b->last[0])))
+				best_table = i;
 		} else {
-			/* add if an empty hash table slot is discovered */
-			if (fseeko(db->f,0,SEEK_END))
-				return KISSDB_ERROR_IO;
-			endoffset = ftello(db->f);
+			b = (best >= 0) ? &(p->frames[best]) : (const KISSDB_Pool_Frame *)0;
+			if ((!b)||(f->last[1] < b->last[1])||((f->last[1] == b->last[1])&&(f->last[0] < b->last[0])))
+				best = i;
+		}
+		/* a hash table frame only goes if no other can */
+		if ((++sampled >= KISSDB_POOL_SAMPLE)&&(best >= 0))
+			break;
+	}
+	return (best >= 0) ? best : best_table;
+}
 
-			if (fwrite(key,db->key_size,1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-			if (fwrite(value,db->value_size,1,db->f) != 1)
-				return KISSDB_ERROR_IO;
+/* Find a page in the pool, reading it in if needed (unless it is about to
+ * be overwritten whole), and pin it: returns its frame or -1 on error */
+static long KISSDB_pool_pin(KISSDB *db,uint64_t page,int whole)
+{
+	KISSDB_Pool *p = db->pool;
+	KISSDB_Pool_Frame *f;
+	long i;
+	int fresh,r;
 
-			if (fseeko(db->f,htoffset + (sizeof(uint64_t) * hash),SEEK_SET))
-				return KISSDB_ERROR_IO;
-			if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-			cur_hash_table[hash] = endoffset;
+	pthread_mutex_lock(&p->lock);
+	for(;;) {
+		if ((i = KISSDB_pool_lookup(p,page)) >= 0) {
+			f = &(p->frames[i]);
+			if (f->loading) {
+				pthread_cond_wait(&p->changed,&p->lock);
+				continue;
+			}
+			++p->hits;
+			break;
+		}
+		if ((i = KISSDB_pool_victim(p)) < 0) {
+			pthread_cond_wait(&p->changed,&p->lock);
+			continue;
+		}
+
+		f = &(p->frames[i]);
+		if (f->used) {
+			if (f->dirty) {
+				if (KISSDB_pool_write_page(p,p->data + ((size_t)i * KISSDB_POOL_PAGE_SIZE),f->page)) {
+					pthread_mutex_unlock(&p->lock);
+					return -1;
+				}
+				if (((f->page + 1) * KISSDB_POOL_PAGE_SIZE) > p->disk_size)
+					p->disk_size = (f->page + 1) * KISSDB_POOL_PAGE_SIZE;
+				f->dirty = 0;
+				--p->dirty;
+			}
+			KISSDB_pool_unlink(p,i);
+			++p->evictions;
+		}
+		f->page = page;
+		f->used = 1;
+		f->loading = 1;
+		f->table = (uint8_t)KISSDB_pool_is_table(db,page);
+		f->last[0] = 0;
+		f->last[1] = 0;
+		f->next = p->buckets[KISSDB_pool_bucket(p,page)];
+		p->buckets[KISSDB_pool_bucket(p,page)] = i;
+		++p->misses;
+		fresh = ((whole)||((page * KISSDB_POOL_PAGE_SIZE) >= p->disk_size));
+		pthread_mutex_unlock(&p->lock);
 
-			fflush(db->f);
+		if (fresh) {
+			memset(p->data + ((size_t)i * KISSDB_POOL_PAGE_SIZE),0,KISSDB_POOL_PAGE_SIZE);
+			r = 0;
+		} else r = KISSDB_pool_read_page(p,p->data + ((size_t)i * KISSDB_POOL_PAGE_SIZE),page);
 
-			return 0; /* success */
+		pthread_mutex_lock(&p->lock);
+		f->loading = 0;
+		pthread_cond_broadcast(&p->changed);
+		if (r) {
+			KISSDB_pool_unlink(p,i);
+			pthread_mutex_unlock(&p->lock);
+			return -1;
 		}
-put_no_match_next_hash_table:
-		lasthtoffset = htoffset;
-		htoffset = cur_hash_table[db->hash_table_size];
-		cur_hash_table += (db->hash_table_size + 1);
+		break;
 	}
 
-	/* if no existing slots, add a new page of hash table entries */
-	if (fseeko(db->f,0,SEEK_END))
-		return KISSDB_ERROR_IO;
-	endoffset = ftello(db->f);
+	/* uses of a page one right after another count as one */
+	++f->pins;
+	if (f->last[0] != p->tick) {
+		f->last[1] = f->last[0];
+		f->last[0] = ++p->tick;
+	}
+	pthread_mutex_unlock(&p->lock);
 
-	hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1));
-	if (!hash_tables_rea)
-		return KISSDB_ERROR_MALLOC;
-	db->hash_tables = hash_tables_rea;
-	cur_hash_table = &(db->hash_tables[(db->hash_table_size + 1) * db->num_hash_tables]);
-	memset(cur_hash_table,0,db->hash_table_size_bytes);
+	return i;
+}
 
-	cur_hash_table[hash] = endoffset + db->hash_table_size_bytes; /* where new entry will go */
+static void KISSDB_pool_unpin(KISSDB_Pool *p,long i,int dirty)
+{
+	KISSDB_Pool_Frame *f = &(p->frames[i]);
 
-	if (fwrite(cur_hash_table,db->hash_table_size_bytes,1,db->f) != 1)
-		return KISSDB_ERROR_IO;
+	pthread_mutex_lock(&p->lock);
+	if (dirty) {
+		if (!f->dirty) {
+			f->dirty = 1;
+			if (++p->dirty == (p->num_frames / 4))
+				pthread_cond_signal(&p->work);
+		}
+		++f->gen;
+	}
+	if (!--f->pins)
+		pthread_cond_broadcast(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+}
 
-	if (fwrite(key,db->key_size,1,db->f) != 1)
-		return KISSDB_ERROR_IO;
-	if (fwrite(value,db->value_size,1,db->f) != 1)
-		return KISSDB_ERROR_IO;
+static int KISSDB_pool_read(KISSDB *db,uint8_t *buf,size_t len,uint64_t offset)
+{
+	size_t in,n;
+	long i;
 
-	if (db->num_hash_tables) {
-		if (fseeko(db->f,lasthtoffset + (sizeof(uint64_t) * db->hash_table_size),SEEK_SET))
+	while (len) {
+		in = (size_t)(offset % KISSDB_POOL_PAGE_SIZE);
+		n = KISSDB_POOL_PAGE_SIZE - in;
+		if (n > len)
+			n = len;
+		if ((i = KISSDB_pool_pin(db,offset / KISSDB_POOL_PAGE_SIZE,0)) < 0)
 			return KISSDB_ERROR_IO;
-		if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
-			return KISSDB_ERROR_IO;
-		db->hash_tables[((db->hash_table_size + 1) * (db->num_hash_tables - 1)) + db->hash_table_size] = endoffset;
+		memcpy(buf,db->pool->data + ((size_t)i * KISSDB_POOL_PAGE_SIZE) + in,n);
+		KISSDB_pool_unpin(db->pool,i,0);
+		buf += n;
+		len -= n;
+		offset += n;
 	}
-
-	++db->num_hash_tables;
-
-	fflush(db->f);
-
-	return 0; /* success */
+	return 0;
 }
 
-void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi)
+static int KISSDB_pool_writev(KISSDB *db,const struct iovec *iov,int iovcnt,uint64_t offset)
 {
-	dbi->db = db;
-	dbi->h_no = 0;
-	dbi->h_idx = 0;
+	const uint8_t *buf;
+	size_t len,in,n;
+	long i;
+
+	for(;iovcnt;++iov,--iovcnt) {
+		buf = (const uint8_t *)iov->iov_base;
+		len = iov->iov_len;
+		while (len) {
+			in = (size_t)(offset % KISSDB_POOL_PAGE_SIZE);
+			n = KISSDB_POOL_PAGE_SIZE - in;
+			if (n > len)
+				n = len;
+			if ((i = KISSDB_pool_pin(db,offset / KISSDB_POOL_PAGE_SIZE,(n == KISSDB_POOL_PAGE_SIZE))) < 0)
+				return KISSDB_ERROR_IO;
+			memcpy(db->pool->data + ((size_t)i * KISSDB_POOL_PAGE_SIZE) + in,buf,n);
+			KISSDB_pool_unpin(db->pool,i,1);
+			buf += n;
+			len -= n;
+			offset += n;
+		}
+	}
+	return 0;
 }
 
-int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
+/* Write back every dirty frame; needs exclusive access to the database */
+static int KISSDB_pool_flush(KISSDB_Pool *p)
 {
-	uint64_t offset;
+	KISSDB_Pool_Frame *f;
+	unsigned long i;
 
-	if ((dbi->h_no < dbi->db->num_hash_tables)&&(dbi->h_idx < dbi->db->hash_table_size)) {
-		while (!(offset = dbi->db->hash_tables[((dbi->db->hash_table_size + 1) * dbi->h_no) + dbi->h_idx])) {
-			if (++dbi->h_idx >= dbi->db->hash_table_size) {
-				dbi->h_idx = 0;
-				if (++dbi->h_no >= dbi->db->num_hash_tables)
-					return 0;
+	pthread_mutex_lock(&p->lock);
+	while (p->dirty) {
+		for(i=0;i<p->num_frames;++i) {
+			f = &(p->frames[i]);
+			if ((!f->dirty)||(f->writing))
+				continue;
+			if (KISSDB_pool_write_page(p,p->data + (i * KISSDB_POOL_PAGE_SIZE),f->page)) {
+				pthread_mutex_unlock(&p->lock);
+				return KISSDB_ERROR_IO;
 			}
+			if (((f->page + 1) * KISSDB_POOL_PAGE_SIZE) > p->disk_size)
+				p->disk_size = (f->page + 1) * KISSDB_POOL_PAGE_SIZE;
+			f->dirty = 0;
+			--p->dirty;
 		}
-		if (fseeko(dbi->db->f,offset,SEEK_SET))
-			return KISSDB_ERROR_IO;
-		if (fread(kbuf,dbi->db->key_size,1,dbi->db->f) != 1)
-			return KISSDB_ERROR_IO;
-		if (fread(vbuf,dbi->db->value_size,1,dbi->db->f) != 1)
-			return KISSDB_ERROR_IO;
-		if (++dbi->h_idx >= dbi->db->hash_table_size) {
-			dbi->h_idx = 0;
-			++dbi->h_no;
-		}
-		return 1;
+		/* the rest are being written by the writer thread */
+		if (p->dirty)
+			pthread_cond_wait(&p->changed,&p->lock);
 	}
+	pthread_mutex_unlock(&p->lock);
 
 	return 0;
 }
 
-#ifdef KISSDB_TEST
-
-#include <inttypes.h>
-
-int main(int argc,char **argv)
+/* Background writer: copies a batch of dirty frames under the lock and
+ * writes the copies out without it. A frame dirtied again meanwhile stays
+ * dirty and goes out with a later batch. */
+static void *KISSDB_pool_thread(void *arg)
 {
-	uint64_t i,j;
-	uint64_t v[8];
-	KISSDB db;
-	KISSDB_Iterator dbi;
-	char got_all_values[10000];
-	int q;
+	KISSDB_Pool *p = (KISSDB_Pool *)arg;
+	KISSDB_Pool_Frame *f;
+	struct timespec deadline;
+	long batch[KISSDB_POOL_WRITEBACK_BATCH];
+	uint64_t gen[KISSDB_POOL_WRITEBACK_BATCH];
+	int err[KISSDB_POOL_WRITEBACK_BATCH];
+	unsigned long i,j,n = 0;
 
-	printf("Opening new empty database test.db...\n");
+	pthread_mutex_lock(&p->lock);
+	for(;;) {
+		if ((!n)||(p->dirty < (p->num_frames / 4))) {
+			clock_gettime(CLOCK_REALTIME,&deadline);
+			deadline.tv_nsec += (long)KISSDB_POOL_WRITEBACK_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_nsec -= 1000000000L;
+				++deadline.tv_sec;
+			}
+			while ((!p->stop)&&(pthread_cond_timedwait(&p->work,&p->lock,&deadline) != ETIMEDOUT)&&(p->dirty < (p->num_frames / 4)));
+		}
+		if (p->stop)
+			break;
 
-	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
-		printf("KISSDB_open failed\n");
-		return 1;
-	}
+		for(i=0,n=0;(i<p->num_frames)&&(n<KISSDB_POOL_WRITEBACK_BATCH)&&(p->dirty);++i) {
+			j = p->wb_hand;
+			if (++p->wb_hand == p->num_frames)
+				p->wb_hand = 0;
+			f = &(p->frames[j]);
+			if ((!f->dirty)||(f->writing)||(f->pins))
+				continue;
+			memcpy(p->wbuf + (n * KISSDB_POOL_PAGE_SIZE),p->data + (j * KISSDB_POOL_PAGE_SIZE),KISSDB_POOL_PAGE_SIZE);
+			f->writing = 1;
+			batch[n] = (long)j;
+			gen[n] = f->gen;
+			++n;
+		}
+		if (!n)
+			continue;
+		pthread_mutex_unlock(&p->lock);
 
-	printf("Adding and then re-getting 10000 64-byte values...\n");
+		/* a frame being written can't be evicted, so its page stays put */
+		for(i=0;i<n;++i)
+			err[i] = KISSDB_pool_write_page(p,p->wbuf + (i * KISSDB_POOL_PAGE_SIZE),p->frames[batch[i]].page);
 
-	for(i=0;i<10000;++i) {
-		for(j=0;j<8;++j)
-			v[j] = i;
-		if (KISSDB_put(&db,&i,v)) {
-			printf("KISSDB_put failed (%"PRIu64")\n",i);
-			return 1;
-		}
-		memset(v,0,sizeof(v));
-		if ((q = KISSDB_get(&db,&i,v))) {
-			printf("KISSDB_get (1) failed (%"PRIu64") (%d)\n",i,q);
-			return 1;
-		}
-		for(j=0;j<8;++j) {
-			if (v[j] != i) {
-				printf("KISSDB_get (1) failed, bad data (%"PRIu64")\n",i);
-				return 1;
+		pthread_mutex_lock(&p->lock);
+		for(i=0;i<n;++i) {
+			f = &(p->frames[batch[i]]);
+			f->writing = 0;
+			if (err[i])
+				continue; /* left dirty; a flush will retry and report it */
+			if (((f->page + 1) * KISSDB_POOL_PAGE_SIZE) > p->disk_size)
+				p->disk_size = (f->page + 1) * KISSDB_POOL_PAGE_SIZE;
+			if (f->gen == gen[i]) {
+				f->dirty = 0;
+				--p->dirty;
 			}
+			++p->writebacks;
 		}
+		pthread_cond_broadcast(&p->changed);
 	}
+	pthread_mutex_unlock(&p->lock);
 
-	printf("Getting 10000 64-byte values...\n");
+	return (void *)0;
+}
 
-	for(i=0;i<10000;++i) {
-		if ((q = KISSDB_get(&db,&i,v))) {
-			printf("KISSDB_get (2) failed (%"PRIu64") (%d)\n",i,q);
-			return 1;
-		}
-		for(j=0;j<8;++j) {
-			if (v[j] != i) {
-				printf("KISSDB_get (2) failed, bad data (%"PRIu64")\n",i);
-				return 1;
-			}
-		}
-	}
+/* Stop the writer, write back what is left, and cut the file back to its
+ * real size, as whole-page writes may have padded it */
+static int KISSDB_pool_free(KISSDB *db)
+{
+	KISSDB_Pool *p = db->pool;
+	int r;
 
-	printf("Closing and re-opening database in read-only mode...\n");
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread,(void **)0);
 
-	KISSDB_close(&db);
+	r = KISSDB_pool_flush(p);
+	if ((!r)&&(p->disk_size > db->file_size)&&(ftruncate(db->fd,(off_t)db->file_size)))
+		r = KISSDB_ERROR_IO;
+	fcntl(db->fd,F_SETFL,fcntl(db->fd,F_GETFL) & ~O_DIRECT);
 
-	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,1024,8,sizeof(v))) {
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->changed);
+	pthread_cond_destroy(&p->work);
+	free(p->data);
+	free(p->wbuf);
+	free(p->frames);
+	free(p->buckets);
+	free(p);
+	db->pool = (KISSDB_Pool *)0;
+
+	return r;
+}
+
+/* Make everything written so far durable */
+static int KISSDB_sync(KISSDB *db)
+{
+	if ((db->pool)&&(KISSDB_pool_flush(db->pool)))
+		return KISSDB_ERROR_IO;
+	KISSDB_COUNT(&db->counters,syncs,1);
+	return (fdatasync(db->fd)) ? KISSDB_ERROR_IO : 0;
+}
+
+/* Read exactly len bytes at offset, retrying short reads */
+static int KISSDB_pread(KISSDB *db,void *buf,size_t len,uint64_t offset)
+{
+	ssize_t n;
+	if (db->pool)
+		return KISSDB_pool_read(db,(uint8_t *)buf,len,offset);
+	while (len) {
+		n = pread(db->fd,buf,len,(off_t)offset);
+		KISSDB_COUNT(&db->counters,reads,1);
+		if (n > 0) {
+			KISSDB_COUNT(&db->counters,bytes_read,n);
+			buf = (void *)(((uint8_t *)buf) + n);
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return KISSDB_ERROR_IO;
+	}
+	return 0;
+}
+
+/* Write an array of buffers contiguously at offset, retrying short writes */
+static int KISSDB_pwritev(KISSDB *db,struct iovec *iov,int iovcnt,uint64_t offset)
+{
+	ssize_t n;
+	if (db->pool)
+		return KISSDB_pool_writev(db,iov,iovcnt,offset);
+	while (iovcnt) {
+		n = pwritev(db->fd,iov,iovcnt,(off_t)offset);
+		KISSDB_COUNT(&db->counters,writes,1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return KISSDB_ERROR_IO;
+		}
+		KISSDB_COUNT(&db->counters,bytes_written,n);
+		offset += (uint64_t)n;
+		while ((iovcnt)&&((size_t)n >= iov->iov_len)) {
+			n -= (ssize_t)iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (void *)(((uint8_t *)iov->iov_base) + n);
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 0;
+}
+
+static int KISSDB_pwrite(KISSDB *db,const void *buf,size_t len,uint64_t offset)
+{
+	struct iovec iov;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return KISSDB_pwritev(db,&iov,1,offset);
+}
+
+/* Make sure the file mapping covers the first 'size' bytes of the file.
+ * The mapping is over-reserved so that appends don't remap every time;
+ * only the first map_size bytes are backed by the file and may be read. */
+static int KISSDB_remap(KISSDB *db,uint64_t size)
+{
+	void *m;
+	uint64_t cap;
+
+	if (size <= db->map_capacity) {
+		db->map_size = size;
+		return 0;
+	}
+
+	cap = db->map_capacity * 2;
+	if (cap < size)
+		cap = size;
+	if (cap < KISSDB_MMAP_MIN_GROWTH)
+		cap = KISSDB_MMAP_MIN_GROWTH;
+
+	m = mmap((void *)0,(size_t)cap,PROT_READ,MAP_SHARED,db->fd,0);
+	if (m == MAP_FAILED)
+		return KISSDB_ERROR_IO;
+	if (db->map)
+		munmap((void *)db->map,(size_t)db->map_capacity);
+
+	db->map = (const uint8_t *)m;
+	db->map_size = size;
+	db->map_capacity = cap;
+	return 0;
+}
+
+/* Where the parts of one entry are in the file */
+typedef struct {
+	uint64_t koffset;
+	uint64_t voffset;
+	unsigned long klen;
+	unsigned long vlen;
+	int deleted;
+} KISSDB_Entry;
+
+/* Decode the length header of a version 3 entry at offset */
+static int KISSDB_entry_decode(KISSDB *db,uint64_t offset,const uint8_t *hdr,KISSDB_Entry *e)
+{
+	uint32_t l[2];
+
+	memcpy(l,hdr,sizeof(l));
+	e->deleted = (l[1] == KISSDB_TOMBSTONE);
+	if (e->deleted)
+		l[1] = 0;
+	if ((l[0] > db->key_size)||(l[1] > db->value_size))
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	e->koffset = offset + KISSDB_ENTRY_HEADER_SIZE;
+	e->klen = l[0];
+	e->voffset = e->koffset + l[0];
+	e->vlen = l[1];
+	if ((e->voffset + e->vlen) > db->file_size)
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	return 0;
+}
+
+/* Locate the key and value of the entry at offset */
+static int KISSDB_entry_at(KISSDB *db,uint64_t offset,KISSDB_Entry *e)
+{
+	uint8_t hdr[KISSDB_ENTRY_HEADER_SIZE];
+
+	if (db->version == KISSDB_VERSION_FIXED) {
+		e->koffset = offset;
+		e->klen = db->key_size;
+		e->voffset = offset + db->key_size;
+		e->vlen = db->value_size;
+		e->deleted = 0;
+		return 0;
+	}
+	if ((offset + KISSDB_ENTRY_HEADER_SIZE) > db->file_size)
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	if (db->map)
+		return KISSDB_entry_decode(db,offset,db->map + offset,e);
+	if (KISSDB_pread(db,hdr,KISSDB_ENTRY_HEADER_SIZE,offset))
+		return KISSDB_ERROR_IO;
+	return KISSDB_entry_decode(db,offset,hdr,e);
+}
+
+/* Compare the key of the entry at offset with key, filling in e: 1 if
+ * equal, 0 if not, <0 on error. For versions 3 and 4 the length header and a
+ * key of up to a few KB are fetched with a single read. */
+static int KISSDB_entry_match(KISSDB *db,uint64_t offset,const void *key,unsigned long klen,KISSDB_Entry *e)
+{
+	uint8_t tmp[4096];
+	const uint8_t *kptr;
+	uint64_t koffset;
+	unsigned long n;
+	int r;
+
+	if ((db->map)||(db->version == KISSDB_VERSION_FIXED)||((KISSDB_ENTRY_HEADER_SIZE + klen) > sizeof(tmp))) {
+		if ((r = KISSDB_entry_at(db,offset,e)))
+			return r;
+		if (e->klen != klen)
+			return 0;
+		if (db->map)
+			return (!memcmp(db->map + e->koffset,key,klen));
+	} else {
+		n = KISSDB_ENTRY_HEADER_SIZE + klen;
+		if ((offset + n) > db->file_size)
+			n = (unsigned long)(db->file_size - offset);
+		if (n < KISSDB_ENTRY_HEADER_SIZE)
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		if (KISSDB_pread(db,tmp,n,offset))
+			return KISSDB_ERROR_IO;
+		if ((r = KISSDB_entry_decode(db,offset,tmp,e)))
+			return r;
+		if (e->klen != klen)
+			return 0;
+		return (!memcmp(tmp + KISSDB_ENTRY_HEADER_SIZE,key,klen));
+	}
+
+	kptr = (const uint8_t *)key;
+	koffset = e->koffset;
+	while (klen) {
+		n = (klen > sizeof(tmp)) ? sizeof(tmp) : klen;
+		if (KISSDB_pread(db,tmp,n,koffset))
+			return KISSDB_ERROR_IO;
+		if (memcmp(kptr,tmp,n))
+			return 0;
+		kptr += n;
+		klen -= n;
+		koffset += n;
+	}
+	return 1;
+}
+
+/* Size of an entry in the file */
+static uint64_t KISSDB_entry_size(KISSDB *db,unsigned long klen,unsigned long vlen)
+{
+	if (db->version == KISSDB_VERSION_FIXED)
+		return (uint64_t)db->key_size + (uint64_t)db->value_size;
+	if (KISSDB_PADDED(db,vlen))
+		vlen = KISSDB_INLINE_MAX;
+	return KISSDB_ENTRY_HEADER_SIZE + (uint64_t)klen + (uint64_t)vlen;
+}
+
+static const uint8_t KISSDB_zeros[KISSDB_INLINE_MAX] = { 0 };
+
+/* Fill iov with the parts of an entry as stored, at most 4; hdr is scratch
+ * space. A null value makes a tombstone (versions 3 and later only). */
+static int KISSDB_entry_iov(KISSDB *db,struct iovec *iov,uint32_t *hdr,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	int n = 0;
+	if (db->version != KISSDB_VERSION_FIXED) {
+		hdr[0] = (uint32_t)klen;
+		hdr[1] = (value) ? (uint32_t)vlen : (uint32_t)KISSDB_TOMBSTONE;
+		iov[n].iov_base = (void *)hdr;
+		iov[n++].iov_len = KISSDB_ENTRY_HEADER_SIZE;
+	}
+	iov[n].iov_base = (void *)key;
+	iov[n++].iov_len = klen;
+	if (value) {
+		iov[n].iov_base = (void *)value;
+		iov[n++].iov_len = vlen;
+		if ((KISSDB_PADDED(db,vlen))&&(vlen < KISSDB_INLINE_MAX)) {
+			iov[n].iov_base = (void *)KISSDB_zeros;
+			iov[n++].iov_len = KISSDB_INLINE_MAX - vlen;
+		}
+	}
+	return n;
+}
+
+/* Version 2 entries are fixed size: pad a short key or value with zeros.
+ * Returns b itself if no padding is needed, else a copy in *alloc. */
+static const void *KISSDB_pad(const void *b,unsigned long len,unsigned long size,void **alloc)
+{
+	if (len >= size)
+		return b;
+	if (!(*alloc = malloc(size)))
+		return (const void *)0;
+	memcpy(*alloc,b,len);
+	memset(((uint8_t *)*alloc) + len,0,size - len);
+	return *alloc;
+}
+
+/* Finalizer from MurmurHash3, spreads djb2's bits for the index */
+static inline uint64_t KISSDB_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Second hash of a key, with a seed of its own, that an inline value in
+ * the index must also match before it is returned for the key */
+static uint64_t KISSDB_fingerprint(const KISSDB *db,const void *key,unsigned long klen)
+{
+	return KISSDB_hash_seeded(key,klen,KISSDB_mix(db->hash_seed ^ KISSDB_WYP2));
+}
+
+/* Bit mask of the control bytes in a group of 16 that equal b */
+static inline unsigned int KISSDB_group_match(const uint8_t *group,uint8_t b)
+{
+#ifdef __SSE2__
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)group),_mm_set1_epi8((char)b)));
+#else
+	unsigned int i,m = 0;
+	for(i=0;i<KISSDB_INDEX_GROUP;++i)
+		m |= ((unsigned int)(group[i] == b)) << i;
+	return m;
+#endif
+}
+
+/* Orders offsets, or records that start with one */
+static int KISSDB_offset_cmp(const void *a,const void *b)
+{
+	uint64_t x = *((const uint64_t *)a);
+	uint64_t y = *((const uint64_t *)b);
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* malloc(), or with hugepages and at least a huge page's worth, memory
+ * aligned to huge pages that the kernel is asked to back with them. Either
+ * way free() releases it. */
+static void *KISSDB_alloc_huge(size_t size,int hugepages)
+{
+	void *p;
+
+	if ((!hugepages)||(size < KISSDB_HUGEPAGE_SIZE))
+		return malloc(size);
+	size = (size + KISSDB_HUGEPAGE_SIZE - 1) & ~((size_t)KISSDB_HUGEPAGE_SIZE - 1);
+	if (posix_memalign(&p,KISSDB_HUGEPAGE_SIZE,size))
+		return (void *)0;
+#ifdef MADV_HUGEPAGE
+	madvise(p,size,MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+static void KISSDB_index_free_table(KISSDB_Index_Table *t)
+{
+	free(t->ctrl);
+	free(t->slots);
+	free(t->values);
+	free(t->vlens);
+	free(t->fprints);
+	memset(t,0,sizeof(KISSDB_Index_Table));
+}
+
+static int KISSDB_index_alloc(KISSDB_Index_Table *t,unsigned long capacity,const KISSDB_Index *idx)
+{
+	unsigned long c = KISSDB_INDEX_GROUP;
+	while (c < capacity)
+		c <<= 1;
+	memset(t,0,sizeof(KISSDB_Index_Table));
+	t->ctrl = KISSDB_alloc_huge(c,idx->hugepages);
+	t->slots = KISSDB_alloc_huge(sizeof(KISSDB_Index_Slot) * c,idx->hugepages);
+	if (idx->inline_values) {
+		t->values = KISSDB_alloc_huge(sizeof(uint64_t) * c,idx->hugepages);
+		t->vlens = KISSDB_alloc_huge(c,idx->hugepages);
+		t->fprints = KISSDB_alloc_huge(sizeof(uint64_t) * c,idx->hugepages);
+	}
+	if ((!t->ctrl)||(!t->slots)||((idx->inline_values)&&((!t->values)||(!t->vlens)||(!t->fprints)))) {
+		KISSDB_index_free_table(t);
+		return KISSDB_ERROR_MALLOC;
+	}
+	memset(t->ctrl,KISSDB_CTRL_EMPTY,c);
+	t->capacity = c;
+	t->count = 0;
+	return 0;
+}
+
+static void KISSDB_index_free(KISSDB_Index *idx)
+{
+	KISSDB_index_free_table(&idx->cur);
+	KISSDB_index_free_table(&idx->old);
+	idx->migrated = 0;
+}
+
+/* Place an entry known not to be in the table; capacity must suffice.
+ * Returns its slot, with no inline value yet. */
+static KISSDB_Index_Slot *KISSDB_index_place(KISSDB_Index_Table *t,uint64_t hash,uint64_t offset)
+{
+	unsigned long mask = (t->capacity / KISSDB_INDEX_GROUP) - 1;
+	unsigned long g = (unsigned long)(hash >> 7) & mask;
+	unsigned long probe = 0;
+	unsigned int m;
+	unsigned long slot;
+
+	for(;;) {
+		m = KISSDB_group_match(t->ctrl + (g * KISSDB_INDEX_GROUP),KISSDB_CTRL_EMPTY);
+		if (m) {
+			slot = (g * KISSDB_INDEX_GROUP) + (unsigned long)__builtin_ctz(m);
+			t->ctrl[slot] = (uint8_t)(hash & 0x7f);
+			t->slots[slot].hash = hash;
+			t->slots[slot].offset = offset;
+			if (t->vlens)
+				t->vlens[slot] = 0;
+			++t->count;
+			return &(t->slots[slot]);
+		}
+		g = (g + ++probe) & mask; /* triangular probing visits every group */
+	}
+}
+
+/* Move up to 'groups' groups from the old table into the current one.
+ * Moved slots are marked deleted rather than empty so that probes for
+ * entries further along the same sequence in the old table go on. */
+static void KISSDB_index_migrate(KISSDB_Index *idx,unsigned long groups)
+{
+	unsigned long ngroups = idx->old.capacity / KISSDB_INDEX_GROUP;
+	unsigned long i,slot,to;
+
+	while ((groups--)&&(idx->migrated < ngroups)) {
+		for(i=0;i<KISSDB_INDEX_GROUP;++i) {
+			slot = (idx->migrated * KISSDB_INDEX_GROUP) + i;
+			if (!(idx->old.ctrl[slot] & KISSDB_CTRL_EMPTY)) {
+				to = (unsigned long)(KISSDB_index_place(&idx->cur,idx->old.slots[slot].hash,idx->old.slots[slot].offset) - idx->cur.slots);
+				if (idx->inline_values) {
+					idx->cur.values[to] = idx->old.values[slot];
+					idx->cur.vlens[to] = idx->old.vlens[slot];
+					idx->cur.fprints[to] = idx->old.fprints[slot];
+				}
+				idx->old.ctrl[slot] = KISSDB_CTRL_DELETED;
+				--idx->old.count;
+			}
+		}
+		++idx->migrated;
+	}
+	if ((idx->old.ctrl)&&(idx->migrated >= ngroups)) {
+		KISSDB_index_free_table(&idx->old);
+		idx->migrated = 0;
+	}
+}
+
+/* Add an entry known not to be in the index; *slot, if not NULL, is set
+ * to its slot, which stays put until the next insert */
+static int KISSDB_index_insert(KISSDB_Index *idx,uint64_t hash,uint64_t offset,KISSDB_Index_Slot **slot)
+{
+	KISSDB_Index_Table bigger;
+	KISSDB_Index_Slot *s;
+
+	/* keep the load factor at or below 7/8; the old table always drains
+	 * well before the new one could fill up */
+	if (((idx->cur.count + 1) * 8) > (idx->cur.capacity * 7)) {
+		KISSDB_index_migrate(idx,~0UL);
+		if (KISSDB_index_alloc(&bigger,idx->cur.capacity * 2,idx))
+			return KISSDB_ERROR_MALLOC;
+		idx->old = idx->cur;
+		idx->cur = bigger;
+		idx->migrated = 0;
+	}
+	s = KISSDB_index_place(&idx->cur,hash,offset);
+	if (idx->old.ctrl)
+		KISSDB_index_migrate(idx,KISSDB_INDEX_MIGRATE_GROUPS);
+	if (slot)
+		*slot = s;
+	return 0;
+}
+
+/* First slot of the table with this hash other than skip, or NULL */
+static KISSDB_Index_Slot *KISSDB_index_next_hash(const KISSDB_Index_Table *t,uint64_t hash,const KISSDB_Index_Slot *skip)
+{
+	unsigned long mask = (t->capacity / KISSDB_INDEX_GROUP) - 1;
+	unsigned long g = (unsigned long)(hash >> 7) & mask;
+	unsigned long probe = 0;
+	unsigned long slot;
+	const uint8_t *group;
+	unsigned int m;
+
+	if (!t->ctrl)
+		return (KISSDB_Index_Slot *)0;
+	for(;;) {
+		group = t->ctrl + (g * KISSDB_INDEX_GROUP);
+		m = KISSDB_group_match(group,(uint8_t)(hash & 0x7f));
+		while (m) {
+			slot = (g * KISSDB_INDEX_GROUP) + (unsigned long)__builtin_ctz(m);
+			m &= m - 1;
+			if ((t->slots[slot].hash == hash)&&(&(t->slots[slot]) != skip))
+				return &(t->slots[slot]);
+		}
+		if (KISSDB_group_match(group,KISSDB_CTRL_EMPTY))
+			return (KISSDB_Index_Slot *)0;
+		g = (g + ++probe) & mask;
+	}
+}
+
+/* The table of the index that slot is in */
+static KISSDB_Index_Table *KISSDB_index_table_of(KISSDB_Index *idx,const KISSDB_Index_Slot *slot)
+{
+	if ((slot >= idx->cur.slots)&&(slot < (idx->cur.slots + idx->cur.capacity)))
+		return &idx->cur;
+	return &idx->old;
+}
+
+/* An inline value is only found by its hash, so a key that shares its
+ * hash with another one, and that other one, are left to be looked up in
+ * the file: 1 if that is the case for the key at slot, else 0 */
+static int KISSDB_index_unshare(KISSDB_Index *idx,KISSDB_Index_Slot *slot)
+{
+	KISSDB_Index_Table *t;
+	KISSDB_Index_Slot *other;
+	unsigned long i;
+	int shared = 0;
+
+	/* any third key with the hash is already left to the file */
+	for(i=0;i<2;++i) {
+		t = (i) ? &idx->old : &idx->cur;
+		if ((other = KISSDB_index_next_hash(t,slot->hash,slot))) {
+			t->vlens[other - t->slots] = 0;
+			shared = 1;
+		}
+	}
+	if (shared) {
+		t = KISSDB_index_table_of(idx,slot);
+		t->vlens[slot - t->slots] = 0;
+	}
+	return shared;
+}
+
+/* Keep the value of the key at slot in the index (version 5): value and
+ * vlen as stored, or a null value if the key is deleted, and fprint the
+ * key's KISSDB_fingerprint() */
+static void KISSDB_index_set_inline(KISSDB_Index *idx,KISSDB_Index_Slot *slot,const void *value,unsigned long vlen,uint64_t fprint)
+{
+	KISSDB_Index_Table *t;
+	unsigned long i;
+
+	if ((!idx->inline_values)||(KISSDB_index_unshare(idx,slot)))
+		return;
+	t = KISSDB_index_table_of(idx,slot);
+	i = (unsigned long)(slot - t->slots);
+	t->fprints[i] = fprint;
+	if (!value)
+		t->vlens[i] = KISSDB_INLINE_DELETED;
+	else if (vlen <= KISSDB_INLINE_MAX) {
+		t->values[i] = 0;
+		memcpy(&(t->values[i]),value,vlen);
+		t->vlens[i] = (uint8_t)(vlen + 1);
+	} else t->vlens[i] = 0;
+}
+
+/* Get a value kept in the index for a key with this hash and
+ * fingerprint: 0 on success, 1 if not found, 2 if it has to be looked up
+ * in the file */
+static int KISSDB_index_get_inline(KISSDB_Index *idx,uint64_t hash,uint64_t fprint,void *vbuf,unsigned long *vlen)
+{
+	const KISSDB_Index_Table *t = &idx->cur;
+	KISSDB_Index_Slot *slot;
+	unsigned long i;
+
+	if (!(slot = KISSDB_index_next_hash(t,hash,(KISSDB_Index_Slot *)0))) {
+		t = &idx->old;
+		if (!(slot = KISSDB_index_next_hash(t,hash,(KISSDB_Index_Slot *)0)))
+			return 1; /* not found */
+	}
+	i = (unsigned long)(slot - t->slots);
+	if (!t->vlens[i])
+		return 2;
+	if (t->vlens[i] == KISSDB_INLINE_DELETED)
+		return 1; /* not found */
+	/* the only key with this hash is another one */
+	if (t->fprints[i] != fprint)
+		return 1; /* not found */
+	memcpy(vbuf,&(t->values[i]),t->vlens[i] - 1);
+	if (vlen)
+		*vlen = t->vlens[i] - 1;
+	return 0;
+}
+
+/* Look up key in one table: 0 and its slot on success, 1 if not found */
+static int KISSDB_index_find_table(KISSDB *db,const KISSDB_Index_Table *t,const void *key,unsigned long klen,uint64_t hash,KISSDB_Index_Slot **eslot,KISSDB_Entry *e)
+{
+	unsigned long mask = (t->capacity / KISSDB_INDEX_GROUP) - 1;
+	unsigned long g = (unsigned long)(hash >> 7) & mask;
+	unsigned long probe = 0;
+	unsigned long slot;
+	const uint8_t *group;
+	unsigned int m;
+	int r;
+
+	for(;;) {
+		group = t->ctrl + (g * KISSDB_INDEX_GROUP);
+		m = KISSDB_group_match(group,(uint8_t)(hash & 0x7f));
+		while (m) {
+			slot = (g * KISSDB_INDEX_GROUP) + (unsigned long)__builtin_ctz(m);
+			m &= m - 1;
+			if (t->slots[slot].hash == hash) {
+				if ((r = KISSDB_entry_match(db,t->slots[slot].offset,key,klen,e)) < 0)
+					return r;
+				if (r) {
+					*eslot = &(t->slots[slot]);
+					return 0; /* success */
+				}
+			}
+		}
+		if (KISSDB_group_match(group,KISSDB_CTRL_EMPTY))
+			return 1; /* not found */
+		g = (g + ++probe) & mask;
+	}
+}
+
+/* Look up key through the index: 0 and its slot on success, 1 if not found */
+static int KISSDB_index_find(KISSDB *db,const void *key,unsigned long klen,uint64_t hash,KISSDB_Index_Slot **eslot,KISSDB_Entry *e)
+{
+	int r = KISSDB_index_find_table(db,&db->index.cur,key,klen,hash,eslot,e);
+	if ((r == 1)&&(db->index.old.ctrl))
+		r = KISSDB_index_find_table(db,&db->index.old,key,klen,hash,eslot,e);
+	return r;
+}
+
+/* A compact hash table page: dense once a sparse one would take more room
+ * than the packed offsets of every bucket. Pages never go back to sparse,
+ * since buckets only ever fill up. */
+typedef struct {
+	uint8_t *dense; /* packed offsets of every bucket, or NULL while sparse */
+	uint8_t *sparse; /* records of the used buckets */
+	unsigned long count; /* records */
+	unsigned long capacity; /* records sparse has room for */
+} KISSDB_Table_Page;
+
+struct KISSDB_Tables {
+	KISSDB_Table_Page *pages;
+	unsigned long capacity; /* pages has room for */
+	uint8_t **blocks; /* dense pages are carved out of these */
+	unsigned long num_blocks;
+	size_t block_size; /* of the last block */
+	size_t block_used; /* of the last block */
+	uint64_t memory; /* bytes of blocks and sparse records */
+	int hugepages;
+};
+
+/* Offsets are packed in 5 bytes in host byte order */
+static inline uint64_t KISSDB_get40(const uint8_t *p)
+{
+	uint32_t lo;
+	memcpy(&lo,p,sizeof(uint32_t));
+	return (uint64_t)lo | ((uint64_t)p[4] << 32);
+}
+
+static inline void KISSDB_put40(uint8_t *p,uint64_t v)
+{
+	uint32_t lo = (uint32_t)v;
+	memcpy(p,&lo,sizeof(uint32_t));
+	p[4] = (uint8_t)(v >> 32);
+}
+
+/* Record of bucket idx in a sparse page, or where it would go */
+static unsigned long KISSDB_table_search(const KISSDB_Table_Page *tp,unsigned long idx,int *found)
+{
+	unsigned long lo = 0,hi = tp->count,mid;
+	uint32_t b;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		memcpy(&b,tp->sparse + (KISSDB_TABLE_RECORD_BYTES * mid),sizeof(uint32_t));
+		if (b < idx)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	*found = 0;
+	if (lo < tp->count) {
+		memcpy(&b,tp->sparse + (KISSDB_TABLE_RECORD_BYTES * lo),sizeof(uint32_t));
+		*found = (b == idx);
+	}
+	return lo;
+}
+
+/* Entry idx of hash table page 'page' */
+static inline uint64_t KISSDB_table_entry(const KISSDB *db,unsigned long page,unsigned long idx)
+{
+	const KISSDB_Table_Page *tp;
+	unsigned long i;
+	int found;
+
+	if (!db->tables)
+		return db->hash_tables[((db->hash_table_size + 1) * page) + idx];
+	tp = &(db->tables->pages[page]);
+	if (tp->dense)
+		return KISSDB_get40(tp->dense + (KISSDB_TABLE_OFFSET_BYTES * idx));
+	i = KISSDB_table_search(tp,idx,&found);
+	return (found) ? KISSDB_get40(tp->sparse + (KISSDB_TABLE_RECORD_BYTES * i) + sizeof(uint32_t)) : 0;
+}
+
+/* Copy hash table page 'page' out whole, as it is in the file */
+static void KISSDB_table_copy(const KISSDB *db,unsigned long page,uint64_t *out)
+{
+	const KISSDB_Table_Page *tp;
+	const uint8_t *rec;
+	unsigned long i;
+	uint32_t b;
+
+	if (!db->tables) {
+		memcpy(out,&(db->hash_tables[(db->hash_table_size + 1) * page]),db->hash_table_size_bytes);
+		return;
+	}
+	tp = &(db->tables->pages[page]);
+	if (tp->dense) {
+		for(i=0;i<=db->hash_table_size;++i)
+			out[i] = KISSDB_get40(tp->dense + (KISSDB_TABLE_OFFSET_BYTES * i));
+		return;
+	}
+	memset(out,0,db->hash_table_size_bytes);
+	for(i=0;i<tp->count;++i) {
+		rec = tp->sparse + (KISSDB_TABLE_RECORD_BYTES * i);
+		memcpy(&b,rec,sizeof(uint32_t));
+		out[b] = KISSDB_get40(rec + sizeof(uint32_t));
+	}
+}
+
+/* Room for a dense page, from the last block or a new one */
+static uint8_t *KISSDB_tables_carve(KISSDB *db)
+{
+	KISSDB_Tables *t = db->tables;
+	size_t size = KISSDB_TABLE_OFFSET_BYTES * (db->hash_table_size + 1);
+	size_t bs;
+	uint8_t **blocks_rea;
+	uint8_t *p;
+
+	if ((!t->num_blocks)||((t->block_size - t->block_used) < size)) {
+		/* small pages share blocks; big ones get one each */
+		bs = size * 16;
+		if (bs > KISSDB_TABLE_BLOCK_SIZE)
+			bs = (size > KISSDB_TABLE_BLOCK_SIZE) ? size : KISSDB_TABLE_BLOCK_SIZE;
+		if ((t->hugepages)&&(bs >= KISSDB_HUGEPAGE_SIZE))
+			bs = (bs + KISSDB_HUGEPAGE_SIZE - 1) & ~((size_t)KISSDB_HUGEPAGE_SIZE - 1);
+		if (!(blocks_rea = realloc(t->blocks,sizeof(uint8_t *) * (t->num_blocks + 1))))
+			return (uint8_t *)0;
+		t->blocks = blocks_rea;
+		if (!(p = KISSDB_alloc_huge(bs,t->hugepages)))
+			return (uint8_t *)0;
+		t->blocks[t->num_blocks++] = p;
+		t->block_size = bs;
+		t->block_used = 0;
+		t->memory += bs;
+	}
+	p = t->blocks[t->num_blocks - 1] + t->block_used;
+	t->block_used += size;
+	return p;
+}
+
+/* Turn a sparse page into a dense one */
+static int KISSDB_table_densify(KISSDB *db,KISSDB_Table_Page *tp)
+{
+	const uint8_t *rec;
+	uint8_t *dense;
+	unsigned long i;
+	uint32_t b;
+
+	if (!(dense = KISSDB_tables_carve(db)))
+		return KISSDB_ERROR_MALLOC;
+	memset(dense,0,KISSDB_TABLE_OFFSET_BYTES * (db->hash_table_size + 1));
+	for(i=0;i<tp->count;++i) {
+		rec = tp->sparse + (KISSDB_TABLE_RECORD_BYTES * i);
+		memcpy(&b,rec,sizeof(uint32_t));
+		memcpy(dense + (KISSDB_TABLE_OFFSET_BYTES * b),rec + sizeof(uint32_t),KISSDB_TABLE_OFFSET_BYTES);
+	}
+	free(tp->sparse);
+	db->tables->memory -= KISSDB_TABLE_RECORD_BYTES * tp->capacity;
+	tp->sparse = (uint8_t *)0;
+	tp->count = 0;
+	tp->capacity = 0;
+	tp->dense = dense;
+	return 0;
+}
+
+/* Whether a sparse page of count records would take at least the room of
+ * a dense one; always so if the buckets don't fit in a record */
+static inline int KISSDB_table_too_full(const KISSDB *db,unsigned long count)
+{
+	return ((db->hash_table_size > 0xffffffffUL)||((KISSDB_TABLE_RECORD_BYTES * (uint64_t)count) >= (KISSDB_TABLE_OFFSET_BYTES * ((uint64_t)db->hash_table_size + 1))));
+}
+
+/* Set entry idx of a compact page. Fails on offsets of 1TB and more, and
+ * if a sparse page needs more room and can't get it. */
+static int KISSDB_table_store(KISSDB *db,unsigned long page,unsigned long idx,uint64_t value)
+{
+	KISSDB_Table_Page *tp = &(db->tables->pages[page]);
+	uint8_t *rec,*sparse_rea;
+	unsigned long i,c;
+	uint32_t b = (uint32_t)idx;
+	int found,r;
+
+	if (value > KISSDB_TABLE_MAX_OFFSET)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (tp->dense) {
+		KISSDB_put40(tp->dense + (KISSDB_TABLE_OFFSET_BYTES * idx),value);
+		return 0;
+	}
+
+	i = KISSDB_table_search(tp,idx,&found);
+	rec = tp->sparse + (KISSDB_TABLE_RECORD_BYTES * i);
+	if (found) {
+		if (value)
+			KISSDB_put40(rec + sizeof(uint32_t),value);
+		else {
+			memmove(rec,rec + KISSDB_TABLE_RECORD_BYTES,KISSDB_TABLE_RECORD_BYTES * (tp->count - i - 1));
+			--tp->count;
+		}
+		return 0;
+	}
+	if (!value)
+		return 0;
+
+	if (tp->count == tp->capacity) {
+		c = (tp->capacity) ? (tp->capacity * 2) : 8;
+		if (KISSDB_table_too_full(db,c)) {
+			if ((r = KISSDB_table_densify(db,tp)))
+				return r;
+			KISSDB_put40(tp->dense + (KISSDB_TABLE_OFFSET_BYTES * idx),value);
+			return 0;
+		}
+		if (!(sparse_rea = realloc(tp->sparse,KISSDB_TABLE_RECORD_BYTES * c)))
+			return KISSDB_ERROR_MALLOC;
+		db->tables->memory += KISSDB_TABLE_RECORD_BYTES * (c - tp->capacity);
+		tp->sparse = sparse_rea;
+		tp->capacity = c;
+		rec = tp->sparse + (KISSDB_TABLE_RECORD_BYTES * i);
+	}
+	memmove(rec + KISSDB_TABLE_RECORD_BYTES,rec,KISSDB_TABLE_RECORD_BYTES * (tp->count - i));
+	memcpy(rec,&b,sizeof(uint32_t));
+	KISSDB_put40(rec + sizeof(uint32_t),value);
+	++tp->count;
+	return 0;
+}
+
+/* Make a whole page, as it is in the file, compact page num_hash_tables.
+ * The page only counts once num_hash_tables is bumped; until then another
+ * call replaces it. */
+static int KISSDB_tables_append(KISSDB *db,const uint64_t *page)
+{
+	KISSDB_Tables *t = db->tables;
+	KISSDB_Table_Page *pages_rea;
+	KISSDB_Table_Page *tp;
+	uint8_t *rec;
+	unsigned long i,c,count = 0;
+	uint32_t b;
+
+	for(i=0;i<=db->hash_table_size;++i) {
+		if (page[i] > KISSDB_TABLE_MAX_OFFSET)
+			return KISSDB_ERROR_INVALID_PARAMETERS;
+		count += (page[i] != 0);
+	}
+	if (db->num_hash_tables == t->capacity) {
+		c = (t->capacity) ? (t->capacity * 2) : 16;
+		if (!(pages_rea = realloc(t->pages,sizeof(KISSDB_Table_Page) * c)))
+			return KISSDB_ERROR_MALLOC;
+		memset(pages_rea + t->capacity,0,sizeof(KISSDB_Table_Page) * (c - t->capacity));
+		t->pages = pages_rea;
+		t->capacity = c;
+	}
+
+	tp = &(t->pages[db->num_hash_tables]);
+	free(tp->sparse);
+	t->memory -= KISSDB_TABLE_RECORD_BYTES * tp->capacity;
+	memset(tp,0,sizeof(KISSDB_Table_Page));
+	if (KISSDB_table_too_full(db,count)) {
+		if (!(tp->dense = KISSDB_tables_carve(db)))
+			return KISSDB_ERROR_MALLOC;
+		for(i=0;i<=db->hash_table_size;++i)
+			KISSDB_put40(tp->dense + (KISSDB_TABLE_OFFSET_BYTES * i),page[i]);
+	} else if (count) {
+		if (!(tp->sparse = malloc(KISSDB_TABLE_RECORD_BYTES * count)))
+			return KISSDB_ERROR_MALLOC;
+		t->memory += KISSDB_TABLE_RECORD_BYTES * count;
+		tp->capacity = count;
+		for(i=0;i<=db->hash_table_size;++i) {
+			if (page[i]) {
+				rec = tp->sparse + (KISSDB_TABLE_RECORD_BYTES * (tp->count++));
+				b = (uint32_t)i;
+				memcpy(rec,&b,sizeof(uint32_t));
+				KISSDB_put40(rec + sizeof(uint32_t),page[i]);
+			}
+		}
+	}
+	return 0;
+}
+
+static void KISSDB_tables_free(KISSDB_Tables *t)
+{
+	unsigned long i;
+
+	for(i=0;i<t->capacity;++i)
+		free(t->pages[i].sparse);
+	for(i=0;i<t->num_blocks;++i)
+		free(t->blocks[i]);
+	free(t->pages);
+	free(t->blocks);
+	free(t);
+}
+
+/* An index checkpoint read back from path.idx */
+typedef struct {
+	uint64_t *buf;
+	uint64_t covered; /* database size when it was taken */
+	uint64_t live_bytes;
+	unsigned long num_hash_tables;
+	const uint64_t *offsets;
+	const uint64_t *tables;
+	const uint64_t *records; /* [offset][full key hash](...) records, by offset */
+	unsigned long count;
+} KISSDB_Idx_Checkpoint;
+
+/* Build the index from the hash tables, reading each stored key once.
+ * Entries a checkpoint has a record for are placed without any reads, and
+ * the live bytes are the checkpoint's, corrected by the entries added and
+ * replaced since. */
+static int KISSDB_index_build(KISSDB *db,const KISSDB_Idx_Checkpoint *ck)
+{
+	unsigned long i,n = 0;
+	unsigned long entries = (db->hash_table_size + 1) * db->num_hash_tables;
+	unsigned long words = KISSDB_IDX_RECORD_WORDS(db);
+	uint64_t offset;
+	uint8_t *kbuf;
+	uint8_t *seen = (uint8_t *)0;
+	const uint64_t *rec;
+	const uint8_t *k;
+	KISSDB_Index_Slot *slot;
+	KISSDB_Index_Table *t = &db->index.cur;
+	KISSDB_Entry e;
+	int small,r;
+
+	for(i=0;i<entries;++i) {
+		if (((i % (db->hash_table_size + 1)) != db->hash_table_size)&&(KISSDB_table_entry(db,i / (db->hash_table_size + 1),i % (db->hash_table_size + 1))))
+			++n;
+	}
+	if (KISSDB_index_alloc(t,((n * 8) / 7) + 1,&db->index))
+		return KISSDB_ERROR_MALLOC;
+
+	kbuf = malloc(db->key_size + KISSDB_INLINE_MAX);
+	if (ck) {
+		seen = calloc(ck->count + 1,1);
+		db->live_bytes = ck->live_bytes;
+	}
+	if ((!kbuf)||((ck)&&(!seen))) {
+		free(kbuf);
+		free(seen);
+		return KISSDB_ERROR_MALLOC;
+	}
+	r = 0;
+	for(i=0;i<entries;++i) {
+		if ((i % (db->hash_table_size + 1)) == db->hash_table_size)
+			continue;
+		if (!(offset = KISSDB_table_entry(db,i / (db->hash_table_size + 1),i % (db->hash_table_size + 1))))
+			continue;
+		if ((ck)&&((rec = bsearch(&offset,ck->records,ck->count,sizeof(uint64_t) * words,KISSDB_offset_cmp)))) {
+			seen[(rec - ck->records) / words] = 1;
+			slot = KISSDB_index_place(t,rec[1],offset);
+			if (db->index.inline_values) {
+				t->values[slot - t->slots] = rec[2];
+				t->fprints[slot - t->slots] = rec[4];
+				if ((rec[3] <= (KISSDB_INLINE_MAX + 1))||(rec[3] == KISSDB_INLINE_DELETED))
+					t->vlens[slot - t->slots] = (uint8_t)rec[3];
+				KISSDB_index_unshare(&db->index,slot);
+			}
+			continue;
+		}
+		if ((r = KISSDB_entry_at(db,offset,&e)))
+			break;
+		if (!e.deleted)
+			db->live_bytes += KISSDB_entry_size(db,e.klen,e.vlen);
+		/* a small value is read along with the key */
+		small = ((db->index.inline_values)&&(!e.deleted)&&(e.vlen <= KISSDB_INLINE_MAX));
+		if (db->map) {
+			if ((e.voffset + e.vlen) > db->map_size) {
+				r = KISSDB_ERROR_IO;
+				break;
+			}
+			k = db->map + e.koffset;
+		} else {
+			if (KISSDB_pread(db,kbuf,e.klen + ((small) ? e.vlen : 0),e.koffset)) {
+				r = KISSDB_ERROR_IO;
+				break;
+			}
+			k = kbuf;
+		}
+		slot = KISSDB_index_place(t,KISSDB_mix(KISSDB_hash(db,k,e.klen)),offset);
+		if (db->index.inline_values)
+			KISSDB_index_set_inline(&db->index,slot,(e.deleted) ? (const void *)0 : (const void *)(k + e.klen),e.vlen,KISSDB_fingerprint(db,k,e.klen));
+	}
+
+	/* entries replaced since the checkpoint no longer count as live */
+	for(i=0;((!r)&&(ck)&&(i<ck->count));++i) {
+		if (seen[i])
+			continue;
+		if ((r = KISSDB_entry_at(db,ck->records[i * words],&e)))
+			break;
+		if (!e.deleted)
+			db->live_bytes -= KISSDB_entry_size(db,e.klen,e.vlen);
+	}
+	free(kbuf);
+	free(seen);
+
+	return r;
+}
+
+/* Write-ahead log: puts and deletes append records to buf under lock,
+ * and the log thread swaps it for spare and writes it out as one batch */
+struct KISSDB_WAL {
+	int fd;
+	int durability;
+	unsigned long interval_ms;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* records appended (commit durability) or stop */
+	pthread_cond_t done; /* a batch has been written */
+	uint8_t *buf;
+	size_t len,cap;
+	uint8_t *spare;
+	size_t spare_cap;
+	uint64_t lsn; /* bytes of records appended so far */
+	uint64_t durable; /* lsn up to which records are written (and synced) */
+	uint64_t checkpoint; /* lsn at the last checkpoint */
+	uint64_t file_offset; /* where the next batch goes in the log file */
+	KISSDB_Counters counters; /* writes and syncs of the log */
+	int flushing;
+	int stop;
+	int error;
+};
+
+static char *KISSDB_wal_path(const char *path)
+{
+	char *p = malloc(strlen(path) + sizeof(KISSDB_WAL_SUFFIX));
+	if (p) {
+		strcpy(p,path);
+		strcat(p,KISSDB_WAL_SUFFIX);
+	}
+	return p;
+}
+
+static int KISSDB_wal_write(int fd,const uint8_t *buf,size_t len,uint64_t offset)
+{
+	ssize_t n;
+	while (len) {
+		n = pwrite(fd,buf,len,(off_t)offset);
+		if (n > 0) {
+			buf += n;
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return KISSDB_ERROR_IO;
+	}
+	return 0;
+}
+
+static void *KISSDB_wal_thread(void *arg)
+{
+	KISSDB_WAL *w = (KISSDB_WAL *)arg;
+	struct timespec deadline;
+	uint8_t *batch;
+	size_t len,cap;
+	uint64_t lsn,offset;
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	for(;;) {
+		if (w->durability == KISSDB_WAL_SYNC_COMMIT) {
+			while ((!w->len)&&(!w->stop))
+				pthread_cond_wait(&w->work,&w->lock);
+		} else {
+			clock_gettime(CLOCK_REALTIME,&deadline);
+			deadline.tv_sec += (time_t)(w->interval_ms / 1000);
+			deadline.tv_nsec += (long)(w->interval_ms % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_nsec -= 1000000000L;
+				++deadline.tv_sec;
+			}
+			while ((!w->stop)&&(pthread_cond_timedwait(&w->work,&w->lock,&deadline) != ETIMEDOUT));
+		}
+		if (!w->len) {
+			if (w->stop)
+				break;
+			continue;
+		}
+
+		/* everything appended while the last batch was being written
+		 * goes out together, with a single sync */
+		batch = w->buf;
+		len = w->len;
+		cap = w->cap;
+		w->buf = w->spare;
+		w->cap = w->spare_cap;
+		w->len = 0;
+		lsn = w->lsn;
+		offset = w->file_offset;
+		w->flushing = 1;
+		pthread_mutex_unlock(&w->lock);
+
+		err = KISSDB_wal_write(w->fd,batch,len,offset);
+		if ((!err)&&(w->durability != KISSDB_WAL_SYNC_NONE)&&(fdatasync(w->fd)))
+			err = KISSDB_ERROR_IO;
+
+		pthread_mutex_lock(&w->lock);
+		w->spare = batch;
+		w->spare_cap = cap;
+		w->flushing = 0;
+		++w->counters.writes;
+		w->counters.bytes_written += (uint64_t)len;
+		if (w->durability != KISSDB_WAL_SYNC_NONE)
+			++w->counters.syncs;
+		if (err)
+			w->error = 1;
+		else {
+			w->file_offset = offset + len;
+			if (lsn > w->durable)
+				w->durable = lsn;
+		}
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return (void *)0;
+}
+
+/* Append one record to the log buffer */
+static int KISSDB_wal_append(KISSDB_WAL *w,uint32_t type,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	uint32_t h[4];
+	size_t size = KISSDB_WAL_RECORD_HEADER_SIZE + klen + vlen;
+	size_t cap;
+	uint8_t *rec;
+
+	pthread_mutex_lock(&w->lock);
+	if ((w->len + size) > w->cap) {
+		cap = w->cap ? w->cap * 2 : 65536;
+		while (cap < (w->len + size))
+			cap *= 2;
+		if (!(rec = realloc(w->buf,cap))) {
+			pthread_mutex_unlock(&w->lock);
+			return KISSDB_ERROR_MALLOC;
+		}
+		w->buf = rec;
+		w->cap = cap;
+	}
+	rec = w->buf + w->len;
+	h[1] = type;
+	h[2] = (uint32_t)klen;
+	h[3] = (uint32_t)vlen;
+	memcpy(rec + sizeof(uint32_t),h + 1,sizeof(uint32_t) * 3);
+	memcpy(rec + KISSDB_WAL_RECORD_HEADER_SIZE,key,klen);
+	if (vlen)
+		memcpy(rec + KISSDB_WAL_RECORD_HEADER_SIZE + klen,value,vlen);
+	h[0] = KISSDB_crc32(0,rec + sizeof(uint32_t),size - sizeof(uint32_t));
+	memcpy(rec,h,sizeof(uint32_t));
+	w->len += size;
+	w->lsn += size;
+	if (w->durability == KISSDB_WAL_SYNC_COMMIT)
+		pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/* Empty the log once the database file holds everything in it */
+static int KISSDB_wal_reset(KISSDB_WAL *w)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->flushing)
+		pthread_cond_wait(&w->done,&w->lock);
+	w->len = 0;
+	if (ftruncate(w->fd,0))
+		r = KISSDB_ERROR_IO;
+	else {
+		w->file_offset = 0;
+		w->durable = w->lsn;
+		w->checkpoint = w->lsn;
+		w->error = 0;
+	}
+	pthread_cond_broadcast(&w->done);
+	pthread_mutex_unlock(&w->lock);
+
+	return r;
+}
+
+/* Stop the log thread after it has written out what is left */
+static void KISSDB_wal_stop(KISSDB_WAL *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread,(void **)0);
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work);
+	pthread_cond_destroy(&w->done);
+	close(w->fd);
+	free(w->buf);
+	free(w->spare);
+	free(w);
+}
+
+struct KISSDB_Snapshot {
+	KISSDB *db; /* database sharing pages with us, NULL once detached */
+	KISSDB view; /* sizes as of the snapshot; fd is our own */
+	uint64_t **pages; /* private copies of pages, NULL while shared */
+	int error; /* a page could not be copied on detaching */
+	struct KISSDB_Snapshot *next;
+};
+
+/* Entry idx of hash table page 'page' as the snapshot sees it */
+static inline uint64_t KISSDB_snapshot_entry(const KISSDB_Snapshot *s,unsigned long page,unsigned long idx)
+{
+	if (s->pages[page])
+		return s->pages[page][idx];
+	return KISSDB_table_entry(s->db,page,idx);
+}
+
+/* Give every snapshot still sharing a page its own copy, before the
+ * page changes */
+static int KISSDB_snapshot_cow(KISSDB *db,unsigned long page)
+{
+	KISSDB_Snapshot *s;
+
+	for(s=db->snapshots;s;s=s->next) {
+		if ((page < s->view.num_hash_tables)&&(!s->pages[page])) {
+			if (!(s->pages[page] = malloc(db->hash_table_size_bytes)))
+				return KISSDB_ERROR_MALLOC;
+			KISSDB_table_copy(db,page,s->pages[page]);
+		}
+	}
+	return 0;
+}
+
+/* Copy every shared page into every snapshot and cut them loose, before
+ * db's tables go away */
+static void KISSDB_snapshot_detach_all(KISSDB *db)
+{
+	KISSDB_Snapshot *s;
+	unsigned long p;
+
+	for(p=0;p<db->num_hash_tables;++p) {
+		if (KISSDB_snapshot_cow(db,p)) {
+			for(s=db->snapshots;s;s=s->next) {
+				if ((p < s->view.num_hash_tables)&&(!s->pages[p]))
+					s->error = KISSDB_ERROR_MALLOC;
+			}
+		}
+	}
+	while ((s = db->snapshots)) {
+		db->snapshots = s->next;
+		s->db = (KISSDB *)0;
+		s->next = (KISSDB_Snapshot *)0;
+	}
+}
+
+/* Take a snapshot off its database's list */
+static void KISSDB_snapshot_unlink(KISSDB_Snapshot *snap)
+{
+	KISSDB_Snapshot **sp;
+
+	for(sp=&(snap->db->snapshots);*sp;sp=&((*sp)->next)) {
+		if (*sp == snap) {
+			*sp = snap->next;
+			break;
+		}
+	}
+	snap->db = (KISSDB *)0;
+	snap->next = (KISSDB_Snapshot *)0;
+}
+
+/* Give one snapshot its own copy of every page and cut it loose now, so
+ * it can be read while the database changes without any locking */
+static int KISSDB_snapshot_detach(KISSDB_Snapshot *snap)
+{
+	unsigned long p;
+
+	for(p=0;p<snap->view.num_hash_tables;++p) {
+		if (!snap->pages[p]) {
+			if (!(snap->pages[p] = malloc(snap->db->hash_table_size_bytes)))
+				return KISSDB_ERROR_MALLOC;
+			KISSDB_table_copy(snap->db,p,snap->pages[p]);
+		}
+	}
+	KISSDB_snapshot_unlink(snap);
+	return 0;
+}
+
+/* Shared state of a database opened with KISSDB_OPEN_FLAG_SHARED, mapped
+ * from path.shm. Writers hold an fcntl() write lock on its first byte;
+ * processes opening or reloading the database hold a read lock. */
+typedef struct {
+	uint64_t seq; /* number of the change, 0 while it is being written */
+	uint64_t page;
+	uint64_t idx; /* KISSDB_SHM_NEW_PAGE for a page appended at value */
+	uint64_t value;
+} KISSDB_Shm_Record;
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint64_t ring_size;
+	uint64_t generation; /* number of the last change published */
+	uint64_t file_size; /* database size when it was published */
+	KISSDB_Shm_Record ring[];
+} KISSDB_Shm;
+
+struct KISSDB_Shared {
+	int fd;
+	KISSDB_Shm *shm;
+	size_t size;
+	uint64_t seen; /* last change this process has applied */
+	uint64_t pending; /* last change written to the ring, not yet published */
+	int locked; /* F_RDLCK, F_WRLCK or 0 */
+	int writable;
+};
+
+/* Write a change to the ring, to be published when the write lock is
+ * released. Each record is stamped with its number last, so a reader can
+ * tell a record that was overwritten while it was copying it. */
+static void KISSDB_shared_log(KISSDB *db,uint64_t page,uint64_t idx,uint64_t value)
+{
+	KISSDB_Shared *sh = db->shared;
+	KISSDB_Shm_Record *rec = &(sh->shm->ring[(++sh->pending) % KISSDB_SHM_RING]);
+
+	__atomic_store_n(&rec->seq,0,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&rec->page,page,__ATOMIC_RELAXED);
+	__atomic_store_n(&rec->idx,idx,__ATOMIC_RELAXED);
+	__atomic_store_n(&rec->value,value,__ATOMIC_RELAXED);
+	__atomic_store_n(&rec->seq,sh->pending,__ATOMIC_RELEASE);
+}
+
+/* Copy change number seq out of the ring: 0 on success, 1 if it has been
+ * overwritten by a later one */
+static int KISSDB_shared_read(const KISSDB_Shared *sh,uint64_t seq,uint64_t *page,uint64_t *idx,uint64_t *value)
+{
+	KISSDB_Shm_Record *rec = &(sh->shm->ring[seq % KISSDB_SHM_RING]);
+
+	if (__atomic_load_n(&rec->seq,__ATOMIC_ACQUIRE) != seq)
+		return 1;
+	*page = __atomic_load_n(&rec->page,__ATOMIC_RELAXED);
+	*idx = __atomic_load_n(&rec->idx,__ATOMIC_RELAXED);
+	*value = __atomic_load_n(&rec->value,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&rec->seq,__ATOMIC_RELAXED) != seq);
+}
+
+/* Set one 64-bit entry of a hash table page. Without a write-ahead log
+ * the file is updated right away; with one the page is only marked dirty
+ * and the change reaches the file at the next checkpoint. */
+static int KISSDB_set_table_entry(KISSDB *db,unsigned long page,unsigned long idx,uint64_t value)
+{
+	uint8_t *dirty_rea;
+	uint64_t old = 0;
+	int r;
+
+	if ((db->snapshots)&&(KISSDB_snapshot_cow(db,page)))
+		return KISSDB_ERROR_MALLOC;
+	/* a compact page may need room for the entry, so it changes first
+	 * and is put back if the rest fails */
+	if (db->tables) {
+		old = KISSDB_table_entry(db,page,idx);
+		if ((r = KISSDB_table_store(db,page,idx,value)))
+			return r;
+	}
+	r = 0;
+	if (db->wal) {
+		if (page >= db->dirty_size) {
+			if ((dirty_rea = realloc(db->dirty,db->num_hash_tables))) {
+				memset(dirty_rea + db->dirty_size,0,db->num_hash_tables - db->dirty_size);
+				db->dirty = dirty_rea;
+				db->dirty_size = db->num_hash_tables;
+			} else r = KISSDB_ERROR_MALLOC;
+		}
+		if (!r)
+			db->dirty[page] = 1;
+	} else if (KISSDB_pwrite(db,&value,sizeof(uint64_t),db->hash_table_offsets[page] + (sizeof(uint64_t) * idx)))
+		r = KISSDB_ERROR_IO;
+	if (r) {
+		if (db->tables)
+			KISSDB_table_store(db,page,idx,old);
+		return r;
+	}
+	if (!db->tables)
+		db->hash_tables[((db->hash_table_size + 1) * page) + idx] = value;
+	if (db->shared)
+		KISSDB_shared_log(db,page,idx,value);
+	return 0;
+}
+
+int KISSDB_wal_checkpoint(KISSDB *db)
+{
+	uint64_t *page = (uint64_t *)0;
+	unsigned long p;
+
+	if (!db->wal)
+		return 0;
+
+	/* the entries have to be on disk before the pages pointing at them */
+	if (KISSDB_sync(db))
+		return KISSDB_ERROR_IO;
+	/* compact pages are written out whole, from a copy */
+	if ((db->tables)&&(!(page = malloc(db->hash_table_size_bytes))))
+		return KISSDB_ERROR_MALLOC;
+	for(p=0;p<db->dirty_size;++p) {
+		if (db->dirty[p]) {
+			if (page)
+				KISSDB_table_copy(db,p,page);
+			if (KISSDB_pwrite(db,(page) ? page : &(db->hash_tables[(db->hash_table_size + 1) * p]),db->hash_table_size_bytes,db->hash_table_offsets[p])) {
+				free(page);
+				return KISSDB_ERROR_IO;
+			}
+			db->dirty[p] = 0;
+		}
+	}
+	free(page);
+	if (KISSDB_sync(db))
+		return KISSDB_ERROR_IO;
+
+	return KISSDB_wal_reset(db->wal);
+}
+
+/* Log a change, checkpointing first if the log has grown large enough */
+static int KISSDB_wal_log(KISSDB *db,uint32_t type,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	int r;
+	if ((db->wal->lsn - db->wal->checkpoint) >= KISSDB_WAL_CHECKPOINT_BYTES) {
+		if ((r = KISSDB_wal_checkpoint(db)))
+			return r;
+	}
+	return KISSDB_wal_append(db->wal,type,key,klen,value,vlen);
+}
+
+/* Value cache: each shard has its own lock, a chained hash table of
+ * cached entries and a CLOCK ring for eviction */
+typedef struct KISSDB_Cache_Entry {
+	struct KISSDB_Cache_Entry *next; /* in hash chain */
+	struct KISSDB_Cache_Entry *clock_prev,*clock_next;
+	uint64_t hash;
+	unsigned long klen,vlen;
+	int referenced;
+	uint8_t data[]; /* key, then value */
+} KISSDB_Cache_Entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	KISSDB_Cache_Entry **buckets;
+	unsigned long nbuckets; /* power of two */
+	unsigned long count;
+	KISSDB_Cache_Entry *hand;
+	uint64_t bytes,budget;
+	uint64_t hits,misses,evictions;
+} KISSDB_Cache_Shard;
+
+struct KISSDB_Cache {
+	KISSDB_Cache_Shard shards[KISSDB_CACHE_SHARDS];
+};
+
+static KISSDB_Cache_Shard *KISSDB_cache_shard(KISSDB_Cache *cache,uint64_t hash)
+{
+	/* the index uses the low bits of the hash, so shard on the high ones */
+	return &(cache->shards[(hash >> 56) % KISSDB_CACHE_SHARDS]);
+}
+
+static KISSDB_Cache_Entry **KISSDB_cache_lookup(KISSDB_Cache_Shard *sh,uint64_t hash,const void *key,unsigned long klen)
+{
+	KISSDB_Cache_Entry **ep = &(sh->buckets[hash & (sh->nbuckets - 1)]);
+	while (*ep) {
+		if (((*ep)->hash == hash)&&((*ep)->klen == klen)&&(!memcmp((*ep)->data,key,klen)))
+			return ep;
+		ep = &((*ep)->next);
+	}
+	return ep;
+}
+
+/* Unlink and free the entry at *ep */
+static void KISSDB_cache_unlink(KISSDB_Cache_Shard *sh,KISSDB_Cache_Entry **ep)
+{
+	KISSDB_Cache_Entry *e = *ep;
+
+	*ep = e->next;
+	if (e->clock_next == e)
+		sh->hand = (KISSDB_Cache_Entry *)0;
+	else {
+		if (sh->hand == e)
+			sh->hand = e->clock_next;
+		e->clock_prev->clock_next = e->clock_next;
+		e->clock_next->clock_prev = e->clock_prev;
+	}
+	--sh->count;
+	sh->bytes -= sizeof(KISSDB_Cache_Entry) + e->klen + e->vlen;
+	free(e);
+}
+
+/* Copy a cached value into vbuf: 0 on a hit, 1 on a miss */
+static int KISSDB_cache_get(KISSDB_Cache *cache,uint64_t hash,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB_Cache_Shard *sh = KISSDB_cache_shard(cache,hash);
+	KISSDB_Cache_Entry *e;
+
+	pthread_mutex_lock(&sh->lock);
+	if ((e = *KISSDB_cache_lookup(sh,hash,key,klen))) {
+		memcpy(vbuf,e->data + klen,e->vlen);
+		if (vlen)
+			*vlen = e->vlen;
+		e->referenced = 1;
+		++sh->hits;
+	} else ++sh->misses;
+	pthread_mutex_unlock(&sh->lock);
+
+	return (e) ? 0 : 1;
+}
+
+/* Drop a key from the cache: 1 if it was cached, 0 if not */
+static int KISSDB_cache_remove(KISSDB_Cache *cache,uint64_t hash,const void *key,unsigned long klen)
+{
+	KISSDB_Cache_Shard *sh = KISSDB_cache_shard(cache,hash);
+	KISSDB_Cache_Entry **ep;
+	int cached = 0;
+
+	pthread_mutex_lock(&sh->lock);
+	ep = KISSDB_cache_lookup(sh,hash,key,klen);
+	if (*ep) {
+		KISSDB_cache_unlink(sh,ep);
+		cached = 1;
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	return cached;
+}
+
+/* Cache a value, evicting entries the CLOCK hand finds unreferenced to
+ * make room. Failing to allocate just means the value isn't cached. */
+static void KISSDB_cache_insert(KISSDB_Cache *cache,uint64_t hash,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	KISSDB_Cache_Shard *sh = KISSDB_cache_shard(cache,hash);
+	uint64_t size = sizeof(KISSDB_Cache_Entry) + klen + vlen;
+	KISSDB_Cache_Entry **ep,**buckets,*e,*next;
+	unsigned long b,nb;
+
+	if (size > sh->budget)
+		return;
+
+	pthread_mutex_lock(&sh->lock);
+	ep = KISSDB_cache_lookup(sh,hash,key,klen);
+	if (*ep)
+		KISSDB_cache_unlink(sh,ep);
+
+	while ((sh->bytes + size) > sh->budget) {
+		e = sh->hand;
+		if (e->referenced) {
+			e->referenced = 0;
+			sh->hand = e->clock_next;
+		} else {
+			KISSDB_cache_unlink(sh,KISSDB_cache_lookup(sh,e->hash,e->data,e->klen));
+			++sh->evictions;
+		}
+	}
+
+	if ((sh->count + 1) > sh->nbuckets) {
+		nb = sh->nbuckets * 2;
+		if ((buckets = calloc(nb,sizeof(KISSDB_Cache_Entry *)))) {
+			for(b=0;b<sh->nbuckets;++b) {
+				for(e=sh->buckets[b];e;e=next) {
+					next = e->next;
+					e->next = buckets[e->hash & (nb - 1)];
+					buckets[e->hash & (nb - 1)] = e;
+				}
+			}
+			free(sh->buckets);
+			sh->buckets = buckets;
+			sh->nbuckets = nb;
+		}
+	}
+
+	if ((e = malloc((size_t)size))) {
+		e->hash = hash;
+		e->klen = klen;
+		e->vlen = vlen;
+		e->referenced = 0;
+		memcpy(e->data,key,klen);
+		memcpy(e->data + klen,value,vlen);
+		ep = &(sh->buckets[hash & (sh->nbuckets - 1)]);
+		e->next = *ep;
+		*ep = e;
+		/* new entries go just behind the hand, so they get a full sweep */
+		if (sh->hand) {
+			e->clock_next = sh->hand;
+			e->clock_prev = sh->hand->clock_prev;
+			e->clock_prev->clock_next = e;
+			sh->hand->clock_prev = e;
+		} else {
+			e->clock_next = e->clock_prev = e;
+			sh->hand = e;
+		}
+		++sh->count;
+		sh->bytes += size;
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static void KISSDB_cache_free(KISSDB_Cache *cache)
+{
+	KISSDB_Cache_Entry *e,*next;
+	unsigned long i,b;
+
+	for(i=0;i<KISSDB_CACHE_SHARDS;++i) {
+		for(b=0;b<cache->shards[i].nbuckets;++b) {
+			for(e=cache->shards[i].buckets[b];e;e=next) {
+				next = e->next;
+				free(e);
+			}
+		}
+		free(cache->shards[i].buckets);
+		pthread_mutex_destroy(&(cache->shards[i].lock));
+	}
+	free(cache);
+}
+
+int KISSDB_cache_enable(KISSDB *db,uint64_t budget)
+{
+	KISSDB_Cache *cache;
+	unsigned long i;
+
+	if ((db->cache)||(budget < KISSDB_CACHE_SHARDS))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (!(cache = calloc(1,sizeof(KISSDB_Cache))))
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;i<KISSDB_CACHE_SHARDS;++i) {
+		cache->shards[i].nbuckets = 64;
+		if (!(cache->shards[i].buckets = calloc(64,sizeof(KISSDB_Cache_Entry *)))) {
+			while (i--) {
+				free(cache->shards[i].buckets);
+				pthread_mutex_destroy(&(cache->shards[i].lock));
+			}
+			free(cache);
+			return KISSDB_ERROR_MALLOC;
+		}
+		pthread_mutex_init(&(cache->shards[i].lock),(const pthread_mutexattr_t *)0);
+		cache->shards[i].budget = budget / KISSDB_CACHE_SHARDS;
+	}
+	db->cache = cache;
+
+	return 0;
+}
+
+void KISSDB_cache_stats(KISSDB *db,KISSDB_Cache_Stats *st)
+{
+	KISSDB_Cache_Shard *sh;
+	unsigned long i;
+
+	memset(st,0,sizeof(KISSDB_Cache_Stats));
+	if (!db->cache)
+		return;
+	for(i=0;i<KISSDB_CACHE_SHARDS;++i) {
+		sh = &(db->cache->shards[i]);
+		pthread_mutex_lock(&sh->lock);
+		st->hits += sh->hits;
+		st->misses += sh->misses;
+		st->evictions += sh->evictions;
+		st->entries += sh->count;
+		st->bytes += sh->bytes;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+int KISSDB_direct_enable(KISSDB *db,uint64_t pool_bytes)
+{
+	KISSDB_Pool *p;
+	struct stat st;
+	unsigned long i,nb;
+	int fl;
+
+	if ((db->pool)||(db->map)||(db->snapshots)||(db->shared)||(pool_bytes < ((uint64_t)KISSDB_POOL_MIN_PAGES * KISSDB_POOL_PAGE_SIZE)))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (fstat(db->fd,&st))
+		return KISSDB_ERROR_IO;
+	if (!(p = calloc(1,sizeof(KISSDB_Pool))))
+		return KISSDB_ERROR_MALLOC;
+	p->fd = db->fd;
+	p->counters = &db->counters;
+	p->num_frames = (unsigned long)(pool_bytes / KISSDB_POOL_PAGE_SIZE);
+	for(nb=1;nb<p->num_frames;nb<<=1);
+	p->bucket_mask = nb - 1;
+	p->tick = 1;
+	p->disk_size = (uint64_t)st.st_size;
+	p->frames = calloc(p->num_frames,sizeof(KISSDB_Pool_Frame));
+	p->buckets = malloc(nb * sizeof(long));
+	if ((!p->frames)||(!p->buckets)||
+	    (posix_memalign((void **)&p->data,KISSDB_POOL_PAGE_SIZE,(size_t)p->num_frames * KISSDB_POOL_PAGE_SIZE))||
+	    (posix_memalign((void **)&p->wbuf,KISSDB_POOL_PAGE_SIZE,(size_t)KISSDB_POOL_WRITEBACK_BATCH * KISSDB_POOL_PAGE_SIZE))) {
+		free(p->frames);
+		free(p->buckets);
+		free(p->data);
+		free(p);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(i=0;i<nb;++i)
+		p->buckets[i] = -1;
+
+	/* not every file system can do direct I/O */
+	if (((fl = fcntl(db->fd,F_GETFL)) < 0)||(fcntl(db->fd,F_SETFL,fl|O_DIRECT))) {
+		free(p->frames);
+		free(p->buckets);
+		free(p->data);
+		free(p->wbuf);
+		free(p);
+		return KISSDB_ERROR_IO;
+	}
+
+	pthread_mutex_init(&p->lock,(const pthread_mutexattr_t *)0);
+	pthread_cond_init(&p->changed,(const pthread_condattr_t *)0);
+	pthread_cond_init(&p->work,(const pthread_condattr_t *)0);
+	if (pthread_create(&p->thread,(const pthread_attr_t *)0,KISSDB_pool_thread,(void *)p)) {
+		fcntl(db->fd,F_SETFL,fl);
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->changed);
+		pthread_cond_destroy(&p->work);
+		free(p->frames);
+		free(p->buckets);
+		free(p->data);
+		free(p->wbuf);
+		free(p);
+		return KISSDB_ERROR_MALLOC;
+	}
+	db->pool = p;
+
+	return 0;
+}
+
+void KISSDB_direct_stats(KISSDB *db,KISSDB_Pool_Stats *st)
+{
+	KISSDB_Pool *p = db->pool;
+	unsigned long i;
+
+	memset(st,0,sizeof(KISSDB_Pool_Stats));
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	st->hits = p->hits;
+	st->misses = p->misses;
+	st->evictions = p->evictions;
+	st->writebacks = p->writebacks;
+	st->dirty = p->dirty;
+	for(i=0;i<p->num_frames;++i) {
+		if (p->frames[i].used) {
+			++st->pages;
+			if (p->frames[i].table)
+				++st->table_pages;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Add the counters of src to dst, reading them atomically */
+static void KISSDB_counters_add(KISSDB_Counters *dst,KISSDB_Counters *src)
+{
+	dst->gets += __atomic_load_n(&src->gets,__ATOMIC_RELAXED);
+	dst->puts += __atomic_load_n(&src->puts,__ATOMIC_RELAXED);
+	dst->deletes += __atomic_load_n(&src->deletes,__ATOMIC_RELAXED);
+	dst->reads += __atomic_load_n(&src->reads,__ATOMIC_RELAXED);
+	dst->writes += __atomic_load_n(&src->writes,__ATOMIC_RELAXED);
+	dst->syncs += __atomic_load_n(&src->syncs,__ATOMIC_RELAXED);
+	dst->bytes_read += __atomic_load_n(&src->bytes_read,__ATOMIC_RELAXED);
+	dst->bytes_written += __atomic_load_n(&src->bytes_written,__ATOMIC_RELAXED);
+}
+
+int KISSDB_stats(KISSDB *db,KISSDB_Stats *st,uint64_t *page_entries,unsigned long max_pages)
+{
+	uint64_t *depths;
+	uint64_t d,probes = 0,miss_probes = 0,data;
+	unsigned long b,p;
+
+	memset(st,0,sizeof(KISSDB_Stats));
+	KISSDB_counters_add(&st->counters,&db->counters);
+	if (db->wal) {
+		pthread_mutex_lock(&db->wal->lock);
+		KISSDB_counters_add(&st->counters,&db->wal->counters);
+		pthread_mutex_unlock(&db->wal->lock);
+	}
+	st->file_size = db->file_size;
+	st->live_bytes = db->live_bytes;
+	st->hash_table_size = db->hash_table_size;
+	st->num_hash_tables = db->num_hash_tables;
+	st->table_bytes = (uint64_t)db->num_hash_tables * db->hash_table_size_bytes;
+	data = KISSDB_HEADER_SIZE_OF(db) + st->table_bytes + db->live_bytes;
+	st->dead_bytes = (db->file_size > data) ? (db->file_size - data) : 0;
+	st->index_entries = (uint64_t)db->index.cur.count + (uint64_t)db->index.old.count;
+	st->index_capacity = (uint64_t)db->index.cur.capacity + (uint64_t)db->index.old.capacity;
+	st->index_memory = st->index_capacity * (1 + sizeof(KISSDB_Index_Slot) + ((db->index.inline_values) ? (1 + (sizeof(uint64_t) * 2)) : 0));
+	if (db->tables)
+		st->table_memory = db->tables->memory + ((uint64_t)db->tables->capacity * sizeof(KISSDB_Table_Page));
+	else st->table_memory = st->table_bytes;
+
+	/* a bucket's entries are a prefix of its chain: one holding d of
+	 * them has one in each of pages 0 to d-1, found after 1 to d page
+	 * reads, and a miss reads d+1 pages or all of them */
+	if (!(depths = calloc((size_t)db->num_hash_tables + 1,sizeof(uint64_t))))
+		return KISSDB_ERROR_MALLOC;
+	for(b=0;b<db->hash_table_size;++b) {
+		d = db->bucket_depth[b];
+		++depths[d];
+		st->entries += d;
+		probes += (d * (d + 1)) / 2;
+		miss_probes += (d < db->num_hash_tables) ? (d + 1) : d;
+		if (d > st->max_probe)
+			st->max_probe = (unsigned long)d;
+	}
+	if (db->num_hash_tables)
+		st->load_factor = (double)st->entries / ((double)db->num_hash_tables * (double)db->hash_table_size);
+	if (st->entries)
+		st->avg_probe = (double)probes / (double)st->entries;
+	st->avg_probe_miss = (double)miss_probes / (double)db->hash_table_size;
+
+	/* page p holds an entry of every bucket deeper than p */
+	if (page_entries) {
+		d = (uint64_t)db->hash_table_size - depths[0];
+		for(p=0;p<max_pages;++p) {
+			page_entries[p] = (p < db->num_hash_tables) ? d : 0;
+			if (p < db->num_hash_tables)
+				d -= depths[p + 1];
+		}
+	}
+	free(depths);
+
+	return 0;
+}
+
+static char *KISSDB_sidecar_path(const char *path,const char *suffix)
+{
+	char *p = malloc(strlen(path) + strlen(suffix) + sizeof(KISSDB_SIDECAR_TMP_SUFFIX));
+	if (p) {
+		strcpy(p,path);
+		strcat(p,suffix);
+	}
+	return p;
+}
+
+/* Read a file kept next to the database in one go and check its magic,
+ * version and CRC: 0 and a buffer to free on success */
+static int KISSDB_sidecar_read(const char *path,const char *suffix,const char *magic,uint32_t version,uint64_t **buf,uint64_t *size)
+{
+	struct stat st;
+	uint32_t v,crc;
+	uint8_t *p,*end;
+	char *sc_path;
+	ssize_t n;
+	int fd;
+
+	if (!(sc_path = KISSDB_sidecar_path(path,suffix)))
+		return KISSDB_ERROR_MALLOC;
+	fd = open(sc_path,O_RDONLY);
+	free(sc_path);
+	if (fd < 0)
+		return KISSDB_ERROR_IO;
+	if ((fstat(fd,&st))||((uint64_t)st.st_size < (KISSDB_SIDECAR_HEADER_SIZE + sizeof(uint32_t)))) {
+		close(fd);
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	}
+	*size = (uint64_t)st.st_size;
+	if (!(*buf = malloc((size_t)*size))) {
+		close(fd);
+		return KISSDB_ERROR_MALLOC;
+	}
+	end = (uint8_t *)*buf + *size;
+	for(p=(uint8_t *)*buf;p<end;) {
+		n = pread(fd,p,(size_t)(end - p),(off_t)(p - (uint8_t *)*buf));
+		if (n > 0)
+			p += n;
+		else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else break;
+	}
+	close(fd);
+	if ((p != end)||(memcmp(*buf,magic,4)))
+		goto sidecar_read_bad;
+	memcpy(&v,(uint8_t *)*buf + 4,sizeof(uint32_t));
+	memcpy(&crc,end - sizeof(uint32_t),sizeof(uint32_t));
+	if ((v != version)||(KISSDB_crc32(0,*buf,(unsigned long)(*size - sizeof(uint32_t))) != crc))
+		goto sidecar_read_bad;
+	return 0;
+
+sidecar_read_bad:
+	free(*buf);
+	*buf = (uint64_t *)0;
+	return KISSDB_ERROR_CORRUPT_DBFILE;
+}
+
+/* Stamp buf with magic, version and a trailing CRC and replace the file
+ * next to the database with it, through a temporary file and a rename */
+static int KISSDB_sidecar_write(const char *path,const char *suffix,const char *magic,uint32_t version,uint64_t *buf,uint64_t size)
+{
+	uint32_t crc;
+	char *sc_path,*tmp_path;
+	int fd,r;
+
+	memcpy(buf,magic,4);
+	memcpy((uint8_t *)buf + 4,&version,sizeof(uint32_t));
+	crc = KISSDB_crc32(0,buf,(unsigned long)(size - sizeof(uint32_t)));
+	memcpy((uint8_t *)buf + size - sizeof(uint32_t),&crc,sizeof(uint32_t));
+
+	sc_path = KISSDB_sidecar_path(path,suffix);
+	tmp_path = KISSDB_sidecar_path(path,suffix);
+	r = KISSDB_ERROR_MALLOC;
+	if ((sc_path)&&(tmp_path)) {
+		strcat(tmp_path,KISSDB_SIDECAR_TMP_SUFFIX);
+		r = KISSDB_ERROR_IO;
+		if ((fd = open(tmp_path,O_WRONLY|O_CREAT|O_TRUNC,0644)) >= 0) {
+			if ((!KISSDB_wal_write(fd,(const uint8_t *)buf,(size_t)size,0))&&(!fdatasync(fd)))
+				r = 0;
+			close(fd);
+			if ((!r)&&(rename(tmp_path,sc_path)))
+				r = KISSDB_ERROR_IO;
+			if (r)
+				unlink(tmp_path);
+		}
+	}
+	free(sc_path);
+	free(tmp_path);
+	return r;
+}
+
+/* Read path.idx and check that it belongs to the database as it is now:
+ * 0 and ck filled in on success, nonzero if it has to be ignored */
+static int KISSDB_idx_load(KISSDB *db,const char *path,const struct stat *dbst,KISSDB_Idx_Checkpoint *ck)
+{
+	uint64_t h[10];
+	uint64_t size,expect;
+	int r;
+
+	if ((r = KISSDB_sidecar_read(path,KISSDB_IDX_SUFFIX,"KdBI",KISSDB_IDX_VERSION,&ck->buf,&size)))
+		return r;
+	if (size < (KISSDB_IDX_HEADER_SIZE + sizeof(uint32_t)))
+		goto idx_load_bad;
+	memcpy(h,ck->buf + 1,sizeof(h));
+	if ((h[0] != (uint64_t)db->version)||(h[1] != db->hash_table_size)||(h[2] != db->key_size)||(h[3] != db->value_size)||(h[4] != db->hash_seed))
+		goto idx_load_bad;
+
+	/* a compaction replaces the file, and every other change appends to
+	 * it, so the same file at the same size has the same hash tables */
+	if ((h[6] != (uint64_t)dbst->st_ino)||(h[5] > db->file_size)||(h[5] < KISSDB_HEADER_SIZE_OF(db)))
+		goto idx_load_bad;
+	if ((h[7] > (size / db->hash_table_size_bytes))||(h[9] > (size / (sizeof(uint64_t) * KISSDB_IDX_RECORD_WORDS(db)))))
+		goto idx_load_bad;
+	expect = KISSDB_IDX_HEADER_SIZE + (h[7] * (sizeof(uint64_t) + db->hash_table_size_bytes)) + (h[9] * sizeof(uint64_t) * KISSDB_IDX_RECORD_WORDS(db)) + sizeof(uint32_t);
+	if (expect != size)
+		goto idx_load_bad;
+
+	ck->covered = h[5];
+	ck->num_hash_tables = (unsigned long)h[7];
+	ck->live_bytes = h[8];
+	ck->count = (unsigned long)h[9];
+	ck->offsets = ck->buf + (KISSDB_IDX_HEADER_SIZE / sizeof(uint64_t));
+	ck->tables = ck->offsets + ck->num_hash_tables;
+	ck->records = ck->tables + ((db->hash_table_size + 1) * ck->num_hash_tables);
+	return 0;
+
+idx_load_bad:
+	free(ck->buf);
+	ck->buf = (uint64_t *)0;
+	return KISSDB_ERROR_CORRUPT_DBFILE;
+}
+
+int KISSDB_index_checkpoint(KISSDB *db)
+{
+	const KISSDB_Index_Table *t[2];
+	struct stat st;
+	uint64_t h[10];
+	uint64_t size,count;
+	uint64_t *buf,*rec;
+	unsigned long i,j;
+	unsigned long words = KISSDB_IDX_RECORD_WORDS(db);
+	int r;
+
+	if (!db->path)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	/* the pages on disk must match the ones written out, and the entries
+	 * they point to must be there too */
+	if (db->wal) {
+		if ((r = KISSDB_wal_checkpoint(db)))
+			return r;
+	} else if (KISSDB_sync(db))
+		return KISSDB_ERROR_IO;
+	if (fstat(db->fd,&st))
+		return KISSDB_ERROR_IO;
+
+	t[0] = &db->index.cur;
+	t[1] = &db->index.old;
+	count = (uint64_t)t[0]->count + (uint64_t)t[1]->count;
+	size = KISSDB_IDX_HEADER_SIZE + ((uint64_t)db->num_hash_tables * (sizeof(uint64_t) + db->hash_table_size_bytes)) + (count * sizeof(uint64_t) * words) + sizeof(uint32_t);
+	if (!(buf = malloc((size_t)size)))
+		return KISSDB_ERROR_MALLOC;
+
+	h[0] = (uint64_t)db->version;
+	h[1] = db->hash_table_size;
+	h[2] = db->key_size;
+	h[3] = db->value_size;
+	h[4] = db->hash_seed;
+	h[5] = db->file_size;
+	h[6] = (uint64_t)st.st_ino;
+	h[7] = db->num_hash_tables;
+	h[8] = db->live_bytes;
+	h[9] = count;
+	memcpy(buf + 1,h,sizeof(h));
+	rec = buf + (KISSDB_IDX_HEADER_SIZE / sizeof(uint64_t));
+	memcpy(rec,db->hash_table_offsets,sizeof(uint64_t) * db->num_hash_tables);
+	rec += db->num_hash_tables;
+	for(i=0;i<db->num_hash_tables;++i) {
+		KISSDB_table_copy(db,i,rec);
+		rec += db->hash_table_size + 1;
+	}
+	for(i=0;i<2;++i) {
+		for(j=0;j<t[i]->capacity;++j) {
+			if (!(t[i]->ctrl[j] & KISSDB_CTRL_EMPTY)) {
+				*(rec++) = t[i]->slots[j].offset;
+				*(rec++) = t[i]->slots[j].hash;
+				if (t[i]->vlens) {
+					*(rec++) = (t[i]->vlens[j]) ? t[i]->values[j] : 0;
+					*(rec++) = t[i]->vlens[j];
+					*(rec++) = t[i]->fprints[j];
+				}
+			}
+		}
+	}
+	qsort(rec - (count * words),(size_t)count,sizeof(uint64_t) * words,KISSDB_offset_cmp);
+
+	r = KISSDB_sidecar_write(db->path,KISSDB_IDX_SUFFIX,"KdBI",KISSDB_IDX_VERSION,buf,size);
+	free(buf);
+	if (!r) {
+		db->idx_file_size = db->file_size;
+		db->idx_stale = 0;
+	}
+
+	return r;
+}
+
+/* A value kept in the index was rewritten in place, leaving the file size
+ * as it was: the checkpoint still matches the file but holds the old
+ * value, so it is removed now and written again on closing */
+static void KISSDB_index_invalidate(KISSDB *db)
+{
+	char *idx_path;
+
+	if ((db->idx_stale)||(!db->index.inline_values))
+		return;
+	db->idx_stale = 1;
+	if ((db->path)&&((idx_path = KISSDB_sidecar_path(db->path,KISSDB_IDX_SUFFIX)))) {
+		unlink(idx_path);
+		free(idx_path);
+	}
+}
+
+/* Checkpoint the index again after enough appends, but no more often than
+ * every quarter of the file size, so writing it stays cheap next to the
+ * writes that made it necessary */
+static void KISSDB_index_autosave(KISSDB *db)
+{
+	uint64_t grown;
+
+	if ((!db->path)||(db->file_size <= db->idx_file_size))
+		return;
+	grown = db->file_size - db->idx_file_size;
+	if ((grown >= KISSDB_IDX_CHECKPOINT_BYTES)&&(grown >= (db->idx_file_size / 4)))
+		KISSDB_index_checkpoint(db);
+}
+
+/* Bloom filter over the full key hashes kept by the index. Each key sets
+ * k bits of a single 512-bit block, so a lookup touches one cache line. */
+struct KISSDB_Bloom {
+	uint64_t *blocks;
+	uint64_t num_blocks; /* a power of two */
+	uint64_t capacity; /* keys it was sized for */
+	uint64_t count; /* keys added */
+	double fp_rate;
+	unsigned int k;
+	unsigned int bits_per_key;
+	uint64_t file_size; /* database size when saved or loaded, 0 if built since */
+};
+
+/* Bits set per key and bits of filter per key for a false positive rate */
+static void KISSDB_bloom_params(double fp_rate,unsigned int *k,unsigned int *bits_per_key)
+{
+	unsigned int l = 0;
+	double q;
+
+	/* l = ceil(log2(1 / fp_rate)); an ideal filter needs 1.44 * l bits
+	 * per key, and one more makes up for keys crowding into a block */
+	for(q=1.0;(q>fp_rate)&&(l<KISSDB_BLOOM_MAX_K);q*=0.5)
+		++l;
+	*k = l ? l : 1;
+	*bits_per_key = ((*k * 23) + 15) / 16 + 1;
+}
+
+static int KISSDB_bloom_alloc(KISSDB_Bloom *b,uint64_t capacity)
+{
+	uint64_t n = 1;
+	void *p;
+
+	while ((n * KISSDB_BLOOM_BLOCK_BITS) < (capacity * b->bits_per_key))
+		n <<= 1;
+	if (posix_memalign(&p,KISSDB_BLOOM_BLOCK_BITS / 8,(size_t)(n * (KISSDB_BLOOM_BLOCK_BITS / 8))))
+		return KISSDB_ERROR_MALLOC;
+	memset(p,0,(size_t)(n * (KISSDB_BLOOM_BLOCK_BITS / 8)));
+	b->blocks = (uint64_t *)p;
+	b->num_blocks = n;
+	b->capacity = capacity;
+	b->count = 0;
+	return 0;
+}
+
+static void KISSDB_bloom_set(KISSDB_Bloom *b,uint64_t hash)
+{
+	uint64_t *block = b->blocks + ((hash & (b->num_blocks - 1)) * (KISSDB_BLOOM_BLOCK_BITS / 64));
+	uint64_t h = hash;
+	unsigned int i,bit;
+
+	for(i=0;i<b->k;++i) {
+		if (!(i % 7))
+			h = KISSDB_mix(h + KISSDB_WYP0);
+		bit = (unsigned int)(h >> ((i % 7) * 9)) & (KISSDB_BLOOM_BLOCK_BITS - 1);
+		block[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+/* 1 if hash may have been added, 0 if it certainly was not */
+static int KISSDB_bloom_test(const KISSDB_Bloom *b,uint64_t hash)
+{
+	const uint64_t *block = b->blocks + ((hash & (b->num_blocks - 1)) * (KISSDB_BLOOM_BLOCK_BITS / 64));
+	uint64_t h = hash;
+	unsigned int i,bit;
+
+	for(i=0;i<b->k;++i) {
+		if (!(i % 7))
+			h = KISSDB_mix(h + KISSDB_WYP0);
+		bit = (unsigned int)(h >> ((i % 7) * 9)) & (KISSDB_BLOOM_BLOCK_BITS - 1);
+		if (!(block[bit >> 6] & (1ULL << (bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+/* (Re)build the filter from every key hash in the index, with room for
+ * twice as many keys */
+static int KISSDB_bloom_build(KISSDB *db,KISSDB_Bloom *b)
+{
+	const KISSDB_Index_Table *t[2];
+	uint64_t count;
+	uint64_t *old = b->blocks;
+	unsigned long i,j;
+
+	t[0] = &db->index.cur;
+	t[1] = &db->index.old;
+	count = (uint64_t)t[0]->count + (uint64_t)t[1]->count;
+	if (KISSDB_bloom_alloc(b,(count < (KISSDB_BLOOM_MIN_KEYS / 2)) ? KISSDB_BLOOM_MIN_KEYS : (count * 2)))
+		return KISSDB_ERROR_MALLOC;
+	free(old);
+	for(i=0;i<2;++i) {
+		for(j=0;j<t[i]->capacity;++j) {
+			if (!(t[i]->ctrl[j] & KISSDB_CTRL_EMPTY))
+				KISSDB_bloom_set(b,t[i]->slots[j].hash);
+		}
+	}
+	b->count = count;
+	b->file_size = 0;
+	return 0;
+}
+
+/* Add a key that the index has just taken in */
+static void KISSDB_bloom_add(KISSDB *db,uint64_t hash)
+{
+	KISSDB_Bloom *b = db->bloom;
+
+	/* past its capacity the false positive rate climbs, so the filter is
+	 * rebuilt larger; if that fails it still has no false negatives */
+	if ((++b->count > b->capacity)&&(!KISSDB_bloom_build(db,b)))
+		return;
+	KISSDB_bloom_set(b,hash);
+	b->file_size = 0;
+}
+
+/* Filter file (path.bloom, "KdBF"): the database size, inode and hash seed
+ * it was saved at, false positive rate, number of blocks, capacity, number
+ * of keys, k and bits per key, then the blocks */
+static int KISSDB_bloom_save(KISSDB *db)
+{
+	KISSDB_Bloom *b = db->bloom;
+	struct stat st;
+	uint64_t h[8];
+	uint64_t size,bytes;
+	uint64_t *buf;
+	int r;
+
+	if (fstat(db->fd,&st))
+		return KISSDB_ERROR_IO;
+	bytes = b->num_blocks * (KISSDB_BLOOM_BLOCK_BITS / 8);
+	size = KISSDB_BLOOM_HEADER_SIZE + bytes + sizeof(uint32_t);
+	if (!(buf = malloc((size_t)size)))
+		return KISSDB_ERROR_MALLOC;
+	h[0] = db->file_size;
+	h[1] = (uint64_t)st.st_ino;
+	h[2] = db->hash_seed;
+	memcpy(&h[3],&b->fp_rate,sizeof(uint64_t));
+	h[4] = b->num_blocks;
+	h[5] = b->capacity;
+	h[6] = b->count;
+	h[7] = ((uint64_t)b->k << 32) | (uint64_t)b->bits_per_key;
+	memcpy(buf + 1,h,sizeof(h));
+	memcpy(buf + (KISSDB_BLOOM_HEADER_SIZE / sizeof(uint64_t)),b->blocks,(size_t)bytes);
+	r = KISSDB_sidecar_write(db->path,KISSDB_BLOOM_SUFFIX,"KdBF",KISSDB_BLOOM_VERSION,buf,size);
+	free(buf);
+	if (!r)
+		b->file_size = db->file_size;
+	return r;
+}
+
+/* Load path.bloom if it was saved for the file as it is now */
+static int KISSDB_bloom_load(KISSDB *db,KISSDB_Bloom *b)
+{
+	struct stat st;
+	uint64_t h[8];
+	uint64_t size;
+	uint64_t *buf;
+	void *p;
+	int r;
+
+	if (fstat(db->fd,&st))
+		return KISSDB_ERROR_IO;
+	if ((r = KISSDB_sidecar_read(db->path,KISSDB_BLOOM_SUFFIX,"KdBF",KISSDB_BLOOM_VERSION,&buf,&size)))
+		return r;
+	r = KISSDB_ERROR_CORRUPT_DBFILE;
+	if (size >= (KISSDB_BLOOM_HEADER_SIZE + sizeof(uint32_t))) {
+		memcpy(h,buf + 1,sizeof(h));
+		/* a file that has grown since may hold keys the filter lacks */
+		if ((h[0] == db->file_size)&&(h[1] == (uint64_t)st.st_ino)&&(h[2] == db->hash_seed)&&(!memcmp(&h[3],&b->fp_rate,sizeof(uint64_t)))&&
+		    (h[4])&&(!(h[4] & (h[4] - 1)))&&(h[7] == (((uint64_t)b->k << 32) | (uint64_t)b->bits_per_key))&&
+		    (size == (KISSDB_BLOOM_HEADER_SIZE + (h[4] * (KISSDB_BLOOM_BLOCK_BITS / 8)) + sizeof(uint32_t)))) {
+			r = KISSDB_ERROR_MALLOC;
+			if (!posix_memalign(&p,KISSDB_BLOOM_BLOCK_BITS / 8,(size_t)(h[4] * (KISSDB_BLOOM_BLOCK_BITS / 8)))) {
+				memcpy(p,buf + (KISSDB_BLOOM_HEADER_SIZE / sizeof(uint64_t)),(size_t)(h[4] * (KISSDB_BLOOM_BLOCK_BITS / 8)));
+				b->blocks = (uint64_t *)p;
+				b->num_blocks = h[4];
+				b->capacity = h[5];
+				b->count = h[6];
+				b->file_size = db->file_size;
+				r = 0;
+			}
+		}
+	}
+	free(buf);
+	return r;
+}
+
+static void KISSDB_bloom_free(KISSDB_Bloom *b)
+{
+	free(b->blocks);
+	free(b);
+}
+
+int KISSDB_bloom_enable(KISSDB *db,double fp_rate)
+{
+	KISSDB_Bloom *b;
+	int r;
+
+	if ((db->bloom)||(!(fp_rate > 0.0))||(!(fp_rate < 1.0)))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (!(b = calloc(1,sizeof(KISSDB_Bloom))))
+		return KISSDB_ERROR_MALLOC;
+	b->fp_rate = fp_rate;
+	KISSDB_bloom_params(fp_rate,&b->k,&b->bits_per_key);
+
+	/* rebuilding only takes the hashes the index already has */
+	if (((!db->path)||((r = KISSDB_bloom_load(db,b)) != 0))&&((r = KISSDB_bloom_build(db,b)))) {
+		free(b);
+		return r;
+	}
+	db->bloom = b;
+
+	return 0;
+}
+
+static int KISSDB_wal_replay(KISSDB *db);
+
+/* Random seed for a new database's hash function */
+static uint64_t KISSDB_new_seed(void)
+{
+	struct timespec ts;
+	uint64_t seed = 0;
+	int fd = open("/dev/urandom",O_RDONLY);
+
+	if (fd >= 0) {
+		if (read(fd,&seed,sizeof(seed)) != (ssize_t)sizeof(seed))
+			seed = 0;
+		close(fd);
+	}
+	if (!seed) {
+		/* no /dev/urandom: still better than a fixed seed */
+		clock_gettime(CLOCK_REALTIME,&ts);
+		seed = KISSDB_wymix((uint64_t)ts.tv_sec ^ KISSDB_WYP0,((uint64_t)ts.tv_nsec << 20) ^ (uint64_t)getpid() ^ KISSDB_WYP1);
+	}
+	return seed;
+}
+
+static int KISSDB_open_file(
+	KISSDB *db,
+	const char *path,
+	int mode,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	uint8_t hdr[KISSDB_HEADER_SIZE_SEEDED];
+	uint64_t tmp;
+	uint64_t htoffset;
+	uint64_t *httmp;
+	uint64_t *htpage = (uint64_t *)0;
+	uint64_t *hash_tables_rea;
+	uint64_t *offsets_rea;
+	unsigned long b,htcap;
+	struct stat st;
+	KISSDB_Idx_Checkpoint ck;
+	char *wal_path;
+	int flags = mode & ~0xff;
+	int r;
+
+	mode &= 0xff;
+	db->flags = flags;
+	db->map = (const uint8_t *)0;
+	db->map_size = 0;
+	db->map_capacity = 0;
+	db->num_hash_tables = 0;
+	db->hash_tables = (uint64_t *)0;
+	db->tables = (KISSDB_Tables *)0;
+	db->hash_table_offsets = (uint64_t *)0;
+	db->bucket_depth = (unsigned long *)0;
+	db->path = (char *)0;
+	db->live_bytes = 0;
+	db->compacting = 0;
+	db->wal = (KISSDB_WAL *)0;
+	db->dirty = (uint8_t *)0;
+	db->dirty_size = 0;
+	db->cache = (KISSDB_Cache *)0;
+	db->snapshots = (KISSDB_Snapshot *)0;
+	db->hash_seed = 0;
+	db->idx_file_size = 0;
+	db->idx_stale = 0;
+	db->bloom = (KISSDB_Bloom *)0;
+	db->pool = (KISSDB_Pool *)0;
+	db->shared = (KISSDB_Shared *)0;
+	memset(&db->index,0,sizeof(KISSDB_Index));
+	db->index.hugepages = ((flags & KISSDB_OPEN_FLAG_HUGEPAGES) != 0);
+	memset(&db->counters,0,sizeof(KISSDB_Counters));
+
+	switch(mode) {
+		case KISSDB_OPEN_MODE_RDONLY: db->fd = open(path,O_RDONLY); break;
+		case KISSDB_OPEN_MODE_RDWR: db->fd = open(path,O_RDWR); break;
+		case KISSDB_OPEN_MODE_RWCREAT: db->fd = open(path,O_RDWR|O_CREAT,0644); break;
+		case KISSDB_OPEN_MODE_RWREPLACE: db->fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0644); break;
+		default: return KISSDB_ERROR_INVALID_PARAMETERS;
+	}
+	if (db->fd < 0)
+		return KISSDB_ERROR_IO;
+
+	if (fstat(db->fd,&st)) {
+		close(db->fd);
+		return KISSDB_ERROR_IO;
+	}
+	db->file_size = (uint64_t)st.st_size;
+
+	if (db->file_size < KISSDB_HEADER_SIZE) {
+		/* write header if not already present */
+		if ((hash_table_size)&&(key_size)&&(value_size)) {
+			if ((flags & KISSDB_OPEN_FLAG_INLINE))
+				db->version = KISSDB_VERSION_INLINE;
+			else db->version = (flags & KISSDB_OPEN_FLAG_VARLEN) ? KISSDB_VERSION : KISSDB_VERSION_FIXED;
+			if ((db->version != KISSDB_VERSION_FIXED)&&((key_size > 0xffffffffUL)||(value_size > 0xffffffffUL))) {
+				close(db->fd);
+				return KISSDB_ERROR_INVALID_PARAMETERS;
+			}
+			hdr[0] = 'K'; hdr[1] = 'd'; hdr[2] = 'B'; hdr[3] = (uint8_t)db->version;
+			tmp = hash_table_size;
+			memcpy(hdr + 4,&tmp,sizeof(uint64_t));
+			tmp = key_size;
+			memcpy(hdr + 12,&tmp,sizeof(uint64_t));
+			tmp = value_size;
+			memcpy(hdr + 20,&tmp,sizeof(uint64_t));
+			if (db->version >= KISSDB_VERSION_SEEDED) {
+				db->hash_seed = KISSDB_new_seed();
+				memcpy(hdr + KISSDB_HEADER_SIZE,&db->hash_seed,sizeof(uint64_t));
+			}
+			if (KISSDB_pwrite(db,hdr,KISSDB_HEADER_SIZE_OF(db),0)) { close(db->fd); return KISSDB_ERROR_IO; }
+			db->file_size = KISSDB_HEADER_SIZE_OF(db);
+		} else {
+			close(db->fd);
+			return KISSDB_ERROR_INVALID_PARAMETERS;
+		}
+	} else {
+		if (KISSDB_pread(db,hdr,KISSDB_HEADER_SIZE,0)) { close(db->fd); return KISSDB_ERROR_IO; }
+		if ((hdr[0] != 'K')||(hdr[1] != 'd')||(hdr[2] != 'B')||(hdr[3] < KISSDB_VERSION_FIXED)||(hdr[3] > KISSDB_VERSION_INLINE)) {
+			close(db->fd);
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		}
+		db->version = hdr[3];
+		if (db->version >= KISSDB_VERSION_SEEDED) {
+			if (db->file_size < KISSDB_HEADER_SIZE_SEEDED) {
+				close(db->fd);
+				return KISSDB_ERROR_CORRUPT_DBFILE;
+			}
+			if (KISSDB_pread(db,&db->hash_seed,sizeof(uint64_t),KISSDB_HEADER_SIZE)) { close(db->fd); return KISSDB_ERROR_IO; }
+		}
+		memcpy(&tmp,hdr + 4,sizeof(uint64_t));
+		if (!tmp) {
+			close(db->fd);
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		}
+		hash_table_size = (unsigned long)tmp;
+		memcpy(&tmp,hdr + 12,sizeof(uint64_t));
+		if (!tmp) {
+			close(db->fd);
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		}
+		key_size = (unsigned long)tmp;
+		memcpy(&tmp,hdr + 20,sizeof(uint64_t));
+		if (!tmp) {
+			close(db->fd);
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		}
+		value_size = (unsigned long)tmp;
+	}
+
+	db->hash_table_size = hash_table_size;
+	db->key_size = key_size;
+	db->value_size = value_size;
+	db->hash_table_size_bytes = sizeof(uint64_t) * (hash_table_size + 1); /* [hash_table_size] == next table */
+	db->index.inline_values = (db->version == KISSDB_VERSION_INLINE);
+
+	if ((flags & KISSDB_OPEN_FLAG_COMPACT_TABLES)) {
+		if (!(db->tables = calloc(1,sizeof(KISSDB_Tables)))) {
+			close(db->fd);
+			return KISSDB_ERROR_MALLOC;
+		}
+		db->tables->hugepages = db->index.hugepages;
+	}
+
+	/* an index checkpoint taken at this very size already has the hash
+	 * tables; otherwise they are read from the file, and only the
+	 * entries added since the checkpoint need their keys read */
+	memset(&ck,0,sizeof(ck));
+	if ((mode != KISSDB_OPEN_MODE_RWREPLACE)&&((r = KISSDB_idx_load(db,path,&st,&ck)) == KISSDB_ERROR_MALLOC)) {
+		close(db->fd);
+		return r;
+	}
+	if ((ck.buf)&&(ck.covered == db->file_size)) {
+		if (ck.num_hash_tables) {
+			if (!db->tables)
+				db->hash_tables = malloc(db->hash_table_size_bytes * ck.num_hash_tables);
+			db->hash_table_offsets = malloc(sizeof(uint64_t) * ck.num_hash_tables);
+			if (((!db->tables)&&(!db->hash_tables))||(!db->hash_table_offsets)) {
+				free(ck.buf);
+				KISSDB_close(db);
+				return KISSDB_ERROR_MALLOC;
+			}
+			if (db->tables) {
+				for(;db->num_hash_tables<ck.num_hash_tables;++db->num_hash_tables) {
+					if ((r = KISSDB_tables_append(db,ck.tables + ((db->hash_table_size + 1) * db->num_hash_tables)))) {
+						free(ck.buf);
+						KISSDB_close(db);
+						return r;
+					}
+				}
+			} else memcpy(db->hash_tables,ck.tables,db->hash_table_size_bytes * ck.num_hash_tables);
+			memcpy(db->hash_table_offsets,ck.offsets,sizeof(uint64_t) * ck.num_hash_tables);
+			db->num_hash_tables = ck.num_hash_tables;
+		}
+	} else {
+		htoffset = KISSDB_HEADER_SIZE_OF(db);
+		htcap = 0;
+		/* compact pages are read one at a time through a whole page */
+		if ((db->tables)&&(!(htpage = malloc(db->hash_table_size_bytes)))) {
+			free(ck.buf);
+			KISSDB_close(db);
+			return KISSDB_ERROR_MALLOC;
+		}
+		while ((htoffset + db->hash_table_size_bytes) <= db->file_size) {
+			/* grow geometrically rather than copying every page so far
+			 * for each page read */
+			if (db->num_hash_tables == htcap) {
+				htcap = htcap ? (htcap * 2) : 16;
+				if (!db->tables) {
+					hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * htcap);
+					if (!hash_tables_rea) {
+						free(htpage);
+						free(ck.buf);
+						KISSDB_close(db);
+						return KISSDB_ERROR_MALLOC;
+					}
+					db->hash_tables = hash_tables_rea;
+				}
+				offsets_rea = realloc(db->hash_table_offsets,sizeof(uint64_t) * htcap);
+				if (!offsets_rea) {
+					free(htpage);
+					free(ck.buf);
+					KISSDB_close(db);
+					return KISSDB_ERROR_MALLOC;
+				}
+				db->hash_table_offsets = offsets_rea;
+			}
+
+			httmp = (htpage) ? htpage : &(db->hash_tables[(db->hash_table_size + 1) * db->num_hash_tables]);
+			r = KISSDB_pread(db,httmp,db->hash_table_size_bytes,htoffset) ? KISSDB_ERROR_IO : 0;
+			if ((!r)&&(htpage))
+				r = KISSDB_tables_append(db,htpage);
+			if (r) {
+				free(htpage);
+				free(ck.buf);
+				KISSDB_close(db);
+				return r;
+			}
+			db->hash_table_offsets[db->num_hash_tables] = htoffset;
+			++db->num_hash_tables;
+			if (!(htoffset = httmp[db->hash_table_size]))
+				break;
+		}
+		free(htpage);
+	}
+
+	/* buckets fill page by page, so the occupied pages of each bucket are
+	 * a prefix of the chain and the depth is the page of its next entry */
+	db->bucket_depth = malloc(sizeof(unsigned long) * db->hash_table_size);
+	if (!db->bucket_depth) {
+		free(ck.buf);
+		KISSDB_close(db);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(b=0;b<db->hash_table_size;++b) {
+		db->bucket_depth[b] = 0;
+		while ((db->bucket_depth[b] < db->num_hash_tables)&&(KISSDB_table_entry(db,db->bucket_depth[b],b)))
+			++db->bucket_depth[b];
+	}
+
+	if ((flags & KISSDB_OPEN_FLAG_MMAP)) {
+		if (KISSDB_remap(db,db->file_size)) {
+			free(ck.buf);
+			KISSDB_close(db);
+			return KISSDB_ERROR_IO;
+		}
+	}
+
+	r = KISSDB_index_build(db,ck.buf ? &ck : (const KISSDB_Idx_Checkpoint *)0);
+	if (ck.buf)
+		db->idx_file_size = ck.covered;
+	free(ck.buf);
+	if (r) {
+		KISSDB_close(db);
+		return r;
+	}
+
+	/* a read-only database never writes a checkpoint on closing */
+	if (mode == KISSDB_OPEN_MODE_RDONLY)
+		db->idx_file_size = db->file_size;
+
+	if (!(db->path = strdup(path))) {
+		KISSDB_close(db);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	/* a log left behind holds changes the hash tables may not reflect */
+	if (mode != KISSDB_OPEN_MODE_RDONLY) {
+		if (mode == KISSDB_OPEN_MODE_RWREPLACE) {
+			if ((wal_path = KISSDB_wal_path(path))) {
+				unlink(wal_path);
+				free(wal_path);
+			}
+			if ((wal_path = KISSDB_sidecar_path(path,KISSDB_IDX_SUFFIX))) {
+				unlink(wal_path);
+				free(wal_path);
+			}
+		} else if ((r = KISSDB_wal_replay(db))) {
+			KISSDB_close(db);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static int KISSDB_shared_lock(KISSDB_Shared *sh,int type)
+{
+	struct flock fl;
+
+	memset(&fl,0,sizeof(fl));
+	fl.l_type = (short)type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+	while (fcntl(sh->fd,F_SETLKW,&fl)) {
+		if (errno != EINTR)
+			return KISSDB_ERROR_IO;
+	}
+	sh->locked = (type == F_UNLCK) ? 0 : type;
+	return 0;
+}
+
+static void KISSDB_shared_detach(KISSDB_Shared *sh)
+{
+	munmap((void *)sh->shm,sh->size);
+	close(sh->fd); /* drops the lock too */
+	free(sh);
+}
+
+/* Map path.shm, creating it if needed, and lock it: for writing if the
+ * database is opened for writing, for reading otherwise */
+static int KISSDB_shared_attach(KISSDB_Shared **shp,const char *path,int writable)
+{
+	KISSDB_Shared *sh;
+	struct stat st;
+	char *shm_path;
+	void *m;
+	int ro = 0;
+
+	if (!(sh = calloc(1,sizeof(KISSDB_Shared))))
+		return KISSDB_ERROR_MALLOC;
+	if (!(shm_path = KISSDB_sidecar_path(path,KISSDB_SHM_SUFFIX))) {
+		free(sh);
+		return KISSDB_ERROR_MALLOC;
+	}
+	sh->writable = writable;
+	sh->size = sizeof(KISSDB_Shm) + (sizeof(KISSDB_Shm_Record) * KISSDB_SHM_RING);
+	if (((sh->fd = open(shm_path,O_RDWR|O_CREAT,0644)) < 0)&&(!writable)) {
+		sh->fd = open(shm_path,O_RDONLY);
+		ro = 1;
+	}
+	free(shm_path);
+	if (sh->fd < 0) {
+		free(sh);
+		return KISSDB_ERROR_IO;
+	}
+
+	/* whoever comes first sets it up, under the write lock */
+	if ((KISSDB_shared_lock(sh,ro ? F_RDLCK : F_WRLCK))||(fstat(sh->fd,&st))) {
+		close(sh->fd);
+		free(sh);
+		return KISSDB_ERROR_IO;
+	}
+	if ((uint64_t)st.st_size < (uint64_t)sh->size) {
+		if ((ro)||(ftruncate(sh->fd,(off_t)sh->size))) {
+			close(sh->fd);
+			free(sh);
+			return KISSDB_ERROR_IO;
+		}
+	}
+	m = mmap((void *)0,sh->size,ro ? PROT_READ : (PROT_READ|PROT_WRITE),MAP_SHARED,sh->fd,0);
+	if (m == MAP_FAILED) {
+		close(sh->fd);
+		free(sh);
+		return KISSDB_ERROR_IO;
+	}
+	sh->shm = (KISSDB_Shm *)m;
+	if (memcmp(sh->shm->magic,"KdBM",4)) {
+		if (ro) {
+			KISSDB_shared_detach(sh);
+			return KISSDB_ERROR_IO;
+		}
+		memset(sh->shm,0,sh->size);
+		sh->shm->version = KISSDB_SHM_VERSION;
+		sh->shm->ring_size = KISSDB_SHM_RING;
+		memcpy(sh->shm->magic,"KdBM",4);
+	} else if ((sh->shm->version != KISSDB_SHM_VERSION)||(sh->shm->ring_size != KISSDB_SHM_RING)) {
+		KISSDB_shared_detach(sh);
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	}
+	if ((!writable)&&(!ro)&&(KISSDB_shared_lock(sh,F_RDLCK))) {
+		KISSDB_shared_detach(sh);
+		return KISSDB_ERROR_IO;
+	}
+
+	*shp = sh;
+	return 0;
+}
+
+/* Replay a change another process made to the hash tables, keeping the
+ * index, live bytes, cache and Bloom filter in step. kbuf holds key_size
+ * bytes and a small value, or is NULL with a mapping. */
+static int KISSDB_shared_apply(KISSDB *db,uint64_t page,uint64_t idx,uint64_t value,uint8_t *kbuf)
+{
+	KISSDB_Index_Slot *slot;
+	KISSDB_Entry e,old_e;
+	uint64_t old,keyhash;
+	uint64_t *empty,*hash_tables_rea,*offsets_rea;
+	const uint8_t *k;
+	int small,r;
+
+	if (idx == KISSDB_SHM_NEW_PAGE) {
+		if (page < db->num_hash_tables)
+			return 0; /* already read from the file */
+		if (page > db->num_hash_tables)
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		if (!(offsets_rea = realloc(db->hash_table_offsets,sizeof(uint64_t) * (db->num_hash_tables + 1))))
+			return KISSDB_ERROR_MALLOC;
+		db->hash_table_offsets = offsets_rea;
+		if (db->tables) {
+			if (!(empty = calloc(1,db->hash_table_size_bytes)))
+				return KISSDB_ERROR_MALLOC;
+			r = KISSDB_tables_append(db,empty);
+			free(empty);
+			if (r)
+				return r;
+		} else {
+			if (!(hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1))))
+				return KISSDB_ERROR_MALLOC;
+			db->hash_tables = hash_tables_rea;
+			memset(&(db->hash_tables[(db->hash_table_size + 1) * db->num_hash_tables]),0,db->hash_table_size_bytes);
+		}
+		db->hash_table_offsets[db->num_hash_tables++] = value;
+		return 0;
+	}
+
+	if ((page >= db->num_hash_tables)||(idx > db->hash_table_size)||(value >= db->file_size))
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	if ((old = KISSDB_table_entry(db,page,(unsigned long)idx)) == value)
+		return 0; /* already read from the file */
+	if ((db->snapshots)&&(KISSDB_snapshot_cow(db,(unsigned long)page)))
+		return KISSDB_ERROR_MALLOC;
+	if (db->tables) {
+		if ((r = KISSDB_table_store(db,(unsigned long)page,(unsigned long)idx,value)))
+			return r;
+	} else db->hash_tables[((db->hash_table_size + 1) * page) + idx] = value;
+	if (idx == db->hash_table_size)
+		return 0; /* link to the next page */
+
+	if ((r = KISSDB_entry_at(db,value,&e)))
+		return r;
+	small = ((db->index.inline_values)&&(!e.deleted)&&(e.vlen <= KISSDB_INLINE_MAX));
+	if (db->map) {
+		if ((e.voffset + e.vlen) > db->map_size)
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		k = db->map + e.koffset;
+	} else {
+		if (KISSDB_pread(db,kbuf,e.klen + ((small) ? e.vlen : 0),e.koffset))
+			return KISSDB_ERROR_IO;
+		k = kbuf;
+	}
+	keyhash = KISSDB_mix(KISSDB_hash(db,k,e.klen));
+
+	/* the index still points the key at the entry the bucket had */
+	if ((old)&&((r = KISSDB_index_find(db,k,e.klen,keyhash,&slot,&old_e)) <= 0)) {
+		if (r < 0)
+			return r;
+		slot->offset = value;
+		if (!old_e.deleted)
+			db->live_bytes -= KISSDB_entry_size(db,old_e.klen,old_e.vlen);
+	} else {
+		if (db->bucket_depth[idx] == page)
+			++db->bucket_depth[idx];
+		if (KISSDB_index_insert(&db->index,keyhash,value,&slot))
+			return KISSDB_ERROR_MALLOC;
+		if (db->bloom)
+			KISSDB_bloom_add(db,keyhash);
+	}
+	KISSDB_index_set_inline(&db->index,slot,(e.deleted) ? (const void *)0 : (const void *)(k + e.klen),e.vlen,KISSDB_fingerprint(db,k,e.klen));
+	if (!e.deleted)
+		db->live_bytes += KISSDB_entry_size(db,e.klen,e.vlen);
+	if (db->cache)
+		KISSDB_cache_remove(db->cache,keyhash,k,e.klen);
+	return 0;
+}
+
+/* Drop every cached value */
+static void KISSDB_cache_clear(KISSDB_Cache *cache)
+{
+	KISSDB_Cache_Shard *sh;
+	unsigned long i,b;
+
+	for(i=0;i<KISSDB_CACHE_SHARDS;++i) {
+		sh = &(cache->shards[i]);
+		pthread_mutex_lock(&sh->lock);
+		for(b=0;b<sh->nbuckets;++b) {
+			while (sh->buckets[b])
+				KISSDB_cache_unlink(sh,&(sh->buckets[b]));
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+/* Read the database from its file again, under at least a read lock,
+ * when the ring no longer has every change since the last refresh. As in
+ * a compaction, the cache and Bloom filter carry over. */
+static int KISSDB_shared_reload(KISSDB *db)
+{
+	KISSDB_Shared *sh = db->shared;
+	KISSDB_Cache *cache = db->cache;
+	KISSDB_Bloom *bloom = db->bloom;
+	KISSDB_Counters counters;
+	char *path = db->path;
+	int flags = db->flags;
+	int locked = sh->locked;
+	int r;
+
+	if ((!locked)&&(KISSDB_shared_lock(sh,F_RDLCK)))
+		return KISSDB_ERROR_IO;
+	memset(&counters,0,sizeof(KISSDB_Counters));
+	KISSDB_counters_add(&counters,&db->counters);
+	db->shared = (KISSDB_Shared *)0;
+	db->path = (char *)0;
+	db->cache = (KISSDB_Cache *)0;
+	db->bloom = (KISSDB_Bloom *)0;
+	db->idx_file_size = db->file_size; /* no checkpoint of what is out of date */
+	KISSDB_close(db);
+
+	r = KISSDB_open_file(db,path,flags|((sh->writable) ? KISSDB_OPEN_MODE_RDWR : KISSDB_OPEN_MODE_RDONLY),0,0,0);
+	free(path);
+	if (r) {
+		if (cache)
+			KISSDB_cache_free(cache);
+		if (bloom)
+			KISSDB_bloom_free(bloom);
+		KISSDB_shared_detach(sh);
+		return r;
+	}
+	KISSDB_counters_add(&db->counters,&counters);
+	if ((db->cache = cache))
+		KISSDB_cache_clear(cache);
+	if ((db->bloom = bloom)) {
+		KISSDB_bloom_build(db,bloom);
+		bloom->file_size = 0;
+	}
+	sh->seen = sh->pending = __atomic_load_n(&sh->shm->generation,__ATOMIC_ACQUIRE);
+	db->shared = sh;
+	if ((!locked)&&(KISSDB_shared_lock(sh,F_UNLCK)))
+		return KISSDB_ERROR_IO;
+	return 0;
+}
+
+/* Apply the changes published since the last time. The ring is read
+ * without any lock, each record checked for having been overwritten while
+ * it was copied; a process that fell further behind reloads. */
+static int KISSDB_shared_catch_up(KISSDB *db)
+{
+	KISSDB_Shared *sh = db->shared;
+	uint64_t gen,seq,file_size,page,idx,value;
+	uint8_t *kbuf = (uint8_t *)0;
+	int r = 0;
+
+	gen = __atomic_load_n(&sh->shm->generation,__ATOMIC_ACQUIRE);
+	if (gen == sh->seen)
+		return 0;
+	if ((gen < sh->seen)||((gen - sh->seen) > KISSDB_SHM_RING))
+		return KISSDB_shared_reload(db);
+
+	file_size = __atomic_load_n(&sh->shm->file_size,__ATOMIC_RELAXED);
+	if (file_size > db->file_size) {
+		db->file_size = file_size;
+		if ((db->map)&&((r = KISSDB_remap(db,db->file_size))))
+			return r;
+	}
+	if ((!db->map)&&(!(kbuf = malloc(db->key_size + KISSDB_INLINE_MAX))))
+		return KISSDB_ERROR_MALLOC;
+	for(seq=sh->seen+1;seq<=gen;++seq) {
+		if (KISSDB_shared_read(sh,seq,&page,&idx,&value)) {
+			r = KISSDB_ERROR_CORRUPT_DBFILE; /* lapped while reading */
+			break;
+		}
+		if ((r = KISSDB_shared_apply(db,page,idx,value,kbuf)))
+			break;
+		sh->seen = sh->pending = seq;
+	}
+	free(kbuf);
+	if (r == KISSDB_ERROR_CORRUPT_DBFILE)
+		return KISSDB_shared_reload(db);
+	/* a reader never writes a checkpoint on closing */
+	if ((!r)&&(!sh->writable))
+		db->idx_file_size = db->file_size;
+	return r;
+}
+
+/* Take the write lock and catch up before changing anything */
+static int KISSDB_shared_begin(KISSDB *db)
+{
+	KISSDB_Shared *sh = db->shared;
+	int r;
+
+	if (KISSDB_shared_lock(sh,F_WRLCK))
+		return KISSDB_ERROR_IO;
+	if ((r = KISSDB_shared_catch_up(db))) {
+		if (db->shared)
+			KISSDB_shared_lock(db->shared,F_UNLCK);
+		return r;
+	}
+	return 0;
+}
+
+/* Publish the changes written to the ring and release the write lock */
+static void KISSDB_shared_end(KISSDB *db)
+{
+	KISSDB_Shared *sh = db->shared;
+
+	__atomic_store_n(&sh->shm->file_size,db->file_size,__ATOMIC_RELAXED);
+	__atomic_store_n(&sh->shm->generation,sh->pending,__ATOMIC_RELEASE);
+	sh->seen = sh->pending;
+	KISSDB_shared_lock(sh,F_UNLCK);
+}
+
+int KISSDB_refresh(KISSDB *db)
+{
+	if (!db->shared)
+		return 0;
+	return KISSDB_shared_catch_up(db);
+}
+
+int KISSDB_open(
+	KISSDB *db,
+	const char *path,
+	int mode,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	KISSDB_Shared *sh;
+	uint64_t gen;
+	int r;
+
+	if (!(mode & KISSDB_OPEN_FLAG_SHARED))
+		return KISSDB_open_file(db,path,mode,hash_table_size,key_size,value_size);
+
+	/* truncating would pull the file out from under the others */
+	if ((mode & 0xff) == KISSDB_OPEN_MODE_RWREPLACE)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if ((r = KISSDB_shared_attach(&sh,path,(mode & 0xff) != KISSDB_OPEN_MODE_RDONLY)))
+		return r;
+	if ((r = KISSDB_open_file(db,path,mode,hash_table_size,key_size,value_size))) {
+		KISSDB_shared_detach(sh);
+		return r;
+	}
+
+	/* the file was read under the lock, so it has every change published
+	 * so far. If it differs from what was published (a log was replayed,
+	 * or a writer died or didn't share it), everyone else has to reload. */
+	gen = sh->shm->generation;
+	if ((sh->locked == F_WRLCK)&&(sh->shm->file_size != db->file_size)) {
+		gen += KISSDB_SHM_RING + 1;
+		__atomic_store_n(&sh->shm->file_size,db->file_size,__ATOMIC_RELAXED);
+		__atomic_store_n(&sh->shm->generation,gen,__ATOMIC_RELEASE);
+	}
+	sh->seen = sh->pending = gen;
+	db->shared = sh;
+	if (KISSDB_shared_lock(sh,F_UNLCK)) {
+		KISSDB_close(db);
+		return KISSDB_ERROR_IO;
+	}
+	return 0;
+}
+
+void KISSDB_close(KISSDB *db)
+{
+	KISSDB_Shared *shared = db->shared;
+
+	/* a writer checkpoints what it has caught up on, under the lock; a
+	 * reader leaves the sidecar files to the writers */
+	if ((shared)&&((!shared->writable)||(KISSDB_shared_begin(db)))) {
+		db->idx_file_size = db->file_size;
+		if (db->bloom)
+			db->bloom->file_size = db->file_size;
+		shared = db->shared; /* gone if a reload failed */
+	}
+	if (db->snapshots)
+		KISSDB_snapshot_detach_all(db);
+	if ((db->path)&&((db->idx_file_size != db->file_size)||(db->idx_stale)))
+		KISSDB_index_checkpoint(db);
+	if (db->bloom) {
+		if ((db->path)&&(db->bloom->file_size != db->file_size))
+			KISSDB_bloom_save(db);
+		KISSDB_bloom_free(db->bloom);
+	}
+	if (db->wal) {
+		KISSDB_wal_checkpoint(db);
+		KISSDB_wal_stop(db->wal);
+	}
+	if (db->pool)
+		KISSDB_pool_free(db);
+	free(db->dirty);
+	if (db->cache)
+		KISSDB_cache_free(db->cache);
+	if (db->map)
+		munmap((void *)db->map,(size_t)db->map_capacity);
+	if (db->hash_tables)
+		free(db->hash_tables);
+	if (db->tables)
+		KISSDB_tables_free(db->tables);
+	free(db->hash_table_offsets);
+	free(db->bucket_depth);
+	KISSDB_index_free(&db->index);
+	free(db->path);
+	if (db->fd >= 0)
+		close(db->fd);
+	if (shared) {
+		if (shared->locked)
+			KISSDB_shared_lock(shared,F_UNLCK);
+		KISSDB_shared_detach(shared);
+	}
+	memset(db,0,sizeof(KISSDB));
+	db->fd = -1;
+}
+
+/* Find key's live entry: 0 on success, 1 if not found or deleted */
+static int KISSDB_find(KISSDB *db,const void *key,unsigned long klen,uint64_t hash,KISSDB_Entry *e)
+{
+	KISSDB_Index_Slot *slot;
+	int r;
+
+	if ((db->bloom)&&(!KISSDB_bloom_test(db->bloom,hash)))
+		return 1; /* not found */
+	r = KISSDB_index_find(db,key,klen,hash,&slot,e);
+	if ((!r)&&(e->deleted))
+		return 1; /* not found */
+	return r;
+}
+
+int KISSDB_get_ref_len(KISSDB *db,const void *key,unsigned long klen,const void **vptr,unsigned long *vlen)
+{
+	KISSDB_Entry e;
+	const void *k;
+	void *kalloc = (void *)0;
+	int r;
+
+	if (!db->map)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (klen > db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	KISSDB_COUNT(&db->counters,gets,1);
+	if (db->version == KISSDB_VERSION_FIXED) {
+		if (!(k = KISSDB_pad(key,klen,db->key_size,&kalloc)))
+			return KISSDB_ERROR_MALLOC;
+		r = KISSDB_find(db,k,db->key_size,KISSDB_mix(KISSDB_hash(db,k,db->key_size)),&e);
+		free(kalloc);
+	} else r = KISSDB_find(db,key,klen,KISSDB_mix(KISSDB_hash(db,key,klen)),&e);
+
+	if (!r) {
+		if ((e.voffset + e.vlen) > db->map_size)
+			return KISSDB_ERROR_IO;
+		*vptr = db->map + e.voffset;
+		if (vlen)
+			*vlen = e.vlen;
+	}
+	return r;
+}
+
+int KISSDB_get_ref(KISSDB *db,const void *key,const void **vptr)
+{
+	return KISSDB_get_ref_len(db,key,db->key_size,vptr,(unsigned long *)0);
+}
+
+int KISSDB_get_len(KISSDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB_Entry e;
+	uint64_t hash;
+	const void *k = key;
+	void *kalloc = (void *)0;
+	int r;
+
+	if (klen > db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	KISSDB_COUNT(&db->counters,gets,1);
+	if (db->version == KISSDB_VERSION_FIXED) {
+		if (!(k = KISSDB_pad(key,klen,db->key_size,&kalloc)))
+			return KISSDB_ERROR_MALLOC;
+		klen = db->key_size;
+	}
+	hash = KISSDB_mix(KISSDB_hash(db,k,klen));
+
+	/* small values are answered by the index without any read */
+	if ((db->index.inline_values)&&((r = KISSDB_index_get_inline(&db->index,hash,KISSDB_fingerprint(db,k,klen),vbuf,vlen)) != 2)) {
+		free(kalloc);
+		return r;
+	}
+	if ((db->cache)&&(!KISSDB_cache_get(db->cache,hash,k,klen,vbuf,vlen))) {
+		free(kalloc);
+		return 0;
+	}
+
+	if (!(r = KISSDB_find(db,k,klen,hash,&e))) {
+		if (db->map) {
+			if ((e.voffset + e.vlen) > db->map_size)
+				r = KISSDB_ERROR_IO;
+			else memcpy(vbuf,db->map + e.voffset,e.vlen);
+		} else if (KISSDB_pread(db,vbuf,e.vlen,e.voffset))
+			r = KISSDB_ERROR_IO;
+		if (!r) {
+			if (vlen)
+				*vlen = e.vlen;
+			if (db->cache)
+				KISSDB_cache_insert(db->cache,hash,k,klen,vbuf,e.vlen);
+		}
+	}
+	free(kalloc);
+	return r;
+}
+
+int KISSDB_get(KISSDB *db,const void *key,void *vbuf)
+{
+	unsigned long vlen = 0;
+	int r = KISSDB_get_len(db,key,db->key_size,vbuf,&vlen);
+	if ((!r)&&(vlen < db->value_size))
+		memset(((uint8_t *)vbuf) + vlen,0,db->value_size - vlen);
+	return r;
+}
+
+/* Point bucket at a new entry offset */
+static int KISSDB_set_bucket(KISSDB *db,uint64_t bucket,uint64_t oldoffset,uint64_t newoffset)
+{
+	unsigned long p;
+
+	for(p=0;p<db->bucket_depth[bucket];++p) {
+		if (KISSDB_table_entry(db,p,(unsigned long)bucket) == oldoffset)
+			return KISSDB_set_table_entry(db,p,(unsigned long)bucket,newoffset);
+	}
+	return KISSDB_ERROR_CORRUPT_DBFILE;
+}
+
+/* Append a new hash table page whose only entry is target in bucket, and
+ * link it to the end of the chain. iov[0] is set to the page; iov[1] to
+ * iov[n-1], if any, are written right after it with the same call. */
+static int KISSDB_add_page(KISSDB *db,uint64_t bucket,uint64_t target,struct iovec *iov,int n)
+{
+	uint64_t endoffset = db->file_size;
+	uint64_t size = 0;
+	uint64_t *cur_hash_table;
+	uint64_t *hash_tables_rea;
+	uint64_t *offsets_rea;
+	int i,r;
+
+	offsets_rea = realloc(db->hash_table_offsets,sizeof(uint64_t) * (db->num_hash_tables + 1));
+	if (!offsets_rea)
+		return KISSDB_ERROR_MALLOC;
+	db->hash_table_offsets = offsets_rea;
+	if (db->tables) {
+		/* the page is written from a copy and kept compact */
+		if (!(cur_hash_table = malloc(db->hash_table_size_bytes)))
+			return KISSDB_ERROR_MALLOC;
+	} else {
+		hash_tables_rea = realloc(db->hash_tables,db->hash_table_size_bytes * (db->num_hash_tables + 1));
+		if (!hash_tables_rea)
+			return KISSDB_ERROR_MALLOC;
+		db->hash_tables = hash_tables_rea;
+		cur_hash_table = &(db->hash_tables[(db->hash_table_size + 1) * db->num_hash_tables]);
+	}
+	memset(cur_hash_table,0,db->hash_table_size_bytes);
+	cur_hash_table[bucket] = target;
+	if ((db->tables)&&((r = KISSDB_tables_append(db,cur_hash_table)))) {
+		free(cur_hash_table);
+		return r;
+	}
+
+	iov[0].iov_base = (void *)cur_hash_table;
+	iov[0].iov_len = db->hash_table_size_bytes;
+	for(i=0;i<n;++i)
+		size += iov[i].iov_len;
+	r = KISSDB_pwritev(db,iov,n,endoffset);
+	if (db->tables)
+		free(cur_hash_table);
+	if (r)
+		return KISSDB_ERROR_IO;
+	db->file_size = endoffset + size;
+
+	if (db->num_hash_tables) {
+		if ((r = KISSDB_set_table_entry(db,db->num_hash_tables - 1,db->hash_table_size,endoffset)))
+			return r;
+	}
+
+	db->hash_table_offsets[db->num_hash_tables] = endoffset;
+	++db->num_hash_tables;
+	if (db->pool)
+		KISSDB_pool_mark_table(db,endoffset);
+	if (db->shared) {
+		KISSDB_shared_log(db,db->num_hash_tables - 1,KISSDB_SHM_NEW_PAGE,endoffset);
+		KISSDB_shared_log(db,db->num_hash_tables - 1,bucket,target);
+	}
+
+	return 0;
+}
+
+/* Point the bucket of a key at its entry, already written at offset with
+ * the value given (fprint is the key's fingerprint on version 5). If slot
+ * is not NULL the key exists, its slot is that and old its entry;
+ * otherwise the entry goes into the first empty slot of its bucket, which
+ * bucket_depth tells us without walking the chain. */
+static int KISSDB_link_entry(KISSDB *db,uint64_t hash,uint64_t keyhash,KISSDB_Index_Slot *slot,const KISSDB_Entry *old,uint64_t offset,uint64_t esize,const void *value,unsigned long vlen,uint64_t fprint)
+{
+	struct iovec iov[1];
+	int r;
+
+	if (slot) {
+		if ((r = KISSDB_set_bucket(db,hash,slot->offset,offset)))
+			return r;
+		slot->offset = offset;
+		KISSDB_index_set_inline(&db->index,slot,value,vlen,fprint);
+		if (!old->deleted)
+			db->live_bytes -= KISSDB_entry_size(db,old->klen,old->vlen);
+		db->live_bytes += esize;
+		return 0;
+	}
+
+	if (db->bucket_depth[hash] < db->num_hash_tables)
+		r = KISSDB_set_table_entry(db,db->bucket_depth[hash],(unsigned long)hash,offset);
+	else r = KISSDB_add_page(db,hash,offset,iov,1);
+	if (r)
+		return r;
+	++db->bucket_depth[hash];
+	db->live_bytes += esize;
+
+	if (KISSDB_index_insert(&db->index,keyhash,offset,&slot))
+		return KISSDB_ERROR_MALLOC;
+	KISSDB_index_set_inline(&db->index,slot,value,vlen,fprint);
+	if (db->bloom)
+		KISSDB_bloom_add(db,keyhash);
+	return 0;
+}
+
+int KISSDB_put_len(KISSDB *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	uint64_t keyhash;
+	uint64_t hash;
+	uint64_t endoffset;
+	uint64_t esize;
+	uint64_t fprint;
+	KISSDB_Index_Slot *slot;
+	KISSDB_Entry e;
+	struct iovec iov[5];
+	uint32_t ehdr[2];
+	const void *k,*v;
+	void *kalloc = (void *)0,*valloc = (void *)0;
+	int r,n,cached;
+
+	if ((klen > db->key_size)||(vlen > db->value_size))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	/* another process may have changed the file */
+	if ((db->shared)&&(!db->shared->locked)) {
+		if ((r = KISSDB_shared_begin(db)))
+			return r;
+		r = KISSDB_put_len(db,key,klen,value,vlen);
+		KISSDB_shared_end(db);
+		return r;
+	}
+	if ((db->version == KISSDB_VERSION_FIXED)&&((klen < db->key_size)||(vlen < db->value_size))) {
+		k = KISSDB_pad(key,klen,db->key_size,&kalloc);
+		v = KISSDB_pad(value,vlen,db->value_size,&valloc);
+		r = ((k)&&(v)) ? KISSDB_put_len(db,k,db->key_size,v,db->value_size) : KISSDB_ERROR_MALLOC;
+		free(kalloc);
+		free(valloc);
+		return r;
+	}
+
+	KISSDB_COUNT(&db->counters,puts,1);
+	keyhash = KISSDB_hash(db,key,klen);
+	hash = keyhash % (uint64_t)db->hash_table_size;
+	keyhash = KISSDB_mix(keyhash);
+	esize = KISSDB_entry_size(db,klen,vlen);
+	fprint = (db->index.inline_values) ? KISSDB_fingerprint(db,key,klen) : 0;
+
+	if ((r = KISSDB_index_find(db,key,klen,keyhash,&slot,&e)) < 0)
+		return r;
+	/* log the put only once the lookup has succeeded, so that a put that
+	 * fails here is not replayed on the next open; r still says whether
+	 * the key was found */
+	if ((db->wal)&&((n = KISSDB_wal_log(db,KISSDB_WAL_PUT,key,klen,value,vlen))))
+		return n;
+
+	/* write-through: a cached value is dropped now and replaced once the
+	 * new one has been written */
+	cached = (db->cache) ? KISSDB_cache_remove(db->cache,keyhash,key,klen) : 0;
+
+	/* rewrite in place if the value still fits exactly, unless a
+	 * compaction needs every change to show up as a new offset, a
+	 * snapshot may still point at the old value or another process may
+	 * be reading it. A value of another length is appended even when it
+	 * would fit the padding of a small one, since its length and bytes
+	 * could not be changed in one write. */
+	if ((!r)&&(!e.deleted)&&(e.vlen == vlen)&&(!db->compacting)&&(!db->snapshots)&&(!db->shared)) {
+		KISSDB_index_invalidate(db);
+		if (KISSDB_pwrite(db,value,vlen,e.voffset))
+			return KISSDB_ERROR_IO;
+		KISSDB_index_set_inline(&db->index,slot,value,vlen,fprint);
+	} else {
+		endoffset = db->file_size;
+		if ((r)&&(db->bucket_depth[hash] >= db->num_hash_tables)) {
+			/* if no existing slots, add a new page of hash table
+			 * entries and write it together with the entry */
+			n = 1 + KISSDB_entry_iov(db,iov + 1,ehdr,key,klen,value,vlen);
+			if ((r = KISSDB_add_page(db,hash,endoffset + db->hash_table_size_bytes,iov,n)))
+				return r;
+			++db->bucket_depth[hash];
+			db->live_bytes += esize;
+			if (KISSDB_index_insert(&db->index,keyhash,endoffset + db->hash_table_size_bytes,&slot))
+				return KISSDB_ERROR_MALLOC;
+			KISSDB_index_set_inline(&db->index,slot,value,vlen,fprint);
+			if (db->bloom)
+				KISSDB_bloom_add(db,keyhash);
+		} else {
+			/* otherwise append the entry and point its bucket at it */
+			n = KISSDB_entry_iov(db,iov,ehdr,key,klen,value,vlen);
+			if (KISSDB_pwritev(db,iov,n,endoffset))
+				return KISSDB_ERROR_IO;
+			db->file_size = endoffset + esize;
+			if ((r = KISSDB_link_entry(db,hash,keyhash,r ? (KISSDB_Index_Slot *)0 : slot,&e,endoffset,esize,value,vlen,fprint)))
+				return r;
+		}
+		if ((db->map)&&((r = KISSDB_remap(db,db->file_size))))
+			return r;
+	}
+
+	if (cached)
+		KISSDB_cache_insert(db->cache,keyhash,key,klen,value,vlen);
+	KISSDB_index_autosave(db);
+
+	return 0; /* success */
+}
+
+int KISSDB_put(KISSDB *db,const void *key,const void *value)
+{
+	return KISSDB_put_len(db,key,db->key_size,value,db->value_size);
+}
+
+int KISSDB_put_many(KISSDB *db,unsigned long n,const void *const *keys,const unsigned long *klens,const void *const *values,const unsigned long *vlens)
+{
+	uint8_t *buf,*p;
+	uint64_t *offsets;
+	uint64_t total = 0;
+	uint64_t endoffset,keyhash;
+	unsigned long i,klen,vlen;
+	KISSDB_Index_Slot *slot;
+	KISSDB_Entry e;
+	uint32_t ehdr[2];
+	const uint8_t *k;
+	int cached;
+	int r = 0;
+
+	if (!n)
+		return 0;
+	/* another process may have changed the file */
+	if ((db->shared)&&(!db->shared->locked)) {
+		if ((r = KISSDB_shared_begin(db)))
+			return r;
+		r = KISSDB_put_many(db,n,keys,klens,values,vlens);
+		KISSDB_shared_end(db);
+		return r;
+	}
+	for(i=0;i<n;++i) {
+		klen = klens ? klens[i] : db->key_size;
+		vlen = vlens ? vlens[i] : db->value_size;
+		if ((klen > db->key_size)||(vlen > db->value_size))
+			return KISSDB_ERROR_INVALID_PARAMETERS;
+		total += KISSDB_entry_size(db,klen,vlen);
+	}
+	if ((db->wal)&&(total > 0xffffffffULL))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	KISSDB_COUNT(&db->counters,puts,n);
+
+	/* lay out all entries as they will be stored, zero-padded on a
+	 * version 2 database and small values on a version 5 one */
+	buf = calloc(1,(size_t)total);
+	offsets = malloc(sizeof(uint64_t) * n);
+	if ((!buf)||(!offsets)) {
+		free(buf);
+		free(offsets);
+		return KISSDB_ERROR_MALLOC;
+	}
+	p = buf;
+	for(i=0;i<n;++i) {
+		klen = klens ? klens[i] : db->key_size;
+		vlen = vlens ? vlens[i] : db->value_size;
+		offsets[i] = (uint64_t)(p - buf);
+		if (db->version == KISSDB_VERSION_FIXED) {
+			memcpy(p,keys[i],klen);
+			memcpy(p + db->key_size,values[i],vlen);
+			p += db->key_size + db->value_size;
+		} else {
+			ehdr[0] = (uint32_t)klen;
+			ehdr[1] = (uint32_t)vlen;
+			memcpy(p,ehdr,KISSDB_ENTRY_HEADER_SIZE);
+			memcpy(p + KISSDB_ENTRY_HEADER_SIZE,keys[i],klen);
+			memcpy(p + KISSDB_ENTRY_HEADER_SIZE + klen,values[i],vlen);
+			p += KISSDB_entry_size(db,klen,vlen);
+		}
+	}
+
+	/* one log record makes the batch atomic, one write appends it */
+	if ((db->wal)&&((r = KISSDB_wal_log(db,KISSDB_WAL_BATCH,buf,(unsigned long)total,(const void *)0,0))))
+		goto put_many_out;
+	endoffset = db->file_size;
+	if (KISSDB_pwrite(db,buf,(size_t)total,endoffset)) {
+		r = KISSDB_ERROR_IO;
+		goto put_many_out;
+	}
+	db->file_size = endoffset + total;
+	if ((db->map)&&((r = KISSDB_remap(db,db->file_size))))
+		goto put_many_out;
+
+	/* then point each bucket at its entry, in order, so a key given
+	 * more than once ends up with its last value */
+	for(i=0;i<n;++i) {
+		p = buf + offsets[i];
+		if (db->version == KISSDB_VERSION_FIXED) {
+			k = p;
+			klen = db->key_size;
+			vlen = db->value_size;
+		} else {
+			memcpy(ehdr,p,KISSDB_ENTRY_HEADER_SIZE);
+			k = p + KISSDB_ENTRY_HEADER_SIZE;
+			klen = ehdr[0];
+			vlen = ehdr[1];
+		}
+		keyhash = KISSDB_hash(db,k,klen);
+		if ((r = KISSDB_index_find(db,k,klen,KISSDB_mix(keyhash),&slot,&e)) < 0)
+			break;
+		cached = (db->cache) ? KISSDB_cache_remove(db->cache,KISSDB_mix(keyhash),k,klen) : 0;
+		if ((r = KISSDB_link_entry(db,keyhash % (uint64_t)db->hash_table_size,KISSDB_mix(keyhash),r ? (KISSDB_Index_Slot *)0 : slot,&e,endoffset + offsets[i],KISSDB_entry_size(db,klen,vlen),k + klen,vlen,(db->index.inline_values) ? KISSDB_fingerprint(db,k,klen) : 0)))
+			break;
+		if (cached)
+			KISSDB_cache_insert(db->cache,KISSDB_mix(keyhash),k,klen,k + klen,vlen);
+	}
+	if ((!r)&&(db->map))
+		r = KISSDB_remap(db,db->file_size);
+	if (!r)
+		KISSDB_index_autosave(db);
+
+put_many_out:
+	free(buf);
+	free(offsets);
+	return r;
+}
+
+/* A key looked up by KISSDB_get_many(): where the index says it is */
+typedef struct {
+	uint64_t offset;
+	unsigned long i;
+} KISSDB_Candidate;
+
+static int KISSDB_candidate_cmp(const void *a,const void *b)
+{
+	uint64_t x = ((const KISSDB_Candidate *)a)->offset;
+	uint64_t y = ((const KISSDB_Candidate *)b)->offset;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Offset of the first index slot with this hash: 0 on success, 1 if none */
+static int KISSDB_index_candidate(const KISSDB_Index_Table *t,uint64_t hash,uint64_t *offset)
+{
+	unsigned long mask = (t->capacity / KISSDB_INDEX_GROUP) - 1;
+	unsigned long g = (unsigned long)(hash >> 7) & mask;
+	unsigned long probe = 0;
+	unsigned long slot;
+	const uint8_t *group;
+	unsigned int m;
+
+	if (!t->ctrl)
+		return 1;
+	for(;;) {
+		group = t->ctrl + (g * KISSDB_INDEX_GROUP);
+		m = KISSDB_group_match(group,(uint8_t)(hash & 0x7f));
+		while (m) {
+			slot = (g * KISSDB_INDEX_GROUP) + (unsigned long)__builtin_ctz(m);
+			m &= m - 1;
+			if (t->slots[slot].hash == hash) {
+				*offset = t->slots[slot].offset;
+				return 0;
+			}
+		}
+		if (KISSDB_group_match(group,KISSDB_CTRL_EMPTY))
+			return 1;
+		g = (g + ++probe) & mask;
+	}
+}
+
+int KISSDB_get_many(KISSDB *db,unsigned long n,const void *const *keys,const unsigned long *klens,void *const *vbufs,unsigned long *vlens,int *results)
+{
+	KISSDB_Candidate *cand;
+	KISSDB_Entry e;
+	uint8_t *buf = (uint8_t *)0;
+	const uint8_t *p;
+	uint64_t hash,start,end,len,next;
+	unsigned long i,j,c,nc = 0,klen;
+	int r = 0;
+
+	for(i=0;i<n;++i) {
+		if ((klens ? klens[i] : db->key_size) > db->key_size)
+			return KISSDB_ERROR_INVALID_PARAMETERS;
+	}
+
+	/* with a mapping there is no I/O to schedule; the same goes for
+	 * short keys on a version 2 database, which need padding */
+	if (!(cand = malloc(sizeof(KISSDB_Candidate) * (n ? n : 1))))
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;i<n;++i) {
+		klen = klens ? klens[i] : db->key_size;
+		if ((db->map)||((db->version == KISSDB_VERSION_FIXED)&&(klen < db->key_size))) {
+			if ((results[i] = KISSDB_get_len(db,keys[i],klen,vbufs[i],vlens ? &vlens[i] : (unsigned long *)0)) < 0) {
+				r = results[i];
+				goto get_many_out;
+			}
+			continue;
+		}
+		KISSDB_COUNT(&db->counters,gets,1);
+		hash = KISSDB_mix(KISSDB_hash(db,keys[i],klen));
+		if ((db->index.inline_values)&&((results[i] = KISSDB_index_get_inline(&db->index,hash,KISSDB_fingerprint(db,keys[i],klen),vbufs[i],vlens ? &vlens[i] : (unsigned long *)0)) != 2))
+			continue;
+		if ((db->cache)&&(!KISSDB_cache_get(db->cache,hash,keys[i],klen,vbufs[i],vlens ? &vlens[i] : (unsigned long *)0))) {
+			results[i] = 0;
+			continue;
+		}
+		if (((db->bloom)&&(!KISSDB_bloom_test(db->bloom,hash)))||((KISSDB_index_candidate(&db->index.cur,hash,&cand[nc].offset))&&(KISSDB_index_candidate(&db->index.old,hash,&cand[nc].offset)))) {
+			results[i] = 1; /* not found */
+			continue;
+		}
+		cand[nc++].i = i;
+	}
+
+	/* sweep the file once in offset order, reading runs of nearby
+	 * entries with a single read each */
+	qsort(cand,nc,sizeof(KISSDB_Candidate),KISSDB_candidate_cmp);
+	if ((nc)&&(!(buf = malloc(KISSDB_READ_MAX_RUN + KISSDB_ENTRY_HEADER_SIZE + db->key_size + db->value_size)))) {
+		r = KISSDB_ERROR_MALLOC;
+		goto get_many_out;
+	}
+	for(c=0;c<nc;c=j) {
+		start = cand[c].offset;
+		end = start;
+		for(j=c;j<nc;++j) {
+			if ((j > c)&&((cand[j].offset > (end + KISSDB_READ_GAP))||((cand[j].offset - start) > KISSDB_READ_MAX_RUN)))
+				break;
+			klen = klens ? klens[cand[j].i] : db->key_size;
+			next = cand[j].offset + ((db->version == KISSDB_VERSION_FIXED) ? (db->key_size + db->value_size) : (KISSDB_ENTRY_HEADER_SIZE + klen + db->value_size));
+			if (next > end)
+				end = next;
+		}
+		if (end > db->file_size)
+			end = db->file_size;
+		len = end - start;
+		if (KISSDB_pread(db,buf,(size_t)len,start)) {
+			r = KISSDB_ERROR_IO;
+			goto get_many_out;
+		}
+
+		while (c < j) {
+			i = cand[c].i;
+			klen = klens ? klens[i] : db->key_size;
+			p = buf + (cand[c].offset - start);
+			if (db->version == KISSDB_VERSION_FIXED) {
+				e.koffset = cand[c].offset;
+				e.klen = db->key_size;
+				e.voffset = e.koffset + db->key_size;
+				e.vlen = db->value_size;
+				e.deleted = 0;
+				r = ((e.voffset + e.vlen) > end) ? KISSDB_ERROR_CORRUPT_DBFILE : 0;
+			} else if ((cand[c].offset + KISSDB_ENTRY_HEADER_SIZE) > end)
+				r = KISSDB_ERROR_CORRUPT_DBFILE;
+			else r = KISSDB_entry_decode(db,cand[c].offset,p,&e);
+			if (r)
+				goto get_many_out;
+			if ((e.klen == klen)&&(!memcmp(buf + (e.koffset - start),keys[i],klen))) {
+				if (e.deleted)
+					results[i] = 1; /* not found */
+				else {
+					memcpy(vbufs[i],buf + (e.voffset - start),e.vlen);
+					if (vlens)
+						vlens[i] = e.vlen;
+					results[i] = 0;
+					if (db->cache)
+						KISSDB_cache_insert(db->cache,KISSDB_mix(KISSDB_hash(db,keys[i],klen)),keys[i],klen,vbufs[i],e.vlen);
+				}
+			} else {
+				/* another key with the same 64-bit hash; look it up properly */
+				if ((results[i] = KISSDB_get_len(db,keys[i],klen,vbufs[i],vlens ? &vlens[i] : (unsigned long *)0)) < 0) {
+					r = results[i];
+					goto get_many_out;
+				}
+			}
+			++c;
+		}
+	}
+
+get_many_out:
+	free(buf);
+	free(cand);
+	return r;
+}
+
+int KISSDB_get_start(KISSDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen,uint64_t *offset,unsigned long *len)
+{
+	uint64_t hash;
+	int r;
+
+	if (klen > db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	/* a mapped file has nothing to wait for, reads in direct mode go
+	 * through the buffer pool, and short keys on a version 2 database need
+	 * padding: all are done right away */
+	if ((db->map)||(db->pool)||((db->version == KISSDB_VERSION_FIXED)&&(klen < db->key_size)))
+		return KISSDB_get_len(db,key,klen,vbuf,vlen);
+
+	KISSDB_COUNT(&db->counters,gets,1);
+	hash = KISSDB_mix(KISSDB_hash(db,key,klen));
+	if ((db->index.inline_values)&&((r = KISSDB_index_get_inline(&db->index,hash,KISSDB_fingerprint(db,key,klen),vbuf,vlen)) != 2))
+		return r;
+	if ((db->cache)&&(!KISSDB_cache_get(db->cache,hash,key,klen,vbuf,vlen)))
+		return 0;
+	if ((db->bloom)&&(!KISSDB_bloom_test(db->bloom,hash)))
+		return 1; /* not found */
+	if ((KISSDB_index_candidate(&db->index.cur,hash,offset))&&(KISSDB_index_candidate(&db->index.old,hash,offset)))
+		return 1; /* not found */
+
+	/* enough for the longest entry the key could have */
+	if (db->version == KISSDB_VERSION_FIXED)
+		*len = db->key_size + db->value_size;
+	else *len = KISSDB_ENTRY_HEADER_SIZE + klen + db->value_size;
+	if ((*offset + *len) > db->file_size)
+		*len = (unsigned long)(db->file_size - *offset);
+	return 2;
+}
+
+int KISSDB_get_finish(KISSDB *db,uint64_t offset,const void *buf,unsigned long len,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	KISSDB_Entry e;
+	int r;
+
+	if (db->version == KISSDB_VERSION_FIXED) {
+		e.koffset = offset;
+		e.klen = db->key_size;
+		e.voffset = offset + db->key_size;
+		e.vlen = db->value_size;
+		e.deleted = 0;
+	} else if (len < KISSDB_ENTRY_HEADER_SIZE)
+		return KISSDB_ERROR_IO;
+	else if ((r = KISSDB_entry_decode(db,offset,p,&e)))
+		return r;
+	if ((e.klen != klen)||((e.voffset + e.vlen) > (offset + len)))
+		return KISSDB_get_len(db,key,klen,vbuf,vlen);
+	if (memcmp(p + (e.koffset - offset),key,klen))
+		return KISSDB_get_len(db,key,klen,vbuf,vlen); /* another key with the same 64-bit hash */
+	if (e.deleted)
+		return 1; /* not found */
+
+	memcpy(vbuf,p + (e.voffset - offset),e.vlen);
+	if (vlen)
+		*vlen = e.vlen;
+	if (db->cache)
+		KISSDB_cache_insert(db->cache,KISSDB_mix(KISSDB_hash(db,key,klen)),key,klen,vbuf,e.vlen);
+	return 0;
+}
+
+int KISSDB_delete(KISSDB *db,const void *key,unsigned long klen)
+{
+	uint64_t keyhash;
+	uint64_t endoffset;
+	KISSDB_Index_Slot *slot;
+	KISSDB_Entry e;
+	struct iovec iov[2];
+	uint32_t ehdr[2];
+	int r,n;
+
+	/* another process may have changed the file */
+	if ((db->shared)&&(!db->shared->locked)) {
+		if ((r = KISSDB_shared_begin(db)))
+			return r;
+		r = KISSDB_delete(db,key,klen);
+		KISSDB_shared_end(db);
+		return r;
+	}
+	if ((db->version == KISSDB_VERSION_FIXED)||(klen > db->key_size))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	KISSDB_COUNT(&db->counters,deletes,1);
+
+	keyhash = KISSDB_hash(db,key,klen);
+	if ((db->bloom)&&(!KISSDB_bloom_test(db->bloom,KISSDB_mix(keyhash))))
+		return 1; /* not found */
+	if ((r = KISSDB_index_find(db,key,klen,KISSDB_mix(keyhash),&slot,&e)))
+		return r;
+	if (e.deleted)
+		return 1; /* not found */
+	if ((db->wal)&&((r = KISSDB_wal_log(db,KISSDB_WAL_DELETE,key,klen,(const void *)0,0))))
+		return r;
+	if (db->cache)
+		KISSDB_cache_remove(db->cache,KISSDB_mix(keyhash),key,klen);
+
+	/* append a tombstone and point the key's bucket at it */
+	endoffset = db->file_size;
+	n = KISSDB_entry_iov(db,iov,ehdr,key,klen,(const void *)0,0);
+	if (KISSDB_pwritev(db,iov,n,endoffset))
+		return KISSDB_ERROR_IO;
+	db->file_size = endoffset + KISSDB_entry_size(db,klen,0);
+	if ((r = KISSDB_set_bucket(db,keyhash % (uint64_t)db->hash_table_size,slot->offset,endoffset)))
+		return r;
+	slot->offset = endoffset;
+	KISSDB_index_set_inline(&db->index,slot,(const void *)0,0,0);
+	db->live_bytes -= KISSDB_entry_size(db,e.klen,e.vlen);
+
+	if ((db->map)&&((r = KISSDB_remap(db,db->file_size))))
+		return r;
+	KISSDB_index_autosave(db);
+
+	return 0; /* success */
+}
+
+uint64_t KISSDB_dead_bytes(KISSDB *db)
+{
+	return db->file_size - KISSDB_HEADER_SIZE_OF(db) - ((uint64_t)db->num_hash_tables * (uint64_t)db->hash_table_size_bytes) - db->live_bytes;
+}
+
+/* Apply the entries of a batch record one by one; the record as a whole
+ * is either in the log or not, so a replayed batch is still atomic */
+static int KISSDB_wal_replay_batch(KISSDB *db,const uint8_t *p,uint64_t len)
+{
+	uint32_t l[2];
+	unsigned long klen,vlen,hlen;
+	uint64_t pos = 0;
+	int r;
+
+	while (pos < len) {
+		if (db->version == KISSDB_VERSION_FIXED) {
+			klen = db->key_size;
+			vlen = db->value_size;
+			hlen = 0;
+		} else {
+			if ((pos + KISSDB_ENTRY_HEADER_SIZE) > len)
+				return KISSDB_ERROR_CORRUPT_DBFILE;
+			memcpy(l,p + pos,sizeof(l));
+			klen = l[0];
+			vlen = l[1];
+			hlen = KISSDB_ENTRY_HEADER_SIZE;
+		}
+		if ((klen > db->key_size)||(vlen > db->value_size)||((pos + KISSDB_entry_size(db,klen,vlen)) > len))
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		if ((r = KISSDB_put_len(db,p + pos + hlen,klen,p + pos + hlen + klen,vlen)))
+			return r;
+		pos += KISSDB_entry_size(db,klen,vlen);
+	}
+	return 0;
+}
+
+/* Apply the records of a log left behind by a previous run, up to the
+ * first one that is torn or fails its CRC, then empty the log */
+static int KISSDB_wal_replay(KISSDB *db)
+{
+	char *path;
+	uint8_t *log;
+	uint32_t h[4];
+	uint64_t pos,size;
+	struct stat st;
+	ssize_t n;
+	int fd;
+	int r = 0;
+
+	if (!(path = KISSDB_wal_path(db->path)))
+		return KISSDB_ERROR_MALLOC;
+	fd = open(path,O_RDWR);
+	free(path);
+	if (fd < 0)
+		return (errno == ENOENT) ? 0 : KISSDB_ERROR_IO;
+	if (fstat(fd,&st)) {
+		close(fd);
+		return KISSDB_ERROR_IO;
+	}
+	if (!(size = (uint64_t)st.st_size)) {
+		close(fd);
+		return 0;
+	}
+	if (!(log = malloc((size_t)size))) {
+		close(fd);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(pos=0;pos<size;) {
+		n = pread(fd,log + pos,(size_t)(size - pos),(off_t)pos);
+		if (n > 0)
+			pos += (uint64_t)n;
+		else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else break;
+	}
+	size = pos;
+
+	pos = 0;
+	while ((pos + KISSDB_WAL_RECORD_HEADER_SIZE) <= size) {
+		memcpy(h,log + pos,sizeof(h));
+		if ((h[1] != KISSDB_WAL_BATCH)&&((h[2] > db->key_size)||(h[3] > db->value_size)))
+			break;
+		if ((pos + KISSDB_WAL_RECORD_HEADER_SIZE + h[2] + h[3]) > size)
+			break;
+		if (KISSDB_crc32(0,log + pos + sizeof(uint32_t),(unsigned long)(KISSDB_WAL_RECORD_HEADER_SIZE - sizeof(uint32_t) + h[2] + h[3])) != h[0])
+			break;
+		if (h[1] == KISSDB_WAL_PUT)
+			r = KISSDB_put_len(db,log + pos + KISSDB_WAL_RECORD_HEADER_SIZE,h[2],log + pos + KISSDB_WAL_RECORD_HEADER_SIZE + h[2],h[3]);
+		else if (h[1] == KISSDB_WAL_DELETE) {
+			if ((r = KISSDB_delete(db,log + pos + KISSDB_WAL_RECORD_HEADER_SIZE,h[2])) == 1)
+				r = 0;
+		} else if (h[1] == KISSDB_WAL_BATCH)
+			r = KISSDB_wal_replay_batch(db,log + pos + KISSDB_WAL_RECORD_HEADER_SIZE,h[2]);
+		if (r)
+			break;
+		pos += KISSDB_WAL_RECORD_HEADER_SIZE + h[2] + h[3];
+	}
+	free(log);
+
+	if ((!r)&&(KISSDB_sync(db)))
+		r = KISSDB_ERROR_IO;
+	if ((!r)&&(ftruncate(fd,0)))
+		r = KISSDB_ERROR_IO;
+	close(fd);
+
+	return r;
+}
+
+int KISSDB_wal_enable(KISSDB *db,int durability,unsigned long interval_ms)
+{
+	KISSDB_WAL *w;
+	char *path;
+
+	if ((db->wal)||(db->shared)||(!db->path)||(durability < KISSDB_WAL_SYNC_NONE)||(durability > KISSDB_WAL_SYNC_COMMIT))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if ((durability != KISSDB_WAL_SYNC_COMMIT)&&(!interval_ms))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	if (!(w = calloc(1,sizeof(KISSDB_WAL))))
+		return KISSDB_ERROR_MALLOC;
+	if (!(path = KISSDB_wal_path(db->path))) {
+		free(w);
+		return KISSDB_ERROR_MALLOC;
+	}
+	w->fd = open(path,O_RDWR|O_CREAT|O_TRUNC,0644);
+	free(path);
+	if (w->fd < 0) {
+		free(w);
+		return KISSDB_ERROR_IO;
+	}
+	w->durability = durability;
+	w->interval_ms = interval_ms;
+	pthread_mutex_init(&w->lock,(const pthread_mutexattr_t *)0);
+	pthread_cond_init(&w->work,(const pthread_condattr_t *)0);
+	pthread_cond_init(&w->done,(const pthread_condattr_t *)0);
+	if (pthread_create(&w->thread,(const pthread_attr_t *)0,KISSDB_wal_thread,w)) {
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->work);
+		pthread_cond_destroy(&w->done);
+		close(w->fd);
+		free(w);
+		return KISSDB_ERROR_MALLOC;
+	}
+	db->wal = w;
+
+	return 0;
+}
+
+uint64_t KISSDB_wal_lsn(KISSDB *db)
+{
+	return db->wal ? db->wal->lsn : 0;
+}
+
+int KISSDB_wal_wait(KISSDB_WAL *wal,uint64_t lsn)
+{
+	int r = 0;
+
+	if ((!wal)||(wal->durability != KISSDB_WAL_SYNC_COMMIT))
+		return 0;
+	pthread_mutex_lock(&wal->lock);
+	while ((wal->durable < lsn)&&(!wal->error))
+		pthread_cond_wait(&wal->done,&wal->lock);
+	if (wal->durable < lsn)
+		r = KISSDB_ERROR_IO;
+	pthread_mutex_unlock(&wal->lock);
+
+	return r;
+}
+
+void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi)
+{
+	dbi->db = db;
+	dbi->h_no = 0;
+	dbi->h_idx = 0;
+	dbi->snap = (KISSDB_Snapshot *)0;
+}
+
+int KISSDB_Iterator_next_len(KISSDB_Iterator *dbi,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB *db = dbi->db;
+	KISSDB_Entry e;
+	uint64_t offset;
+	int r;
+
+	if ((dbi->snap)&&(dbi->snap->error))
+		return dbi->snap->error;
+	while ((dbi->h_no < db->num_hash_tables)&&(dbi->h_idx < db->hash_table_size)) {
+		while (!(offset = (dbi->snap) ? KISSDB_snapshot_entry(dbi->snap,dbi->h_no,dbi->h_idx) : KISSDB_table_entry(db,dbi->h_no,dbi->h_idx))) {
+			if (++dbi->h_idx >= db->hash_table_size) {
+				dbi->h_idx = 0;
+				if (++dbi->h_no >= db->num_hash_tables)
+					return 0;
+			}
+		}
+		if ((r = KISSDB_entry_at(db,offset,&e)))
+			return r;
+		if (e.deleted) {
+			if (++dbi->h_idx >= db->hash_table_size) {
+				dbi->h_idx = 0;
+				++dbi->h_no;
+			}
+			continue;
+		}
+		if (db->map) {
+			if ((e.voffset + e.vlen) > db->map_size)
+				return KISSDB_ERROR_IO;
+			memcpy(kbuf,db->map + e.koffset,e.klen);
+			memcpy(vbuf,db->map + e.voffset,e.vlen);
+		} else {
+			if (KISSDB_pread(db,kbuf,e.klen,e.koffset))
+				return KISSDB_ERROR_IO;
+			if (KISSDB_pread(db,vbuf,e.vlen,e.voffset))
+				return KISSDB_ERROR_IO;
+		}
+		if (klen)
+			*klen = e.klen;
+		if (vlen)
+			*vlen = e.vlen;
+		if (++dbi->h_idx >= db->hash_table_size) {
+			dbi->h_idx = 0;
+			++dbi->h_no;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
+{
+	unsigned long klen = 0,vlen = 0;
+	int r = KISSDB_Iterator_next_len(dbi,kbuf,&klen,vbuf,&vlen);
+	if (r > 0) {
+		if (klen < dbi->db->key_size)
+			memset(((uint8_t *)kbuf) + klen,0,dbi->db->key_size - klen);
+		if (vlen < dbi->db->value_size)
+			memset(((uint8_t *)vbuf) + vlen,0,dbi->db->value_size - vlen);
+	}
+	return r;
+}
+
+/* Start a scan of db, or of snap (whose view db is) if not NULL */
+static int KISSDB_scan_start(KISSDB *db,KISSDB_Snapshot *snap,KISSDB_Scan *s,const void *prefix,unsigned long prefix_len)
+{
+	unsigned long i,j;
+	uint64_t offset;
+
+	memset(s,0,sizeof(KISSDB_Scan));
+	s->db = db;
+	if (prefix_len > db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	if (!(s->offsets = malloc(sizeof(uint64_t) * ((db->num_hash_tables * db->hash_table_size) + 1))))
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;i<db->num_hash_tables;++i) {
+		for(j=0;j<db->hash_table_size;++j) {
+			offset = (snap) ? KISSDB_snapshot_entry(snap,i,j) : KISSDB_table_entry(db,i,j);
+			if (offset)
+				s->offsets[s->count++] = offset;
+		}
+	}
+	qsort(s->offsets,s->count,sizeof(uint64_t),KISSDB_offset_cmp);
+
+	if (prefix_len) {
+		if (!(s->prefix = malloc(prefix_len))) {
+			KISSDB_Scan_close(s);
+			return KISSDB_ERROR_MALLOC;
+		}
+		memcpy(s->prefix,prefix,prefix_len);
+		s->prefix_len = prefix_len;
+	}
+
+	/* a mapped file is read in place */
+	if (!db->map) {
+		s->buf_capacity = KISSDB_SCAN_CHUNK;
+		if (s->buf_capacity < (KISSDB_ENTRY_HEADER_SIZE + db->key_size + db->value_size))
+			s->buf_capacity = KISSDB_ENTRY_HEADER_SIZE + db->key_size + db->value_size;
+		if (!(s->buf = malloc(s->buf_capacity))) {
+			KISSDB_Scan_close(s);
+			return KISSDB_ERROR_MALLOC;
+		}
+	}
+
+	return 0;
+}
+
+int KISSDB_Scan_init(KISSDB *db,KISSDB_Scan *s,const void *prefix,unsigned long prefix_len)
+{
+	return KISSDB_scan_start(db,(KISSDB_Snapshot *)0,s,prefix,prefix_len);
+}
+
+/* Make sure bytes [offset,offset+len) are in the scan buffer and return
+ * a pointer to them. The buffer is refilled starting at offset, so with
+ * sorted offsets every byte of the file is read at most once. */
+static const uint8_t *KISSDB_scan_fetch(KISSDB_Scan *s,uint64_t offset,uint64_t len)
+{
+	KISSDB *db = s->db;
+	uint64_t n;
+
+	if ((offset + len) > db->file_size)
+		return (const uint8_t *)0;
+	if (db->map)
+		return ((offset + len) <= db->map_size) ? (db->map + offset) : (const uint8_t *)0;
+	if ((offset < s->buf_start)||((offset + len) > s->buf_end)) {
+		n = db->file_size - offset;
+		if (n > s->buf_capacity)
+			n = s->buf_capacity;
+		if (KISSDB_pread(db,s->buf,(size_t)n,offset))
+			return (const uint8_t *)0;
+		s->buf_start = offset;
+		s->buf_end = offset + n;
+	}
+	return s->buf + (offset - s->buf_start);
+}
+
+int KISSDB_Scan_next(KISSDB_Scan *s,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB *db = s->db;
+	KISSDB_Entry e;
+	const uint8_t *p;
+	uint64_t offset;
+	int r;
+
+	while (s->pos < s->count) {
+		offset = s->offsets[s->pos++];
+		if (db->version == KISSDB_VERSION_FIXED) {
+			e.koffset = offset;
+			e.klen = db->key_size;
+			e.voffset = offset + db->key_size;
+			e.vlen = db->value_size;
+			e.deleted = 0;
+		} else {
+			if (!(p = KISSDB_scan_fetch(s,offset,KISSDB_ENTRY_HEADER_SIZE)))
+				return KISSDB_ERROR_IO;
+			if ((r = KISSDB_entry_decode(db,offset,p,&e)))
+				return r;
+			if (e.deleted)
+				continue;
+		}
+		if (!(p = KISSDB_scan_fetch(s,offset,(e.voffset + e.vlen) - offset)))
+			return KISSDB_ERROR_IO;
+		if ((e.klen < s->prefix_len)||((s->prefix_len)&&(memcmp(p + (e.koffset - offset),s->prefix,s->prefix_len))))
+			continue;
+		memcpy(kbuf,p + (e.koffset - offset),e.klen);
+		memcpy(vbuf,p + (e.voffset - offset),e.vlen);
+		if (klen)
+			*klen = e.klen;
+		if (vlen)
+			*vlen = e.vlen;
+		return 1;
+	}
+
+	return 0;
+}
+
+void KISSDB_Scan_close(KISSDB_Scan *s)
+{
+	free(s->offsets);
+	free(s->buf);
+	free(s->prefix);
+	s->offsets = (uint64_t *)0;
+	s->buf = (uint8_t *)0;
+	s->prefix = (uint8_t *)0;
+	s->count = 0;
+	s->pos = 0;
+}
+
+int KISSDB_snapshot(KISSDB *db,KISSDB_Snapshot **snap)
+{
+	KISSDB_Snapshot *s;
+
+	/* the view would read through a descriptor sharing O_DIRECT */
+	if (db->pool)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (!(s = malloc(sizeof(KISSDB_Snapshot))))
+		return KISSDB_ERROR_MALLOC;
+	memset(s,0,sizeof(KISSDB_Snapshot));
+	if (!(s->pages = calloc(db->num_hash_tables + 1,sizeof(uint64_t *)))) {
+		free(s);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	/* the view is only ever used to read entries, through a descriptor
+	 * that keeps the file alive if a compaction replaces it */
+	s->view.hash_table_size = db->hash_table_size;
+	s->view.key_size = db->key_size;
+	s->view.value_size = db->value_size;
+	s->view.hash_table_size_bytes = db->hash_table_size_bytes;
+	s->view.num_hash_tables = db->num_hash_tables;
+	s->view.file_size = db->file_size;
+	s->view.live_bytes = db->live_bytes;
+	s->view.version = db->version;
+	s->view.hash_seed = db->hash_seed;
+	if ((s->view.fd = dup(db->fd)) < 0) {
+		free(s->pages);
+		free(s);
+		return KISSDB_ERROR_IO;
+	}
+
+	s->db = db;
+	s->next = db->snapshots;
+	db->snapshots = s;
+	*snap = s;
+	return 0;
+}
+
+void KISSDB_snapshot_release(KISSDB_Snapshot *snap)
+{
+	unsigned long p;
+
+	if (snap->db)
+		KISSDB_snapshot_unlink(snap);
+	for(p=0;p<snap->view.num_hash_tables;++p)
+		free(snap->pages[p]);
+	free(snap->pages);
+	close(snap->view.fd);
+	free(snap);
+}
+
+int KISSDB_snapshot_get(KISSDB_Snapshot *snap,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB *db = &snap->view;
+	KISSDB_Entry e;
+	uint64_t hash,bucket,offset;
+	const void *k = key;
+	void *kalloc = (void *)0;
+	unsigned long p;
+	int r = 1; /* not found */
+
+	if (snap->error)
+		return snap->error;
+	if (klen > db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (db->version == KISSDB_VERSION_FIXED) {
+		if (!(k = KISSDB_pad(key,klen,db->key_size,&kalloc)))
+			return KISSDB_ERROR_MALLOC;
+		klen = db->key_size;
+	}
+
+	/* no index for the past: walk the bucket's chain as the file has it,
+	 * unless the filter, which only ever gains keys, rules the key out */
+	hash = KISSDB_hash(db,k,klen);
+	if ((snap->db)&&(snap->db->bloom)&&(!KISSDB_bloom_test(snap->db->bloom,KISSDB_mix(hash)))) {
+		free(kalloc);
+		return 1; /* not found */
+	}
+	bucket = hash % (uint64_t)db->hash_table_size;
+	for(p=0;p<db->num_hash_tables;++p) {
+		if (!(offset = KISSDB_snapshot_entry(snap,p,(unsigned long)bucket)))
+			break;
+		if ((r = KISSDB_entry_match(db,offset,k,klen,&e)) < 0)
+			break;
+		if (r) {
+			if (e.deleted)
+				r = 1; /* not found */
+			else if (KISSDB_pread(db,vbuf,e.vlen,e.voffset))
+				r = KISSDB_ERROR_IO;
+			else {
+				if (vlen)
+					*vlen = e.vlen;
+				r = 0;
+			}
+			break;
+		}
+		r = 1;
+	}
+	free(kalloc);
+	return r;
+}
+
+void KISSDB_snapshot_iterator_init(KISSDB_Snapshot *snap,KISSDB_Iterator *dbi)
+{
+	KISSDB_Iterator_init(&snap->view,dbi);
+	dbi->snap = snap;
+}
+
+int KISSDB_snapshot_scan_init(KISSDB_Snapshot *snap,KISSDB_Scan *s,const void *prefix,unsigned long prefix_len)
+{
+	if (snap->error)
+		return snap->error;
+	return KISSDB_scan_start(&snap->view,snap,s,prefix,prefix_len);
+}
+
+/* Copy every live entry of db, or of snap (whose view db is) if not
+ * NULL, into the new file, in file order so the old one is read
+ * sequentially */
+static int KISSDB_compact_copy_from(KISSDB_Compaction *c,KISSDB *db,KISSDB_Snapshot *snap)
+{
+	KISSDB_Scan scan;
+	uint8_t *kbuf,*vbuf;
+	unsigned long klen,vlen;
+	int r;
+
+	kbuf = malloc(db->key_size);
+	vbuf = malloc(db->value_size);
+	if ((!kbuf)||(!vbuf)) {
+		free(kbuf);
+		free(vbuf);
+		return KISSDB_ERROR_MALLOC;
+	}
+	if (!(r = KISSDB_scan_start(db,snap,&scan,(const void *)0,0))) {
+		while ((r = KISSDB_Scan_next(&scan,kbuf,&klen,vbuf,&vlen)) > 0) {
+			if ((r = KISSDB_put_len(&c->db,kbuf,klen,vbuf,vlen)))
+				break;
+		}
+	}
+	KISSDB_Scan_close(&scan);
+	free(kbuf);
+	free(vbuf);
+	return r;
+}
+
+int KISSDB_compact_begin(KISSDB *db,KISSDB_Compaction *c)
+{
+	int r;
+
+	/* the other processes would be left with the old file */
+	if ((!db->path)||(db->shared))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (!(c->path = malloc(strlen(db->path) + sizeof(KISSDB_COMPACT_SUFFIX))))
+		return KISSDB_ERROR_MALLOC;
+	strcpy(c->path,db->path);
+	strcat(c->path,KISSDB_COMPACT_SUFFIX);
+
+	if ((r = KISSDB_open(&c->db,c->path,KISSDB_OPEN_MODE_RWREPLACE|((db->version == KISSDB_VERSION_FIXED) ? 0 : KISSDB_OPEN_FLAG_VARLEN)|((db->version == KISSDB_VERSION_INLINE) ? KISSDB_OPEN_FLAG_INLINE : 0)|(db->flags & (KISSDB_OPEN_FLAG_COMPACT_TABLES|KISSDB_OPEN_FLAG_HUGEPAGES)),db->hash_table_size,db->key_size,db->value_size))) {
+		free(c->path);
+		return r;
+	}
+	/* the copy takes over db's path, and its index checkpoint, only
+	 * once it replaces the database */
+	free(c->db.path);
+	c->db.path = (char *)0;
+
+	/* from here on every put or delete leaves a new offset behind, at or
+	 * past c->end, for KISSDB_compact_finish() to pick up */
+	c->end = db->file_size;
+	c->snap = (KISSDB_Snapshot *)0;
+	db->compacting = 1;
+
+	/* the copy is made later from a private snapshot, which has no need
+	 * of db; with direct I/O there is none, so it is made here */
+	if (db->pool)
+		r = KISSDB_compact_copy_from(c,db,(KISSDB_Snapshot *)0);
+	else if (!(r = KISSDB_snapshot(db,&c->snap)))
+		r = KISSDB_snapshot_detach(c->snap);
+	if (r) {
+		KISSDB_compact_abort(db,c);
+		return r;
+	}
+
+	return 0;
+}
+
+int KISSDB_compact_copy(KISSDB_Compaction *c)
+{
+	int r;
+
+	if (!c->snap)
+		return 0;
+	r = KISSDB_compact_copy_from(c,&c->snap->view,c->snap);
+	KISSDB_snapshot_release(c->snap);
+	c->snap = (KISSDB_Snapshot *)0;
+	return r;
+}
+
+int KISSDB_compact_finish(KISSDB *db,KISSDB_Compaction *c)
+{
+	KISSDB_Entry e;
+	KISSDB_WAL *wal;
+	KISSDB_Cache *cache;
+	KISSDB_Bloom *bloom;
+	KISSDB_Counters counters;
+	uint64_t offset,pool_bytes;
+	unsigned long i;
+	uint8_t *kbuf,*vbuf;
+	char *path;
+	int flags;
+	int r = 0;
+
+	if ((r = KISSDB_compact_copy(c))) {
+		KISSDB_compact_abort(db,c);
+		return r;
+	}
+	kbuf = malloc(db->key_size);
+	vbuf = malloc(db->value_size);
+	if ((!kbuf)||(!vbuf)) {
+		free(kbuf);
+		free(vbuf);
+		KISSDB_compact_abort(db,c);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	/* carry over whatever changed while the copy was being made */
+	for(i=0;i<(db->hash_table_size + 1) * db->num_hash_tables;++i) {
+		if ((i % (db->hash_table_size + 1)) == db->hash_table_size)
+			continue;
+		if ((offset = KISSDB_table_entry(db,i / (db->hash_table_size + 1),i % (db->hash_table_size + 1))) < c->end)
+			continue;
+		if ((r = KISSDB_entry_at(db,offset,&e)))
+			break;
+		if (KISSDB_pread(db,kbuf,e.klen,e.koffset)) {
+			r = KISSDB_ERROR_IO;
+			break;
+		}
+		if (e.deleted) {
+			if ((r = KISSDB_delete(&c->db,kbuf,e.klen)) == 1)
+				r = 0;
+		} else if (KISSDB_pread(db,vbuf,e.vlen,e.voffset))
+			r = KISSDB_ERROR_IO;
+		else r = KISSDB_put_len(&c->db,kbuf,e.klen,vbuf,e.vlen);
+		if (r)
+			break;
+	}
+	free(kbuf);
+	free(vbuf);
+	if ((!r)&&(fsync(c->db.fd)))
+		r = KISSDB_ERROR_IO;
+	if ((!r)&&(rename(c->path,db->path)))
+		r = KISSDB_ERROR_IO;
+	if (r) {
+		KISSDB_compact_abort(db,c);
+		return r;
+	}
+
+	/* the new file is in place; take over its state. It already holds
+	 * everything in the log, so the log carries over empty; cached
+	 * values are the same in both files. The Bloom filter is rebuilt
+	 * without the deleted keys, or kept as it is if that fails. A buffer
+	 * pool is written back to the old file and a new one set up. */
+	pool_bytes = (db->pool) ? (uint64_t)db->pool->num_frames * KISSDB_POOL_PAGE_SIZE : 0;
+	path = db->path;
+	flags = db->flags;
+	wal = db->wal;
+	cache = db->cache;
+	bloom = db->bloom;
+	memset(&counters,0,sizeof(KISSDB_Counters));
+	KISSDB_counters_add(&counters,&db->counters);
+	db->path = (char *)0;
+	db->wal = (KISSDB_WAL *)0;
+	db->cache = (KISSDB_Cache *)0;
+	db->bloom = (KISSDB_Bloom *)0;
+	KISSDB_close(db);
+	*db = c->db;
+	KISSDB_counters_add(&db->counters,&counters);
+	free(db->path);
+	db->path = path;
+	db->flags = flags;
+	db->cache = cache;
+	if ((db->bloom = bloom)) {
+		KISSDB_bloom_build(db,bloom);
+		bloom->file_size = 0;
+	}
+	free(c->path);
+	if (wal) {
+		db->wal = wal;
+		if ((r = KISSDB_wal_reset(wal)))
+			return r;
+	}
+	if (pool_bytes)
+		return KISSDB_direct_enable(db,pool_bytes);
+
+	if ((flags & KISSDB_OPEN_FLAG_MMAP))
+		return KISSDB_remap(db,db->file_size);
+
+	return 0;
+}
+
+void KISSDB_compact_abort(KISSDB *db,KISSDB_Compaction *c)
+{
+	if (c->snap)
+		KISSDB_snapshot_release(c->snap);
+	c->snap = (KISSDB_Snapshot *)0;
+	KISSDB_close(&c->db);
+	unlink(c->path);
+	free(c->path);
+	db->compacting = 0;
+}
+
+int KISSDB_compact(KISSDB *db)
+{
+	KISSDB_Compaction c;
+	int r;
+
+	if ((r = KISSDB_compact_begin(db,&c)))
+		return r;
+	return KISSDB_compact_finish(db,&c);
+}
+
+/* Sequential writer for bulk builds: bytes are gathered in buf and
+ * written out at offset a whole buffer at a time, optionally keeping a
+ * running CRC-32 of everything written */
+typedef struct {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	uint64_t offset;
+	uint32_t crc;
+	int with_crc;
+} KISSDB_Bulk_Writer;
+
+static int KISSDB_bulk_flush(KISSDB_Bulk_Writer *w)
+{
+	if (!w->len)
+		return 0;
+	if (w->with_crc)
+		w->crc = KISSDB_crc32(w->crc,w->buf,(unsigned long)w->len);
+	if (KISSDB_wal_write(w->fd,w->buf,w->len,w->offset))
+		return KISSDB_ERROR_IO;
+	w->offset += (uint64_t)w->len;
+	w->len = 0;
+	return 0;
+}
+
+static int KISSDB_bulk_write(KISSDB_Bulk_Writer *w,const void *b,size_t len)
+{
+	size_t n;
+	while (len) {
+		if (w->len == KISSDB_BULK_BUFFER) {
+			if (KISSDB_bulk_flush(w))
+				return KISSDB_ERROR_IO;
+		}
+		n = KISSDB_BULK_BUFFER - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->len,b,n);
+		w->len += n;
+		b = (const void *)(((const uint8_t *)b) + n);
+		len -= n;
+	}
+	return 0;
+}
+
+struct KISSDB_Bulk {
+	KISSDB db; /* header fields, and fd and file_size for reading back keys */
+	char *path;
+	char *bulk_path;
+	KISSDB_Bulk_Writer out;
+	uint8_t *kpad,*vpad; /* version 2 entries are padded to full size */
+	uint64_t *records; /* [entry offset][key hash] pairs, in file order */
+	uint64_t count;
+	uint64_t capacity;
+	int error;
+};
+
+int KISSDB_bulk_begin(KISSDB_Bulk **b,const char *path,int flags,uint64_t expected_entries,unsigned long key_size,unsigned long value_size)
+{
+	uint8_t hdr[KISSDB_HEADER_SIZE_SEEDED];
+	uint64_t tmp,m;
+	KISSDB_Bulk *bk;
+
+	if ((!key_size)||(!value_size))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (((flags & KISSDB_OPEN_FLAG_VARLEN))&&((key_size > 0xffffffffUL)||(value_size > 0xffffffffUL)))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (!(bk = calloc(1,sizeof(KISSDB_Bulk))))
+		return KISSDB_ERROR_MALLOC;
+
+	m = expected_entries / KISSDB_BULK_LOAD;
+	if (m < KISSDB_BULK_MIN_BUCKETS)
+		m = KISSDB_BULK_MIN_BUCKETS;
+	bk->db.version = (flags & KISSDB_OPEN_FLAG_VARLEN) ? KISSDB_VERSION : KISSDB_VERSION_FIXED;
+	bk->db.hash_table_size = (unsigned long)m;
+	bk->db.hash_table_size_bytes = sizeof(uint64_t) * (bk->db.hash_table_size + 1);
+	bk->db.key_size = key_size;
+	bk->db.value_size = value_size;
+	if (bk->db.version >= KISSDB_VERSION_SEEDED)
+		bk->db.hash_seed = KISSDB_new_seed();
+	bk->out.fd = -1;
+
+	bk->capacity = (expected_entries < 1024) ? 1024 : expected_entries;
+	if (bk->capacity > 0xffffffffULL)
+		bk->capacity = 0xffffffffULL;
+	bk->path = strdup(path);
+	bk->bulk_path = malloc(strlen(path) + sizeof(KISSDB_BULK_SUFFIX));
+	bk->out.buf = malloc(KISSDB_BULK_BUFFER);
+	bk->records = malloc((size_t)bk->capacity * sizeof(uint64_t) * 2);
+	if (bk->db.version == KISSDB_VERSION_FIXED) {
+		bk->kpad = malloc(key_size);
+		bk->vpad = malloc(value_size);
+	}
+	if ((!bk->path)||(!bk->bulk_path)||(!bk->out.buf)||(!bk->records)||((bk->db.version == KISSDB_VERSION_FIXED)&&((!bk->kpad)||(!bk->vpad)))) {
+		KISSDB_bulk_abort(bk);
+		return KISSDB_ERROR_MALLOC;
+	}
+	strcpy(bk->bulk_path,path);
+	strcat(bk->bulk_path,KISSDB_BULK_SUFFIX);
+
+	if ((bk->out.fd = open(bk->bulk_path,O_RDWR|O_CREAT|O_TRUNC,0644)) < 0) {
+		KISSDB_bulk_abort(bk);
+		return KISSDB_ERROR_IO;
+	}
+	bk->db.fd = bk->out.fd;
+
+	/* page 0 has to follow the header, so the entries start after room
+	 * for it and it is filled in by KISSDB_bulk_finish() */
+	hdr[0] = 'K'; hdr[1] = 'd'; hdr[2] = 'B'; hdr[3] = (uint8_t)bk->db.version;
+	tmp = bk->db.hash_table_size;
+	memcpy(hdr + 4,&tmp,sizeof(uint64_t));
+	tmp = key_size;
+	memcpy(hdr + 12,&tmp,sizeof(uint64_t));
+	tmp = value_size;
+	memcpy(hdr + 20,&tmp,sizeof(uint64_t));
+	if (bk->db.version >= KISSDB_VERSION_SEEDED)
+		memcpy(hdr + KISSDB_HEADER_SIZE,&bk->db.hash_seed,sizeof(uint64_t));
+	if (KISSDB_wal_write(bk->out.fd,hdr,KISSDB_HEADER_SIZE_OF(&bk->db),0)) {
+		KISSDB_bulk_abort(bk);
+		return KISSDB_ERROR_IO;
+	}
+	bk->out.offset = KISSDB_HEADER_SIZE_OF(&bk->db) + bk->db.hash_table_size_bytes;
+
+	*b = bk;
+	return 0;
+}
+
+int KISSDB_bulk_add(KISSDB_Bulk *b,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	struct iovec iov[3];
+	uint32_t hdr[2];
+	uint64_t *rea;
+	int i,n;
+
+	if (b->error)
+		return b->error;
+	if ((klen > b->db.key_size)||(vlen > b->db.value_size))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (b->db.version == KISSDB_VERSION_FIXED) {
+		memcpy(b->kpad,key,klen);
+		memset(b->kpad + klen,0,b->db.key_size - klen);
+		memcpy(b->vpad,value,vlen);
+		memset(b->vpad + vlen,0,b->db.value_size - vlen);
+		key = b->kpad;
+		klen = b->db.key_size;
+		value = b->vpad;
+		vlen = b->db.value_size;
+	}
+
+	if (b->count == b->capacity) {
+		if (b->capacity == 0xffffffffULL)
+			return (b->error = KISSDB_ERROR_INVALID_PARAMETERS);
+		b->capacity = ((b->capacity * 2) > 0xffffffffULL) ? 0xffffffffULL : (b->capacity * 2);
+		if (!(rea = realloc(b->records,(size_t)b->capacity * sizeof(uint64_t) * 2)))
+			return (b->error = KISSDB_ERROR_MALLOC);
+		b->records = rea;
+	}
+	b->records[b->count * 2] = b->out.offset + (uint64_t)b->out.len;
+	b->records[(b->count * 2) + 1] = KISSDB_hash(&b->db,key,klen);
+	++b->count;
+
+	n = KISSDB_entry_iov(&b->db,iov,hdr,key,klen,value,vlen);
+	for(i=0;i<n;++i) {
+		if (KISSDB_bulk_write(&b->out,iov[i].iov_base,iov[i].iov_len))
+			return (b->error = KISSDB_ERROR_IO);
+	}
+	return 0;
+}
+
+int KISSDB_bulk_finish(KISSDB_Bulk *b)
+{
+	KISSDB_Bulk_Writer idx;
+	KISSDB_Entry e;
+	struct stat st;
+	uint64_t h[10];
+	uint64_t *start = (uint64_t *)0;
+	uint64_t *page = (uint64_t *)0;
+	uint64_t *offsets = (uint64_t *)0;
+	uint32_t *order = (uint32_t *)0;
+	uint32_t *depth = (uint32_t *)0;
+	uint8_t *dead = (uint8_t *)0;
+	uint8_t *kbuf = (uint8_t *)0;
+	uint32_t v;
+	uint64_t data_end,live_bytes,live,bucket,i,j,d,p,num_pages,o;
+	uint64_t m = b->db.hash_table_size;
+	char *idx_path = (char *)0;
+	char *tmp_path = (char *)0;
+	char *old_path;
+	int r;
+
+	memset(&idx,0,sizeof(idx));
+	idx.fd = -1;
+	if ((r = b->error))
+		goto bulk_finish_out;
+	r = KISSDB_ERROR_IO;
+	if (KISSDB_bulk_flush(&b->out))
+		goto bulk_finish_out;
+	data_end = b->out.offset;
+	b->db.file_size = data_end;
+
+	/* group the entries by bucket, keeping them in file order within each */
+	r = KISSDB_ERROR_MALLOC;
+	start = calloc((size_t)m + 1,sizeof(uint64_t));
+	depth = calloc((size_t)m,sizeof(uint32_t));
+	order = malloc(((size_t)b->count + 1) * sizeof(uint32_t));
+	dead = calloc(((size_t)b->count / 8) + 1,1);
+	kbuf = malloc(b->db.key_size);
+	page = malloc(b->db.hash_table_size_bytes);
+	if ((!start)||(!depth)||(!order)||(!dead)||(!kbuf)||(!page))
+		goto bulk_finish_out;
+	for(i=0;i<b->count;++i)
+		++start[(b->records[(i * 2) + 1] % m) + 1];
+	for(i=0;i<m;++i)
+		start[i + 1] += start[i];
+	for(i=0;i<b->count;++i) {
+		bucket = b->records[(i * 2) + 1] % m;
+		order[start[bucket] + depth[bucket]++] = (uint32_t)i;
+	}
+
+	/* a key added again replaces the earlier entry in its slot; the live
+	 * entries of each bucket are packed at the front of its range */
+	live_bytes = data_end - (KISSDB_HEADER_SIZE_OF(&b->db) + b->db.hash_table_size_bytes);
+	live = b->count;
+	num_pages = 1;
+	for(bucket=0;bucket<m;++bucket) {
+		d = 0;
+		for(i=start[bucket];i<start[bucket + 1];++i) {
+			o = order[i];
+			for(j=0;j<d;++j) {
+				if (b->records[(order[start[bucket] + j] * 2) + 1] != b->records[(o * 2) + 1])
+					continue;
+				r = KISSDB_ERROR_IO;
+				if ((KISSDB_entry_at(&b->db,b->records[o * 2],&e))||(KISSDB_pread(&b->db,kbuf,e.klen,e.koffset)))
+					goto bulk_finish_out;
+				if ((r = KISSDB_entry_match(&b->db,b->records[order[start[bucket] + j] * 2],kbuf,e.klen,&e)) < 0)
+					goto bulk_finish_out;
+				if (r)
+					break;
+			}
+			if (j < d) {
+				p = order[start[bucket] + j];
+				dead[p / 8] |= (uint8_t)(1 << (p % 8));
+				live_bytes -= ((p + 1) < b->count) ? (b->records[(p + 1) * 2] - b->records[p * 2]) : (data_end - b->records[p * 2]);
+				--live;
+				order[start[bucket] + j] = (uint32_t)o;
+			} else order[start[bucket] + d++] = (uint32_t)o;
+		}
+		depth[bucket] = (uint32_t)d;
+		if (d > num_pages)
+			num_pages = d;
+	}
+
+	/* page 0 goes in the room left after the header and the others are
+	 * appended after the entries; each is also streamed into the index
+	 * checkpoint, so opening the database reads no keys */
+	r = KISSDB_ERROR_MALLOC;
+	idx_path = KISSDB_sidecar_path(b->path,KISSDB_IDX_SUFFIX);
+	tmp_path = KISSDB_sidecar_path(b->path,KISSDB_IDX_SUFFIX);
+	offsets = malloc((size_t)num_pages * sizeof(uint64_t));
+	idx.buf = malloc(KISSDB_BULK_BUFFER);
+	if ((!idx_path)||(!tmp_path)||(!offsets)||(!idx.buf))
+		goto bulk_finish_out;
+	strcat(tmp_path,KISSDB_SIDECAR_TMP_SUFFIX);
+	r = KISSDB_ERROR_IO;
+	if ((idx.fd = open(tmp_path,O_WRONLY|O_CREAT|O_TRUNC,0644)) < 0)
+		goto bulk_finish_out;
+	if (fstat(b->out.fd,&st))
+		goto bulk_finish_out;
+	idx.with_crc = 1;
+
+	offsets[0] = KISSDB_HEADER_SIZE_OF(&b->db);
+	for(p=1;p<num_pages;++p)
+		offsets[p] = data_end + ((p - 1) * b->db.hash_table_size_bytes);
+	h[0] = (uint64_t)b->db.version;
+	h[1] = m;
+	h[2] = b->db.key_size;
+	h[3] = b->db.value_size;
+	h[4] = b->db.hash_seed;
+	h[5] = data_end + ((num_pages - 1) * b->db.hash_table_size_bytes);
+	h[6] = (uint64_t)st.st_ino;
+	h[7] = num_pages;
+	h[8] = live_bytes;
+	h[9] = live;
+	memcpy(idx.buf,"KdBI",4);
+	v = KISSDB_IDX_VERSION;
+	memcpy(idx.buf + 4,&v,sizeof(uint32_t));
+	idx.len = KISSDB_SIDECAR_HEADER_SIZE;
+	if ((KISSDB_bulk_write(&idx,h,sizeof(h)))||(KISSDB_bulk_write(&idx,offsets,(size_t)num_pages * sizeof(uint64_t))))
+		goto bulk_finish_out;
+
+	for(p=0;p<num_pages;++p) {
+		for(bucket=0;bucket<m;++bucket)
+			page[bucket] = (p < depth[bucket]) ? b->records[order[start[bucket] + p] * 2] : 0;
+		page[m] = ((p + 1) < num_pages) ? offsets[p + 1] : 0;
+		if (p) {
+			if (KISSDB_bulk_write(&b->out,page,b->db.hash_table_size_bytes))
+				goto bulk_finish_out;
+		} else if (KISSDB_wal_write(b->out.fd,(const uint8_t *)page,b->db.hash_table_size_bytes,offsets[0]))
+			goto bulk_finish_out;
+		if (KISSDB_bulk_write(&idx,page,b->db.hash_table_size_bytes))
+			goto bulk_finish_out;
+	}
+	for(i=0;i<b->count;++i) {
+		if ((dead[i / 8] & (1 << (i % 8))))
+			continue;
+		o = KISSDB_mix(b->records[(i * 2) + 1]);
+		if ((KISSDB_bulk_write(&idx,&b->records[i * 2],sizeof(uint64_t)))||(KISSDB_bulk_write(&idx,&o,sizeof(uint64_t))))
+			goto bulk_finish_out;
+	}
+	if ((KISSDB_bulk_flush(&b->out))||(KISSDB_bulk_flush(&idx)))
+		goto bulk_finish_out;
+	if (KISSDB_wal_write(idx.fd,(const uint8_t *)&idx.crc,sizeof(uint32_t),idx.offset))
+		goto bulk_finish_out;
+	if ((fdatasync(b->out.fd))||(fdatasync(idx.fd)))
+		goto bulk_finish_out;
+
+	/* whatever was kept next to an old database at path belongs to it;
+	 * its log in particular must not be replayed onto the new file */
+	if ((old_path = KISSDB_wal_path(b->path))) {
+		unlink(old_path);
+		free(old_path);
+	}
+	if ((old_path = KISSDB_sidecar_path(b->path,KISSDB_BLOOM_SUFFIX))) {
+		unlink(old_path);
+		free(old_path);
+	}
+	if (rename(b->bulk_path,b->path))
+		goto bulk_finish_out;
+	if (rename(tmp_path,idx_path)) {
+		unlink(idx_path);
+		unlink(tmp_path);
+	}
+	r = 0;
+
+bulk_finish_out:
+	if (idx.fd >= 0) {
+		close(idx.fd);
+		if (r)
+			unlink(tmp_path);
+	}
+	free(idx.buf);
+	free(idx_path);
+	free(tmp_path);
+	free(offsets);
+	free(page);
+	free(kbuf);
+	free(dead);
+	free(order);
+	free(depth);
+	free(start);
+	if (!r)
+		b->bulk_path[0] = '\0'; /* renamed into place: keep it */
+	KISSDB_bulk_abort(b);
+	return r;
+}
+
+void KISSDB_bulk_abort(KISSDB_Bulk *b)
+{
+	if (b->out.fd >= 0) {
+		close(b->out.fd);
+		if ((b->bulk_path)&&(b->bulk_path[0]))
+			unlink(b->bulk_path);
+	}
+	free(b->path);
+	free(b->bulk_path);
+	free(b->out.buf);
+	free(b->records);
+	free(b->kpad);
+	free(b->vpad);
+	free(b);
+}
+
+int KISSDB_bulk_build(const char *path,int flags,uint64_t expected_entries,unsigned long key_size,unsigned long value_size,KISSDB_Bulk_Next next,void *arg)
+{
+	KISSDB_Bulk *b;
+	const void *key,*value;
+	unsigned long klen,vlen;
+	int r;
+
+	if ((r = KISSDB_bulk_begin(&b,path,flags,expected_entries,key_size,value_size)))
+		return r;
+	while ((r = next(arg,&key,&klen,&value,&vlen)) > 0) {
+		if ((r = KISSDB_bulk_add(b,key,klen,value,vlen)))
+			break;
+	}
+	if (r) {
+		KISSDB_bulk_abort(b);
+		return r;
+	}
+	return KISSDB_bulk_finish(b);
+}
+
+#ifdef KISSDB_TEST
+
+#include <inttypes.h>
+#include <sys/wait.h>
+
+static void *KISSDB_test_reader(void *arg)
+{
+	KISSDB *db = (KISSDB *)arg;
+	uint64_t i,j;
+	uint64_t v[8];
+
+	for(i=0;i<10000;++i) {
+		if (KISSDB_get(db,&i,v))
+			return (void *)1;
+		for(j=0;j<8;++j) {
+			if (v[j] != i)
+				return (void *)1;
+		}
+	}
+	return (void *)0;
+}
+
+static pthread_mutex_t KISSDB_test_lock = PTHREAD_MUTEX_INITIALIZER;
+static KISSDB *KISSDB_test_db;
+
+/* Put 1000 keys of its own, waiting for each commit outside the lock */
+static void *KISSDB_test_writer(void *arg)
+{
+	uint64_t i,lsn;
+	char kbuf[64];
+	unsigned long klen;
+	int r;
+
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"wal.%"PRIu64,(uint64_t)(uintptr_t)arg * 1000 + i);
+		pthread_mutex_lock(&KISSDB_test_lock);
+		r = KISSDB_put_len(KISSDB_test_db,kbuf,klen,kbuf,klen);
+		lsn = KISSDB_wal_lsn(KISSDB_test_db);
+		pthread_mutex_unlock(&KISSDB_test_lock);
+		if ((r)||(KISSDB_wal_wait(KISSDB_test_db->wal,lsn)))
+			return (void *)1;
+	}
+	return (void *)0;
+}
+
+/* Copy a compaction's snapshot while the test goes on writing */
+static void *KISSDB_test_compact_copy(void *arg)
+{
+	return (KISSDB_compact_copy((KISSDB_Compaction *)arg)) ? (void *)1 : (void *)0;
+}
+
+/* Entries for KISSDB_bulk_build(): 20000 keys, the first 1000 of them
+ * twice with a different value the second time */
+typedef struct {
+	uint64_t i;
+	char kbuf[64],vbuf[64];
+} KISSDB_Test_Bulk;
+
+static int KISSDB_test_bulk_next(void *arg,const void **key,unsigned long *klen,const void **value,unsigned long *vlen)
+{
+	KISSDB_Test_Bulk *t = (KISSDB_Test_Bulk *)arg;
+	uint64_t k;
+
+	if (t->i == 21000)
+		return 0;
+	k = (t->i < 20000) ? t->i : (t->i - 20000);
+	*klen = (unsigned long)snprintf(t->kbuf,sizeof(t->kbuf),"bulk.%"PRIu64,k);
+	*vlen = (unsigned long)snprintf(t->vbuf,sizeof(t->vbuf),"%"PRIu64".%s",(t->i < 20000) ? k : (k * 3),t->kbuf);
+	*key = t->kbuf;
+	*value = t->vbuf;
+	++t->i;
+	return 1;
+}
+
+int main(int argc,char **argv)
+{
+	uint64_t i,j;
+	uint64_t v[8];
+	KISSDB db;
+	KISSDB_Iterator dbi;
+	KISSDB_Scan scan;
+	KISSDB_Snapshot *snap;
+	const void *vref;
+	pthread_t readers[4];
+	void *tret;
+	char got_all_values[10000];
+	char kbuf[64],vbuf[64],vexp[64];
+	KISSDB_Compaction comp;
+	uint64_t dead;
+	unsigned long klen,vlen;
+	char many_kbuf[64][64],many_vbuf[64][64],many_gbuf[64][64];
+	const void *many_keys[64],*many_values[64];
+	void *many_gbufs[64];
+	unsigned long many_klen[64],many_vlen[64];
+	int many_results[64];
+	KISSDB_Cache_Stats cst;
+	KISSDB_Pool_Stats pst;
+	struct stat st;
+	FILE *f;
+	char *ckbuf;
+	size_t cklen;
+	KISSDB_Bulk *bulk;
+	KISSDB_Test_Bulk bulk_src;
+	KISSDB_Stats dst,rst;
+	uint64_t page_entries[64];
+	KISSDB rdb;
+	int q,r;
+
+	printf("Opening new empty database test.db...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+
+	printf("Adding and then re-getting 10000 64-byte values...\n");
+
+	for(i=0;i<10000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = i;
+		if (KISSDB_put(&db,&i,v)) {
+			printf("KISSDB_put failed (%"PRIu64")\n",i);
+			return 1;
+		}
+		memset(v,0,sizeof(v));
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (1) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i) {
+				printf("KISSDB_get (1) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	printf("Getting 10000 64-byte values...\n");
+
+	for(i=0;i<10000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (2) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i) {
+				printf("KISSDB_get (2) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	printf("Closing and re-opening database in read-only mode...\n");
+
+	KISSDB_close(&db);
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,1024,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+
+	printf("Getting 10000 64-byte values...\n");
+
+	for(i=0;i<10000;++i) {
+		if ((q = KISSDB_get(&db,&i,v))) {
+			printf("KISSDB_get (3) failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != i) {
+				printf("KISSDB_get (3) failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+
+	printf("Getting 10000 64-byte values from 4 threads at once, through a cache...\n");
+
+	if (KISSDB_cache_enable(&db,65536)) {
+		printf("KISSDB_cache_enable failed\n");
+		return 1;
+	}
+
+	for(j=0;j<4;++j)
+		pthread_create(&readers[j],NULL,KISSDB_test_reader,&db);
+	q = 0;
+	for(j=0;j<4;++j) {
+		pthread_join(readers[j],&tret);
+		if (tret)
+			q = 1;
+	}
+	if (q) {
+		printf("concurrent KISSDB_get failed\n");
+		return 1;
+	}
+
+	printf("Iterator test...\n");
+
+	KISSDB_Iterator_init(&db,&dbi);
+	i = 0xdeadbeef;
+	memset(got_all_values,0,sizeof(got_all_values));
+	while (KISSDB_Iterator_next(&dbi,&i,&v) > 0) {
+		if (i < 10000)
+			got_all_values[i] = 1;
+		else {
+			printf("KISSDB_Iterator_next failed, bad data (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<10000;++i) {
+		if (!got_all_values[i]) {
+			printf("KISSDB_Iterator failed, missing value index %"PRIu64"\n",i);
+			return 1;
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Re-opening database mapped, adding 10000 more values...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR|KISSDB_OPEN_FLAG_MMAP,1024,8,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=10000;i<20000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = i;
+		if (KISSDB_put(&db,&i,v)) {
+			printf("KISSDB_put failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<20000;++i) {
+		if ((q = KISSDB_get_ref(&db,&i,&vref))) {
+			printf("KISSDB_get_ref failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (((const uint64_t *)vref)[j] != i) {
+				printf("KISSDB_get_ref failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+	i = 20000;
+	if (KISSDB_get_ref(&db,&i,&vref) != 1) {
+		printf("KISSDB_get_ref found nonexistent key\n");
+		return 1;
+	}
+
+	KISSDB_close(&db);
+
+	printf("Version 3 (unseeded) file: adding and re-getting 1000 values...\n");
+
+	if (!(f = fopen("test.db","wb"))) {
+		printf("fopen failed\n");
+		return 1;
+	}
+	fwrite("KdB\003",1,4,f);
+	j = 1024;
+	fwrite(&j,sizeof(uint64_t),1,f);
+	j = 64;
+	fwrite(&j,sizeof(uint64_t),1,f);
+	fwrite(&j,sizeof(uint64_t),1,f);
+	fclose(f);
+	for(q=0;q<2;++q) {
+		if (KISSDB_open(&db,"test.db",q ? KISSDB_OPEN_MODE_RDONLY : KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+			printf("KISSDB_open failed\n");
+			return 1;
+		}
+		if (db.version != KISSDB_VERSION_VARLEN_DJB2) {
+			printf("KISSDB_open changed the file format\n");
+			return 1;
+		}
+		for(i=0;i<1000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+			if ((!q)&&(KISSDB_put_len(&db,kbuf,klen,kbuf,klen))) {
+				printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+				return 1;
+			}
+			if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+				printf("KISSDB_get_len failed (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+		KISSDB_close(&db);
+	}
+
+	printf("Variable-length entries: adding, overwriting and re-getting 10000 values...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_VARLEN,1024,64,64)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if ((db.version != KISSDB_VERSION)||(!db.hash_seed)) {
+		printf("KISSDB_open did not create a seeded database\n");
+		return 1;
+	}
+	/* keys whose first word is a constant of the hash must still depend
+	 * on the rest of the key and on the seed */
+	v[0] = KISSDB_WYP1;
+	for(i=0;i<16;++i) {
+		v[1] = i;
+		v[2] = 0x5353535353535353ULL;
+		v[3 + (i & 3)] = KISSDB_hash_seeded(v,24,db.hash_seed);
+		if (((i & 3) == 3)&&((v[3] == v[4])||(v[3] == v[5])||(v[3] == v[6])||(v[4] == v[5])||(v[4] == v[6])||(v[5] == v[6]))) {
+			printf("KISSDB_hash_seeded collides on keys starting with a hash constant\n");
+			return 1;
+		}
+		if (KISSDB_hash_seeded(v,24,db.hash_seed) == KISSDB_hash_seeded(v,24,db.hash_seed ^ (1ULL << i))) {
+			printf("KISSDB_hash_seeded ignores the seed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64,i * 7);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<10000;i+=3) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"-overwritten",i);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len (overwrite) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if ((i % 3) == 0)
+			snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i);
+		else snprintf(vexp,sizeof(vexp),"%"PRIu64,i * 7);
+		memset(vbuf,0,sizeof(vbuf));
+		if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))) {
+			printf("KISSDB_get_len failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		if ((vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) {
+			printf("KISSDB_get_len failed, bad data (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_get_len(&db,"station.",8,vbuf,&vlen) != 1) {
+		printf("KISSDB_get_len found nonexistent key\n");
+		return 1;
+	}
+	KISSDB_Iterator_init(&db,&dbi);
+	j = 0;
+	while ((q = KISSDB_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen)) > 0) {
+		if ((klen < 9)||(memcmp(kbuf,"station.",8))) {
+			printf("KISSDB_Iterator_next_len failed, bad key\n");
+			return 1;
+		}
+		++j;
+	}
+	if ((q < 0)||(j != 10000)) {
+		printf("KISSDB_Iterator_next_len failed (%"PRIu64" entries)\n",j);
+		return 1;
+	}
+	for(q=0;q<2;++q) {
+		/* the whole file, then only keys starting with "station.1" */
+		if (KISSDB_Scan_init(&db,&scan,"station.1",q ? 9 : 0)) {
+			printf("KISSDB_Scan_init failed\n");
+			return 1;
+		}
+		memset(got_all_values,0,sizeof(got_all_values));
+		j = 0;
+		while ((r = KISSDB_Scan_next(&scan,kbuf,&klen,vbuf,&vlen)) > 0) {
+			kbuf[klen] = (char)0;
+			i = strtoull(kbuf + 8,(char **)0,10);
+			if ((i % 3) == 0)
+				snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i);
+			else snprintf(vexp,sizeof(vexp),"%"PRIu64,i * 7);
+			if ((i >= 10000)||(got_all_values[i])||((q)&&(kbuf[8] != '1'))||(vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) {
+				printf("KISSDB_Scan_next failed, bad data (%s)\n",kbuf);
+				return 1;
+			}
+			got_all_values[i] = 1;
+			++j;
+		}
+		KISSDB_Scan_close(&scan);
+		if ((r < 0)||(j != (q ? 1111 : 10000))) {
+			printf("KISSDB_Scan_next failed (%"PRIu64" entries)\n",j);
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
+
+	printf("Batches: putting 64 values at once, then getting them back...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<64;++i) {
+		many_klen[i] = (unsigned long)snprintf(many_kbuf[i],sizeof(many_kbuf[i]),"station.%"PRIu64,(i < 63) ? i * 150 : 0);
+		many_vlen[i] = (unsigned long)snprintf(many_vbuf[i],sizeof(many_vbuf[i]),"%"PRIu64"-overwritten",(i < 63) ? i * 150 : 0);
+		many_keys[i] = many_kbuf[i];
+		many_values[i] = many_vbuf[i];
+	}
+	many_vlen[0] = 2; /* key 0 appears twice; the last value wins */
+	/* every key here is a multiple of 3, so this leaves the values the
+	 * tests below expect */
+	if (KISSDB_put_many(&db,64,many_keys,many_klen,many_values,many_vlen)) {
+		printf("KISSDB_put_many failed\n");
+		return 1;
+	}
+	many_klen[63] = (unsigned long)snprintf(many_kbuf[63],sizeof(many_kbuf[63]),"station.nonexistent");
+	for(i=0;i<64;++i)
+		many_gbufs[i] = many_gbuf[i];
+	if (KISSDB_get_many(&db,64,many_keys,many_klen,many_gbufs,many_vlen,many_results)) {
+		printf("KISSDB_get_many failed\n");
+		return 1;
+	}
+	for(i=0;i<63;++i) {
+		snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i * 150);
+		if ((many_results[i])||(many_vlen[i] != strlen(vexp))||(memcmp(many_gbuf[i],vexp,many_vlen[i]))) {
+			printf("KISSDB_get_many failed, bad data (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (many_results[63] != 1) {
+		printf("KISSDB_get_many found nonexistent key\n");
+		return 1;
+	}
+
+	printf("Value cache: re-getting, overwriting and deleting cached values...\n");
+
+	if (KISSDB_cache_enable(&db,16384)) {
+		printf("KISSDB_cache_enable failed\n");
+		return 1;
+	}
+	for(j=0;j<2;++j) {
+		for(i=0;i<63;++i) {
+			snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i * 150);
+			if ((KISSDB_get_len(&db,many_kbuf[i],many_klen[i],vbuf,&vlen))||(vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) {
+				printf("KISSDB_get_len with cache failed (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+	KISSDB_cache_stats(&db,&cst);
+	if ((cst.hits < 63)||(cst.entries != 63)) {
+		printf("KISSDB_cache_stats failed (%"PRIu64" hits)\n",cst.hits);
+		return 1;
+	}
+	KISSDB_put_len(&db,many_kbuf[1],many_klen[1],"x",1);
+	if ((KISSDB_get_len(&db,many_kbuf[1],many_klen[1],vbuf,&vlen))||(vlen != 1)||(vbuf[0] != 'x')) {
+		printf("KISSDB_get_len returned a stale cached value\n");
+		return 1;
+	}
+	KISSDB_delete(&db,many_kbuf[1],many_klen[1]);
+	if (KISSDB_get_len(&db,many_kbuf[1],many_klen[1],vbuf,&vlen) != 1) {
+		printf("KISSDB_get_len returned a deleted cached value\n");
+		return 1;
+	}
+	KISSDB_put_len(&db,many_kbuf[1],many_klen[1],"150-overwritten",15);
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen);
+	}
+	KISSDB_cache_stats(&db,&cst);
+	if ((!cst.evictions)||(cst.bytes > 16384)) {
+		printf("KISSDB_cache_stats failed (%"PRIu64" bytes)\n",cst.bytes);
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	printf("Snapshots: overwriting, deleting and compacting under a snapshot...\n");
+
+	if (KISSDB_open(&db,"test-snapshot.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_VARLEN,1024,64,64)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"old.%06"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_snapshot(&db,&snap)) {
+		printf("KISSDB_snapshot failed\n");
+		return 1;
+	}
+	for(i=0;i<4000;++i) {
+		/* same-length overwrites of every old key, new keys (and so new
+		 * pages), and deletes */
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"new.%06"PRIu64,i);
+		if ((i % 7) == 3)
+			r = (KISSDB_delete(&db,kbuf,klen) < 0);
+		else r = KISSDB_put_len(&db,kbuf,klen,vbuf,vlen);
+		if (r) {
+			printf("KISSDB_put_len/KISSDB_delete failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(q=0;q<3;++q) {
+		/* live, after a compaction, and after the database is closed */
+		if (q == 1)
+			r = KISSDB_compact(&db);
+		else if (q == 2) {
+			KISSDB_close(&db);
+			r = 0;
+		} else r = 0;
+		if (r) {
+			printf("KISSDB_compact failed\n");
+			return 1;
+		}
+		for(i=0;i<4000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+			snprintf(vexp,sizeof(vexp),"old.%06"PRIu64,i);
+			r = KISSDB_snapshot_get(snap,kbuf,klen,vbuf,&vlen);
+			if ((i < 1000) ? ((r)||(vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) : (r != 1)) {
+				printf("KISSDB_snapshot_get failed (%"PRIu64") (%d)\n",i,r);
+				return 1;
+			}
+		}
+		KISSDB_snapshot_iterator_init(snap,&dbi);
+		j = 0;
+		while ((r = KISSDB_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen)) > 0) {
+			if ((vlen != 10)||(memcmp(vbuf,"old.",4))) {
+				printf("KISSDB_Iterator_next_len on a snapshot failed, bad data\n");
+				return 1;
+			}
+			++j;
+		}
+		if ((r < 0)||(j != 1000)) {
+			printf("KISSDB_Iterator_next_len on a snapshot failed (%"PRIu64" entries)\n",j);
+			return 1;
+		}
+		if (KISSDB_snapshot_scan_init(snap,&scan,"station.9",9)) {
+			printf("KISSDB_snapshot_scan_init failed\n");
+			return 1;
+		}
+		j = 0;
+		while ((r = KISSDB_Scan_next(&scan,kbuf,&klen,vbuf,&vlen)) > 0)
+			++j;
+		KISSDB_Scan_close(&scan);
+		if ((r < 0)||(j != 111)) {
+			printf("KISSDB_Scan_next on a snapshot failed (%"PRIu64" entries)\n",j);
+			return 1;
+		}
+		if (q < 2) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.5");
+			if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != 10)||(memcmp(vbuf,"new.000005",10))) {
+				printf("KISSDB_get_len under a snapshot failed\n");
+				return 1;
+			}
+		}
+	}
+	KISSDB_snapshot_release(snap);
+
+	printf("Deleting every 5th value and compacting while writing...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;i+=5) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if (KISSDB_delete(&db,kbuf,klen)) {
+			printf("KISSDB_delete failed (%"PRIu64")\n",i);
+			return 1;
+		}
+		if (KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen) != 1) {
+			printf("KISSDB_get_len found deleted key (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_delete(&db,kbuf,klen) != 1) {
+		printf("KISSDB_delete deleted a key twice\n");
+		return 1;
+	}
+	if (!(dead = KISSDB_dead_bytes(&db))) {
+		printf("KISSDB_dead_bytes failed\n");
+		return 1;
+	}
+	if (KISSDB_compact_begin(&db,&comp)) {
+		printf("KISSDB_compact_begin failed\n");
+		return 1;
+	}
+	/* the copy runs alongside these changes, which must carry over */
+	pthread_create(&readers[0],NULL,KISSDB_test_compact_copy,&comp);
+	for(i=1;i<10000;i+=5) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"-overwritten",i);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.2");
+	KISSDB_delete(&db,kbuf,klen);
+	klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.0");
+	KISSDB_put_len(&db,kbuf,klen,"revived",7);
+	pthread_join(readers[0],&tret);
+	if (tret) {
+		printf("KISSDB_compact_copy failed\n");
+		return 1;
+	}
+	if (KISSDB_compact_finish(&db,&comp)) {
+		printf("KISSDB_compact_finish failed\n");
+		return 1;
+	}
+	if (KISSDB_dead_bytes(&db) >= dead) {
+		printf("KISSDB_compact did not reclaim dead bytes\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if (i == 0)
+			snprintf(vexp,sizeof(vexp),"revived");
+		else if ((i == 2)||((i % 5) == 0))
+			vexp[0] = (char)0;
+		else if (((i % 3) == 0)||((i % 5) == 1))
+			snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i);
+		else snprintf(vexp,sizeof(vexp),"%"PRIu64,i * 7);
+		q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen);
+		if ((!vexp[0])&&(q == 1))
+			continue;
+		if ((q)||(vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) {
+			printf("KISSDB_get_len after compaction failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
+
+	printf("Logging 4000 puts from 4 threads, then exiting without closing...\n");
+
+	if (!fork()) {
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0))
+			_exit(1);
+		if (KISSDB_wal_enable(&db,KISSDB_WAL_SYNC_COMMIT,0))
+			_exit(1);
+		KISSDB_test_db = &db;
+		for(j=0;j<4;++j)
+			pthread_create(&readers[j],NULL,KISSDB_test_writer,(void *)(uintptr_t)j);
+		q = 0;
+		for(j=0;j<4;++j) {
+			pthread_join(readers[j],&tret);
+			if (tret)
+				q = 1;
+		}
+		for(i=0;i<64;++i)
+			many_klen[i] = (unsigned long)snprintf(many_kbuf[i],sizeof(many_kbuf[i]),"batch.%"PRIu64,i);
+		if ((q)||(KISSDB_put_many(&db,64,many_keys,many_klen,many_keys,many_klen)))
+			_exit(1);
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.1");
+		if ((KISSDB_delete(&db,kbuf,klen))||(KISSDB_wal_wait(db.wal,KISSDB_wal_lsn(&db))))
+			_exit(1);
+		_exit(0); /* no checkpoint: only the log has the new hash table entries */
+	}
+	wait(&q);
+	if ((!WIFEXITED(q))||(WEXITSTATUS(q))) {
+		printf("KISSDB_wal_wait failed\n");
+		return 1;
+	}
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open (log replay) failed\n");
+		return 1;
+	}
+	for(i=0;i<4000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"wal.%"PRIu64,i);
+		if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("KISSDB_get_len after log replay failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+	}
+	for(i=0;i<64;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"batch.%"PRIu64,i);
+		if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("KISSDB_get_len after batch replay failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_get_len(&db,"station.1",9,vbuf,&vlen) != 1) {
+		printf("KISSDB_get_len found key deleted before log replay\n");
+		return 1;
+	}
+	dead = db.live_bytes;
+	KISSDB_close(&db);
+
+	printf("Index checkpoint: reopening from it, then from a stale one...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if (db.live_bytes != dead) {
+		printf("KISSDB_open from index checkpoint failed (live bytes)\n");
+		return 1;
+	}
+	for(i=0;i<4000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"wal.%"PRIu64,i);
+		if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("KISSDB_get_len from index checkpoint failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
+
+	/* keep the checkpoint as it is now, change the database, then put the
+	 * old checkpoint back as if the process had died before closing */
+	if (!(f = fopen("test.db.idx","rb"))) {
+		printf("KISSDB_close did not write an index checkpoint\n");
+		return 1;
+	}
+	fseek(f,0,SEEK_END);
+	cklen = (size_t)ftell(f);
+	fseek(f,0,SEEK_SET);
+	if ((!(ckbuf = malloc(cklen)))||(fread(ckbuf,1,cklen,f) != cklen)) {
+		printf("reading test.db.idx failed\n");
+		return 1;
+	}
+	fclose(f);
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"wal.%"PRIu64,i);
+		if ((i % 2) == 0)
+			r = KISSDB_delete(&db,kbuf,klen);
+		else r = KISSDB_put_len(&db,kbuf,klen,"overwritten",11);
+		if (r) {
+			printf("KISSDB_put_len/KISSDB_delete failed (%"PRIu64")\n",i);
+			return 1;
+		}
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"idx.%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,kbuf,klen)) {
+			printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	dead = db.live_bytes;
+	KISSDB_close(&db);
+	for(r=0;r<2;++r) {
+		/* then corrupt it, which should make open ignore it */
+		if (r)
+			ckbuf[cklen / 2] ^= 1;
+		if ((!(f = fopen("test.db.idx","wb")))||(fwrite(ckbuf,1,cklen,f) != cklen)) {
+			printf("writing test.db.idx failed\n");
+			return 1;
+		}
+		fclose(f);
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+			printf("KISSDB_open with a stale index checkpoint failed\n");
+			return 1;
+		}
+		if (db.live_bytes != dead) {
+			printf("KISSDB_open with a stale index checkpoint failed (live bytes)\n");
+			return 1;
+		}
+		for(i=0;i<4000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"wal.%"PRIu64,i);
+			q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen);
+			if ((i < 1000)&&((i % 2) == 0)) {
+				if (q != 1) {
+					printf("KISSDB_get_len with a stale index checkpoint found deleted key (%"PRIu64")\n",i);
+					return 1;
+				}
+			} else if ((q)||((i < 1000) ? ((vlen != 11)||(memcmp(vbuf,"overwritten",11))) : ((vlen != klen)||(memcmp(vbuf,kbuf,klen))))) {
+				printf("KISSDB_get_len with a stale index checkpoint failed (%"PRIu64") (%d)\n",i,q);
+				return 1;
+			}
+			if (i < 1000) {
+				klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"idx.%"PRIu64,i);
+				if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+					printf("KISSDB_get_len with a stale index checkpoint failed (%"PRIu64")\n",i);
+					return 1;
+				}
+			}
+		}
+		KISSDB_close(&db);
+	}
+	free(ckbuf);
+
+	printf("Bloom filter: growing it with 40000 puts, then saving and loading it...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
 		printf("KISSDB_open failed\n");
 		return 1;
 	}
+	if (KISSDB_bloom_enable(&db,0.01)) {
+		printf("KISSDB_bloom_enable failed\n");
+		return 1;
+	}
+	for(i=0;i<40000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bloom.%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,kbuf,klen)) {
+			printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(r=0;r<2;++r) {
+		for(i=0;i<40000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bloom.%"PRIu64,i);
+			if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+				printf("KISSDB_get_len with a Bloom filter failed (%"PRIu64") (%d)\n",i,q);
+				return 1;
+			}
+		}
+		for(i=0,j=0;i<100000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"absent.%"PRIu64,i);
+			j += (uint64_t)KISSDB_bloom_test(db.bloom,KISSDB_mix(KISSDB_hash(&db,kbuf,klen)));
+			if (KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen) != 1) {
+				printf("KISSDB_get_len with a Bloom filter found nonexistent key\n");
+				return 1;
+			}
+		}
+		if (j > 2000) {
+			printf("Bloom filter has too many false positives (%"PRIu64" in 100000)\n",j);
+			return 1;
+		}
+		if (r)
+			break;
+		KISSDB_close(&db);
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+			printf("KISSDB_open failed\n");
+			return 1;
+		}
+		if ((KISSDB_bloom_enable(&db,0.01))||(db.bloom->file_size != db.file_size)) {
+			printf("KISSDB_bloom_enable did not load the saved filter\n");
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
 
-	printf("Getting 10000 64-byte values...\n");
+	printf("Direct I/O: 20000 puts through a 256KB buffer pool, then compacting...\n");
 
-	for(i=0;i<10000;++i) {
-		if ((q = KISSDB_get(&db,&i,v))) {
-			printf("KISSDB_get (3) failed (%"PRIu64") (%d)\n",i,q);
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if ((r = KISSDB_direct_enable(&db,262144)) == KISSDB_ERROR_IO)
+		printf("(no direct I/O on this file system, skipped)\n");
+	else if (r) {
+		printf("KISSDB_direct_enable failed\n");
+		return 1;
+	} else {
+		for(i=0;i<20000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"direct.%"PRIu64,i);
+			vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64".%s",i * 7,kbuf);
+			if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+				printf("KISSDB_put_len failed (%"PRIu64")\n",i);
+				return 1;
+			}
+			if ((!(i % 3))&&(KISSDB_delete(&db,kbuf,klen))) {
+				printf("KISSDB_delete failed (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+		for(r=0;r<2;++r) {
+			for(i=0;i<20000;++i) {
+				klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"direct.%"PRIu64,i);
+				vlen = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64".%s",i * 7,kbuf);
+				q = KISSDB_get_len(&db,kbuf,klen,vbuf,&klen);
+				if ((i % 3) ? ((q)||(klen != vlen)||(memcmp(vbuf,vexp,vlen))) : (q != 1)) {
+					printf("KISSDB_get_len in direct mode failed (%"PRIu64") (%d)\n",i,q);
+					return 1;
+				}
+			}
+			for(i=0;i<40000;i+=97) {
+				klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bloom.%"PRIu64,i);
+				if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+					printf("KISSDB_get_len in direct mode failed (%"PRIu64")\n",i);
+					return 1;
+				}
+			}
+			if (r)
+				break;
+			if (KISSDB_snapshot(&db,&snap) != KISSDB_ERROR_INVALID_PARAMETERS) {
+				printf("KISSDB_snapshot in direct mode did not fail\n");
+				return 1;
+			}
+			KISSDB_direct_stats(&db,&pst);
+			if ((!pst.evictions)||(!pst.table_pages)||(pst.pages != 64)) {
+				printf("buffer pool did not fill up and evict\n");
+				return 1;
+			}
+			if (KISSDB_compact(&db)) {
+				printf("KISSDB_compact in direct mode failed\n");
+				return 1;
+			}
+			if (!db.pool) {
+				printf("KISSDB_compact did not carry over the buffer pool\n");
+				return 1;
+			}
+		}
+		KISSDB_close(&db);
+
+		/* the padding from whole-page writes is gone, and everything is
+		 * there without the pool too */
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+			printf("KISSDB_open failed\n");
 			return 1;
 		}
-		for(j=0;j<8;++j) {
-			if (v[j] != i) {
-				printf("KISSDB_get (3) failed, bad data (%"PRIu64")\n",i);
+		if ((stat("test.db",&st))||((uint64_t)st.st_size != db.file_size)) {
+			printf("KISSDB_close did not cut the file back to size\n");
+			return 1;
+		}
+		for(i=1;i<20000;i+=3) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"direct.%"PRIu64,i);
+			vlen = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64".%s",i * 7,kbuf);
+			if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&klen))||(klen != vlen)||(memcmp(vbuf,vexp,vlen))) {
+				printf("KISSDB_get_len after direct mode failed (%"PRIu64") (%d)\n",i,q);
 				return 1;
 			}
 		}
 	}
+	KISSDB_close(&db);
 
-	printf("Iterator test...\n");
+	printf("Bulk building a database of 20000 entries with 1000 repeated keys...\n");
+
+	memset(&bulk_src,0,sizeof(bulk_src));
+	if ((q = KISSDB_bulk_build("test.db",KISSDB_OPEN_FLAG_VARLEN,20000,32,48,KISSDB_test_bulk_next,&bulk_src))) {
+		printf("KISSDB_bulk_build failed (%d)\n",q);
+		return 1;
+	}
+	if ((!stat("test.db.bulk",&st))||(!stat("test.db.wal",&st))||(stat("test.db.idx",&st))) {
+		printf("KISSDB_bulk_build did not leave the right files behind\n");
+		return 1;
+	}
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if ((db.idx_file_size != db.file_size)||(db.hash_table_size != 1250)) {
+		printf("bulk built database did not open from its index checkpoint\n");
+		return 1;
+	}
+	for(i=0;i<20000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bulk.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64".%s",(i < 1000) ? (i * 3) : i,kbuf);
+		if ((q = KISSDB_get_len(&db,kbuf,klen,vbuf,&klen))||(klen != vlen)||(memcmp(vbuf,vexp,vlen))) {
+			printf("KISSDB_get_len after bulk build failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+	}
+	dead = db.live_bytes;
+	for(i=20000;i<21000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bulk.%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,kbuf,klen)) {
+			printf("KISSDB_put_len after bulk build failed\n");
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
 
+	/* the checkpoint's live bytes are the same as counting them afresh */
+	unlink("test.db.idx");
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=20000;i<21000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bulk.%"PRIu64,i);
+		dead += KISSDB_entry_size(&db,klen,klen);
+	}
+	if (db.live_bytes != dead) {
+		printf("bulk built database has the wrong live bytes (%"PRIu64" != %"PRIu64")\n",db.live_bytes,dead);
+		return 1;
+	}
 	KISSDB_Iterator_init(&db,&dbi);
-	i = 0xdeadbeef;
-	memset(got_all_values,0,sizeof(got_all_values));
-	while (KISSDB_Iterator_next(&dbi,&i,&v) > 0) {
-		if (i < 10000)
-			got_all_values[i] = 1;
-		else {
-			printf("KISSDB_Iterator_next failed, bad data (%"PRIu64")\n",i);
+	for(j=0;KISSDB_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen) > 0;++j);
+	if (j != 21000) {
+		printf("bulk built database iterated %"PRIu64" entries\n",j);
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	printf("Bulk building a fixed size database...\n");
+
+	if (KISSDB_bulk_begin(&bulk,"test.db",0,0,8,sizeof(v))) {
+		printf("KISSDB_bulk_begin failed\n");
+		return 1;
+	}
+	for(i=0;i<5000;++i) {
+		for(j=0;j<8;++j)
+			v[j] = i + j;
+		if (KISSDB_bulk_add(bulk,&i,sizeof(i),v,sizeof(v))) {
+			printf("KISSDB_bulk_add failed\n");
 			return 1;
 		}
 	}
-	for(i=0;i<10000;++i) {
-		if (!got_all_values[i]) {
-			printf("KISSDB_Iterator failed, missing value index %"PRIu64"\n",i);
+	if (KISSDB_bulk_add(bulk,"short",5,"val",3)) {
+		printf("KISSDB_bulk_add failed\n");
+		return 1;
+	}
+	if (KISSDB_bulk_finish(bulk)) {
+		printf("KISSDB_bulk_finish failed\n");
+		return 1;
+	}
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if ((db.version != KISSDB_VERSION_FIXED)||(db.hash_table_size != 1024)) {
+		printf("bulk built fixed database has the wrong header\n");
+		return 1;
+	}
+	for(i=0;i<5000;++i) {
+		if (KISSDB_get(&db,&i,v)) {
+			printf("KISSDB_get after bulk build failed (%"PRIu64")\n",i);
+			return 1;
+		}
+		for(j=0;j<8;++j) {
+			if (v[j] != (i + j)) {
+				printf("KISSDB_get after bulk build returned bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+	}
+	if ((KISSDB_get_len(&db,"short",5,vbuf,&vlen))||(vlen != sizeof(v))||(memcmp(vbuf,"val",4))) {
+		printf("KISSDB_get_len of a padded key after bulk build failed\n");
+		return 1;
+	}
+
+	printf("Statistics: shape of the hash tables and counters...\n");
+
+	if (KISSDB_stats(&db,&dst,page_entries,64)) {
+		printf("KISSDB_stats failed\n");
+		return 1;
+	}
+	for(i=0,j=0;i<64;++i)
+		j += page_entries[i];
+	if ((dst.entries != 5001)||(j != dst.entries)||(dst.num_hash_tables != dst.max_probe)||(dst.index_entries != 5001)||(dst.dead_bytes)) {
+		printf("KISSDB_stats returned a bad shape (%"PRIu64" entries, %lu pages)\n",dst.entries,dst.num_hash_tables);
+		return 1;
+	}
+	if ((dst.avg_probe < 1.0)||(dst.avg_probe > (double)dst.max_probe)||(dst.avg_probe_miss > (double)dst.max_probe)||(dst.load_factor <= 0.0)||(dst.load_factor > 1.0)) {
+		printf("KISSDB_stats returned bad probe depths\n");
+		return 1;
+	}
+	if ((dst.counters.gets != 5001)||(dst.counters.puts)||(!dst.counters.reads)||(dst.counters.bytes_read < ((uint64_t)5001 * sizeof(v)))) {
+		printf("KISSDB_stats returned bad counters (%"PRIu64" gets, %"PRIu64" reads)\n",dst.counters.gets,dst.counters.reads);
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	printf("Compact hash tables: 20000 values in 64-bucket pages, then reopening...\n");
+
+	/* deep chains of small pages: the first pages go dense, the last
+	 * ones stay sparse, and every path that reads or writes a page is
+	 * taken through both */
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_VARLEN|KISSDB_OPEN_FLAG_COMPACT_TABLES|KISSDB_OPEN_FLAG_HUGEPAGES,64,32,48)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<20000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"compact.%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,kbuf,klen)) {
+			printf("KISSDB_put_len with compact tables failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (KISSDB_snapshot(&db,&snap)) {
+		printf("KISSDB_snapshot with compact tables failed\n");
+		return 1;
+	}
+	if (KISSDB_wal_enable(&db,KISSDB_WAL_SYNC_NONE,10)) {
+		printf("KISSDB_wal_enable with compact tables failed\n");
+		return 1;
+	}
+	for(i=0;i<20000;i+=2) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"compact.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64".%s",i,kbuf);
+		if (((i % 10) == 0) ? (KISSDB_delete(&db,kbuf,klen) != 0) : (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen) != 0)) {
+			printf("KISSDB_put_len with compact tables failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"compact.%d",20);
+	if ((KISSDB_snapshot_get(snap,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+		printf("KISSDB_snapshot_get with compact tables returned a changed value\n");
+		return 1;
+	}
+	KISSDB_snapshot_release(snap);
+	if ((KISSDB_stats(&db,&dst,(uint64_t *)0,0))||(dst.num_hash_tables < 300)||(dst.table_memory >= ((dst.table_bytes * 3) / 4))) {
+		printf("compact tables took %"PRIu64" bytes for %"PRIu64" on disk\n",dst.table_memory,dst.table_bytes);
+		return 1;
+	}
+	KISSDB_close(&db);
+
+	for(q=0;q<4;++q) {
+		/* from the checkpoint and from the file, compact and not, and
+		 * compacted */
+		if (q == 2)
+			unlink("test.db.idx");
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR|((q != 1) ? KISSDB_OPEN_FLAG_COMPACT_TABLES : 0),0,0,0)) {
+			printf("KISSDB_open failed\n");
+			return 1;
+		}
+		if ((q == 3)&&(KISSDB_compact(&db))) {
+			printf("KISSDB_compact with compact tables failed\n");
+			return 1;
+		}
+		for(i=0;i<20000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"compact.%"PRIu64,i);
+			if ((i % 10) == 0) {
+				if (KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen) != 1) {
+					printf("KISSDB_get_len with compact tables found a deleted key (%"PRIu64")\n",i);
+					return 1;
+				}
+				continue;
+			}
+			if ((i % 2) == 0)
+				j = (uint64_t)snprintf(vexp,sizeof(vexp),"%"PRIu64".%s",i,kbuf);
+			else j = (uint64_t)snprintf(vexp,sizeof(vexp),"%s",kbuf);
+			if ((KISSDB_get_len(&db,kbuf,klen,vbuf,&vlen))||(vlen != j)||(memcmp(vbuf,vexp,vlen))) {
+				printf("KISSDB_get_len with compact tables failed (%d, %"PRIu64")\n",q,i);
+				return 1;
+			}
+		}
+		KISSDB_Iterator_init(&db,&dbi);
+		for(j=0;KISSDB_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen) > 0;++j);
+		if (j != 18000) {
+			printf("compact tables iterated %"PRIu64" entries (%d)\n",j,q);
+			return 1;
+		}
+		KISSDB_close(&db);
+	}
+
+	printf("Sharing test.db between processes: 6000 values from 3 writers and a reader...\n");
+
+	unlink("test.db");
+	unlink("test.db.idx");
+	unlink("test.db.bloom");
+	unlink("test.db.shm");
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_SHARED,64,32,48) != KISSDB_ERROR_INVALID_PARAMETERS) {
+		printf("KISSDB_open replaced a shared database\n");
+		return 1;
+	}
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWCREAT|KISSDB_OPEN_FLAG_VARLEN|KISSDB_OPEN_FLAG_SHARED,64,32,48)) {
+		printf("KISSDB_open (shared) failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"shared.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len (shared) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if ((KISSDB_wal_enable(&db,KISSDB_WAL_SYNC_NONE,10) != KISSDB_ERROR_INVALID_PARAMETERS)||(KISSDB_compact(&db) != KISSDB_ERROR_INVALID_PARAMETERS)) {
+		printf("KISSDB_wal_enable or KISSDB_compact accepted a shared database\n");
+		return 1;
+	}
+	if ((KISSDB_open(&rdb,"test.db",KISSDB_OPEN_MODE_RDONLY|KISSDB_OPEN_FLAG_SHARED|KISSDB_OPEN_FLAG_COMPACT_TABLES|KISSDB_OPEN_FLAG_MMAP,0,0,0))||(KISSDB_cache_enable(&rdb,1048576))||(KISSDB_bloom_enable(&rdb,0.01))) {
+		printf("KISSDB_open (shared, read-only) failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;i+=3) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"shared.%"PRIu64,i);
+		if (KISSDB_get_len(&rdb,kbuf,klen,vbuf,&vlen)) {
+			printf("KISSDB_get_len (shared, read-only) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+
+	for(r=0;r<2;++r) {
+		/* the first writer changes more than the ring holds, so the
+		 * reader reloads; the second few enough to be replayed */
+		if (!fork()) {
+			if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR|KISSDB_OPEN_FLAG_SHARED,0,0,0))
+				_exit(1);
+			for(i=0;(r == 0)&&(i<6000);++i) {
+				klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"shared.%"PRIu64,i);
+				vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"%s",i,(i < 1000) ? "-new" : "");
+				if ((i < 1000)&&((i % 7) == 1))
+					q = KISSDB_delete(&db,kbuf,klen);
+				else if ((i >= 1000)||((i % 3) == 0))
+					q = KISSDB_put_len(&db,kbuf,klen,vbuf,vlen);
+				else q = 0;
+				if (q)
+					_exit(1);
+			}
+			for(i=1000;(r == 1)&&(i<1100);++i) {
+				klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"shared.%"PRIu64,i);
+				vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"-again",i);
+				if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen))
+					_exit(1);
+			}
+			if ((r == 1)&&((KISSDB_delete(&db,"shared.2000",11))||(KISSDB_put_len(&db,"shared.extra",12,"extra",5))))
+				_exit(1);
+			KISSDB_close(&db);
+			_exit(0);
+		}
+		wait(&q);
+		if ((!WIFEXITED(q))||(WEXITSTATUS(q))) {
+			printf("writing to a shared database from another process failed\n");
+			return 1;
+		}
+		if (KISSDB_refresh(&rdb)) {
+			printf("KISSDB_refresh failed (%d)\n",r);
+			return 1;
+		}
+		for(i=0;i<6000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"shared.%"PRIu64,i);
+			if ((i < 1000)&&((i % 7) == 1))
+				vexp[0] = 0;
+			else if ((i < 1000)&&((i % 3) == 0))
+				snprintf(vexp,sizeof(vexp),"%"PRIu64"-new",i);
+			else if ((r == 1)&&(i >= 1000)&&(i < 1100))
+				snprintf(vexp,sizeof(vexp),"%"PRIu64"-again",i);
+			else if ((r == 1)&&(i == 2000))
+				vexp[0] = 0;
+			else snprintf(vexp,sizeof(vexp),"%"PRIu64,i);
+			q = KISSDB_get_len(&rdb,kbuf,klen,vbuf,&vlen);
+			if ((!vexp[0])&&(q == 1))
+				continue;
+			if ((q)||(vlen != strlen(vexp))||(memcmp(vbuf,vexp,vlen))) {
+				printf("KISSDB_get_len after KISSDB_refresh failed (%d, %"PRIu64") (%d)\n",r,i,q);
+				return 1;
+			}
+		}
+		KISSDB_Iterator_init(&rdb,&dbi);
+		for(j=0;KISSDB_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen) > 0;++j);
+		if (j != (6000 - 143)) { /* the second writer deletes one, adds one */
+			printf("KISSDB_refresh left %"PRIu64" entries (%d)\n",j,r);
 			return 1;
 		}
 	}
 
+	/* the first writer catches up before its own put */
+	if ((KISSDB_put_len(&db,"shared.last",11,"last",4))||(KISSDB_get_len(&db,"shared.1050",11,vbuf,&vlen))||(vlen != 10)||(memcmp(vbuf,"1050-again",10))) {
+		printf("KISSDB_put_len (shared) did not catch up\n");
+		return 1;
+	}
+	if ((KISSDB_refresh(&rdb))||(KISSDB_get_len(&rdb,"shared.last",11,vbuf,&vlen))||(vlen != 4)) {
+		printf("KISSDB_refresh missed a put\n");
+		return 1;
+	}
+	KISSDB_close(&db);
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if ((KISSDB_stats(&db,&dst,(uint64_t *)0,0))||(KISSDB_stats(&rdb,&rst,(uint64_t *)0,0))||(dst.live_bytes != rst.live_bytes)||(dst.entries != rst.entries)||(dst.num_hash_tables != rst.num_hash_tables)) {
+		printf("KISSDB_refresh left %"PRIu64" live bytes, not %"PRIu64"\n",rst.live_bytes,dst.live_bytes);
+		return 1;
+	}
+	KISSDB_close(&db);
+	KISSDB_close(&rdb);
+	unlink("test.db.shm");
+
+	printf("Inline small values: 3000 puts, rewrites, deletes and batches, then reopening...\n");
+
+	unlink("test.db");
+	unlink("test.db.idx");
+	unlink("test.db.bloom");
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_INLINE,64,32,48)) {
+		printf("KISSDB_open (inline) failed\n");
+		return 1;
+	}
+	/* two of every three values are 1 to 8 bytes long, the rest 20; the
+	 * second pass rewrites them all, half with a new length, which must
+	 * be appended rather than written over the old value */
+	for(r=0;r<2;++r) {
+		dead = db.file_size;
+		for(i=0;i<3000;++i) {
+			if ((r)&&(!(i % 3)))
+				continue;
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"inline.%"PRIu64,i);
+			snprintf(vexp,sizeof(vexp),"%08"PRIu64"%012"PRIu64,((i * 7919) + (uint64_t)r) % 100000000,i);
+			vlen = (i % 3) ? (unsigned long)(1 + ((i + (((i % 3) == 1) ? (uint64_t)r : 0)) % 8)) : 20;
+			if (KISSDB_put_len(&db,kbuf,klen,vexp + ((i % 3) ? (8 - vlen) : 0),vlen)) {
+				printf("KISSDB_put_len (inline) failed (%d, %"PRIu64")\n",r,i);
+				return 1;
+			}
+			if ((r)&&((i % 3) == 1))
+				dead += KISSDB_entry_size(&db,klen,vlen);
+		}
+		if ((r)&&(db.file_size != dead)) {
+			printf("rewriting small values left the file %"PRIu64" bytes long, not %"PRIu64"\n",db.file_size,dead);
+			return 1;
+		}
+	}
+	for(i=1;i<3000;i+=5) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"inline.%"PRIu64,i);
+		if (KISSDB_delete(&db,kbuf,klen)) {
+			printf("KISSDB_delete (inline) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<64;++i) {
+		many_klen[i] = (unsigned long)snprintf(many_kbuf[i],sizeof(many_kbuf[i]),"inline.batch.%"PRIu64,i);
+		many_vlen[i] = (unsigned long)snprintf(many_vbuf[i],sizeof(many_vbuf[i]),"%"PRIu64"%s",i,(i & 1) ? "-large-value" : "");
+		many_keys[i] = many_kbuf[i];
+		many_values[i] = many_vbuf[i];
+		many_gbufs[i] = many_gbuf[i];
+	}
+	if (KISSDB_put_many(&db,64,many_keys,many_klen,many_values,many_vlen)) {
+		printf("KISSDB_put_many (inline) failed\n");
+		return 1;
+	}
+
+	/* the same checks on the open database, after reopening from the
+	 * index checkpoint, after reading every key and after compacting */
+	for(r=0;r<4;++r) {
+		if (r) {
+			KISSDB_close(&db);
+			if (r >= 2)
+				unlink("test.db.idx");
+			if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR|((r == 3) ? KISSDB_OPEN_FLAG_MMAP : 0),0,0,0)) {
+				printf("KISSDB_open (inline) failed (%d)\n",r);
+				return 1;
+			}
+			if ((r == 3)&&((KISSDB_compact(&db))||(db.version != KISSDB_VERSION_INLINE))) {
+				printf("KISSDB_compact (inline) failed\n");
+				return 1;
+			}
+		}
+		for(i=0;i<3000;++i) {
+			klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"inline.%"PRIu64,i);
+			snprintf(vexp,sizeof(vexp),"%08"PRIu64"%012"PRIu64,((i * 7919) + ((i % 3) ? 1 : 0)) % 100000000,i);
+			vlen = (i % 3) ? (unsigned long)(1 + ((i + (((i % 3) == 1) ? 1 : 0)) % 8)) : 20;
+			j = db.counters.reads;
+			q = KISSDB_get_len(&db,kbuf,klen,vbuf,&klen);
+			if ((i % 5) == 1) {
+				if (q != 1) {
+					printf("KISSDB_get_len (inline) found a deleted key (%d, %"PRIu64")\n",r,i);
+					return 1;
+				}
+			} else if ((q)||(klen != vlen)||(memcmp(vbuf,vexp + ((i % 3) ? (8 - vlen) : 0),vlen))) {
+				printf("KISSDB_get_len (inline) failed (%d, %"PRIu64") (%d)\n",r,i,q);
+				return 1;
+			}
+			if (((i % 3)||((i % 5) == 1))&&(db.counters.reads != j)) {
+				printf("KISSDB_get_len (inline) read the file for a small value (%d, %"PRIu64")\n",r,i);
+				return 1;
+			}
+		}
+		/* a key with a stored key's hash but not its fingerprint is missing */
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"inline.2");
+		if ((KISSDB_index_get_inline(&db.index,KISSDB_mix(KISSDB_hash(&db,kbuf,klen)),KISSDB_fingerprint(&db,kbuf,klen),vbuf,&vlen))||(KISSDB_index_get_inline(&db.index,KISSDB_mix(KISSDB_hash(&db,kbuf,klen)),~KISSDB_fingerprint(&db,kbuf,klen),vbuf,&vlen) != 1)) {
+			printf("KISSDB_index_get_inline did not check the fingerprint (%d)\n",r);
+			return 1;
+		}
+		if (KISSDB_get_many(&db,64,many_keys,many_klen,many_gbufs,many_vlen,many_results)) {
+			printf("KISSDB_get_many (inline) failed (%d)\n",r);
+			return 1;
+		}
+		for(i=0;i<64;++i) {
+			if ((many_results[i])||(many_vlen[i] != strlen(many_vbuf[i]))||(memcmp(many_gbuf[i],many_vbuf[i],many_vlen[i]))) {
+				printf("KISSDB_get_many (inline) returned a bad value (%d, %"PRIu64")\n",r,i);
+				return 1;
+			}
+		}
+	}
 	KISSDB_close(&db);
 
+	/* a value rewritten in place leaves the file size as it was, yet the
+	 * checkpoint taken before it must not be trusted again: not after
+	 * closing, and not if the process dies before it can close */
+	for(r=0;r<2;++r) {
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_INLINE,64,32,48)) {
+			printf("KISSDB_open (inline rewrite) failed\n");
+			return 1;
+		}
+		if (KISSDB_put_len(&db,"rewrite",7,"AAAAAAA",7)) {
+			printf("KISSDB_put_len (inline rewrite) failed\n");
+			return 1;
+		}
+		KISSDB_close(&db);
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+			printf("KISSDB_open (inline rewrite) failed\n");
+			return 1;
+		}
+		dead = db.file_size;
+		if ((KISSDB_put_len(&db,"rewrite",7,"BBBBBBB",7))||(db.file_size != dead)) {
+			printf("KISSDB_put_len (inline rewrite) did not rewrite in place\n");
+			return 1;
+		}
+		if (r) {
+			/* what a crash leaves behind: no checkpoint written on closing */
+			if (!access("test.db.idx",F_OK)) {
+				printf("a rewrite in place left the old index checkpoint\n");
+				return 1;
+			}
+			free(db.path);
+			db.path = (char *)0;
+		}
+		KISSDB_close(&db);
+		if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0)) {
+			printf("KISSDB_open (inline rewrite) failed\n");
+			return 1;
+		}
+		vlen = sizeof(vbuf);
+		if ((KISSDB_get_len(&db,"rewrite",7,vbuf,&vlen))||(vlen != 7)||(memcmp(vbuf,"BBBBBBB",7))) {
+			printf("KISSDB_get_len (inline rewrite) returned the old value (%d)\n",r);
+			return 1;
+		}
+		KISSDB_close(&db);
+	}
+
 	printf("All tests OK!\n");
 
 	return 0;
@@ -16,19 +16,179 @@ extern "C" {
 #endif
 
 /**
- * Version: 2
+ * Version: 4
  *
  * This is the file format identifier, and changes any time the file
  * format changes. The code version will be this dot something, and can
  * be seen in tags in the git repository.
+ *
+ * Version 4 stores each entry with its key and value length, so keys
+ * and values may be shorter than key_size and value_size, and hashes
+ * keys with a seeded 64-bit hash whose seed is kept in the header.
+ */
+#define KISSDB_VERSION 4
+
+/**
+ * First version whose keys are hashed with the seeded hash
+ */
+#define KISSDB_VERSION_SEEDED 4
+
+/**
+ * Version 5: version 4 with values of 1 to 8 bytes padded to 8
+ *
+ * Created with KISSDB_OPEN_FLAG_INLINE. The index keeps every small value
+ * in memory next to the key's hash.
+ */
+#define KISSDB_VERSION_INLINE 5
+
+/**
+ * Version 3: variable-length entries like version 4, but keys are hashed
+ * with djb2 and there is no seed
+ *
+ * Files in this format are still read and written. Compacting one
+ * rewrites it as version 4.
+ */
+#define KISSDB_VERSION_VARLEN_DJB2 3
+
+/**
+ * Version 2: every key and value occupies exactly key_size/value_size
+ *
+ * Files in this format are still read and written, and are what gets
+ * created unless KISSDB_OPEN_FLAG_VARLEN is given.
+ */
+#define KISSDB_VERSION_FIXED 2
+
+/**
+ * Slot in the in-memory index: full key hash and entry offset in the file
+ */
+typedef struct {
+	uint64_t hash;
+	uint64_t offset;
+} KISSDB_Index_Slot;
+
+/**
+ * One open-addressing table of the in-memory index
+ */
+typedef struct {
+	uint8_t *ctrl;
+	KISSDB_Index_Slot *slots;
+	uint64_t *values; /* version 5: small value of each slot, or NULL */
+	uint8_t *vlens; /* version 5: its length + 1, 0 if in the file only */
+	uint64_t *fprints; /* version 5: second hash of its key */
+	unsigned long capacity; /* slots, power of two and multiple of 16 */
+	unsigned long count;
+} KISSDB_Index_Table;
+
+/**
+ * In-memory lookup index
+ *
+ * Open-addressing table built at open time, in the style of Google's
+ * SwissTable. Each slot has a control byte holding either an empty
+ * marker or 7 bits of the key's hash, and slots are probed in groups of
+ * 16 control bytes at a time (with SSE2 where available). The full hash
+ * is compared before the key is read from the file, so a lookup only
+ * does I/O on a near-certain match.
+ *
+ * The index grows incrementally: when the current table passes its load
+ * limit a table of twice the size takes its place, and each following
+ * insert moves a few groups out of the old table until it is empty.
+ * Lookups check both tables while a migration is in progress.
+ *
+ * On a version 5 database each slot also holds the key's value if it is
+ * at most 8 bytes, as long as no other key has the same full hash, along
+ * with a second hash of the key under a seed of its own. A lookup that
+ * finds such a slot returns the value without reading the file if the
+ * second hash matches too, and reports the key missing if it does not.
+ */
+typedef struct {
+	KISSDB_Index_Table cur;
+	KISSDB_Index_Table old;
+	unsigned long migrated; /* groups of old already moved to cur */
+	int hugepages; /* back large tables with huge pages */
+	int inline_values; /* fill in values and vlens (version 5) */
+} KISSDB_Index;
+
+/**
+ * Write-ahead log durability: the log is written out in batches but never
+ * synced, so a system crash may lose recent changes
+ */
+#define KISSDB_WAL_SYNC_NONE 0
+
+/**
+ * Write-ahead log durability: the log is written and synced every
+ * interval_ms milliseconds, which bounds what a system crash can lose
+ */
+#define KISSDB_WAL_SYNC_INTERVAL 1
+
+/**
+ * Write-ahead log durability: KISSDB_wal_wait() returns once a change is
+ * synced; changes waiting at the same time share a single sync
+ */
+#define KISSDB_WAL_SYNC_COMMIT 2
+
+/**
+ * Write-ahead log state (see KISSDB_wal_enable())
+ */
+typedef struct KISSDB_WAL KISSDB_WAL;
+
+/**
+ * Value cache state (see KISSDB_cache_enable())
  */
-#define KISSDB_VERSION 2
+typedef struct KISSDB_Cache KISSDB_Cache;
+
+/**
+ * Bloom filter state (see KISSDB_bloom_enable())
+ */
+typedef struct KISSDB_Bloom KISSDB_Bloom;
+
+/**
+ * Direct I/O buffer pool state (see KISSDB_direct_enable())
+ */
+typedef struct KISSDB_Pool KISSDB_Pool;
+
+/**
+ * Hash table pages kept in compact form (see KISSDB_OPEN_FLAG_COMPACT_TABLES)
+ */
+typedef struct KISSDB_Tables KISSDB_Tables;
+
+/**
+ * State shared with other processes (see KISSDB_OPEN_FLAG_SHARED)
+ */
+typedef struct KISSDB_Shared KISSDB_Shared;
+
+/**
+ * Frozen view of a database (opaque, see KISSDB_snapshot())
+ */
+typedef struct KISSDB_Snapshot KISSDB_Snapshot;
+
+/**
+ * Operation and I/O counters, kept since the database was opened
+ *
+ * The system calls are those on the database file and its write-ahead
+ * log; reads through a mapping (KISSDB_OPEN_FLAG_MMAP) make none.
+ */
+typedef struct {
+	uint64_t gets;
+	uint64_t puts;
+	uint64_t deletes;
+	uint64_t reads; /* read system calls */
+	uint64_t writes; /* write system calls */
+	uint64_t syncs;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+} KISSDB_Counters;
 
 /**
  * KISSDB database state
  *
  * These fields can be read by a user, e.g. to look up key_size and
  * value_size, but should never be changed.
+ *
+ * Thread safety: all file I/O is positional (pread/pwrite) so there is
+ * no shared file position. Any number of threads may call KISSDB_get(),
+ * KISSDB_get_ref() and KISSDB_Iterator_next() on the same database at
+ * once. KISSDB_put() modifies the in-memory hash tables and the mapping
+ * and must not run concurrently with any other call on the database.
  */
 typedef struct {
 	unsigned long hash_table_size;
@@ -36,8 +196,33 @@ typedef struct {
 	unsigned long value_size;
 	unsigned long hash_table_size_bytes;
 	unsigned long num_hash_tables;
-	uint64_t *hash_tables;
-	FILE *f;
+	uint64_t *hash_tables; /* NULL with compact tables */
+	KISSDB_Tables *tables; /* compact tables, or NULL */
+	uint64_t *hash_table_offsets;
+	unsigned long *bucket_depth;
+	int fd;
+	uint64_t file_size;
+	uint64_t live_bytes;
+	int version;
+	uint64_t hash_seed;
+	int flags;
+	int compacting;
+	char *path;
+	const uint8_t *map;
+	uint64_t map_size;
+	uint64_t map_capacity;
+	KISSDB_Index index;
+	KISSDB_WAL *wal;
+	uint8_t *dirty; /* hash table pages changed since the last checkpoint */
+	unsigned long dirty_size;
+	KISSDB_Cache *cache;
+	KISSDB_Snapshot *snapshots; /* open snapshots sharing hash table pages */
+	uint64_t idx_file_size; /* file size the index checkpoint (path.idx) was taken at */
+	int idx_stale; /* a value in the index was rewritten in place since then */
+	KISSDB_Bloom *bloom;
+	KISSDB_Pool *pool;
+	KISSDB_Counters counters; /* bumped atomically, read with KISSDB_stats() */
+	KISSDB_Shared *shared;
 } KISSDB;
 
 /**
@@ -80,6 +265,77 @@ typedef struct {
  */
 #define KISSDB_OPEN_MODE_RWREPLACE 4
 
+/**
+ * Open flag: map the database file into memory
+ *
+ * May be OR'ed into any of the open modes above. Lookups and iteration
+ * then read keys and values straight from the mapping instead of going
+ * through stdio, and KISSDB_get_ref() becomes available. The mapping is
+ * extended as KISSDB_put() grows the file.
+ */
+#define KISSDB_OPEN_FLAG_MMAP 0x100
+
+/**
+ * Open flag: create new databases in the variable-length format
+ *
+ * A database created with this flag uses file format version 4, where
+ * key_size and value_size are upper bounds and each entry takes only as
+ * much space as its key and value. Existing files keep their format.
+ */
+#define KISSDB_OPEN_FLAG_VARLEN 0x200
+
+/**
+ * Open flag: keep the hash table pages in memory in compact form
+ *
+ * Normally every page is held as it is in the file, 8 bytes per bucket
+ * whether the bucket is used or not. With this flag a page that is mostly
+ * full is held as packed 40-bit offsets, 5 bytes per bucket, and one that
+ * is mostly empty (as the overflow pages at the end of long chains are)
+ * as a sorted list of its used buckets only. Lookups go through the
+ * in-memory index either way; walking and updating the pages costs a few
+ * more instructions. Files are unchanged, but a database opened this way
+ * is limited to 1TB: puts that would store an entry past that fail.
+ */
+#define KISSDB_OPEN_FLAG_COMPACT_TABLES 0x400
+
+/**
+ * Open flag: ask for huge pages for the in-memory index and tables
+ *
+ * The index and compact hash table pages (if any) are allocated in 2MB
+ * aligned blocks that the kernel is advised to back with transparent huge
+ * pages, so lookups in a large database take fewer TLB misses. Without
+ * transparent huge pages this only costs some memory in alignment.
+ */
+#define KISSDB_OPEN_FLAG_HUGEPAGES 0x800
+
+/**
+ * Open flag: share the database file with other processes
+ *
+ * Every process that opens the file with this flag maps path.shm, which
+ * holds a generation counter and a ring of the last hash table changes.
+ * Puts and deletes take an fcntl() write lock on it, first replay what
+ * other processes have changed, and publish their own changes to the
+ * ring as they release it. Overwrites always append, so no process ever
+ * reads a value that is being rewritten. Other processes pick the changes
+ * up with KISSDB_refresh(), updating their tables and index in place, or
+ * reloading them from the file if they fell more than the ring behind.
+ *
+ * Not available with KISSDB_OPEN_MODE_RWREPLACE, and the write-ahead log,
+ * direct I/O and compaction can't be enabled. fcntl() locks belong to the
+ * process, so a process should open a shared database only once.
+ */
+#define KISSDB_OPEN_FLAG_SHARED 0x1000
+
+/**
+ * Open flag: create new databases with small values inline
+ *
+ * Like KISSDB_OPEN_FLAG_VARLEN, but creates file format version 5: values
+ * of 1 to 8 bytes take 8 bytes in the file, and gets for keys with such a
+ * value are answered from the in-memory index with no I/O. Existing
+ * files keep their format.
+ */
+#define KISSDB_OPEN_FLAG_INLINE 0x2000
+
 /**
  * Open database
  *
@@ -89,9 +345,15 @@ typedef struct {
  * from the database. You can check the struture afterwords to see what
  * they were.
  *
+ * If a write-ahead log (path.wal) was left behind and the database is
+ * opened for writing, the changes in it are applied before this returns.
+ *
+ * If an index checkpoint (path.idx) matches the file, the index is loaded
+ * from it instead of being rebuilt from every stored key.
+ *
  * @param db Database struct
  * @param path Path to file
- * @param mode One of the KISSDB_OPEN_MODE constants
+ * @param mode One of the KISSDB_OPEN_MODE constants, optionally OR'ed with KISSDB_OPEN_FLAG_ flags
  * @param hash_table_size Size of hash table in 64-bit entries (must be >0)
  * @param key_size Size of keys in bytes
  * @param value_size Size of values in bytes
@@ -112,6 +374,23 @@ extern int KISSDB_open(
  */
 extern void KISSDB_close(KISSDB *db);
 
+/**
+ * Catch up with changes other processes made to a shared database
+ *
+ * Does nothing unless the database was opened with
+ * KISSDB_OPEN_FLAG_SHARED. Puts and deletes catch up by themselves; a
+ * process that only reads calls this whenever it wants to see what was
+ * written since it last did. Cached values and the Bloom filter are kept
+ * up to date too.
+ *
+ * Needs the same exclusive access as KISSDB_put(). If the database has
+ * to be reloaded and that fails, it is left closed.
+ *
+ * @param db Database struct
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_refresh(KISSDB *db);
+
 /**
  * Get an entry
  *
@@ -122,6 +401,51 @@ extern void KISSDB_close(KISSDB *db);
  */
 extern int KISSDB_get(KISSDB *db,const void *key,void *vbuf);
 
+/**
+ * Get an entry with an explicit key length
+ *
+ * On a version 2 database the key is zero-padded to key_size and the
+ * whole value_size bytes of the value are returned.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_get_len(KISSDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Get a pointer to an entry's value without copying it
+ *
+ * Only available if the database was opened with KISSDB_OPEN_FLAG_MMAP.
+ * The returned pointer points into the file mapping and stays valid until
+ * the next KISSDB_put() or KISSDB_close(), since a put that grows the file
+ * may move the mapping.
+ *
+ * On a version 3, 4 or 5 database the value may be shorter than
+ * value_size; use KISSDB_get_ref_len() to find out its length.
+ *
+ * @param db Database struct
+ * @param key Key (key_size bytes)
+ * @param vptr Set to point at the value (value_size bytes) on success
+ * @return -1 on I/O error, 0 on success, 1 on not found, -3 if not mapped
+ */
+extern int KISSDB_get_ref(KISSDB *db,const void *key,const void **vptr);
+
+/**
+ * Get a pointer to an entry's value, with explicit key and value lengths
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vptr Set to point at the value on success
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found, -3 if not mapped
+ */
+extern int KISSDB_get_ref_len(KISSDB *db,const void *key,unsigned long klen,const void **vptr,unsigned long *vlen);
+
 /**
  * Put an entry (overwriting it if it already exists)
  *
@@ -135,6 +459,494 @@ extern int KISSDB_get(KISSDB *db,const void *key,void *vbuf);
  */
 extern int KISSDB_put(KISSDB *db,const void *key,const void *value);
 
+/**
+ * Put an entry with explicit key and value lengths
+ *
+ * On a version 3, 4 or 5 database an existing entry is rewritten in place
+ * if the new value has the same length, and appended anew otherwise. On a
+ * version 5 database a value of 1 to 8 bytes is also kept in the in-memory
+ * index. On a version 2 database the key and value are zero-padded to full
+ * size.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return -1 on I/O error, 0 on success
+ */
+extern int KISSDB_put_len(KISSDB *db,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Get many entries at once
+ *
+ * Each key is resolved through the in-memory index first, then the
+ * entries are read in file order, with entries close to each other
+ * fetched by a single read. This may run alongside KISSDB_get().
+ *
+ * @param db Database struct
+ * @param n Number of keys
+ * @param keys Keys
+ * @param klens Key lengths, or NULL if all keys are key_size bytes
+ * @param vbufs Value buffers (value_size bytes capacity each)
+ * @param vlens If not NULL, value lengths are stored here for keys found
+ * @param results Set to 0 for each key found and 1 for each key not found
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_get_many(KISSDB *db,unsigned long n,const void *const *keys,const unsigned long *klens,void *const *vbufs,unsigned long *vlens,int *results);
+
+/**
+ * Start getting an entry whose read is done by the caller
+ *
+ * This splits KISSDB_get_len() for asynchronous I/O: if the answer needs
+ * no read from the file it is returned right away, otherwise the caller
+ * reads len bytes at offset from db->fd and hands them to
+ * KISSDB_get_finish(). The same access as for KISSDB_get() must be held
+ * from here until KISSDB_get_finish() returns.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @param offset Set to where to read from if 2 is returned
+ * @param len Set to how many bytes to read if 2 is returned
+ * @return Negative on error, 0 on success, 1 on not found, 2 if the entry has to be read
+ */
+extern int KISSDB_get_start(KISSDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen,uint64_t *offset,unsigned long *len);
+
+/**
+ * Finish a get started by KISSDB_get_start()
+ *
+ * If the entry read belongs to another key with the same hash, the key is
+ * looked up again with KISSDB_get_len().
+ *
+ * @param db Database struct
+ * @param offset Offset KISSDB_get_start() returned
+ * @param buf Bytes read from offset
+ * @param len Number of bytes read
+ * @param key Key (klen bytes)
+ * @param klen Length of key
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_get_finish(KISSDB *db,uint64_t offset,const void *buf,unsigned long len,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Put many entries at once
+ *
+ * All entries are appended to the file with a single write and their
+ * buckets updated afterwards; nothing is rewritten in place. With a
+ * write-ahead log the batch is logged as one record, so after a crash
+ * either all of it or none of it is there. If a key is given more than
+ * once the last value wins.
+ *
+ * @param db Database struct
+ * @param n Number of entries
+ * @param keys Keys
+ * @param klens Key lengths, or NULL if all keys are key_size bytes
+ * @param values Values
+ * @param vlens Value lengths, or NULL if all values are value_size bytes
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_put_many(KISSDB *db,unsigned long n,const void *const *keys,const unsigned long *klens,const void *const *values,const unsigned long *vlens);
+
+/**
+ * Delete an entry
+ *
+ * Appends a tombstone for the key and points its bucket at it, so the
+ * space of the old entry becomes dead until the database is compacted.
+ * Only supported on version 3, 4 and 5 databases.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @return -1 on I/O error, 0 on success, 1 on not found, -3 on a version 2 database
+ */
+extern int KISSDB_delete(KISSDB *db,const void *key,unsigned long klen);
+
+/**
+ * Get the number of bytes in the file taken up by dead entries
+ *
+ * Dead entries are overwritten or deleted values and tombstones. The
+ * space is reclaimed by compaction.
+ *
+ * @param db Database struct
+ * @return Bytes of dead entries
+ */
+extern uint64_t KISSDB_dead_bytes(KISSDB *db);
+
+/**
+ * State of a compaction in progress
+ */
+typedef struct {
+	KISSDB db;
+	char *path;
+	uint64_t end;
+	KISSDB_Snapshot *snap; /* what is left to copy, NULL once copied */
+} KISSDB_Compaction;
+
+/**
+ * Start compacting a database
+ *
+ * Creates path.compact and takes a snapshot of db with its own copy of
+ * the hash table pages, for KISSDB_compact_copy() to copy from. Needs the
+ * same exclusive access as KISSDB_put(), but only for as long as copying
+ * the pages takes. Puts and deletes may be made between this call and
+ * KISSDB_compact_finish(), but they will no longer overwrite values in
+ * place.
+ *
+ * With direct I/O on (see KISSDB_direct_enable()) no snapshot can be
+ * taken, so the live entries are copied here instead.
+ *
+ * @param db Database struct
+ * @param c Compaction state to initialize
+ * @return 0 on success, negative on error (nothing is left behind)
+ */
+extern int KISSDB_compact_begin(KISSDB *db,KISSDB_Compaction *c);
+
+/**
+ * Copy all live entries into the new file
+ *
+ * Reads only the snapshot taken by KISSDB_compact_begin(), never db, so
+ * it needs no access to db at all: gets, puts and deletes may go on in
+ * other threads meanwhile. Called by KISSDB_compact_finish() if it has
+ * not been. On failure, abandon the compaction with
+ * KISSDB_compact_abort().
+ *
+ * @param c Compaction state from KISSDB_compact_begin()
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_compact_copy(KISSDB_Compaction *c);
+
+/**
+ * Finish a compaction
+ *
+ * Copies changes made since KISSDB_compact_begin() into the new file,
+ * syncs it, renames it over the database and switches db over to it.
+ * Needs exclusive access to db. On failure the compaction is abandoned
+ * and db is left as it was.
+ *
+ * @param db Database struct
+ * @param c Compaction state from KISSDB_compact_begin()
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_compact_finish(KISSDB *db,KISSDB_Compaction *c);
+
+/**
+ * Abandon a compaction started with KISSDB_compact_begin()
+ *
+ * @param db Database struct
+ * @param c Compaction state
+ */
+extern void KISSDB_compact_abort(KISSDB *db,KISSDB_Compaction *c);
+
+/**
+ * Compact a database in one step (needs exclusive access)
+ *
+ * @param db Database struct
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_compact(KISSDB *db);
+
+/**
+ * State of a bulk build in progress (see KISSDB_bulk_begin())
+ */
+typedef struct KISSDB_Bulk KISSDB_Bulk;
+
+/**
+ * Start building a new database file in one pass
+ *
+ * Entries are appended to path.bulk through a large buffer as they are
+ * added, and only their offsets and key hashes are kept in memory. The
+ * hash table pages are laid out once all entries are in, and written
+ * along with an index checkpoint (path.idx), so opening the result does
+ * not read any keys. Nothing replaces path until KISSDB_bulk_finish().
+ *
+ * The hash table is sized for expected_entries; if more are added it
+ * just has more pages, as if they had been put.
+ *
+ * @param b Set to the build state
+ * @param path Path of the database to create or replace
+ * @param flags KISSDB_OPEN_FLAG_VARLEN or 0, as for KISSDB_open()
+ * @param expected_entries Number of entries that will be added, 0 if unknown
+ * @param key_size Maximum size of keys in bytes
+ * @param value_size Maximum size of values in bytes
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_bulk_begin(KISSDB_Bulk **b,const char *path,int flags,uint64_t expected_entries,unsigned long key_size,unsigned long value_size);
+
+/**
+ * Add an entry to a bulk build
+ *
+ * If a key is added more than once, the last value wins.
+ *
+ * @param b Build state
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return 0 on success, negative on error (the build must then be aborted)
+ */
+extern int KISSDB_bulk_add(KISSDB_Bulk *b,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Write out the hash table pages and index checkpoint and move the new
+ * file into place
+ *
+ * Any write-ahead log or Bloom filter left next to an old database at
+ * path is removed. The build state is freed, whether this succeeds or not.
+ *
+ * @param b Build state
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_bulk_finish(KISSDB_Bulk *b);
+
+/**
+ * Give up on a bulk build, removing its file and freeing its state
+ *
+ * @param b Build state
+ */
+extern void KISSDB_bulk_abort(KISSDB_Bulk *b);
+
+/**
+ * Called by KISSDB_bulk_build() for each entry
+ *
+ * The key and value must stay valid until the next call.
+ *
+ * @return 1 if key and value are set, 0 at the end of the input, negative to abort the build
+ */
+typedef int (*KISSDB_Bulk_Next)(void *arg,const void **key,unsigned long *klen,const void **value,unsigned long *vlen);
+
+/**
+ * Build a database from a stream of entries (see KISSDB_bulk_begin())
+ *
+ * @param path Path of the database to create or replace
+ * @param flags KISSDB_OPEN_FLAG_VARLEN or 0
+ * @param expected_entries Number of entries next will return, 0 if unknown
+ * @param key_size Maximum size of keys in bytes
+ * @param value_size Maximum size of values in bytes
+ * @param next Called for each entry
+ * @param arg Passed to next
+ * @return 0 on success, negative on error or the negative value next returned
+ */
+extern int KISSDB_bulk_build(const char *path,int flags,uint64_t expected_entries,unsigned long key_size,unsigned long value_size,KISSDB_Bulk_Next next,void *arg);
+
+/**
+ * Put a write-ahead log in front of the database
+ *
+ * Creates path.wal and starts a thread that writes logged changes to it
+ * in batches. From then on puts and deletes append their record to the
+ * log and their entry to the database file, but the hash table entries
+ * they change are only updated in memory. The changed pages are written
+ * out by a checkpoint, which happens every so many bytes of log and on
+ * KISSDB_close(), after which the log is emptied. Opening the database
+ * for writing replays whatever is left in the log.
+ *
+ * @param db Database struct (opened for writing)
+ * @param durability One of the KISSDB_WAL_SYNC_ constants
+ * @param interval_ms Milliseconds between log writes unless durability is KISSDB_WAL_SYNC_COMMIT
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_wal_enable(KISSDB *db,int durability,unsigned long interval_ms);
+
+/**
+ * Get the log position just past the last logged change
+ *
+ * Call this under the same exclusive access as the put or delete, and
+ * pass the result to KISSDB_wal_wait() once that access is released.
+ *
+ * @param db Database struct
+ * @return Log sequence number, or 0 without a write-ahead log
+ */
+extern uint64_t KISSDB_wal_lsn(KISSDB *db);
+
+/**
+ * Wait until the log is durable up to a given position
+ *
+ * Only waits with KISSDB_WAL_SYNC_COMMIT durability. This does not touch
+ * the database itself, so it may and should be called without holding
+ * whatever lock serializes access to it; db->wal stays the same for as
+ * long as the database is open, including across compactions.
+ *
+ * @param wal Write-ahead log (db->wal, may be NULL)
+ * @param lsn Position from KISSDB_wal_lsn()
+ * @return 0 on success, -1 if writing or syncing the log failed
+ */
+extern int KISSDB_wal_wait(KISSDB_WAL *wal,uint64_t lsn);
+
+/**
+ * Write changed hash table pages to the database file and empty the log
+ *
+ * Needs exclusive access to db. Does nothing without a write-ahead log.
+ *
+ * @param db Database struct
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_wal_checkpoint(KISSDB *db);
+
+/**
+ * Write an index checkpoint to path.idx
+ *
+ * The checkpoint holds the hash table pages and the full hash of every
+ * stored key, so that KISSDB_open() can load the index with one read
+ * instead of reading every key. If the file has grown since, only the keys
+ * added since are read. KISSDB_close() and puts and deletes that have grown
+ * the file by enough call this on their own.
+ *
+ * Needs exclusive access to db. With a write-ahead log this checkpoints
+ * the log first.
+ *
+ * @param db Database struct
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_index_checkpoint(KISSDB *db);
+
+/**
+ * Check lookups against a Bloom filter of the stored keys first
+ *
+ * A key the filter rules out is reported as not found without probing the
+ * index, and a snapshot lookup no longer walks the key's bucket chain in the
+ * file for it. Puts add new keys to the filter, which is rebuilt larger
+ * when it fills up and without deleted keys when the database is compacted.
+ *
+ * The filter is saved to path.bloom on close and loaded from there if the
+ * database has not changed since; otherwise it is built from the key hashes
+ * held by the index, which takes no I/O.
+ *
+ * Needs exclusive access to db.
+ *
+ * @param db Database struct
+ * @param fp_rate Rate of false positives to size the filter for, e.g. 0.01
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_bloom_enable(KISSDB *db,double fp_rate);
+
+/**
+ * Value cache counters
+ */
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t entries;
+	uint64_t bytes;
+} KISSDB_Cache_Stats;
+
+/**
+ * Keep recently read values in memory
+ *
+ * The cache is split into shards by key hash, each with its own lock, so
+ * concurrent KISSDB_get() calls rarely contend. Values are cached when
+ * they are read and evicted with the CLOCK algorithm once a shard passes
+ * its share of the budget. Puts update cached values and deletes drop
+ * them, so the cache never returns stale data.
+ *
+ * @param db Database struct
+ * @param budget Memory to use for cached keys, values and their overhead, in bytes
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_cache_enable(KISSDB *db,uint64_t budget);
+
+/**
+ * Get value cache counters (all zero without a cache)
+ *
+ * @param db Database struct
+ * @param st Filled with the counters
+ */
+extern void KISSDB_cache_stats(KISSDB *db,KISSDB_Cache_Stats *st);
+
+/**
+ * Buffer pool counters
+ */
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks; /* pages written by the background writer */
+	uint64_t pages; /* pages held */
+	uint64_t table_pages; /* of those, pages holding part of a hash table */
+	uint64_t dirty;
+} KISSDB_Pool_Stats;
+
+/**
+ * Bypass the page cache and do file I/O through a buffer pool of our own
+ *
+ * The file is switched to O_DIRECT and read and written in whole 4KB pages
+ * kept in pool_bytes of aligned memory. Pages holding hash tables, which
+ * every put without a write-ahead log updates in place, are kept in
+ * preference to pages holding only entries; among those the page whose
+ * second most recent use is the oldest is evicted first (LRU-2), so a scan
+ * or compaction does not push out pages that keep being read. Dirty pages
+ * are written back by a background thread, and all of them before any
+ * sync of the file. Writes in whole pages can pad the file past its end;
+ * KISSDB_close() cuts it back.
+ *
+ * Not available with KISSDB_OPEN_FLAG_MMAP, and KISSDB_snapshot() fails
+ * while it is on. KISSDB_compact_finish() carries it over to the new file.
+ *
+ * Needs exclusive access to db.
+ *
+ * @param db Database struct
+ * @param pool_bytes Memory for the pool, at least 256KB
+ * @return 0 on success, KISSDB_ERROR_IO if the file system can't do direct I/O, other negative on error
+ */
+extern int KISSDB_direct_enable(KISSDB *db,uint64_t pool_bytes);
+
+/**
+ * Get buffer pool counters (all zero without direct I/O)
+ *
+ * @param db Database struct
+ * @param st Filled with the counters
+ */
+extern void KISSDB_direct_stats(KISSDB *db,KISSDB_Pool_Stats *st);
+
+/**
+ * Shape and health of a database (see KISSDB_stats())
+ */
+typedef struct {
+	uint64_t file_size;
+	uint64_t live_bytes; /* current entries */
+	uint64_t dead_bytes; /* overwritten and deleted entries, until a compaction */
+	uint64_t table_bytes; /* hash table pages */
+	unsigned long hash_table_size; /* buckets per page */
+	unsigned long num_hash_tables; /* pages */
+	uint64_t entries; /* occupied buckets over all pages, deletes included */
+	double load_factor; /* entries / (pages * buckets) */
+	double avg_probe; /* pages a lookup of a stored key walks, on average */
+	double avg_probe_miss; /* pages a lookup of an absent key walks, on average */
+	unsigned long max_probe; /* pages in the longest chain */
+	uint64_t index_entries; /* entries in the in-memory index */
+	uint64_t index_capacity; /* slots of the in-memory index */
+	uint64_t table_memory; /* bytes of memory holding the hash table pages */
+	uint64_t index_memory; /* bytes of memory holding the in-memory index */
+	KISSDB_Counters counters;
+} KISSDB_Stats;
+
+/**
+ * Get the shape of the hash tables and the operation and I/O counters
+ *
+ * Buckets fill page by page, so the hash table pages of a database are
+ * chained: a bucket's entries are in pages 0, 1, 2... and a put into a
+ * bucket that is full in every page appends a new page. The probe depths
+ * are the pages the on-disk structure has to be walked through; lookups
+ * go through the in-memory index instead, but deep chains still mean big
+ * pages that are mostly empty. When avg_probe_miss and max_probe keep
+ * growing, the hash table is too small for the data and a rebuild with a
+ * larger one (e.g. KISSDB_bulk_build()) pays off; when dead_bytes is
+ * large, KISSDB_compact() does.
+ *
+ * May run alongside gets, like KISSDB_get().
+ *
+ * @param db Database struct
+ * @param st Filled with the statistics
+ * @param page_entries If not NULL, set to the occupied buckets of each of the first max_pages pages
+ * @param max_pages Size of page_entries
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_stats(KISSDB *db,KISSDB_Stats *st,uint64_t *page_entries,unsigned long max_pages);
+
 /**
  * Cursor used for iterating over all entries in database
  */
@@ -142,6 +954,7 @@ typedef struct {
 	KISSDB *db;
 	unsigned long h_no;
 	unsigned long h_idx;
+	KISSDB_Snapshot *snap; /* NULL unless iterating over a snapshot */
 } KISSDB_Iterator;
 
 /**
@@ -165,6 +978,133 @@ extern void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi);
  */
 extern int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf);
 
+/**
+ * Get the next entry along with its key and value lengths
+ *
+ * @param Database iterator
+ * @param kbuf Buffer to fill with next key (key_size bytes capacity)
+ * @param klen If not NULL, set to the key length
+ * @param vbuf Buffer to fill with next value (value_size bytes capacity)
+ * @param vlen If not NULL, set to the value length
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Iterator_next_len(KISSDB_Iterator *dbi,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Cursor used for scanning all entries in file order
+ */
+typedef struct {
+	KISSDB *db;
+	uint64_t *offsets;
+	unsigned long count;
+	unsigned long pos;
+	uint8_t *buf;
+	unsigned long buf_capacity;
+	uint64_t buf_start;
+	uint64_t buf_end;
+	uint8_t *prefix;
+	unsigned long prefix_len;
+} KISSDB_Scan;
+
+/**
+ * Start a sequential scan
+ *
+ * This collects the offsets of all live entries and sorts them, so that
+ * the file can then be read front to back in large chunks rather than one
+ * small read per entry. Entries put after this call are not seen, and the
+ * database must not be compacted until the scan is closed.
+ *
+ * @param db Database struct
+ * @param s Scan to initialize
+ * @param prefix If not NULL, only return entries whose key starts with this
+ * @param prefix_len Length of prefix
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Scan_init(KISSDB *db,KISSDB_Scan *s,const void *prefix,unsigned long prefix_len);
+
+/**
+ * Get the next entry in file order
+ *
+ * @param s Scan
+ * @param kbuf Buffer to fill with next key (key_size bytes capacity)
+ * @param klen If not NULL, set to the key length
+ * @param vbuf Buffer to fill with next value (value_size bytes capacity)
+ * @param vlen If not NULL, set to the value length
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Scan_next(KISSDB_Scan *s,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Free the memory held by a scan
+ *
+ * @param s Scan
+ */
+extern void KISSDB_Scan_close(KISSDB_Scan *s);
+
+/**
+ * Take a snapshot of the database
+ *
+ * The snapshot shares the hash table pages with the database until a
+ * put or delete is about to change one, which first copies the page for
+ * each snapshot still sharing it. While any snapshot is open, values are
+ * never rewritten in place, so the entries a snapshot points to stay as
+ * they were. The snapshot reads the file through its own descriptor, so
+ * it survives a compaction or KISSDB_close(), both of which first give it
+ * private copies of every page it still shares.
+ *
+ * Taking and releasing a snapshot needs the same exclusive access as
+ * KISSDB_put(). Reading from a snapshot needs only the shared access of
+ * KISSDB_get(), so long scans no longer hold out writers for their whole
+ * length; once the database is closed, no locking is needed at all.
+ *
+ * @param db Database struct
+ * @param snap Set to the new snapshot
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_snapshot(KISSDB *db,KISSDB_Snapshot **snap);
+
+/**
+ * Release a snapshot, freeing its pages and descriptor
+ *
+ * @param snap Snapshot from KISSDB_snapshot()
+ */
+extern void KISSDB_snapshot_release(KISSDB_Snapshot *snap);
+
+/**
+ * Get an entry as it was when the snapshot was taken
+ *
+ * @param snap Snapshot
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_snapshot_get(KISSDB_Snapshot *snap,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Initialize an iterator over the entries of a snapshot
+ *
+ * Use KISSDB_Iterator_next() or KISSDB_Iterator_next_len() as usual.
+ *
+ * @param snap Snapshot
+ * @param dbi Iterator to initialize
+ */
+extern void KISSDB_snapshot_iterator_init(KISSDB_Snapshot *snap,KISSDB_Iterator *dbi);
+
+/**
+ * Start a sequential scan of a snapshot (see KISSDB_Scan_init())
+ *
+ * Use KISSDB_Scan_next() and KISSDB_Scan_close() as usual.
+ *
+ * @param snap Snapshot
+ * @param s Scan to initialize
+ * @param prefix If not NULL, only return entries whose key starts with this
+ * @param prefix_len Length of prefix
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_snapshot_scan_init(KISSDB_Snapshot *snap,KISSDB_Scan *s,const void *prefix,unsigned long prefix_len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,445 @@
+/* (Keep It) Simple Stupid Database: asynchronous gets
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+/* Compile with KISSDB_ASYNC_TEST (along with kissdb.c and -lpthread) to
+ * build as a test program. */
+
+/* io_uring is used through its system calls directly, so nothing beyond
+ * the kernel headers is needed to build this. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "kissdb_async.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Size of an entry header on a version 3 or 4 database */
+#define KISSDB_ASYNC_ENTRY_HEADER_SIZE 8
+
+/* Request buffers are aligned to this many bytes */
+#define KISSDB_ASYNC_BUFFER_ALIGN 64
+
+static int KISSDB_io_uring_setup(unsigned int entries,struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int KISSDB_io_uring_enter(int fd,unsigned int to_submit,unsigned int min_complete,unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,(void *)0,(size_t)0);
+}
+
+static int KISSDB_io_uring_register(int fd,unsigned int opcode,const void *arg,unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+
+static void KISSDB_async_ring_free(KISSDB_Async *a)
+{
+	if (a->sqes)
+		munmap(a->sqes,a->sqes_size);
+	if ((a->cq_ring)&&(a->cq_ring != a->sq_ring))
+		munmap(a->cq_ring,a->cq_ring_size);
+	if (a->sq_ring)
+		munmap(a->sq_ring,a->sq_ring_size);
+	if (a->ring_fd >= 0)
+		close(a->ring_fd);
+	a->sqes = (void *)0;
+	a->sq_ring = a->cq_ring = (uint8_t *)0;
+	a->ring_fd = -1;
+	a->fixed_fd = -1;
+	a->fixed_buffers = 0;
+}
+
+/* Set up the ring; if the kernel has no io_uring (or won't let us use
+ * it), a->ring_fd stays -1 and reads are done synchronously */
+static void KISSDB_async_ring_init(KISSDB_Async *a)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	int fds[1];
+
+	memset(&p,0,sizeof(p));
+	if ((a->ring_fd = KISSDB_io_uring_setup(a->depth,&p)) < 0) {
+		a->ring_fd = -1;
+		return;
+	}
+
+	a->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	a->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if ((p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (a->cq_ring_size > a->sq_ring_size)
+			a->sq_ring_size = a->cq_ring_size;
+		a->cq_ring_size = a->sq_ring_size;
+	}
+	a->sq_ring = mmap((void *)0,a->sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,a->ring_fd,IORING_OFF_SQ_RING);
+	if (a->sq_ring == MAP_FAILED) {
+		a->sq_ring = (uint8_t *)0;
+		KISSDB_async_ring_free(a);
+		return;
+	}
+	if ((p.features & IORING_FEAT_SINGLE_MMAP))
+		a->cq_ring = a->sq_ring;
+	else {
+		a->cq_ring = mmap((void *)0,a->cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,a->ring_fd,IORING_OFF_CQ_RING);
+		if (a->cq_ring == MAP_FAILED) {
+			a->cq_ring = (uint8_t *)0;
+			KISSDB_async_ring_free(a);
+			return;
+		}
+	}
+	a->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	a->sqes = mmap((void *)0,a->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,a->ring_fd,IORING_OFF_SQES);
+	if (a->sqes == MAP_FAILED) {
+		a->sqes = (void *)0;
+		KISSDB_async_ring_free(a);
+		return;
+	}
+
+	a->sq_head = (unsigned int *)(a->sq_ring + p.sq_off.head);
+	a->sq_tail = (unsigned int *)(a->sq_ring + p.sq_off.tail);
+	a->sq_mask = (unsigned int *)(a->sq_ring + p.sq_off.ring_mask);
+	a->sq_array = (unsigned int *)(a->sq_ring + p.sq_off.array);
+	a->cq_head = (unsigned int *)(a->cq_ring + p.cq_off.head);
+	a->cq_tail = (unsigned int *)(a->cq_ring + p.cq_off.tail);
+	a->cq_mask = (unsigned int *)(a->cq_ring + p.cq_off.ring_mask);
+	a->cqes = a->cq_ring + p.cq_off.cqes;
+
+	/* both registrations are optional: pinned buffers and a fixed file
+	 * save the kernel work per read, but plain reads work as well */
+	iov.iov_base = a->buffers;
+	iov.iov_len = (size_t)a->depth * a->buffer_size;
+	a->fixed_buffers = (KISSDB_io_uring_register(a->ring_fd,IORING_REGISTER_BUFFERS,&iov,1) == 0);
+	fds[0] = a->db->fd;
+	a->fixed_fd = (KISSDB_io_uring_register(a->ring_fd,IORING_REGISTER_FILES,fds,1) == 0) ? a->db->fd : -1;
+}
+
+int KISSDB_async_init(KISSDB_Async *a,KISSDB *db,unsigned int depth)
+{
+	void *p;
+	unsigned int i;
+
+	memset(a,0,sizeof(KISSDB_Async));
+	a->db = db;
+	a->depth = depth ? depth : KISSDB_ASYNC_DEFAULT_DEPTH;
+	a->ring_fd = -1;
+	a->fixed_fd = -1;
+	a->free_list = -1;
+	a->done_head = a->done_tail = -1;
+
+	a->buffer_size = KISSDB_ASYNC_ENTRY_HEADER_SIZE + db->key_size + db->value_size;
+	a->buffer_size = (a->buffer_size + (KISSDB_ASYNC_BUFFER_ALIGN - 1)) & ~((unsigned long)KISSDB_ASYNC_BUFFER_ALIGN - 1);
+	a->requests = calloc(a->depth,sizeof(KISSDB_Async_Request));
+	a->keys = malloc((size_t)a->depth * db->key_size);
+	if ((posix_memalign(&p,KISSDB_ASYNC_BUFFER_ALIGN,(size_t)a->depth * a->buffer_size))||(!a->requests)||(!a->keys)) {
+		free(a->requests);
+		free(a->keys);
+		return KISSDB_ERROR_MALLOC;
+	}
+	a->buffers = (uint8_t *)p;
+	for(i=a->depth;i>0;--i) {
+		a->requests[i - 1].kbuf = a->keys + ((size_t)(i - 1) * db->key_size);
+		a->requests[i - 1].next = a->free_list;
+		a->free_list = (long)(i - 1);
+	}
+
+	KISSDB_async_ring_init(a);
+
+	return 0;
+}
+
+void KISSDB_async_close(KISSDB_Async *a)
+{
+	unsigned int head;
+
+	/* the kernel may still be writing into our buffers */
+	while ((a->ring_fd >= 0)&&(a->inflight)) {
+		if ((KISSDB_io_uring_enter(a->ring_fd,0,a->inflight,IORING_ENTER_GETEVENTS) < 0)&&(errno != EINTR))
+			break;
+		head = *a->cq_head;
+		while (head != __atomic_load_n(a->cq_tail,__ATOMIC_ACQUIRE)) {
+			++head;
+			--a->inflight;
+		}
+		__atomic_store_n(a->cq_head,head,__ATOMIC_RELEASE);
+	}
+	KISSDB_async_ring_free(a);
+	free(a->buffers);
+	free(a->requests);
+	free(a->keys);
+	memset(a,0,sizeof(KISSDB_Async));
+	a->ring_fd = -1;
+	a->fixed_fd = -1;
+}
+
+static long KISSDB_async_slot(KISSDB_Async *a)
+{
+	long slot = a->free_list;
+	if (slot >= 0)
+		a->free_list = a->requests[slot].next;
+	return slot;
+}
+
+static void KISSDB_async_done(KISSDB_Async *a,long slot)
+{
+	a->requests[slot].next = -1;
+	if (a->done_tail >= 0)
+		a->requests[a->done_tail].next = slot;
+	else a->done_head = slot;
+	a->done_tail = slot;
+	++a->done;
+}
+
+/* Finish a get whose entry has been read into its buffer */
+static void KISSDB_async_finish(KISSDB_Async *a,long slot,long res)
+{
+	KISSDB_Async_Request *req = &(a->requests[slot]);
+
+	if (res < 0)
+		req->result = KISSDB_ERROR_IO;
+	else req->result = KISSDB_get_finish(a->db,req->offset,a->buffers + ((size_t)slot * a->buffer_size),(unsigned long)res,req->kbuf,req->klen,req->vbuf,&req->vlen);
+	if (req->result)
+		req->vlen = 0;
+	KISSDB_async_done(a,slot);
+}
+
+int KISSDB_async_get(KISSDB_Async *a,const void *key,unsigned long klen,void *vbuf,KISSDB_Async_Callback cb,void *arg)
+{
+	KISSDB_Async_Request *req;
+	struct io_uring_sqe *sqe;
+	uint8_t *buf;
+	unsigned int tail,idx;
+	long slot;
+	ssize_t n;
+	unsigned long got;
+
+	if (klen > a->db->key_size)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if ((slot = KISSDB_async_slot(a)) < 0)
+		return KISSDB_ASYNC_FULL;
+	req = &(a->requests[slot]);
+	req->cb = cb;
+	req->arg = arg;
+	req->vbuf = vbuf;
+	req->klen = klen;
+	req->vlen = 0;
+	memcpy(req->kbuf,key,klen);
+
+	req->result = KISSDB_get_start(a->db,key,klen,vbuf,&req->vlen,&req->offset,&req->len);
+	if (req->result != 2) {
+		if (req->result)
+			req->vlen = 0;
+		KISSDB_async_done(a,slot);
+		return 0;
+	}
+
+	buf = a->buffers + ((size_t)slot * a->buffer_size);
+	if (a->ring_fd < 0) {
+		for(got=0;got<req->len;) {
+			n = pread(a->db->fd,buf + got,req->len - got,(off_t)(req->offset + got));
+			if (n > 0)
+				got += (unsigned long)n;
+			else if ((n < 0)&&(errno == EINTR))
+				continue;
+			else break;
+		}
+		KISSDB_async_finish(a,slot,(long)got);
+		return 0;
+	}
+
+	tail = *a->sq_tail;
+	idx = tail & *a->sq_mask;
+	sqe = &(((struct io_uring_sqe *)a->sqes)[idx]);
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	sqe->opcode = a->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	/* a compaction replaces db->fd; reads then go to the new descriptor
+	 * while ones already queued finish on the old file */
+	if ((a->fixed_fd >= 0)&&(a->fixed_fd == a->db->fd)) {
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+	} else sqe->fd = a->db->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)req->len;
+	sqe->off = req->offset;
+	sqe->buf_index = 0;
+	sqe->user_data = (uint64_t)slot;
+	a->sq_array[idx] = idx;
+	__atomic_store_n(a->sq_tail,tail + 1,__ATOMIC_RELEASE);
+	++a->to_submit;
+
+	return 0;
+}
+
+int KISSDB_async_submit(KISSDB_Async *a)
+{
+	int n;
+
+	if ((a->ring_fd < 0)||(!a->to_submit))
+		return 0;
+	while ((n = KISSDB_io_uring_enter(a->ring_fd,a->to_submit,0,0)) < 0) {
+		if (errno != EINTR)
+			return KISSDB_ERROR_IO;
+	}
+	a->to_submit -= (unsigned int)n;
+	a->inflight += (unsigned int)n;
+	return n;
+}
+
+int KISSDB_async_poll(KISSDB_Async *a,unsigned int min_complete)
+{
+	struct io_uring_cqe *cqe;
+	KISSDB_Async_Request *req;
+	unsigned int head,wait;
+	long slot;
+	int n = 0;
+
+	if (a->ring_fd >= 0) {
+		/* submitting and waiting take one system call together */
+		wait = 0;
+		if (a->done < min_complete) {
+			wait = min_complete - a->done;
+			if (wait > (a->inflight + a->to_submit))
+				wait = a->inflight + a->to_submit;
+		}
+		if ((a->to_submit)||(wait)) {
+			while ((n = KISSDB_io_uring_enter(a->ring_fd,a->to_submit,wait,wait ? IORING_ENTER_GETEVENTS : 0)) < 0) {
+				if (errno != EINTR)
+					return KISSDB_ERROR_IO;
+			}
+			a->to_submit -= (unsigned int)n;
+			a->inflight += (unsigned int)n;
+		}
+
+		head = *a->cq_head;
+		while (head != __atomic_load_n(a->cq_tail,__ATOMIC_ACQUIRE)) {
+			cqe = &(((struct io_uring_cqe *)a->cqes)[head & *a->cq_mask]);
+			--a->inflight;
+			KISSDB_async_finish(a,(long)cqe->user_data,(long)cqe->res);
+			++head;
+		}
+		__atomic_store_n(a->cq_head,head,__ATOMIC_RELEASE);
+	}
+
+	/* callbacks may queue new requests, which go on the list after these */
+	n = 0;
+	while ((slot = a->done_head) >= 0) {
+		req = &(a->requests[slot]);
+		if ((a->done_head = req->next) < 0)
+			a->done_tail = -1;
+		--a->done;
+		req->next = a->free_list;
+		a->free_list = slot;
+		if (req->cb)
+			req->cb(req->arg,req->result,req->vlen);
+		++n;
+	}
+	return n;
+}
+
+#ifdef KISSDB_ASYNC_TEST
+
+#include <stdio.h>
+#include <inttypes.h>
+
+static unsigned long KISSDB_test_completed;
+static int KISSDB_test_failed;
+static char KISSDB_test_vbufs[64][64];
+
+/* arg is the key number; keys 10000 and up were never put */
+static void KISSDB_test_get_done(void *arg,int result,unsigned long vlen)
+{
+	uint64_t i = (uint64_t)(uintptr_t)arg;
+	char expect[64];
+	unsigned long elen;
+
+	++KISSDB_test_completed;
+	if (i >= 10000) {
+		if (result != 1)
+			KISSDB_test_failed = 1;
+		return;
+	}
+	elen = (unsigned long)snprintf(expect,sizeof(expect),"value.%"PRIu64,i);
+	if ((result)||(vlen != elen)||(memcmp(KISSDB_test_vbufs[i % 64],expect,elen)))
+		KISSDB_test_failed = 1;
+}
+
+int main(int argc,char **argv)
+{
+	KISSDB db;
+	KISSDB_Async a;
+	char kbuf[64],vbuf[64];
+	unsigned long klen,vlen;
+	uint64_t i;
+
+	printf("Putting 10000 values...\n");
+
+	if (KISSDB_open(&db,"test-async.db",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_VARLEN,1024,64,64)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"value.%"PRIu64,i);
+		if (KISSDB_put_len(&db,kbuf,klen,vbuf,vlen)) {
+			printf("KISSDB_put_len failed\n");
+			return 1;
+		}
+	}
+	KISSDB_close(&db);
+
+	printf("Re-opening and getting 10000 values and 10000 missing keys, 64 at a time...\n");
+
+	if (KISSDB_open(&db,"test-async.db",KISSDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	if (KISSDB_async_init(&a,&db,64)) {
+		printf("KISSDB_async_init failed\n");
+		return 1;
+	}
+	printf("(%s, %s buffers, %s file)\n",(a.ring_fd >= 0) ? "io_uring" : "no io_uring",a.fixed_buffers ? "registered" : "plain",(a.fixed_fd >= 0) ? "fixed" : "plain");
+	for(i=0;i<20000;++i) {
+		/* a value buffer is reused every 64 keys, so keep at most 64
+		 * requests outstanding */
+		while ((i - KISSDB_test_completed) >= 64) {
+			if (KISSDB_async_poll(&a,1) < 0) {
+				printf("KISSDB_async_poll failed\n");
+				return 1;
+			}
+		}
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if (KISSDB_async_get(&a,kbuf,klen,KISSDB_test_vbufs[i % 64],KISSDB_test_get_done,(void *)(uintptr_t)i)) {
+			printf("KISSDB_async_get failed\n");
+			return 1;
+		}
+		if ((i % 16) == 15)
+			KISSDB_async_submit(&a);
+	}
+	while (KISSDB_test_completed < 20000) {
+		if (KISSDB_async_poll(&a,20000 - (unsigned int)KISSDB_test_completed) < 0)
+			break;
+	}
+	if ((KISSDB_test_failed)||(KISSDB_test_completed != 20000)) {
+		printf("KISSDB_async_get completions failed\n");
+		return 1;
+	}
+	KISSDB_async_close(&a);
+	KISSDB_close(&db);
+
+	printf("All tests OK!\n");
+
+	return 0;
+}
+
+#endif
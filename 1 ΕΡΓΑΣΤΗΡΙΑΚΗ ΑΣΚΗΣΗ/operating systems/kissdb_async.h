@@ -0,0 +1,151 @@
+/* (Keep It) Simple Stupid Database: asynchronous gets
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#ifndef ___KISSDB_ASYNC_H
+#define ___KISSDB_ASYNC_H
+
+#include <stdint.h>
+
+#include "kissdb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Requests a KISSDB_Async can have in flight unless told otherwise
+ */
+#define KISSDB_ASYNC_DEFAULT_DEPTH 64
+
+/**
+ * Returned when every request slot is in use; reap completions with
+ * KISSDB_async_poll() and try again
+ */
+#define KISSDB_ASYNC_FULL 1
+
+/**
+ * Called by KISSDB_async_poll() when a request completes
+ *
+ * @param arg Argument given with the request
+ * @param result As KISSDB_get_len() would have returned
+ * @param vlen Length of the value for a get that found its key, else 0
+ */
+typedef void (*KISSDB_Async_Callback)(void *arg,int result,unsigned long vlen);
+
+/**
+ * A request slot (see KISSDB_async_get())
+ */
+typedef struct {
+	KISSDB_Async_Callback cb;
+	void *arg;
+	void *vbuf;
+	uint8_t *kbuf; /* copy of the key */
+	unsigned long klen;
+	uint64_t offset;
+	unsigned long len;
+	int result;
+	unsigned long vlen;
+	long next; /* next slot in the free or done list, -1 at the end */
+} KISSDB_Async_Request;
+
+/**
+ * Asynchronous request queue for one database
+ *
+ * Gets that need a read from the file are queued on an io_uring and
+ * submitted together by KISSDB_async_submit() or KISSDB_async_poll(), so
+ * one thread can keep up to depth reads in flight. Entries are read into
+ * buffers registered with the kernel, through the database descriptor
+ * registered as a fixed file, falling back to plain reads if either cannot
+ * be registered. Without io_uring at all, reads are done synchronously and
+ * completions are still delivered through KISSDB_async_poll().
+ *
+ * Puts are not queued: appending an entry only writes to the page cache,
+ * so KISSDB_put() is called directly between gets.
+ *
+ * A KISSDB_Async is used by one thread at a time. That thread must hold
+ * the same access as for KISSDB_get() from queueing a get until its
+ * completion has been delivered.
+ */
+typedef struct {
+	KISSDB *db;
+	unsigned int depth;
+	int ring_fd; /* -1 without io_uring */
+	int fixed_fd; /* db->fd as registered, -1 if not registered */
+	int fixed_buffers;
+	uint8_t *sq_ring;
+	uint8_t *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head,*sq_tail,*sq_mask,*sq_array;
+	unsigned int *cq_head,*cq_tail,*cq_mask;
+	void *cqes;
+	unsigned int to_submit;
+	unsigned int inflight;
+	KISSDB_Async_Request *requests;
+	uint8_t *buffers; /* one entry-sized buffer per request */
+	unsigned long buffer_size;
+	uint8_t *keys;
+	long free_list;
+	long done_head,done_tail;
+	unsigned int done;
+} KISSDB_Async;
+
+/**
+ * Set up an asynchronous request queue for a database
+ *
+ * @param a Request queue struct
+ * @param db Open database
+ * @param depth Most requests in flight at once (0 for KISSDB_ASYNC_DEFAULT_DEPTH)
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_async_init(KISSDB_Async *a,KISSDB *db,unsigned int depth);
+
+/**
+ * Tear down a request queue
+ *
+ * Waits for reads still in flight; their callbacks are not called.
+ *
+ * @param a Request queue struct
+ */
+extern void KISSDB_async_close(KISSDB_Async *a);
+
+/**
+ * Queue a get
+ *
+ * @param a Request queue struct
+ * @param key Key (klen bytes), copied
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity), filled in before cb is called
+ * @param cb Called from KISSDB_async_poll() on completion
+ * @param arg Passed to cb
+ * @return 0 if queued, KISSDB_ASYNC_FULL if no slot is free, negative on error
+ */
+extern int KISSDB_async_get(KISSDB_Async *a,const void *key,unsigned long klen,void *vbuf,KISSDB_Async_Callback cb,void *arg);
+
+/**
+ * Hand all queued reads to the kernel with a single system call
+ *
+ * @param a Request queue struct
+ * @return Number of reads submitted, negative on error
+ */
+extern int KISSDB_async_submit(KISSDB_Async *a);
+
+/**
+ * Submit queued reads, then deliver completions
+ *
+ * @param a Request queue struct
+ * @param min_complete Wait until at least this many requests have completed (capped at those outstanding)
+ * @return Number of callbacks called, negative on error
+ */
+extern int KISSDB_async_poll(KISSDB_Async *a,unsigned int min_complete);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
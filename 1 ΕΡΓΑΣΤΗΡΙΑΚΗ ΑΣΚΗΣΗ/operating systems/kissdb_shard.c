@@ -0,0 +1,611 @@
+/* (Keep It) Simple Stupid Database: hash-partitioned shards
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+/* Compile with KISSDB_SHARD_TEST (along with kissdb.c and -lpthread) to
+ * build as a test program. */
+
+#include "kissdb_shard.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/* First line of the manifest, followed by its version */
+#define KISSDB_SHARD_MAGIC "KdBS"
+#define KISSDB_SHARD_MANIFEST_VERSION 1
+
+/* Seeded FNV-1a, finished with the Murmur3 64-bit mixer. This is not the
+ * hash the shards themselves use, so the keys that land in one shard are
+ * still spread over all of that shard's buckets. */
+static uint64_t KISSDB_Sharded_hash(uint64_t seed,const void *b,unsigned long len)
+{
+	unsigned long i;
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	for(i=0;i<len;++i) {
+		h ^= (uint64_t)(((const uint8_t *)b)[i]);
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Length of a key as far as picking its shard goes. Fixed-size (version
+ * 2) shards zero-pad every key to key_size, so a key is the same key
+ * with or without trailing zero bytes and they are left out. */
+static unsigned long KISSDB_Sharded_klen(int fixed,const void *key,unsigned long klen)
+{
+	if (fixed) {
+		while ((klen)&&(!((const uint8_t *)key)[klen - 1]))
+			--klen;
+	}
+	return klen;
+}
+
+static uint64_t KISSDB_Sharded_new_seed(void)
+{
+	struct timespec ts;
+	uint64_t seed = 0;
+	int fd = open("/dev/urandom",O_RDONLY);
+
+	if (fd >= 0) {
+		if (read(fd,&seed,sizeof(seed)) != (ssize_t)sizeof(seed))
+			seed = 0;
+		close(fd);
+	}
+	if (!seed) {
+		clock_gettime(CLOCK_REALTIME,&ts);
+		seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+	}
+	return seed;
+}
+
+/* Write the manifest to a temporary file and rename it into place */
+static int KISSDB_Sharded_write_manifest(const char *path,unsigned long num_shards,uint64_t seed)
+{
+	char *tmp;
+	FILE *f;
+	int r = 0;
+
+	if (!(tmp = malloc(strlen(path) + 5)))
+		return KISSDB_ERROR_MALLOC;
+	strcpy(tmp,path);
+	strcat(tmp,".tmp");
+	if (!(f = fopen(tmp,"w"))) {
+		free(tmp);
+		return KISSDB_ERROR_IO;
+	}
+	if (fprintf(f,"%s %d %lu %016llx\n",KISSDB_SHARD_MAGIC,KISSDB_SHARD_MANIFEST_VERSION,num_shards,(unsigned long long)seed) < 0)
+		r = KISSDB_ERROR_IO;
+	if (fflush(f))
+		r = KISSDB_ERROR_IO;
+	if ((!r)&&(fsync(fileno(f))))
+		r = KISSDB_ERROR_IO;
+	if (fclose(f))
+		r = KISSDB_ERROR_IO;
+	if ((!r)&&(rename(tmp,path)))
+		r = KISSDB_ERROR_IO;
+	if (r)
+		unlink(tmp);
+	free(tmp);
+	return r;
+}
+
+int KISSDB_Sharded_open(
+	KISSDB_Sharded *sdb,
+	const char *path,
+	int mode,
+	unsigned long num_shards,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	char magic[8];
+	unsigned long long seed;
+	char *spath;
+	unsigned long i;
+	int version;
+	int created = 0;
+	FILE *f;
+	int r;
+
+	sdb->num_shards = 0;
+	sdb->shards = (KISSDB_Shard *)0;
+
+	f = ((mode & 0xff) == KISSDB_OPEN_MODE_RWREPLACE) ? (FILE *)0 : fopen(path,"r");
+	if (f) {
+		if ((fscanf(f,"%7s %d %lu %llx",magic,&version,&sdb->num_shards,&seed) != 4)||(strcmp(magic,KISSDB_SHARD_MAGIC))||(version != KISSDB_SHARD_MANIFEST_VERSION)||(!sdb->num_shards)) {
+			fclose(f);
+			return KISSDB_ERROR_CORRUPT_DBFILE;
+		}
+		fclose(f);
+		sdb->seed = (uint64_t)seed;
+	} else {
+		if (((mode & 0xff) != KISSDB_OPEN_MODE_RWCREAT)&&((mode & 0xff) != KISSDB_OPEN_MODE_RWREPLACE))
+			return ((mode & 0xff) == KISSDB_OPEN_MODE_RDONLY)||((mode & 0xff) == KISSDB_OPEN_MODE_RDWR) ? KISSDB_ERROR_IO : KISSDB_ERROR_INVALID_PARAMETERS;
+		if (!num_shards)
+			return KISSDB_ERROR_INVALID_PARAMETERS;
+		sdb->num_shards = num_shards;
+		sdb->seed = KISSDB_Sharded_new_seed();
+		created = 1;
+	}
+
+	if (!(sdb->shards = calloc(sdb->num_shards,sizeof(KISSDB_Shard))))
+		return KISSDB_ERROR_MALLOC;
+	if (!(spath = malloc(strlen(path) + 24))) {
+		free(sdb->shards);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(i=0;i<sdb->num_shards;++i) {
+		sprintf(spath,"%s.%lu",path,i);
+		if ((r = KISSDB_open(&(sdb->shards[i].db),spath,mode,hash_table_size,key_size,value_size))) {
+			while (i--) {
+				KISSDB_close(&(sdb->shards[i].db));
+				pthread_rwlock_destroy(&(sdb->shards[i].lock));
+			}
+			free(spath);
+			free(sdb->shards);
+			sdb->shards = (KISSDB_Shard *)0;
+			return r;
+		}
+		pthread_rwlock_init(&(sdb->shards[i].lock),(const pthread_rwlockattr_t *)0);
+	}
+	free(spath);
+
+	/* the manifest goes last, so a database only exists once all of its
+	 * shards do */
+	if ((created)&&((r = KISSDB_Sharded_write_manifest(path,sdb->num_shards,sdb->seed)))) {
+		KISSDB_Sharded_close(sdb);
+		return r;
+	}
+
+	return 0;
+}
+
+void KISSDB_Sharded_close(KISSDB_Sharded *sdb)
+{
+	unsigned long i;
+
+	if (sdb->shards) {
+		for(i=0;i<sdb->num_shards;++i) {
+			KISSDB_close(&(sdb->shards[i].db));
+			pthread_rwlock_destroy(&(sdb->shards[i].lock));
+		}
+		free(sdb->shards);
+	}
+	sdb->shards = (KISSDB_Shard *)0;
+	sdb->num_shards = 0;
+}
+
+unsigned long KISSDB_Sharded_shard(KISSDB_Sharded *sdb,const void *key,unsigned long klen)
+{
+	klen = KISSDB_Sharded_klen(sdb->shards[0].db.version == KISSDB_VERSION_FIXED,key,klen);
+	return (unsigned long)((KISSDB_Sharded_hash(sdb->seed,key,klen) >> 32) % (uint64_t)sdb->num_shards);
+}
+
+int KISSDB_Sharded_get_len(KISSDB_Sharded *sdb,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB_Shard *s = &(sdb->shards[KISSDB_Sharded_shard(sdb,key,klen)]);
+	int r;
+
+	pthread_rwlock_rdlock(&s->lock);
+	r = KISSDB_get_len(&s->db,key,klen,vbuf,vlen);
+	pthread_rwlock_unlock(&s->lock);
+	return r;
+}
+
+int KISSDB_Sharded_get(KISSDB_Sharded *sdb,const void *key,void *vbuf)
+{
+	KISSDB_Shard *s = &(sdb->shards[KISSDB_Sharded_shard(sdb,key,sdb->shards[0].db.key_size)]);
+	int r;
+
+	pthread_rwlock_rdlock(&s->lock);
+	r = KISSDB_get(&s->db,key,vbuf);
+	pthread_rwlock_unlock(&s->lock);
+	return r;
+}
+
+int KISSDB_Sharded_put_len(KISSDB_Sharded *sdb,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	KISSDB_Shard *s = &(sdb->shards[KISSDB_Sharded_shard(sdb,key,klen)]);
+	KISSDB_WAL *wal;
+	uint64_t lsn;
+	int r;
+
+	pthread_rwlock_wrlock(&s->lock);
+	r = KISSDB_put_len(&s->db,key,klen,value,vlen);
+	wal = s->db.wal;
+	lsn = KISSDB_wal_lsn(&s->db);
+	pthread_rwlock_unlock(&s->lock);
+
+	/* wait outside the lock, so writers waiting together share a sync */
+	if (!r)
+		r = KISSDB_wal_wait(wal,lsn);
+	return r;
+}
+
+int KISSDB_Sharded_put(KISSDB_Sharded *sdb,const void *key,const void *value)
+{
+	return KISSDB_Sharded_put_len(sdb,key,sdb->shards[0].db.key_size,value,sdb->shards[0].db.value_size);
+}
+
+int KISSDB_Sharded_delete(KISSDB_Sharded *sdb,const void *key,unsigned long klen)
+{
+	KISSDB_Shard *s = &(sdb->shards[KISSDB_Sharded_shard(sdb,key,klen)]);
+	KISSDB_WAL *wal;
+	uint64_t lsn;
+	int r;
+
+	pthread_rwlock_wrlock(&s->lock);
+	r = KISSDB_delete(&s->db,key,klen);
+	wal = s->db.wal;
+	lsn = KISSDB_wal_lsn(&s->db);
+	pthread_rwlock_unlock(&s->lock);
+
+	if (!r)
+		r = KISSDB_wal_wait(wal,lsn);
+	return r;
+}
+
+int KISSDB_Sharded_wal_enable(KISSDB_Sharded *sdb,int durability,unsigned long interval_ms)
+{
+	unsigned long i;
+	int r;
+
+	for(i=0;i<sdb->num_shards;++i) {
+		pthread_rwlock_wrlock(&(sdb->shards[i].lock));
+		r = KISSDB_wal_enable(&(sdb->shards[i].db),durability,interval_ms);
+		pthread_rwlock_unlock(&(sdb->shards[i].lock));
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+int KISSDB_Sharded_cache_enable(KISSDB_Sharded *sdb,uint64_t budget)
+{
+	unsigned long i;
+	int r;
+
+	for(i=0;i<sdb->num_shards;++i) {
+		pthread_rwlock_wrlock(&(sdb->shards[i].lock));
+		r = KISSDB_cache_enable(&(sdb->shards[i].db),budget / sdb->num_shards);
+		pthread_rwlock_unlock(&(sdb->shards[i].lock));
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+int KISSDB_Sharded_bloom_enable(KISSDB_Sharded *sdb,double fp_rate)
+{
+	unsigned long i;
+	int r;
+
+	for(i=0;i<sdb->num_shards;++i) {
+		pthread_rwlock_wrlock(&(sdb->shards[i].lock));
+		r = KISSDB_bloom_enable(&(sdb->shards[i].db),fp_rate);
+		pthread_rwlock_unlock(&(sdb->shards[i].lock));
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
+void KISSDB_Sharded_cache_stats(KISSDB_Sharded *sdb,KISSDB_Cache_Stats *st)
+{
+	KISSDB_Cache_Stats s;
+	unsigned long i;
+
+	memset(st,0,sizeof(KISSDB_Cache_Stats));
+	for(i=0;i<sdb->num_shards;++i) {
+		pthread_rwlock_rdlock(&(sdb->shards[i].lock));
+		KISSDB_cache_stats(&(sdb->shards[i].db),&s);
+		pthread_rwlock_unlock(&(sdb->shards[i].lock));
+		st->hits += s.hits;
+		st->misses += s.misses;
+		st->evictions += s.evictions;
+		st->entries += s.entries;
+		st->bytes += s.bytes;
+	}
+}
+
+void KISSDB_Sharded_Iterator_init(KISSDB_Sharded *sdb,KISSDB_Sharded_Iterator *dbi)
+{
+	dbi->sdb = sdb;
+	dbi->shard = 0;
+	KISSDB_Iterator_init(&(sdb->shards[0].db),&dbi->dbi);
+}
+
+int KISSDB_Sharded_Iterator_next_len(KISSDB_Sharded_Iterator *dbi,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen)
+{
+	KISSDB_Shard *s;
+	int r;
+
+	while (dbi->shard < dbi->sdb->num_shards) {
+		s = &(dbi->sdb->shards[dbi->shard]);
+		pthread_rwlock_rdlock(&s->lock);
+		/* a compaction may have swapped the shard's state in place, but
+		 * the struct itself never moves */
+		r = KISSDB_Iterator_next_len(&dbi->dbi,kbuf,klen,vbuf,vlen);
+		pthread_rwlock_unlock(&s->lock);
+		if (r)
+			return r;
+		if (++dbi->shard < dbi->sdb->num_shards)
+			KISSDB_Iterator_init(&(dbi->sdb->shards[dbi->shard].db),&dbi->dbi);
+	}
+	return 0;
+}
+
+int KISSDB_Sharded_Iterator_next(KISSDB_Sharded_Iterator *dbi,void *kbuf,void *vbuf)
+{
+	KISSDB *db = &(dbi->sdb->shards[0].db);
+	unsigned long klen = 0,vlen = 0;
+	int r = KISSDB_Sharded_Iterator_next_len(dbi,kbuf,&klen,vbuf,&vlen);
+	if (r > 0) {
+		if (klen < db->key_size)
+			memset(((uint8_t *)kbuf) + klen,0,db->key_size - klen);
+		if (vlen < db->value_size)
+			memset(((uint8_t *)vbuf) + vlen,0,db->value_size - vlen);
+	}
+	return r;
+}
+
+int KISSDB_Sharded_bulk_begin(KISSDB_Sharded_Bulk *sb,const char *path,int flags,unsigned long num_shards,uint64_t expected_entries,unsigned long key_size,unsigned long value_size)
+{
+	char *spath;
+	unsigned long i;
+	int r;
+
+	if (!num_shards)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	sb->num_shards = num_shards;
+	sb->seed = KISSDB_Sharded_new_seed();
+	sb->fixed = !(flags & KISSDB_OPEN_FLAG_VARLEN);
+	if (!(sb->shards = calloc(num_shards,sizeof(KISSDB_Bulk *))))
+		return KISSDB_ERROR_MALLOC;
+	if (!(sb->path = strdup(path))) {
+		free(sb->shards);
+		return KISSDB_ERROR_MALLOC;
+	}
+	if (!(spath = malloc(strlen(path) + 24))) {
+		KISSDB_Sharded_bulk_abort(sb);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(i=0;i<num_shards;++i) {
+		sprintf(spath,"%s.%lu",path,i);
+		if ((r = KISSDB_bulk_begin(&(sb->shards[i]),spath,flags,expected_entries / num_shards,key_size,value_size))) {
+			free(spath);
+			KISSDB_Sharded_bulk_abort(sb);
+			return r;
+		}
+	}
+	free(spath);
+	return 0;
+}
+
+int KISSDB_Sharded_bulk_add(KISSDB_Sharded_Bulk *sb,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	unsigned long i = (unsigned long)((KISSDB_Sharded_hash(sb->seed,key,KISSDB_Sharded_klen(sb->fixed,key,klen)) >> 32) % (uint64_t)sb->num_shards);
+	return KISSDB_bulk_add(sb->shards[i],key,klen,value,vlen);
+}
+
+int KISSDB_Sharded_bulk_finish(KISSDB_Sharded_Bulk *sb)
+{
+	unsigned long i;
+	int r = 0;
+
+	for(i=0;i<sb->num_shards;++i) {
+		if (!r)
+			r = KISSDB_bulk_finish(sb->shards[i]);
+		else KISSDB_bulk_abort(sb->shards[i]);
+		sb->shards[i] = (KISSDB_Bulk *)0;
+	}
+
+	/* as with KISSDB_Sharded_open(), the manifest goes last */
+	if (!r)
+		r = KISSDB_Sharded_write_manifest(sb->path,sb->num_shards,sb->seed);
+	KISSDB_Sharded_bulk_abort(sb);
+	return r;
+}
+
+void KISSDB_Sharded_bulk_abort(KISSDB_Sharded_Bulk *sb)
+{
+	unsigned long i;
+
+	if (sb->shards) {
+		for(i=0;i<sb->num_shards;++i) {
+			if (sb->shards[i])
+				KISSDB_bulk_abort(sb->shards[i]);
+		}
+		free(sb->shards);
+	}
+	free(sb->path);
+	sb->shards = (KISSDB_Bulk **)0;
+	sb->path = (char *)0;
+	sb->num_shards = 0;
+}
+
+#ifdef KISSDB_SHARD_TEST
+
+#include <inttypes.h>
+
+static KISSDB_Sharded KISSDB_test_sdb;
+
+/* Each writer puts 2500 keys of its own */
+static void *KISSDB_test_writer(void *arg)
+{
+	uint64_t i;
+	char kbuf[64];
+	unsigned long klen;
+
+	for(i=0;i<2500;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,(uint64_t)(uintptr_t)arg * 2500 + i);
+		if (KISSDB_Sharded_put_len(&KISSDB_test_sdb,kbuf,klen,kbuf,klen))
+			return (void *)1;
+	}
+	return (void *)0;
+}
+
+int main(int argc,char **argv)
+{
+	KISSDB_Sharded_Iterator dbi;
+	KISSDB_Sharded_Bulk bulk;
+	pthread_t writers[4];
+	void *tret;
+	char kbuf[64],vbuf[64];
+	char seen[10000];
+	unsigned long klen,vlen,i,n,min,max;
+	unsigned long counts[8];
+	int q;
+
+	printf("Creating sharded database test.kdbs with 8 shards...\n");
+
+	if (KISSDB_Sharded_open(&KISSDB_test_sdb,"test.kdbs",KISSDB_OPEN_MODE_RWREPLACE|KISSDB_OPEN_FLAG_VARLEN,8,1024,64,64)) {
+		printf("KISSDB_Sharded_open failed\n");
+		return 1;
+	}
+
+	printf("Putting 10000 values from 4 threads at once...\n");
+
+	for(i=0;i<4;++i)
+		pthread_create(&writers[i],NULL,KISSDB_test_writer,(void *)(uintptr_t)i);
+	q = 0;
+	for(i=0;i<4;++i) {
+		pthread_join(writers[i],&tret);
+		if (tret)
+			q = 1;
+	}
+	if (q) {
+		printf("KISSDB_Sharded_put_len failed\n");
+		return 1;
+	}
+	KISSDB_Sharded_close(&KISSDB_test_sdb);
+
+	printf("Re-opening, getting and iterating over 10000 values...\n");
+
+	if (KISSDB_Sharded_open(&KISSDB_test_sdb,"test.kdbs",KISSDB_OPEN_MODE_RDWR,0,0,0,0)) {
+		printf("KISSDB_Sharded_open failed\n");
+		return 1;
+	}
+	if (KISSDB_test_sdb.num_shards != 8) {
+		printf("KISSDB_Sharded_open read a bad manifest\n");
+		return 1;
+	}
+	memset(counts,0,sizeof(counts));
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%lu",i);
+		if ((KISSDB_Sharded_get_len(&KISSDB_test_sdb,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("KISSDB_Sharded_get_len failed (%lu)\n",i);
+			return 1;
+		}
+		++counts[KISSDB_Sharded_shard(&KISSDB_test_sdb,kbuf,klen)];
+	}
+	min = max = counts[0];
+	for(i=1;i<8;++i) {
+		if (counts[i] < min)
+			min = counts[i];
+		if (counts[i] > max)
+			max = counts[i];
+	}
+	if ((min * 2) < max) {
+		printf("keys are spread unevenly over shards (%lu to %lu)\n",min,max);
+		return 1;
+	}
+	klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.7");
+	if ((KISSDB_Sharded_delete(&KISSDB_test_sdb,kbuf,klen))||(KISSDB_Sharded_get_len(&KISSDB_test_sdb,kbuf,klen,vbuf,&vlen) != 1)) {
+		printf("KISSDB_Sharded_delete failed\n");
+		return 1;
+	}
+	memset(seen,0,sizeof(seen));
+	n = 0;
+	KISSDB_Sharded_Iterator_init(&KISSDB_test_sdb,&dbi);
+	while ((q = KISSDB_Sharded_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen)) > 0) {
+		kbuf[klen] = (char)0;
+		i = strtoul(kbuf + 8,(char **)0,10);
+		if ((i >= 10000)||(seen[i])) {
+			printf("KISSDB_Sharded_Iterator_next_len failed, bad key\n");
+			return 1;
+		}
+		seen[i] = 1;
+		++n;
+	}
+	if ((q < 0)||(n != 9999)) {
+		printf("KISSDB_Sharded_Iterator_next_len failed (%lu entries)\n",n);
+		return 1;
+	}
+	KISSDB_Sharded_close(&KISSDB_test_sdb);
+
+	printf("Bulk building 10000 values into 4 shards...\n");
+
+	if (KISSDB_Sharded_bulk_begin(&bulk,"test.kdbs",KISSDB_OPEN_FLAG_VARLEN,4,10000,64,64)) {
+		printf("KISSDB_Sharded_bulk_begin failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bulk.%lu",i);
+		if (KISSDB_Sharded_bulk_add(&bulk,kbuf,klen,kbuf,klen)) {
+			printf("KISSDB_Sharded_bulk_add failed\n");
+			return 1;
+		}
+	}
+	if (KISSDB_Sharded_bulk_finish(&bulk)) {
+		printf("KISSDB_Sharded_bulk_finish failed\n");
+		return 1;
+	}
+	if ((KISSDB_Sharded_open(&KISSDB_test_sdb,"test.kdbs",KISSDB_OPEN_MODE_RDONLY,0,0,0,0))||(KISSDB_test_sdb.num_shards != 4)) {
+		printf("KISSDB_Sharded_open after bulk build failed\n");
+		return 1;
+	}
+	for(i=0;i<10000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"bulk.%lu",i);
+		if ((KISSDB_Sharded_get_len(&KISSDB_test_sdb,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("KISSDB_Sharded_get_len after bulk build failed (%lu)\n",i);
+			return 1;
+		}
+	}
+	KISSDB_Sharded_close(&KISSDB_test_sdb);
+
+	printf("Fixed size shards: putting and getting with short and padded keys...\n");
+
+	if (KISSDB_Sharded_open(&KISSDB_test_sdb,"test.kdbs",KISSDB_OPEN_MODE_RWREPLACE,8,64,32,16)) {
+		printf("KISSDB_Sharded_open (fixed) failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		memset(kbuf,0,sizeof(kbuf));
+		memset(vbuf,0,sizeof(vbuf));
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"fixed.%lu",i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%lu",i);
+		/* every other key goes in short and is read back padded, the
+		 * rest the other way around */
+		if ((i & 1) ? (KISSDB_Sharded_put(&KISSDB_test_sdb,kbuf,vbuf)) : (KISSDB_Sharded_put_len(&KISSDB_test_sdb,kbuf,klen,vbuf,vlen))) {
+			printf("KISSDB_Sharded_put (fixed) failed (%lu)\n",i);
+			return 1;
+		}
+		memset(vbuf,0xff,sizeof(vbuf));
+		q = (i & 1) ? KISSDB_Sharded_get_len(&KISSDB_test_sdb,kbuf,klen,vbuf,&vlen) : KISSDB_Sharded_get(&KISSDB_test_sdb,kbuf,vbuf);
+		if ((q)||(strtoul(vbuf,(char **)0,10) != i)) {
+			printf("KISSDB_Sharded_get (fixed) missed a key put with another length (%lu) (%d)\n",i,q);
+			return 1;
+		}
+	}
+	KISSDB_Sharded_close(&KISSDB_test_sdb);
+
+	printf("All tests OK!\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,292 @@
+/* (Keep It) Simple Stupid Database: hash-partitioned shards
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#ifndef ___KISSDB_SHARD_H
+#define ___KISSDB_SHARD_H
+
+#include <pthread.h>
+
+#include "kissdb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * One shard: a KISSDB database and the lock that guards it
+ *
+ * Gets take the lock for reading, puts and deletes for writing. Code that
+ * calls KISSDB functions on db directly (e.g. to compact it) must take
+ * the lock the same way.
+ */
+typedef struct {
+	KISSDB db;
+	pthread_rwlock_t lock;
+} KISSDB_Shard;
+
+/**
+ * Sharded database state
+ *
+ * The keyspace is split by key hash across num_shards KISSDB files,
+ * path.0 to path.(num_shards-1), each with its own lock, so writers to
+ * different shards don't wait for each other. The number of shards and
+ * the seed of the hash that picks a shard are fixed when the database is
+ * created and kept in a small text manifest at path.
+ */
+typedef struct {
+	unsigned long num_shards;
+	uint64_t seed;
+	KISSDB_Shard *shards;
+} KISSDB_Sharded;
+
+/**
+ * Open a sharded database
+ *
+ * Like KISSDB_open(): if the database could be created, the _size
+ * parameters and num_shards must be given; if it exists they are read
+ * from the manifest and the shards. The mode and flags apply to every
+ * shard.
+ *
+ * @param sdb Sharded database struct
+ * @param path Path to manifest; shards are path.0, path.1, ...
+ * @param mode One of the KISSDB_OPEN_MODE constants, optionally OR'ed with KISSDB_OPEN_FLAG_ flags
+ * @param num_shards Number of shards (must be >0 when creating)
+ * @param hash_table_size Size of each shard's hash table in 64-bit entries
+ * @param key_size Size of keys in bytes
+ * @param value_size Size of values in bytes
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Sharded_open(
+	KISSDB_Sharded *sdb,
+	const char *path,
+	int mode,
+	unsigned long num_shards,
+	unsigned long hash_table_size,
+	unsigned long key_size,
+	unsigned long value_size);
+
+/**
+ * Close a sharded database
+ *
+ * @param sdb Sharded database struct
+ */
+extern void KISSDB_Sharded_close(KISSDB_Sharded *sdb);
+
+/**
+ * Get the shard a key belongs to
+ *
+ * On fixed-size (version 2) shards trailing zero bytes of the key are
+ * ignored, since every key is zero-padded to key_size, so a key maps to
+ * the same shard whether it is given with its length or padded.
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key
+ * @return Shard index, less than num_shards
+ */
+extern unsigned long KISSDB_Sharded_shard(KISSDB_Sharded *sdb,const void *key,unsigned long klen);
+
+/**
+ * Get an entry (see KISSDB_get_len())
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_Sharded_get_len(KISSDB_Sharded *sdb,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Get an entry with a key_size key (see KISSDB_get())
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (key_size bytes)
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_Sharded_get(KISSDB_Sharded *sdb,const void *key,void *vbuf);
+
+/**
+ * Put an entry (see KISSDB_put_len())
+ *
+ * If the shard has a write-ahead log this also waits, after releasing
+ * the shard's lock, for the change to be as durable as the log's policy
+ * asks.
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return -1 on I/O error, 0 on success
+ */
+extern int KISSDB_Sharded_put_len(KISSDB_Sharded *sdb,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Put an entry with a key_size key and value_size value (see KISSDB_put())
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (key_size bytes)
+ * @param value Value (value_size bytes)
+ * @return -1 on I/O error, 0 on success
+ */
+extern int KISSDB_Sharded_put(KISSDB_Sharded *sdb,const void *key,const void *value);
+
+/**
+ * Delete an entry (see KISSDB_delete())
+ *
+ * @param sdb Sharded database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @return -1 on I/O error, 0 on success, 1 on not found, -3 on a version 2 database
+ */
+extern int KISSDB_Sharded_delete(KISSDB_Sharded *sdb,const void *key,unsigned long klen);
+
+/**
+ * Put a write-ahead log in front of every shard (see KISSDB_wal_enable())
+ *
+ * @param sdb Sharded database struct
+ * @param durability One of the KISSDB_WAL_SYNC_ constants
+ * @param interval_ms Milliseconds between log writes unless durability is KISSDB_WAL_SYNC_COMMIT
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Sharded_wal_enable(KISSDB_Sharded *sdb,int durability,unsigned long interval_ms);
+
+/**
+ * Give every shard a value cache (see KISSDB_cache_enable())
+ *
+ * @param sdb Sharded database struct
+ * @param budget Total memory for all shards' caches, in bytes
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Sharded_cache_enable(KISSDB_Sharded *sdb,uint64_t budget);
+
+/**
+ * Give every shard a Bloom filter of its keys (see KISSDB_bloom_enable())
+ *
+ * @param sdb Sharded database struct
+ * @param fp_rate Rate of false positives to size the filters for
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Sharded_bloom_enable(KISSDB_Sharded *sdb,double fp_rate);
+
+/**
+ * Get value cache counters summed over all shards
+ *
+ * @param sdb Sharded database struct
+ * @param st Filled with the counters
+ */
+extern void KISSDB_Sharded_cache_stats(KISSDB_Sharded *sdb,KISSDB_Cache_Stats *st);
+
+/**
+ * Cursor used for iterating over all entries in all shards
+ */
+typedef struct {
+	KISSDB_Sharded *sdb;
+	unsigned long shard;
+	KISSDB_Iterator dbi;
+} KISSDB_Sharded_Iterator;
+
+/**
+ * Initialize an iterator
+ *
+ * @param sdb Sharded database struct
+ * @param dbi Iterator to initialize
+ */
+extern void KISSDB_Sharded_Iterator_init(KISSDB_Sharded *sdb,KISSDB_Sharded_Iterator *dbi);
+
+/**
+ * Get the next entry (see KISSDB_Iterator_next_len())
+ *
+ * Shards are visited one after the other. Each call holds the lock of
+ * the current shard for reading, so iterating runs alongside puts, but
+ * entries put or deleted meanwhile may or may not be seen.
+ *
+ * @param dbi Sharded database iterator
+ * @param kbuf Buffer to fill with next key (key_size bytes capacity)
+ * @param klen If not NULL, set to the key length
+ * @param vbuf Buffer to fill with next value (value_size bytes capacity)
+ * @param vlen If not NULL, set to the value length
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Sharded_Iterator_next_len(KISSDB_Sharded_Iterator *dbi,void *kbuf,unsigned long *klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Get the next entry with a key_size key and value_size value
+ *
+ * @param dbi Sharded database iterator
+ * @param kbuf Buffer to fill with next key (key_size bytes)
+ * @param vbuf Buffer to fill with next value (value_size bytes)
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Sharded_Iterator_next(KISSDB_Sharded_Iterator *dbi,void *kbuf,void *vbuf);
+
+/**
+ * Bulk build of a sharded database: one KISSDB_Bulk per shard
+ */
+typedef struct {
+	unsigned long num_shards;
+	uint64_t seed;
+	KISSDB_Bulk **shards;
+	char *path;
+	int fixed; /* building version 2 shards */
+} KISSDB_Sharded_Bulk;
+
+/**
+ * Start building a new sharded database (see KISSDB_bulk_begin())
+ *
+ * Each entry goes to the shard KISSDB_Sharded_shard() would pick in the
+ * finished database. Any database at path is only replaced, shard by
+ * shard and then its manifest, by KISSDB_Sharded_bulk_finish().
+ *
+ * @param sb Sharded bulk build state
+ * @param path Path to manifest; shards are path.0, path.1, ...
+ * @param flags KISSDB_OPEN_FLAG_VARLEN or 0
+ * @param num_shards Number of shards (must be >0)
+ * @param expected_entries Number of entries that will be added in all, 0 if unknown
+ * @param key_size Maximum size of keys in bytes
+ * @param value_size Maximum size of values in bytes
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Sharded_bulk_begin(KISSDB_Sharded_Bulk *sb,const char *path,int flags,unsigned long num_shards,uint64_t expected_entries,unsigned long key_size,unsigned long value_size);
+
+/**
+ * Add an entry to a sharded bulk build (see KISSDB_bulk_add())
+ *
+ * @param sb Sharded bulk build state
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return 0 on success, negative on error (the build must then be aborted)
+ */
+extern int KISSDB_Sharded_bulk_add(KISSDB_Sharded_Bulk *sb,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Finish every shard and write the manifest
+ *
+ * If a shard fails the rest are aborted; shards already finished are left
+ * in place, but without a new manifest. The state is freed either way.
+ *
+ * @param sb Sharded bulk build state
+ * @return 0 on success, negative on error
+ */
+extern int KISSDB_Sharded_bulk_finish(KISSDB_Sharded_Bulk *sb);
+
+/**
+ * Give up on a sharded bulk build
+ *
+ * @param sb Sharded bulk build state
+ */
+extern void KISSDB_Sharded_bulk_abort(KISSDB_Sharded_Bulk *sb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,200 @@
+/* loader.c
+
+   Builds the server's database offline from a file of key/value lines,
+   writing each KISSDB file in one sequential pass instead of putting the
+   entries one by one.
+
+*/
+
+#include "kissdb_shard.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define KEY_SIZE                 128  // opws ston server
+#define VALUE_SIZE              1024
+#define SHARDS                     8  // opws i mixani kissdb tou server
+#define DELIMITER                ':'  // PUT:key:value
+
+
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+  fprintf(stderr, "Usage: loader [OPTION]... DATABASE [INPUT]\n\n");
+  fprintf(stderr, "Builds DATABASE from the key<delimiter>value lines of INPUT (or stdin),\n");
+  fprintf(stderr, "replacing it if it exists. If a key appears more than once, its last\n");
+  fprintf(stderr, "value is kept.\n\n");
+  fprintf(stderr, "Available Options:\n");
+  fprintf(stderr, "-h:             Print this help message.\n");
+  fprintf(stderr, "-s <shards>:    Number of shards (default %d); 0 builds a single file.\n", SHARDS);
+  fprintf(stderr, "-n <entries>:   Expected number of entries (default: lines of INPUT).\n");
+  fprintf(stderr, "-d <char>:      Delimiter between key and value (default '%c').\n", DELIMITER);
+  fprintf(stderr, "-k <size>:      Maximum key size in bytes (default %d).\n", KEY_SIZE);
+  fprintf(stderr, "-v <size>:      Maximum value size in bytes (default %d).\n", VALUE_SIZE);
+  fprintf(stderr, "-f:             Fixed size entries (padded to the maximum sizes).\n");
+}
+
+/**
+ * @name count_lines - Counts the lines of a regular file.
+ * @path: The file.
+ *
+ * @return The number of lines, or 0 if they cannot be counted.
+ */
+unsigned long long count_lines(const char *path) {
+  char buf[65536];
+  unsigned long long lines = 0;
+  struct stat st;
+  size_t n, i;
+  FILE *f;
+
+  if ((stat(path, &st)) || (!S_ISREG(st.st_mode)) || (!(f = fopen(path, "r"))))
+    return 0;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (i = 0; i < n; i++)
+      lines += (buf[i] == '\n');
+  }
+  fclose(f);
+  return lines;
+}
+
+int main(int argc, char *argv[]) {
+  int option = 0;
+  long shards = SHARDS;
+  unsigned long long expected = 0;
+  unsigned long key_size = KEY_SIZE;
+  unsigned long value_size = VALUE_SIZE;
+  char delimiter = DELIMITER;
+  int flags = KISSDB_OPEN_FLAG_VARLEN;
+  const char *path, *input = NULL;
+  KISSDB_Sharded_Bulk sbulk;
+  KISSDB_Bulk *bulk = NULL;
+  struct timeval start, end;
+  unsigned long long line_no = 0, loaded = 0;
+  char *line = NULL, *sep;
+  size_t cap = 0;
+  ssize_t len;
+  FILE *in = stdin;
+  int r;
+
+  // Parse user parameters.
+  while ((option = getopt(argc, argv,"hs:n:d:k:v:f")) != -1) {
+    switch (option) {
+      case 'h':
+        print_usage();
+        exit(0);
+      case 's':
+        shards = atol(optarg);
+        break;
+      case 'n':
+        expected = strtoull(optarg, NULL, 10);
+        break;
+      case 'd':
+        if (strlen(optarg) != 1) {
+          fprintf(stderr, "Error: The delimiter must be a single character.\n");
+          exit(EXIT_FAILURE);
+        }
+        delimiter = optarg[0];
+        break;
+      case 'k':
+        key_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'v':
+        value_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        flags = 0;
+        break;
+      default:
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  // Check parameters.
+  if ((optind >= argc) || ((argc - optind) > 2)) {
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+  if ((shards < 0) || (!key_size) || (!value_size)) {
+    fprintf(stderr, "Error: Bad number of shards or entry size.\n\n");
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+  path = argv[optind];
+  if ((argc - optind) == 2) {
+    input = argv[optind + 1];
+    if (!(in = fopen(input, "r"))) {
+      perror(input);
+      exit(EXIT_FAILURE);
+    }
+    // to megethos tou pinaka hash vgainei apo to plithos twn grammwn
+    if (!expected)
+      expected = count_lines(input);
+  }
+
+  gettimeofday(&start, NULL);
+  if (shards)
+    r = KISSDB_Sharded_bulk_begin(&sbulk, path, flags, (unsigned long)shards, expected, key_size, value_size);
+  else
+    r = KISSDB_bulk_begin(&bulk, path, flags, expected, key_size, value_size);
+  if (r) {
+    fprintf(stderr, "Error: Cannot start building %s (%d).\n", path, r);
+    exit(EXIT_FAILURE);
+  }
+
+  while ((len = getline(&line, &cap, in)) >= 0) {
+    line_no++;
+    while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+      line[--len] = '\0';
+    if (!len)
+      continue;
+    if (!(sep = memchr(line, delimiter, (size_t)len))) {
+      fprintf(stderr, "Error: Line %llu has no '%c'.\n", line_no, delimiter);
+      r = KISSDB_ERROR_INVALID_PARAMETERS;
+      break;
+    }
+    if (shards)
+      r = KISSDB_Sharded_bulk_add(&sbulk, line, (unsigned long)(sep - line), sep + 1, (unsigned long)(len - (sep + 1 - line)));
+    else
+      r = KISSDB_bulk_add(bulk, line, (unsigned long)(sep - line), sep + 1, (unsigned long)(len - (sep + 1 - line)));
+    if (r) {
+      if (r == KISSDB_ERROR_INVALID_PARAMETERS)
+        fprintf(stderr, "Error: Key or value on line %llu is too long.\n", line_no);
+      else
+        fprintf(stderr, "Error: Cannot add line %llu (%d).\n", line_no, r);
+      break;
+    }
+    loaded++;
+  }
+  if ((!r) && (ferror(in))) {
+    perror(input ? input : "stdin");
+    r = KISSDB_ERROR_IO;
+  }
+  free(line);
+  if (in != stdin)
+    fclose(in);
+
+  if (r) {
+    if (shards)
+      KISSDB_Sharded_bulk_abort(&sbulk);
+    else
+      KISSDB_bulk_abort(bulk);
+    exit(EXIT_FAILURE);
+  }
+  r = (shards) ? KISSDB_Sharded_bulk_finish(&sbulk) : KISSDB_bulk_finish(bulk);
+  if (r) {
+    fprintf(stderr, "Error: Cannot write %s (%d).\n", path, r);
+    exit(EXIT_FAILURE);
+  }
+  gettimeofday(&end, NULL);
+
+  printf("Loaded %llu entries into %s in %.2f seconds.\n", loaded, path,
+         (double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_usec - start.tv_usec) / 1000000.0));
+
+  return 0;
+}
@@ -0,0 +1,1856 @@
+/* (Keep It) Simple Stupid Database: log-structured merge engine
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+/* Compile with LSMDB_TEST (and -lpthread) to build as a test program. */
+
+/* Like kissdb.c, integers are stored in host byte order, so files are
+ * only portable between machines of the same endianness. */
+
+#define _FILE_OFFSET_BITS 64
+
+#include "lsmdb.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* The manifest is one line of text,
+ *
+ * KdBL <version> <key size> <value size> <log> <next run> <number of runs>
+ *
+ * followed by a line "<run> <level>" for each run, newest first. It is
+ * replaced via path.tmp and a rename whenever the set of runs changes.
+ * Runs are path.<run>.run; the memtable's log is path.<log>.log, and logs
+ * numbered <log> and up are replayed on open.
+ *
+ * A log record is [crc:4][klen:4][vlen:4][key][value], the CRC-32 being of
+ * everything after it; vlen is LSMDB_TOMBSTONE for a delete, which has no
+ * value. Replay stops at the first record that is cut short or fails its
+ * CRC.
+ *
+ * A run is a series of blocks of entries sorted by key, each entry being
+ * [klen:4][vlen:4][key][value] as in the log, then an index with one entry
+ * per block, [offset:8][length:4][klen:4][first key], then a Bloom filter
+ * of the keys, then the footer:
+ *
+ * [0-3]   "KdBL"
+ * [4-7]   version
+ * [8-15]  number of entries
+ * [16-23] number of blocks
+ * [24-31] offset of the index
+ * [32-39] length of the index
+ * [40-47] offset of the Bloom filter
+ * [48-55] length of the Bloom filter in bytes
+ * [56-63] number of Bloom filter probes
+ * [64-71] length of the longest block
+ * [72-75] CRC-32 of the index, Bloom filter and bytes 8-71 */
+#define LSMDB_MAGIC "KdBL"
+#define LSMDB_LOG_SUFFIX ".log"
+#define LSMDB_RUN_SUFFIX ".run"
+#define LSMDB_LOG_HEADER_SIZE (sizeof(uint32_t) * 3)
+#define LSMDB_ENTRY_HEADER_SIZE (sizeof(uint32_t) * 2)
+#define LSMDB_FOOTER_SIZE 76
+#define LSMDB_TOMBSTONE 0xffffffffUL
+
+/* Blocks are closed once they hold this many bytes */
+#define LSMDB_BLOCK_SIZE 4096
+
+/* Run files are written through a buffer this big */
+#define LSMDB_WRITE_BUFFER 262144
+
+/* Bloom filter bits per key and probes, for about 1% false positives */
+#define LSMDB_BLOOM_BITS_PER_KEY 10
+#define LSMDB_BLOOM_PROBES 7
+
+/* Memtable skiplist: levels, and memory is carved out of chunks this big */
+#define LSMDB_SKIP_LEVELS 12
+#define LSMDB_ARENA_CHUNK 1048576
+
+/* A merge that failed is tried again after this many seconds */
+#define LSMDB_RETRY_SECONDS 1
+
+/* A skiplist node, followed by its height's worth of next pointers and
+ * then the key */
+typedef struct LSMDB_Node {
+	const uint8_t *value;
+	uint32_t klen;
+	uint32_t vlen; /* LSMDB_TOMBSTONE for a delete */
+	unsigned int height;
+	struct LSMDB_Node *next[1];
+} LSMDB_Node;
+
+struct LSMDB_Memtable {
+	LSMDB_Node *head;
+	unsigned int height;
+	uint8_t *chunk; /* current arena chunk; each starts with a pointer to the previous one */
+	uint8_t *chunk_pos;
+	size_t chunk_left;
+	uint64_t bytes; /* arena memory used */
+	uint64_t count;
+	uint64_t rnd;
+	uint64_t log_first; /* logs holding this memtable's writes */
+	uint64_t log_last;
+};
+
+/* One block of a run, as listed in its index */
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t klen;
+	const uint8_t *key; /* points into the run's index */
+} LSMDB_Block;
+
+typedef struct {
+	uint64_t id;
+	unsigned int level;
+	unsigned int refs; /* versions holding the run */
+	int fd;
+	uint64_t size;
+	uint64_t entries;
+	unsigned long num_blocks;
+	unsigned long max_block;
+	LSMDB_Block *blocks;
+	uint8_t *meta; /* the index and Bloom filter */
+	const uint8_t *bloom;
+	uint64_t bloom_bits;
+	unsigned int bloom_probes;
+} LSMDB_Run;
+
+struct LSMDB_Version {
+	unsigned int refs;
+	unsigned long num_runs;
+	LSMDB_Run *runs[1]; /* newest first */
+};
+
+/* Where a merge or scan is in a memtable or run */
+typedef struct {
+	LSMDB_Node *node; /* memtable source */
+	LSMDB_Run *run; /* run source */
+	unsigned long block;
+	uint8_t *buf;
+	uint32_t len,pos;
+	const uint8_t *key;
+	unsigned long klen;
+	const uint8_t *value;
+	uint32_t vlen;
+	int valid;
+} LSMDB_Source;
+
+/* Builds a run file */
+typedef struct {
+	int fd;
+	uint8_t *buf;
+	size_t len;
+	uint64_t offset; /* file offset of buf */
+	uint8_t *index;
+	size_t index_len,index_cap;
+	size_t block_entry; /* index entry of the open block */
+	uint64_t block_start;
+	int in_block;
+	uint64_t *hashes;
+	uint64_t entries,hashes_cap;
+	uint64_t blocks;
+	unsigned long max_block;
+	int error;
+} LSMDB_Writer;
+
+static uint32_t LSMDB_crc_table[256];
+static pthread_once_t LSMDB_crc_once = PTHREAD_ONCE_INIT;
+
+static void LSMDB_crc_init(void)
+{
+	uint32_t c;
+	int i,j;
+	for(i=0;i<256;++i) {
+		c = (uint32_t)i;
+		for(j=0;j<8;++j)
+			c = (c & 1) ? (0xedb88320UL ^ (c >> 1)) : (c >> 1);
+		LSMDB_crc_table[i] = c;
+	}
+}
+
+static uint32_t LSMDB_crc32(uint32_t crc,const void *b,unsigned long len)
+{
+	unsigned long i;
+	pthread_once(&LSMDB_crc_once,LSMDB_crc_init);
+	crc = ~crc;
+	for(i=0;i<len;++i)
+		crc = LSMDB_crc_table[(crc ^ ((const uint8_t *)b)[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* FNV-1a, finished with the Murmur3 64-bit mixer */
+static uint64_t LSMDB_hash(const void *b,unsigned long len)
+{
+	unsigned long i;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(i=0;i<len;++i) {
+		h ^= (uint64_t)(((const uint8_t *)b)[i]);
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint32_t LSMDB_get32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static inline uint64_t LSMDB_get64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+/* Byte order, shorter key first on a common prefix */
+static int LSMDB_compare(const void *a,unsigned long alen,const void *b,unsigned long blen)
+{
+	int c = memcmp(a,b,(alen < blen) ? alen : blen);
+	if (c)
+		return c;
+	return (alen < blen) ? -1 : ((alen > blen) ? 1 : 0);
+}
+
+/* Read exactly len bytes at offset, retrying short reads */
+static int LSMDB_pread(int fd,void *buf,size_t len,uint64_t offset)
+{
+	ssize_t n;
+	while (len) {
+		n = pread(fd,buf,len,(off_t)offset);
+		if (n > 0) {
+			buf = (void *)(((uint8_t *)buf) + n);
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return LSMDB_ERROR_IO;
+	}
+	return 0;
+}
+
+/* Write exactly len bytes at the file position, retrying short writes */
+static int LSMDB_write(int fd,const void *buf,size_t len)
+{
+	ssize_t n;
+	while (len) {
+		n = write(fd,buf,len);
+		if (n > 0) {
+			buf = (const void *)(((const uint8_t *)buf) + n);
+			len -= (size_t)n;
+		} else if ((n < 0)&&(errno == EINTR))
+			continue;
+		else return LSMDB_ERROR_IO;
+	}
+	return 0;
+}
+
+/* path.<n><suffix> */
+static char *LSMDB_file_path(const char *path,uint64_t n,const char *suffix)
+{
+	size_t len = strlen(path) + 32;
+	char *p = malloc(len);
+	if (p)
+		snprintf(p,len,"%s.%llu%s",path,(unsigned long long)n,suffix);
+	return p;
+}
+
+static void LSMDB_unlink_file(const char *path,uint64_t n,const char *suffix)
+{
+	char *p = LSMDB_file_path(path,n,suffix);
+	if (p) {
+		unlink(p);
+		free(p);
+	}
+}
+
+/* ---- memtable ---- */
+
+static void *LSMDB_arena_alloc(LSMDB_Memtable *m,size_t size)
+{
+	size_t chunk;
+	uint8_t *c,*p;
+
+	size = (size + 7) & ~((size_t)7);
+	if (size > m->chunk_left) {
+		chunk = (size > (LSMDB_ARENA_CHUNK - sizeof(uint8_t *))) ? (size + sizeof(uint8_t *)) : LSMDB_ARENA_CHUNK;
+		if (!(c = malloc(chunk)))
+			return (void *)0;
+		memcpy(c,&m->chunk,sizeof(uint8_t *));
+		m->chunk = c;
+		m->chunk_pos = c + sizeof(uint8_t *);
+		m->chunk_left = chunk - sizeof(uint8_t *);
+	}
+	p = m->chunk_pos;
+	m->chunk_pos += size;
+	m->chunk_left -= size;
+	m->bytes += size;
+	return (void *)p;
+}
+
+static void LSMDB_mem_free(LSMDB_Memtable *m)
+{
+	uint8_t *c,*prev;
+
+	if (!m)
+		return;
+	for(c=m->chunk;c;c=prev) {
+		memcpy(&prev,c,sizeof(uint8_t *));
+		free(c);
+	}
+	free(m);
+}
+
+static LSMDB_Memtable *LSMDB_mem_new(uint64_t log)
+{
+	LSMDB_Memtable *m = calloc(1,sizeof(LSMDB_Memtable));
+	unsigned int i;
+
+	if (!m)
+		return m;
+	m->head = (LSMDB_Node *)LSMDB_arena_alloc(m,offsetof(LSMDB_Node,next) + (sizeof(LSMDB_Node *) * LSMDB_SKIP_LEVELS));
+	if (!m->head) {
+		LSMDB_mem_free(m);
+		return (LSMDB_Memtable *)0;
+	}
+	m->head->height = LSMDB_SKIP_LEVELS;
+	for(i=0;i<LSMDB_SKIP_LEVELS;++i)
+		m->head->next[i] = (LSMDB_Node *)0;
+	m->height = 1;
+	m->rnd = 0x9e3779b97f4a7c15ULL;
+	m->log_first = log;
+	m->log_last = log;
+	return m;
+}
+
+static inline const uint8_t *LSMDB_node_key(const LSMDB_Node *n)
+{
+	return (const uint8_t *)&(n->next[n->height]);
+}
+
+/* Last node at each level with a key less than key */
+static LSMDB_Node *LSMDB_mem_seek(LSMDB_Memtable *m,const void *key,unsigned long klen,LSMDB_Node **prev)
+{
+	LSMDB_Node *x = m->head,*n;
+	int l;
+
+	for(l=(int)m->height-1;l>=0;--l) {
+		while (((n = x->next[l]))&&(LSMDB_compare(LSMDB_node_key(n),n->klen,key,klen) < 0))
+			x = n;
+		if (prev)
+			prev[l] = x;
+	}
+	return x->next[0];
+}
+
+static LSMDB_Node *LSMDB_mem_find(LSMDB_Memtable *m,const void *key,unsigned long klen)
+{
+	LSMDB_Node *n = LSMDB_mem_seek(m,key,klen,(LSMDB_Node **)0);
+	if ((n)&&(!LSMDB_compare(LSMDB_node_key(n),n->klen,key,klen)))
+		return n;
+	return (LSMDB_Node *)0;
+}
+
+static int LSMDB_mem_put(LSMDB_Memtable *m,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	LSMDB_Node *prev[LSMDB_SKIP_LEVELS];
+	LSMDB_Node *n;
+	uint8_t *v = (uint8_t *)0;
+	unsigned int h,l;
+
+	if (vlen != LSMDB_TOMBSTONE) {
+		if (!(v = (uint8_t *)LSMDB_arena_alloc(m,vlen ? vlen : 1)))
+			return LSMDB_ERROR_MALLOC;
+		memcpy(v,value,vlen);
+	}
+
+	/* an overwrite just points the node at the new value */
+	n = LSMDB_mem_seek(m,key,klen,prev);
+	if ((n)&&(!LSMDB_compare(LSMDB_node_key(n),n->klen,key,klen))) {
+		n->value = v;
+		n->vlen = (uint32_t)vlen;
+		return 0;
+	}
+
+	/* height: 1 plus one for each pair of random bits that are zero, so
+	 * each level has a quarter of the nodes of the one below */
+	m->rnd ^= m->rnd << 13;
+	m->rnd ^= m->rnd >> 7;
+	m->rnd ^= m->rnd << 17;
+	for(h=1;(h<LSMDB_SKIP_LEVELS)&&(!((m->rnd >> (2 * h)) & 3));++h);
+	if (!(n = (LSMDB_Node *)LSMDB_arena_alloc(m,offsetof(LSMDB_Node,next) + (sizeof(LSMDB_Node *) * h) + klen)))
+		return LSMDB_ERROR_MALLOC;
+	n->value = v;
+	n->klen = (uint32_t)klen;
+	n->vlen = (uint32_t)vlen;
+	n->height = h;
+	memcpy((uint8_t *)LSMDB_node_key(n),key,klen);
+	for(l=m->height;l<h;++l)
+		prev[l] = m->head;
+	if (h > m->height)
+		m->height = h;
+	for(l=0;l<h;++l) {
+		n->next[l] = prev[l]->next[l];
+		prev[l]->next[l] = n;
+	}
+	++m->count;
+	return 0;
+}
+
+/* Copy the entries of m from start to end (NULL for no bound) into dst,
+ * leaving out keys dst already has. Called locked. */
+static int LSMDB_mem_copy(LSMDB_Memtable *dst,LSMDB_Memtable *m,const void *start,unsigned long slen,const void *end,unsigned long elen)
+{
+	LSMDB_Node *n;
+	int r;
+
+	n = (start) ? LSMDB_mem_seek(m,start,slen,(LSMDB_Node **)0) : m->head->next[0];
+	for(;n;n=n->next[0]) {
+		if ((end)&&(LSMDB_compare(LSMDB_node_key(n),n->klen,end,elen) > 0))
+			break;
+		if ((dst->count)&&(LSMDB_mem_find(dst,LSMDB_node_key(n),n->klen)))
+			continue;
+		if ((r = LSMDB_mem_put(dst,LSMDB_node_key(n),n->klen,n->value,n->vlen)))
+			return r;
+	}
+	return 0;
+}
+
+/* ---- runs ---- */
+
+static int LSMDB_bloom_test(const LSMDB_Run *run,uint64_t h)
+{
+	uint64_t delta = (h >> 33) | (h << 31);
+	unsigned int i;
+	uint64_t b;
+
+	for(i=0;i<run->bloom_probes;++i) {
+		b = h % run->bloom_bits;
+		if (!(run->bloom[b >> 3] & (1 << (b & 7))))
+			return 0;
+		h += delta;
+	}
+	return 1;
+}
+
+static void LSMDB_run_free(LSMDB_Run *run)
+{
+	if (run->fd >= 0)
+		close(run->fd);
+	free(run->blocks);
+	free(run->meta);
+	free(run);
+}
+
+static int LSMDB_run_open(const char *path,uint64_t id,unsigned int level,LSMDB_Run **out)
+{
+	uint8_t footer[LSMDB_FOOTER_SIZE];
+	uint64_t f[8];
+	uint32_t v;
+	struct stat st;
+	LSMDB_Run *run;
+	char *p;
+	uint64_t pos,meta_len;
+	unsigned long i;
+	int r = LSMDB_ERROR_CORRUPT_DBFILE;
+
+	if (!(run = calloc(1,sizeof(LSMDB_Run))))
+		return LSMDB_ERROR_MALLOC;
+	run->id = id;
+	run->level = level;
+	if (!(p = LSMDB_file_path(path,id,LSMDB_RUN_SUFFIX))) {
+		free(run);
+		return LSMDB_ERROR_MALLOC;
+	}
+	run->fd = open(p,O_RDONLY);
+	free(p);
+	if ((run->fd < 0)||(fstat(run->fd,&st))) {
+		LSMDB_run_free(run);
+		return LSMDB_ERROR_IO;
+	}
+	run->size = (uint64_t)st.st_size;
+	if (run->size < LSMDB_FOOTER_SIZE)
+		goto run_open_fail;
+	if (LSMDB_pread(run->fd,footer,LSMDB_FOOTER_SIZE,run->size - LSMDB_FOOTER_SIZE)) {
+		r = LSMDB_ERROR_IO;
+		goto run_open_fail;
+	}
+	memcpy(&v,footer + 4,sizeof(v));
+	memcpy(f,footer + 8,sizeof(f));
+	if ((memcmp(footer,LSMDB_MAGIC,4))||(v != LSMDB_VERSION))
+		goto run_open_fail;
+	/* the index and the filter sit right before the footer */
+	meta_len = f[3] + f[5];
+	if ((f[2] > run->size)||((f[2] + meta_len) != (run->size - LSMDB_FOOTER_SIZE))||(f[4] != (f[2] + f[3]))||(!f[5])||(!f[6])||(f[6] > 32)||(!f[1]))
+		goto run_open_fail;
+	run->entries = f[0];
+	run->num_blocks = (unsigned long)f[1];
+	run->bloom_bits = f[5] * 8;
+	run->bloom_probes = (unsigned int)f[6];
+	run->max_block = (unsigned long)f[7];
+	run->meta = malloc((size_t)meta_len);
+	run->blocks = malloc(sizeof(LSMDB_Block) * run->num_blocks);
+	if ((!run->meta)||(!run->blocks)) {
+		r = LSMDB_ERROR_MALLOC;
+		goto run_open_fail;
+	}
+	if (LSMDB_pread(run->fd,run->meta,(size_t)meta_len,f[2])) {
+		r = LSMDB_ERROR_IO;
+		goto run_open_fail;
+	}
+	if (LSMDB_crc32(LSMDB_crc32(0,run->meta,(unsigned long)meta_len),footer + 8,LSMDB_FOOTER_SIZE - 12) != LSMDB_get32(footer + LSMDB_FOOTER_SIZE - 4))
+		goto run_open_fail;
+	run->bloom = run->meta + f[3];
+
+	for(i=0,pos=0;i<run->num_blocks;++i) {
+		if ((pos + 16) > f[3])
+			goto run_open_fail;
+		run->blocks[i].offset = LSMDB_get64(run->meta + pos);
+		run->blocks[i].len = LSMDB_get32(run->meta + pos + 8);
+		run->blocks[i].klen = LSMDB_get32(run->meta + pos + 12);
+		run->blocks[i].key = run->meta + pos + 16;
+		pos += 16 + (uint64_t)run->blocks[i].klen;
+		if ((pos > f[3])||((run->blocks[i].offset + run->blocks[i].len) > f[2])||(run->blocks[i].len > run->max_block))
+			goto run_open_fail;
+	}
+
+	*out = run;
+	return 0;
+
+run_open_fail:
+	LSMDB_run_free(run);
+	return r;
+}
+
+/* Index of the block that would hold key: the last whose first key is
+ * not past it, or -1 if key comes before all of them */
+static long LSMDB_run_block(const LSMDB_Run *run,const void *key,unsigned long klen)
+{
+	unsigned long lo = 0,hi = run->num_blocks,mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (LSMDB_compare(run->blocks[mid].key,run->blocks[mid].klen,key,klen) <= 0)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return (long)lo - 1;
+}
+
+/* Look a key up in one run: 0 if found, 1 if the run doesn't have it, 2
+ * if the run has it deleted, negative on error */
+static int LSMDB_run_get(LSMDB_Run *run,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen,uint8_t *buf)
+{
+	const LSMDB_Block *b;
+	uint32_t pos,kl,vl;
+	long i;
+	int c;
+
+	if ((i = LSMDB_run_block(run,key,klen)) < 0)
+		return 1;
+	b = &(run->blocks[i]);
+	if (LSMDB_pread(run->fd,buf,b->len,b->offset))
+		return LSMDB_ERROR_IO;
+	for(pos=0;(pos + LSMDB_ENTRY_HEADER_SIZE)<=b->len;) {
+		kl = LSMDB_get32(buf + pos);
+		vl = LSMDB_get32(buf + pos + 4);
+		if ((pos + LSMDB_ENTRY_HEADER_SIZE + kl + ((vl == LSMDB_TOMBSTONE) ? 0 : vl)) > b->len)
+			return LSMDB_ERROR_CORRUPT_DBFILE;
+		c = LSMDB_compare(buf + pos + LSMDB_ENTRY_HEADER_SIZE,kl,key,klen);
+		if (c > 0)
+			break;
+		if (!c) {
+			if (vl == LSMDB_TOMBSTONE)
+				return 2;
+			if (vbuf)
+				memcpy(vbuf,buf + pos + LSMDB_ENTRY_HEADER_SIZE + kl,vl);
+			if (vlen)
+				*vlen = vl;
+			return 0;
+		}
+		pos += LSMDB_ENTRY_HEADER_SIZE + kl + ((vl == LSMDB_TOMBSTONE) ? 0 : vl);
+	}
+	return 1;
+}
+
+/* Called locked */
+static void LSMDB_version_release(LSMDB_Version *v)
+{
+	unsigned long i;
+
+	if (--v->refs)
+		return;
+	for(i=0;i<v->num_runs;++i) {
+		if (!--v->runs[i]->refs)
+			LSMDB_run_free(v->runs[i]);
+	}
+	free(v);
+}
+
+static LSMDB_Version *LSMDB_version_new(unsigned long num_runs)
+{
+	LSMDB_Version *v = malloc(sizeof(LSMDB_Version) + (sizeof(LSMDB_Run *) * num_runs));
+	if (v) {
+		v->refs = 1;
+		v->num_runs = num_runs;
+	}
+	return v;
+}
+
+/* ---- merging ---- */
+
+static void LSMDB_source_node(LSMDB_Source *s)
+{
+	if ((s->valid = (s->node != (LSMDB_Node *)0))) {
+		s->key = LSMDB_node_key(s->node);
+		s->klen = s->node->klen;
+		s->value = s->node->value;
+		s->vlen = s->node->vlen;
+	}
+}
+
+/* Decode the entry at pos, moving on to the next block if this one is done */
+static int LSMDB_source_decode(LSMDB_Source *s)
+{
+	const LSMDB_Block *b;
+	uint32_t vl;
+
+	while (s->pos >= s->len) {
+		if (++s->block >= s->run->num_blocks) {
+			s->valid = 0;
+			return 0;
+		}
+		b = &(s->run->blocks[s->block]);
+		if (LSMDB_pread(s->run->fd,s->buf,b->len,b->offset))
+			return LSMDB_ERROR_IO;
+		s->len = b->len;
+		s->pos = 0;
+	}
+	if ((s->pos + LSMDB_ENTRY_HEADER_SIZE) > s->len)
+		return LSMDB_ERROR_CORRUPT_DBFILE;
+	s->klen = LSMDB_get32(s->buf + s->pos);
+	s->vlen = vl = LSMDB_get32(s->buf + s->pos + 4);
+	if ((s->pos + LSMDB_ENTRY_HEADER_SIZE + s->klen + ((vl == LSMDB_TOMBSTONE) ? 0 : vl)) > s->len)
+		return LSMDB_ERROR_CORRUPT_DBFILE;
+	s->key = s->buf + s->pos + LSMDB_ENTRY_HEADER_SIZE;
+	s->value = s->key + s->klen;
+	s->valid = 1;
+	return 0;
+}
+
+static int LSMDB_source_next(LSMDB_Source *s)
+{
+	if (!s->run) {
+		s->node = s->node->next[0];
+		LSMDB_source_node(s);
+		return 0;
+	}
+	s->pos += LSMDB_ENTRY_HEADER_SIZE + (uint32_t)s->klen + ((s->vlen == LSMDB_TOMBSTONE) ? 0 : s->vlen);
+	return LSMDB_source_decode(s);
+}
+
+/* Position a source at the first key not before start (NULL for the first) */
+static int LSMDB_source_seek(LSMDB_Source *s,const void *start,unsigned long slen)
+{
+	long i;
+	int r;
+
+	if (!s->run) {
+		s->node = start ? s->node : s->node->next[0];
+		LSMDB_source_node(s);
+		return 0;
+	}
+	i = start ? LSMDB_run_block(s->run,start,slen) : 0;
+	s->block = (unsigned long)((i < 0) ? 0 : i) - 1;
+	s->len = 0;
+	s->pos = 0;
+	if ((r = LSMDB_source_decode(s)))
+		return r;
+	while ((start)&&(s->valid)&&(LSMDB_compare(s->key,s->klen,start,slen) < 0)) {
+		if ((r = LSMDB_source_next(s)))
+			return r;
+	}
+	return 0;
+}
+
+/* The source with the smallest key, the newest (lowest) one on a tie, or
+ * -1 once all are done */
+static long LSMDB_merge_pick(LSMDB_Source *src,unsigned long n)
+{
+	unsigned long i;
+	long best = -1;
+
+	for(i=0;i<n;++i) {
+		if ((src[i].valid)&&((best < 0)||(LSMDB_compare(src[i].key,src[i].klen,src[best].key,src[best].klen) < 0)))
+			best = (long)i;
+	}
+	return best;
+}
+
+/* Step past the picked key in every source; the picked one goes last, as
+ * the others are compared with its key */
+static int LSMDB_merge_advance(LSMDB_Source *src,unsigned long n,long best)
+{
+	unsigned long i;
+	int r;
+
+	for(i=0;i<n;++i) {
+		if (((long)i != best)&&(src[i].valid)&&(!LSMDB_compare(src[i].key,src[i].klen,src[best].key,src[best].klen))) {
+			if ((r = LSMDB_source_next(&src[i])))
+				return r;
+		}
+	}
+	return LSMDB_source_next(&src[best]);
+}
+
+/* ---- writing runs ---- */
+
+static int LSMDB_writer_out(LSMDB_Writer *w,const void *data,size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (w->len == LSMDB_WRITE_BUFFER) {
+			if (LSMDB_write(w->fd,w->buf,w->len))
+				return (w->error = LSMDB_ERROR_IO);
+			w->offset += w->len;
+			w->len = 0;
+		}
+		n = LSMDB_WRITE_BUFFER - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->len,data,n);
+		w->len += n;
+		data = (const void *)(((const uint8_t *)data) + n);
+		len -= n;
+	}
+	return 0;
+}
+
+static void LSMDB_writer_end_block(LSMDB_Writer *w)
+{
+	uint32_t len = (uint32_t)((w->offset + w->len) - w->block_start);
+
+	memcpy(w->index + w->block_entry + 8,&len,sizeof(len));
+	if (len > w->max_block)
+		w->max_block = len;
+	w->in_block = 0;
+}
+
+static int LSMDB_writer_add(LSMDB_Writer *w,const uint8_t *key,unsigned long klen,const uint8_t *value,uint32_t vlen)
+{
+	uint32_t h[2];
+	uint64_t *hashes;
+	uint8_t *index;
+	size_t cap;
+
+	if (!w->in_block) {
+		if ((w->index_len + 16 + klen) > w->index_cap) {
+			cap = w->index_cap ? w->index_cap * 2 : 65536;
+			while (cap < (w->index_len + 16 + klen))
+				cap *= 2;
+			if (!(index = realloc(w->index,cap)))
+				return (w->error = LSMDB_ERROR_MALLOC);
+			w->index = index;
+			w->index_cap = cap;
+		}
+		w->block_start = w->offset + w->len;
+		w->block_entry = w->index_len;
+		memcpy(w->index + w->index_len,&w->block_start,sizeof(uint64_t));
+		h[0] = 0;
+		h[1] = (uint32_t)klen;
+		memcpy(w->index + w->index_len + 8,h,sizeof(h));
+		memcpy(w->index + w->index_len + 16,key,klen);
+		w->index_len += 16 + klen;
+		w->in_block = 1;
+		++w->blocks;
+	}
+	if (w->entries == w->hashes_cap) {
+		cap = w->hashes_cap ? (size_t)w->hashes_cap * 2 : 65536;
+		if (!(hashes = realloc(w->hashes,cap * sizeof(uint64_t))))
+			return (w->error = LSMDB_ERROR_MALLOC);
+		w->hashes = hashes;
+		w->hashes_cap = cap;
+	}
+	w->hashes[w->entries++] = LSMDB_hash(key,klen);
+
+	h[0] = (uint32_t)klen;
+	h[1] = vlen;
+	if ((LSMDB_writer_out(w,h,sizeof(h)))||(LSMDB_writer_out(w,key,klen)))
+		return w->error;
+	if ((vlen != LSMDB_TOMBSTONE)&&(LSMDB_writer_out(w,value,vlen)))
+		return w->error;
+	if (((w->offset + w->len) - w->block_start) >= LSMDB_BLOCK_SIZE)
+		LSMDB_writer_end_block(w);
+	return 0;
+}
+
+/* Write out the index, filter and footer, and sync the file */
+static int LSMDB_writer_finish(LSMDB_Writer *w)
+{
+	uint8_t footer[LSMDB_FOOTER_SIZE];
+	uint64_t f[8];
+	uint8_t *bloom;
+	uint64_t bits,b,h,delta,i;
+	uint32_t crc;
+	unsigned int j;
+
+	if (w->in_block)
+		LSMDB_writer_end_block(w);
+	bits = w->entries * LSMDB_BLOOM_BITS_PER_KEY;
+	if (bits < 64)
+		bits = 64;
+	bits = (bits + 63) & ~((uint64_t)63);
+	if (!(bloom = calloc(1,(size_t)(bits / 8))))
+		return (w->error = LSMDB_ERROR_MALLOC);
+	for(i=0;i<w->entries;++i) {
+		h = w->hashes[i];
+		delta = (h >> 33) | (h << 31);
+		for(j=0;j<LSMDB_BLOOM_PROBES;++j) {
+			b = h % bits;
+			bloom[b >> 3] |= (uint8_t)(1 << (b & 7));
+			h += delta;
+		}
+	}
+
+	f[0] = w->entries;
+	f[1] = w->blocks;
+	f[2] = w->offset + w->len;
+	f[3] = w->index_len;
+	f[4] = f[2] + f[3];
+	f[5] = bits / 8;
+	f[6] = LSMDB_BLOOM_PROBES;
+	f[7] = w->max_block;
+	memcpy(footer,LSMDB_MAGIC,4);
+	j = LSMDB_VERSION;
+	memcpy(footer + 4,&j,sizeof(uint32_t));
+	memcpy(footer + 8,f,sizeof(f));
+	crc = LSMDB_crc32(LSMDB_crc32(LSMDB_crc32(0,w->index,(unsigned long)w->index_len),bloom,(unsigned long)(bits / 8)),footer + 8,LSMDB_FOOTER_SIZE - 12);
+	memcpy(footer + LSMDB_FOOTER_SIZE - 4,&crc,sizeof(crc));
+
+	if ((!LSMDB_writer_out(w,w->index,w->index_len))&&(!LSMDB_writer_out(w,bloom,(size_t)(bits / 8))))
+		LSMDB_writer_out(w,footer,LSMDB_FOOTER_SIZE);
+	free(bloom);
+	if ((!w->error)&&(LSMDB_write(w->fd,w->buf,w->len)))
+		w->error = LSMDB_ERROR_IO;
+	if ((!w->error)&&(fdatasync(w->fd)))
+		w->error = LSMDB_ERROR_IO;
+	return w->error;
+}
+
+/* Merge the sources into run file id. Tombstones are dropped if drop is
+ * set, i.e. there is nothing older for them to hide. *run is set to the
+ * new run, or to NULL if nothing was left to write. */
+static int LSMDB_write_run(LSMDB *db,LSMDB_Source *src,unsigned long n,int drop,uint64_t id,unsigned int level,LSMDB_Run **run,uint64_t *bytes)
+{
+	LSMDB_Writer w;
+	char *p;
+	long i;
+	int r = 0;
+
+	*run = (LSMDB_Run *)0;
+	memset(&w,0,sizeof(w));
+	if (!(p = LSMDB_file_path(db->path,id,LSMDB_RUN_SUFFIX)))
+		return LSMDB_ERROR_MALLOC;
+	if (!(w.buf = malloc(LSMDB_WRITE_BUFFER))) {
+		free(p);
+		return LSMDB_ERROR_MALLOC;
+	}
+	if ((w.fd = open(p,O_WRONLY|O_CREAT|O_TRUNC,0644)) < 0) {
+		free(w.buf);
+		free(p);
+		return LSMDB_ERROR_IO;
+	}
+
+	while ((i = LSMDB_merge_pick(src,n)) >= 0) {
+		if ((!drop)||(src[i].vlen != LSMDB_TOMBSTONE)) {
+			if ((r = LSMDB_writer_add(&w,src[i].key,src[i].klen,src[i].value,src[i].vlen)))
+				break;
+		}
+		if ((r = LSMDB_merge_advance(src,n,i)))
+			break;
+	}
+	if ((!r)&&(w.entries))
+		r = LSMDB_writer_finish(&w);
+	*bytes = w.offset + w.len;
+	close(w.fd);
+	free(w.buf);
+	free(w.index);
+	free(w.hashes);
+
+	if ((r)||(!w.entries))
+		unlink(p);
+	else r = LSMDB_run_open(db->path,id,level,run);
+	free(p);
+	return r;
+}
+
+/* ---- manifest ---- */
+
+/* Write the manifest to a temporary file and rename it into place; the
+ * logs from log on are the ones still to be replayed */
+static int LSMDB_write_manifest(LSMDB *db,const LSMDB_Version *v,uint64_t log)
+{
+	char *tmp;
+	FILE *f;
+	unsigned long i;
+	int r = 0;
+
+	if (!(tmp = malloc(strlen(db->path) + 5)))
+		return LSMDB_ERROR_MALLOC;
+	strcpy(tmp,db->path);
+	strcat(tmp,".tmp");
+	if (!(f = fopen(tmp,"w"))) {
+		free(tmp);
+		return LSMDB_ERROR_IO;
+	}
+	if (fprintf(f,"%s %d %lu %lu %llu %llu %lu\n",LSMDB_MAGIC,LSMDB_VERSION,db->key_size,db->value_size,(unsigned long long)log,(unsigned long long)db->next_run,v->num_runs) < 0)
+		r = LSMDB_ERROR_IO;
+	for(i=0;i<v->num_runs;++i) {
+		if (fprintf(f,"%llu %u\n",(unsigned long long)v->runs[i]->id,v->runs[i]->level) < 0)
+			r = LSMDB_ERROR_IO;
+	}
+	if (fflush(f))
+		r = LSMDB_ERROR_IO;
+	if ((!r)&&(fsync(fileno(f))))
+		r = LSMDB_ERROR_IO;
+	if (fclose(f))
+		r = LSMDB_ERROR_IO;
+	if ((!r)&&(rename(tmp,db->path)))
+		r = LSMDB_ERROR_IO;
+	if (r)
+		unlink(tmp);
+	free(tmp);
+	return r;
+}
+
+/* Replace runs first to first+k-1 of the current version with run (which
+ * may be NULL) and record the result in the manifest. Called locked. */
+static int LSMDB_install(LSMDB *db,LSMDB_Run *run,unsigned long first,unsigned long k,uint64_t log)
+{
+	LSMDB_Version *cur = db->version,*v;
+	unsigned long i,n = 0;
+	int r;
+
+	if (!(v = LSMDB_version_new(cur->num_runs - k + (run ? 1 : 0))))
+		return LSMDB_ERROR_MALLOC;
+	for(i=0;i<first;++i)
+		v->runs[n++] = cur->runs[i];
+	if (run)
+		v->runs[n++] = run;
+	for(i=first+k;i<cur->num_runs;++i)
+		v->runs[n++] = cur->runs[i];
+	if ((r = LSMDB_write_manifest(db,v,log))) {
+		free(v);
+		return r;
+	}
+	for(i=0;i<n;++i)
+		++v->runs[i]->refs;
+	/* readers still holding the old version keep the replaced runs open */
+	for(i=first;i<first+k;++i)
+		LSMDB_unlink_file(db->path,cur->runs[i]->id,LSMDB_RUN_SUFFIX);
+	db->version = v;
+	LSMDB_version_release(cur);
+	db->stats.runs = v->num_runs;
+	return 0;
+}
+
+/* ---- background work ---- */
+
+/* Write db->imm out as a new run */
+static int LSMDB_flush(LSMDB *db)
+{
+	LSMDB_Memtable *m;
+	LSMDB_Source src;
+	LSMDB_Run *run;
+	uint64_t id,bytes,l;
+	int drop,r;
+
+	pthread_mutex_lock(&db->lock);
+	m = db->imm;
+	drop = (db->version->num_runs == 0);
+	id = db->next_run++;
+	pthread_mutex_unlock(&db->lock);
+
+	/* puts only go to db->mem, so m can be read without the lock */
+	memset(&src,0,sizeof(src));
+	src.node = m->head;
+	LSMDB_source_seek(&src,(const void *)0,0);
+	if ((r = LSMDB_write_run(db,&src,1,drop,id,0,&run,&bytes)))
+		return r;
+
+	pthread_mutex_lock(&db->lock);
+	if ((r = LSMDB_install(db,run,0,0,db->mem->log_first))) {
+		pthread_mutex_unlock(&db->lock);
+		if (run) {
+			LSMDB_unlink_file(db->path,id,LSMDB_RUN_SUFFIX);
+			LSMDB_run_free(run);
+		}
+		return r;
+	}
+	db->imm = (LSMDB_Memtable *)0;
+	++db->stats.flushes;
+	db->stats.bytes_flushed += bytes;
+	pthread_cond_broadcast(&db->done);
+	pthread_cond_broadcast(&db->work);
+	pthread_mutex_unlock(&db->lock);
+
+	for(l=m->log_first;l<=m->log_last;++l)
+		LSMDB_unlink_file(db->path,l,LSMDB_LOG_SUFFIX);
+	LSMDB_mem_free(m);
+	return 0;
+}
+
+static void *LSMDB_flush_thread(void *arg)
+{
+	LSMDB *db = (LSMDB *)arg;
+
+	pthread_mutex_lock(&db->lock);
+	for(;;) {
+		while ((!db->imm)&&(!db->stop))
+			pthread_cond_wait(&db->work,&db->lock);
+		if (!db->imm)
+			break;
+		pthread_mutex_unlock(&db->lock);
+		if (LSMDB_flush(db)) {
+			pthread_mutex_lock(&db->lock);
+			db->error = LSMDB_ERROR_IO;
+			pthread_cond_broadcast(&db->done);
+			break;
+		}
+		pthread_mutex_lock(&db->lock);
+	}
+	pthread_mutex_unlock(&db->lock);
+
+	return (void *)0;
+}
+
+/* Runs of one level are next to each other, newer levels first: find a
+ * level with LSMDB_FANOUT runs. Called locked. */
+static int LSMDB_pick_merge(const LSMDB_Version *v,unsigned long *first)
+{
+	unsigned long i,j;
+
+	for(i=0;i<v->num_runs;i=j) {
+		for(j=i+1;(j<v->num_runs)&&(v->runs[j]->level == v->runs[i]->level);++j);
+		if ((j - i) >= LSMDB_FANOUT) {
+			*first = j - LSMDB_FANOUT;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *LSMDB_compact_thread(void *arg)
+{
+	LSMDB *db = (LSMDB *)arg;
+	LSMDB_Source src[LSMDB_FANOUT];
+	LSMDB_Version *v;
+	LSMDB_Run *run,*oldest;
+	struct timespec ts;
+	unsigned long first,i,k;
+	uint64_t id,bytes;
+	unsigned int level;
+	int drop,r = 0;
+
+	memset(src,0,sizeof(src));
+	pthread_mutex_lock(&db->lock);
+	for(;;) {
+		while ((!db->stop)&&(!LSMDB_pick_merge(db->version,&first)))
+			pthread_cond_wait(&db->work,&db->lock);
+		if (db->stop)
+			break;
+
+		v = db->version;
+		++v->refs;
+		oldest = v->runs[first];
+		level = oldest->level + 1;
+		drop = ((first + LSMDB_FANOUT) == v->num_runs);
+		id = db->next_run++;
+		pthread_mutex_unlock(&db->lock);
+
+		for(i=0;(!r)&&(i<LSMDB_FANOUT);++i) {
+			src[i].run = v->runs[first + i];
+			if (!(src[i].buf = malloc(src[i].run->max_block ? src[i].run->max_block : 1)))
+				r = LSMDB_ERROR_MALLOC;
+			else r = LSMDB_source_seek(&src[i],(const void *)0,0);
+		}
+		if (!r)
+			r = LSMDB_write_run(db,src,LSMDB_FANOUT,drop,id,level,&run,&bytes);
+		for(i=0;i<LSMDB_FANOUT;++i) {
+			free(src[i].buf);
+			src[i].buf = (uint8_t *)0;
+		}
+
+		pthread_mutex_lock(&db->lock);
+		/* runs flushed meanwhile went in front, so find ours again */
+		if (!r) {
+			for(k=0;db->version->runs[k]!=oldest;++k);
+			r = LSMDB_install(db,run,k,LSMDB_FANOUT,db->imm ? db->imm->log_first : db->mem->log_first);
+			if (r) {
+				if (run) {
+					LSMDB_unlink_file(db->path,id,LSMDB_RUN_SUFFIX);
+					LSMDB_run_free(run);
+				}
+			} else {
+				++db->stats.compactions;
+				db->stats.bytes_compacted += bytes;
+			}
+		}
+		LSMDB_version_release(v);
+		if (r) {
+			/* the runs stay as they are, so reads and writes go on;
+			 * the merge is counted and tried again a bit later */
+			++db->stats.compaction_errors;
+			clock_gettime(CLOCK_REALTIME,&ts);
+			ts.tv_sec += LSMDB_RETRY_SECONDS;
+			while ((!db->stop)&&(pthread_cond_timedwait(&db->work,&db->lock,&ts) != ETIMEDOUT));
+			r = 0;
+		}
+	}
+	pthread_mutex_unlock(&db->lock);
+
+	return (void *)0;
+}
+
+/* ---- logs ---- */
+
+static int LSMDB_log_open(LSMDB *db,uint64_t log)
+{
+	char *p = LSMDB_file_path(db->path,log,LSMDB_LOG_SUFFIX);
+	int fd;
+
+	if (!p)
+		return LSMDB_ERROR_MALLOC;
+	fd = open(p,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0644);
+	free(p);
+	if (fd < 0)
+		return LSMDB_ERROR_IO;
+	/* the old log holds puts that were acknowledged but may not be in a
+	 * run yet, so it goes to the disk before it is let go */
+	if (db->log_fd >= 0) {
+		if (fdatasync(db->log_fd)) {
+			close(fd);
+			return LSMDB_ERROR_IO;
+		}
+		close(db->log_fd);
+	}
+	db->log_fd = fd;
+	return 0;
+}
+
+/* Replay logs log, log+1, ... into m; returns the last one found in
+ * m->log_last (or log - 1 if there were none) */
+static int LSMDB_log_replay(LSMDB *db,LSMDB_Memtable *m,uint64_t log)
+{
+	struct stat st;
+	uint8_t *buf;
+	uint64_t pos,len;
+	uint32_t h[3];
+	char *p;
+	int fd,r;
+
+	for(;;++log) {
+		if (!(p = LSMDB_file_path(db->path,log,LSMDB_LOG_SUFFIX)))
+			return LSMDB_ERROR_MALLOC;
+		fd = open(p,O_RDONLY);
+		free(p);
+		if (fd < 0)
+			break;
+		if (fstat(fd,&st)) {
+			close(fd);
+			return LSMDB_ERROR_IO;
+		}
+		len = (uint64_t)st.st_size;
+		if (!(buf = malloc(len ? (size_t)len : 1))) {
+			close(fd);
+			return LSMDB_ERROR_MALLOC;
+		}
+		r = LSMDB_pread(fd,buf,(size_t)len,0);
+		close(fd);
+		for(pos=0;(!r)&&((pos + LSMDB_LOG_HEADER_SIZE)<=len);) {
+			memcpy(h,buf + pos,sizeof(h));
+			if ((h[1] > db->key_size)||((h[2] != LSMDB_TOMBSTONE)&&(h[2] > db->value_size)))
+				break;
+			if ((pos + LSMDB_LOG_HEADER_SIZE + h[1] + ((h[2] == LSMDB_TOMBSTONE) ? 0 : h[2])) > len)
+				break;
+			if (LSMDB_crc32(0,buf + pos + 4,(unsigned long)(LSMDB_LOG_HEADER_SIZE - 4 + h[1] + ((h[2] == LSMDB_TOMBSTONE) ? 0 : h[2]))) != h[0])
+				break;
+			r = LSMDB_mem_put(m,buf + pos + LSMDB_LOG_HEADER_SIZE,h[1],buf + pos + LSMDB_LOG_HEADER_SIZE + h[1],(h[2] == LSMDB_TOMBSTONE) ? LSMDB_TOMBSTONE : h[2]);
+			pos += LSMDB_LOG_HEADER_SIZE + h[1] + ((h[2] == LSMDB_TOMBSTONE) ? 0 : h[2]);
+		}
+		free(buf);
+		if (r)
+			return r;
+		m->log_last = log;
+	}
+	return 0;
+}
+
+/* Append a put or delete to the log and the memtable, freezing the
+ * memtable first if it is full */
+static int LSMDB_write_entry(LSMDB *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	struct iovec iov[3];
+	LSMDB_Memtable *m;
+	uint32_t h[3];
+	unsigned long vl = (vlen == LSMDB_TOMBSTONE) ? 0 : vlen;
+	int r;
+
+	h[1] = (uint32_t)klen;
+	h[2] = (uint32_t)vlen;
+	h[0] = LSMDB_crc32(LSMDB_crc32(LSMDB_crc32(0,h + 1,sizeof(uint32_t) * 2),key,klen),value,vl);
+	iov[0].iov_base = (void *)h;
+	iov[0].iov_len = LSMDB_LOG_HEADER_SIZE;
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = klen;
+	iov[2].iov_base = (void *)value;
+	iov[2].iov_len = vl;
+
+	pthread_mutex_lock(&db->lock);
+	if (db->mem->bytes >= db->memtable_bytes) {
+		if (db->imm)
+			++db->stats.stalls;
+		while ((db->imm)&&(!db->error))
+			pthread_cond_wait(&db->done,&db->lock);
+		if (db->error) {
+			pthread_mutex_unlock(&db->lock);
+			return db->error;
+		}
+		if (!(m = LSMDB_mem_new(db->mem->log_last + 1))) {
+			pthread_mutex_unlock(&db->lock);
+			return LSMDB_ERROR_MALLOC;
+		}
+		if ((r = LSMDB_log_open(db,m->log_first))) {
+			LSMDB_mem_free(m);
+			pthread_mutex_unlock(&db->lock);
+			return r;
+		}
+		db->imm = db->mem;
+		db->mem = m;
+		pthread_cond_broadcast(&db->work);
+	}
+	if (writev(db->log_fd,iov,(vl) ? 3 : 2) != (ssize_t)(LSMDB_LOG_HEADER_SIZE + klen + vl))
+		r = LSMDB_ERROR_IO;
+	else r = LSMDB_mem_put(db->mem,key,klen,value,vlen);
+	db->stats.memtable_bytes = db->mem->bytes;
+	pthread_mutex_unlock(&db->lock);
+	return r;
+}
+
+/* ---- public calls ---- */
+
+static void LSMDB_free(LSMDB *db)
+{
+	pthread_mutex_lock(&db->lock);
+	if (db->version)
+		LSMDB_version_release(db->version);
+	pthread_mutex_unlock(&db->lock);
+	LSMDB_mem_free(db->mem);
+	LSMDB_mem_free(db->imm);
+	if (db->log_fd >= 0)
+		close(db->log_fd);
+	free(db->path);
+	pthread_mutex_destroy(&db->lock);
+	pthread_cond_destroy(&db->work);
+	pthread_cond_destroy(&db->done);
+	memset(db,0,sizeof(LSMDB));
+	db->log_fd = -1;
+}
+
+/* Write the memtable out synchronously, leaving an empty one that logs
+ * to the next log; used on open and close, without the threads */
+static int LSMDB_flush_now(LSMDB *db)
+{
+	LSMDB_Memtable *m;
+
+	if (!db->mem->count)
+		return 0;
+	if (!(m = LSMDB_mem_new(db->mem->log_last + 1)))
+		return LSMDB_ERROR_MALLOC;
+	db->imm = db->mem;
+	db->mem = m;
+	return LSMDB_flush(db);
+}
+
+int LSMDB_open(
+	LSMDB *db,
+	const char *path,
+	int mode,
+	unsigned long memtable_bytes,
+	unsigned long key_size,
+	unsigned long value_size)
+{
+	char magic[8];
+	unsigned long long log,next_run,id;
+	unsigned long i,num_runs;
+	unsigned int level;
+	int version;
+	FILE *f;
+	char *p;
+	int r = 0;
+
+	memset(db,0,sizeof(LSMDB));
+	db->log_fd = -1;
+	if ((mode < LSMDB_OPEN_MODE_RDONLY)||(mode > LSMDB_OPEN_MODE_RWREPLACE))
+		return LSMDB_ERROR_INVALID_PARAMETERS;
+	db->rdonly = (mode == LSMDB_OPEN_MODE_RDONLY);
+	db->memtable_bytes = memtable_bytes ? memtable_bytes : LSMDB_DEFAULT_MEMTABLE_BYTES;
+	if (!(db->path = strdup(path)))
+		return LSMDB_ERROR_MALLOC;
+	pthread_mutex_init(&db->lock,(const pthread_mutexattr_t *)0);
+	pthread_cond_init(&db->work,(const pthread_condattr_t *)0);
+	pthread_cond_init(&db->done,(const pthread_condattr_t *)0);
+
+	log = 1;
+	next_run = 1;
+	num_runs = 0;
+	if ((f = fopen(path,"r"))) {
+		if ((fscanf(f,"%7s %d %lu %lu %llu %llu %lu",magic,&version,&db->key_size,&db->value_size,&log,&next_run,&num_runs) != 7)||(strcmp(magic,LSMDB_MAGIC))||(version != LSMDB_VERSION)) {
+			fclose(f);
+			LSMDB_free(db);
+			return LSMDB_ERROR_CORRUPT_DBFILE;
+		}
+		if (!(db->version = LSMDB_version_new(num_runs))) {
+			fclose(f);
+			LSMDB_free(db);
+			return LSMDB_ERROR_MALLOC;
+		}
+		db->version->num_runs = 0;
+		for(i=0;i<num_runs;++i) {
+			if (fscanf(f,"%llu %u",&id,&level) != 2) {
+				r = LSMDB_ERROR_CORRUPT_DBFILE;
+				break;
+			}
+			if (mode == LSMDB_OPEN_MODE_RWREPLACE) {
+				LSMDB_unlink_file(path,id,LSMDB_RUN_SUFFIX);
+				continue;
+			}
+			if ((r = LSMDB_run_open(path,id,level,&(db->version->runs[i]))))
+				break;
+			db->version->runs[i]->refs = 1;
+			++db->version->num_runs;
+		}
+		fclose(f);
+		if (r) {
+			LSMDB_free(db);
+			return r;
+		}
+		if (mode == LSMDB_OPEN_MODE_RWREPLACE) {
+			for(;;++log) {
+				if (!(p = LSMDB_file_path(path,log,LSMDB_LOG_SUFFIX)))
+					break;
+				r = unlink(p);
+				free(p);
+				if (r)
+					break;
+			}
+			r = 0;
+		}
+	} else if ((errno != ENOENT)||(db->rdonly)||(mode == LSMDB_OPEN_MODE_RDWR)) {
+		LSMDB_free(db);
+		return LSMDB_ERROR_IO;
+	}
+	db->next_run = next_run;
+
+	if ((!db->version)||(mode == LSMDB_OPEN_MODE_RWREPLACE)) {
+		/* new database */
+		if ((!key_size)||(!value_size)||(key_size >= LSMDB_TOMBSTONE)||(value_size >= LSMDB_TOMBSTONE)) {
+			LSMDB_free(db);
+			return LSMDB_ERROR_INVALID_PARAMETERS;
+		}
+		db->key_size = key_size;
+		db->value_size = value_size;
+		if (db->version)
+			LSMDB_version_release(db->version);
+		if (!(db->version = LSMDB_version_new(0))) {
+			LSMDB_free(db);
+			return LSMDB_ERROR_MALLOC;
+		}
+		log = 1;
+		db->next_run = 1;
+		if ((r = LSMDB_write_manifest(db,db->version,log))) {
+			LSMDB_free(db);
+			return r;
+		}
+	}
+	db->stats.runs = db->version->num_runs;
+
+	/* writes a crash left in the logs go into a run right away, so the
+	 * database starts out with a single, empty log */
+	if (!(db->mem = LSMDB_mem_new(log))) {
+		LSMDB_free(db);
+		return LSMDB_ERROR_MALLOC;
+	}
+	if ((r = LSMDB_log_replay(db,db->mem,log))) {
+		LSMDB_free(db);
+		return r;
+	}
+	if (db->rdonly)
+		return 0;
+	if (!db->mem->count) {
+		/* logs with nothing to replay; the first is truncated below */
+		for(log=db->mem->log_first+1;log<=db->mem->log_last;++log)
+			LSMDB_unlink_file(path,log,LSMDB_LOG_SUFFIX);
+		db->mem->log_last = db->mem->log_first;
+	}
+	if (((r = LSMDB_flush_now(db)))||((r = LSMDB_log_open(db,db->mem->log_first)))) {
+		LSMDB_free(db);
+		return r;
+	}
+
+	if (pthread_create(&db->flusher,(const pthread_attr_t *)0,LSMDB_flush_thread,(void *)db)) {
+		LSMDB_free(db);
+		return LSMDB_ERROR_MALLOC;
+	}
+	if (pthread_create(&db->compactor,(const pthread_attr_t *)0,LSMDB_compact_thread,(void *)db)) {
+		pthread_mutex_lock(&db->lock);
+		db->stop = 1;
+		pthread_cond_broadcast(&db->work);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->flusher,(void **)0);
+		LSMDB_free(db);
+		return LSMDB_ERROR_MALLOC;
+	}
+	db->threads = 1;
+
+	return 0;
+}
+
+void LSMDB_close(LSMDB *db)
+{
+	if (!db->path)
+		return;
+	if (db->threads) {
+		/* the flusher finishes a frozen memtable before it stops */
+		pthread_mutex_lock(&db->lock);
+		db->stop = 1;
+		pthread_cond_broadcast(&db->work);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->flusher,(void **)0);
+		pthread_join(db->compactor,(void **)0);
+	}
+	if ((!db->rdonly)&&(!db->imm)&&(!db->error)&&(!LSMDB_flush_now(db)))
+		LSMDB_unlink_file(db->path,db->mem->log_first,LSMDB_LOG_SUFFIX);
+	LSMDB_free(db);
+}
+
+/* Find key: 0 if found, 1 if not, negative on error */
+static int LSMDB_lookup(LSMDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	LSMDB_Memtable *mt[2];
+	LSMDB_Version *v;
+	LSMDB_Node *n;
+	uint8_t *buf = (uint8_t *)0;
+	unsigned long i,max = 0,skips = 0;
+	uint64_t h;
+	int r = 1;
+
+	if (klen > db->key_size)
+		return LSMDB_ERROR_INVALID_PARAMETERS;
+
+	pthread_mutex_lock(&db->lock);
+	mt[0] = db->mem;
+	mt[1] = db->imm;
+	for(i=0;i<2;++i) {
+		if ((mt[i])&&((n = LSMDB_mem_find(mt[i],key,klen)))) {
+			if (n->vlen != LSMDB_TOMBSTONE) {
+				if (vbuf)
+					memcpy(vbuf,n->value,n->vlen);
+				if (vlen)
+					*vlen = n->vlen;
+				r = 0;
+			}
+			pthread_mutex_unlock(&db->lock);
+			return r;
+		}
+	}
+	v = db->version;
+	++v->refs;
+	pthread_mutex_unlock(&db->lock);
+
+	/* the runs are immutable, so they are read without the lock */
+	h = LSMDB_hash(key,klen);
+	for(i=0;i<v->num_runs;++i) {
+		if (v->runs[i]->max_block > max)
+			max = v->runs[i]->max_block;
+	}
+	if ((max)&&(!(buf = malloc(max))))
+		r = LSMDB_ERROR_MALLOC;
+	else {
+		for(i=0;i<v->num_runs;++i) {
+			if (!LSMDB_bloom_test(v->runs[i],h)) {
+				++skips;
+				continue;
+			}
+			if ((r = LSMDB_run_get(v->runs[i],key,klen,vbuf,vlen,buf)) != 1)
+				break;
+		}
+		if (r == 2)
+			r = 1; /* deleted */
+	}
+	free(buf);
+
+	pthread_mutex_lock(&db->lock);
+	db->stats.bloom_skips += skips;
+	LSMDB_version_release(v);
+	pthread_mutex_unlock(&db->lock);
+	return r;
+}
+
+int LSMDB_get(LSMDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	return LSMDB_lookup(db,key,klen,vbuf,vlen);
+}
+
+int LSMDB_put(LSMDB *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	if ((klen > db->key_size)||(vlen > db->value_size))
+		return LSMDB_ERROR_INVALID_PARAMETERS;
+	if (db->rdonly)
+		return LSMDB_ERROR_IO;
+	return LSMDB_write_entry(db,key,klen,value,vlen);
+}
+
+int LSMDB_delete(LSMDB *db,const void *key,unsigned long klen)
+{
+	int r;
+
+	if (klen > db->key_size)
+		return LSMDB_ERROR_INVALID_PARAMETERS;
+	if (db->rdonly)
+		return LSMDB_ERROR_IO;
+	/* the Bloom filters make this cheap for keys that are not there */
+	if ((r = LSMDB_lookup(db,key,klen,(void *)0,(unsigned long *)0)))
+		return r;
+	return LSMDB_write_entry(db,key,klen,(const void *)0,LSMDB_TOMBSTONE);
+}
+
+int LSMDB_range_scan(LSMDB *db,const void *start,unsigned long slen,const void *end,unsigned long elen,LSMDB_Range_Callback cb,void *arg)
+{
+	LSMDB_Memtable *m;
+	LSMDB_Source *src;
+	LSMDB_Version *v;
+	unsigned long i,n = 0;
+	long b;
+	int r = 0;
+
+	/* the range of the memtables is copied and the runs held, so the
+	 * scan and cb run without the lock while puts go on */
+	if (!(m = LSMDB_mem_new(0)))
+		return LSMDB_ERROR_MALLOC;
+	pthread_mutex_lock(&db->lock);
+	if ((!(r = LSMDB_mem_copy(m,db->mem,start,slen,end,elen)))&&(db->imm))
+		r = LSMDB_mem_copy(m,db->imm,start,slen,end,elen);
+	v = db->version;
+	++v->refs;
+	pthread_mutex_unlock(&db->lock);
+	if ((r)||(!(src = calloc(v->num_runs + 1,sizeof(LSMDB_Source))))) {
+		src = (LSMDB_Source *)0;
+		if (!r)
+			r = LSMDB_ERROR_MALLOC;
+	} else {
+		src[n++].node = m->head;
+		for(i=0;i<v->num_runs;++i)
+			src[n++].run = v->runs[i];
+	}
+	for(i=0;(!r)&&(i<n);++i) {
+		if ((src[i].run)&&(!(src[i].buf = malloc(src[i].run->max_block ? src[i].run->max_block : 1))))
+			r = LSMDB_ERROR_MALLOC;
+		else r = LSMDB_source_seek(&src[i],(src[i].run) ? start : (const void *)0,slen);
+	}
+
+	while ((!r)&&((b = LSMDB_merge_pick(src,n)) >= 0)) {
+		if ((end)&&(LSMDB_compare(src[b].key,src[b].klen,end,elen) > 0))
+			break;
+		if ((src[b].vlen != LSMDB_TOMBSTONE)&&((r = cb(arg,src[b].key,src[b].klen,src[b].value,src[b].vlen))))
+			break;
+		r = LSMDB_merge_advance(src,n,b);
+	}
+
+	for(i=0;i<n;++i)
+		free(src[i].buf);
+	free(src);
+	LSMDB_mem_free(m);
+	pthread_mutex_lock(&db->lock);
+	LSMDB_version_release(v);
+	pthread_mutex_unlock(&db->lock);
+	return r;
+}
+
+int LSMDB_sync(LSMDB *db)
+{
+	int r = 0;
+
+	if (db->rdonly)
+		return 0;
+	pthread_mutex_lock(&db->lock);
+	if (fdatasync(db->log_fd))
+		r = LSMDB_ERROR_IO;
+	pthread_mutex_unlock(&db->lock);
+	return r;
+}
+
+void LSMDB_stats(LSMDB *db,LSMDB_Stats *st)
+{
+	pthread_mutex_lock(&db->lock);
+	memcpy(st,&db->stats,sizeof(LSMDB_Stats));
+	pthread_mutex_unlock(&db->lock);
+}
+
+#ifdef LSMDB_TEST
+
+#include <inttypes.h>
+
+static int LSMDB_test_collect(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	char **prev = (char **)arg;
+	char k[64];
+
+	memcpy(k,key,klen);
+	k[klen] = (char)0;
+	if ((prev[0][0])&&(strcmp(prev[0],k) >= 0)) {
+		printf("LSMDB_range_scan failed, out of order (%s after %s)\n",k,prev[0]);
+		return -100;
+	}
+	strcpy(prev[0],k);
+	++*((unsigned long *)prev[1]);
+	return 0;
+}
+
+/* Puts a key just after each one it is given, inside the range scanned */
+static int LSMDB_test_put_next(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	LSMDB *db = ((LSMDB **)arg)[0];
+	char k[64];
+
+	memcpy(k,key,klen);
+	k[klen] = '+';
+	++*((unsigned long *)((void **)arg)[1]);
+	return LSMDB_put(db,k,klen + 1,value,vlen);
+}
+
+static void *LSMDB_test_writer(void *arg)
+{
+	LSMDB *db = ((LSMDB **)arg)[0];
+	uint64_t t = (uint64_t)(uintptr_t)((void **)arg)[1];
+	char kbuf[64],vbuf[64];
+	unsigned long klen,vlen;
+	uint64_t i;
+
+	for(i=t;i<40000;i+=4) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,(i * 7919) % 40000);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64,((i * 7919) % 40000) * 3);
+		if (LSMDB_put(db,kbuf,klen,vbuf,vlen))
+			return (void *)1;
+	}
+	return (void *)0;
+}
+
+static int LSMDB_test_check(LSMDB *db)
+{
+	char kbuf[64],vbuf[1024],vexp[1024];
+	unsigned long klen,vlen,n;
+	uint64_t i;
+	int r;
+
+	for(i=0;i<40000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		r = LSMDB_get(db,kbuf,klen,vbuf,&vlen);
+		if ((i % 10) == 0) {
+			if (r != 1) {
+				printf("LSMDB_get found deleted key (%"PRIu64") (%d)\n",i,r);
+				return 1;
+			}
+			continue;
+		}
+		if ((i % 2) == 0)
+			n = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64"-overwritten",i);
+		else n = (unsigned long)snprintf(vexp,sizeof(vexp),"%"PRIu64,i * 3);
+		if ((r)||(vlen != n)||(memcmp(vbuf,vexp,n))) {
+			printf("LSMDB_get failed (%"PRIu64") (%d)\n",i,r);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc,char **argv)
+{
+	LSMDB db;
+	LSMDB_Stats st;
+	LSMDB *dbp = &db;
+	void *args4[4][2];
+	pthread_t writers[4];
+	void *ret;
+	char kbuf[64],vbuf[64];
+	char last[64];
+	char *args[2];
+	void *scan_args[2];
+	unsigned long klen,vlen,n;
+	uint64_t i;
+	int r;
+
+	printf("Creating LSM database test.lsm and putting 40000 values from 4 threads...\n");
+
+	/* a small memtable, so that there are many runs to merge */
+	if (LSMDB_open(&db,"test.lsm",LSMDB_OPEN_MODE_RWREPLACE,65536,64,64)) {
+		printf("LSMDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<4;++i) {
+		args4[i][0] = (void *)dbp;
+		args4[i][1] = (void *)(uintptr_t)i;
+		pthread_create(&writers[i],NULL,LSMDB_test_writer,args4[i]);
+	}
+	for(i=0;i<4;++i) {
+		pthread_join(writers[i],&ret);
+		if (ret) {
+			printf("LSMDB_put failed\n");
+			return 1;
+		}
+	}
+	for(i=0;i<40000;i+=2) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		vlen = (unsigned long)snprintf(vbuf,sizeof(vbuf),"%"PRIu64"-overwritten",i);
+		if (LSMDB_put(&db,kbuf,klen,vbuf,vlen)) {
+			printf("LSMDB_put (overwrite) failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(i=0;i<40000;i+=10) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"station.%"PRIu64,i);
+		if (LSMDB_delete(&db,kbuf,klen)) {
+			printf("LSMDB_delete failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (LSMDB_delete(&db,"station.0",9) != 1) {
+		printf("LSMDB_delete deleted a missing key\n");
+		return 1;
+	}
+	if (LSMDB_test_check(&db))
+		return 1;
+	LSMDB_stats(&db,&st);
+	if ((!st.flushes)||(!st.compactions)) {
+		printf("LSMDB did not flush and merge runs (%"PRIu64" flushes, %"PRIu64" merges)\n",st.flushes,st.compactions);
+		return 1;
+	}
+	for(i=0,n=0;i<100000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"absent.%"PRIu64,i);
+		if (LSMDB_get(&db,kbuf,klen,vbuf,&vlen) != 1) {
+			printf("LSMDB_get found nonexistent key\n");
+			return 1;
+		}
+	}
+	LSMDB_stats(&db,&st);
+	if (st.bloom_skips < (100000 * st.runs * 9 / 10)) {
+		printf("LSMDB Bloom filters ruled out too few lookups (%"PRIu64")\n",st.bloom_skips);
+		return 1;
+	}
+	LSMDB_close(&db);
+
+	printf("Re-opening, getting 40000 values and scanning...\n");
+
+	if (LSMDB_open(&db,"test.lsm",LSMDB_OPEN_MODE_RDONLY,0,0,0)) {
+		printf("LSMDB_open failed\n");
+		return 1;
+	}
+	if (LSMDB_test_check(&db))
+		return 1;
+	last[0] = (char)0;
+	n = 0;
+	args[0] = last;
+	args[1] = (char *)&n;
+	if ((LSMDB_range_scan(&db,"station.10",10,"station.40",10,LSMDB_test_collect,args))) {
+		printf("LSMDB_range_scan failed\n");
+		return 1;
+	}
+	/* station.1x to 1xxxx (11110 keys), 2 to 2xxxx and 3 to 3xxxx (11111
+	 * each), 4 and 40, less the 3334 multiples of 10 */
+	if (n != 30000) {
+		printf("LSMDB_range_scan failed (%lu entries)\n",n);
+		return 1;
+	}
+	LSMDB_close(&db);
+
+	printf("Logging 1000 puts, then exiting without closing...\n");
+
+	if (LSMDB_open(&db,"test.lsm",LSMDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("LSMDB_open failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"logged.%"PRIu64,i);
+		if (LSMDB_put(&db,kbuf,klen,kbuf,klen)) {
+			printf("LSMDB_put failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	if (LSMDB_delete(&db,"station.1",9)) {
+		printf("LSMDB_delete failed\n");
+		return 1;
+	}
+	/* as if the process died: closing a read only database writes
+	 * nothing out, so the log is all there is */
+	db.rdonly = 1;
+	LSMDB_close(&db);
+
+	if (LSMDB_open(&db,"test.lsm",LSMDB_OPEN_MODE_RDWR,0,0,0)) {
+		printf("LSMDB_open (log replay) failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"logged.%"PRIu64,i);
+		if ((r = LSMDB_get(&db,kbuf,klen,vbuf,&vlen))||(vlen != klen)||(memcmp(vbuf,kbuf,klen))) {
+			printf("LSMDB_get after log replay failed (%"PRIu64") (%d)\n",i,r);
+			return 1;
+		}
+	}
+	if (LSMDB_get(&db,"station.1",9,vbuf,&vlen) != 1) {
+		printf("LSMDB_get found key deleted before log replay\n");
+		return 1;
+	}
+
+	/* the callback puts into the range being scanned, enough to freeze
+	 * the memtable; the scan sees none of it */
+	n = 0;
+	scan_args[0] = (void *)dbp;
+	scan_args[1] = (void *)&n;
+	if ((r = LSMDB_range_scan(&db,"logged.",7,"logged.~",8,LSMDB_test_put_next,scan_args))||(n != 1000)) {
+		printf("LSMDB_range_scan with puts failed (%lu entries) (%d)\n",n,r);
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		klen = (unsigned long)snprintf(kbuf,sizeof(kbuf),"logged.%"PRIu64"+",i);
+		if ((r = LSMDB_get(&db,kbuf,klen,vbuf,&vlen))||(vlen != (klen - 1))||(memcmp(vbuf,kbuf,klen - 1))) {
+			printf("LSMDB_get of a put made during a scan failed (%"PRIu64") (%d)\n",i,r);
+			return 1;
+		}
+	}
+	LSMDB_close(&db);
+
+	printf("All tests OK!\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,265 @@
+/* (Keep It) Simple Stupid Database: log-structured merge engine
+ *
+ * KISSDB is in the public domain and is distributed with NO WARRANTY.
+ *
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+#ifndef ___LSMDB_H
+#define ___LSMDB_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Version: 1
+ *
+ * Format identifier of the manifest and of sorted run files
+ */
+#define LSMDB_VERSION 1
+
+/**
+ * Memtable size at which it is frozen and written out as a sorted run,
+ * unless LSMDB_open() is given another size
+ */
+#define LSMDB_DEFAULT_MEMTABLE_BYTES 4194304
+
+/**
+ * Number of runs of one level that are merged into a run of the next
+ */
+#define LSMDB_FANOUT 4
+
+/**
+ * I/O error or file not found
+ */
+#define LSMDB_ERROR_IO -1
+
+/**
+ * Out of memory
+ */
+#define LSMDB_ERROR_MALLOC -2
+
+/**
+ * Invalid paramters (e.g. missing _size paramters on init to create database)
+ */
+#define LSMDB_ERROR_INVALID_PARAMETERS -3
+
+/**
+ * Database file appears corrupt
+ */
+#define LSMDB_ERROR_CORRUPT_DBFILE -4
+
+/**
+ * Open mode: read only
+ */
+#define LSMDB_OPEN_MODE_RDONLY 1
+
+/**
+ * Open mode: read/write
+ */
+#define LSMDB_OPEN_MODE_RDWR 2
+
+/**
+ * Open mode: read/write, create if doesn't exist
+ */
+#define LSMDB_OPEN_MODE_RWCREAT 3
+
+/**
+ * Open mode: truncate database, open for reading and writing
+ */
+#define LSMDB_OPEN_MODE_RWREPLACE 4
+
+/**
+ * In-memory sorted buffer of recent writes (opaque)
+ */
+typedef struct LSMDB_Memtable LSMDB_Memtable;
+
+/**
+ * The set of sorted runs at one point in time (opaque)
+ */
+typedef struct LSMDB_Version LSMDB_Version;
+
+/**
+ * Counters (see LSMDB_stats())
+ */
+typedef struct {
+	uint64_t flushes; /* memtables written out as runs */
+	uint64_t compactions; /* merges of runs */
+	uint64_t compaction_errors; /* merges that failed, to be tried again */
+	uint64_t bytes_flushed;
+	uint64_t bytes_compacted;
+	uint64_t bloom_skips; /* run lookups a Bloom filter ruled out */
+	uint64_t stalls; /* puts that waited for a memtable to be written out */
+	uint64_t runs;
+	uint64_t memtable_bytes;
+} LSMDB_Stats;
+
+/**
+ * Log-structured merge database state
+ *
+ * Puts and deletes are appended to a log and inserted into a memtable (a
+ * skiplist). A full memtable is frozen and a background thread writes it
+ * out as an immutable run file sorted by key, while a new memtable takes
+ * the writes; another thread merges runs once LSMDB_FANOUT of them are the
+ * same size. So all writes to the disk are sequential appends.
+ *
+ * A lookup checks the memtables and then the runs from newest to oldest,
+ * skipping the runs whose Bloom filter rules the key out, and reads one
+ * block of the first run that may have it.
+ *
+ * Keys are kept in byte order (shorter keys first on a common prefix).
+ * Every call takes the database's mutex, so an LSMDB may be shared between
+ * threads; reads from run files are done outside it.
+ */
+typedef struct {
+	unsigned long key_size;
+	unsigned long value_size;
+	unsigned long memtable_bytes;
+	char *path;
+	int rdonly;
+	int log_fd;
+	uint64_t next_run;
+	LSMDB_Memtable *mem;
+	LSMDB_Memtable *imm; /* frozen memtable being written out, or NULL */
+	LSMDB_Version *version;
+	LSMDB_Stats stats;
+	pthread_t flusher;
+	pthread_t compactor;
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* a memtable was frozen, a run added, or stop */
+	pthread_cond_t done; /* a memtable was written out */
+	int threads;
+	int stop;
+	int error;
+} LSMDB;
+
+/**
+ * Open database
+ *
+ * The database is a manifest at path listing its runs, path.N.run, plus
+ * the log of the memtable, path.N.log. A log left by a crash is replayed
+ * and written out as a run when the database is opened.
+ *
+ * As with KISSDB_open(), the _size parameters must be given if the
+ * database could be created; if it exists they are read from the manifest.
+ *
+ * @param db Database struct
+ * @param path Path to the manifest
+ * @param mode One of the LSMDB_OPEN_MODE constants
+ * @param memtable_bytes Memtable size to write out at (0 for LSMDB_DEFAULT_MEMTABLE_BYTES)
+ * @param key_size Maximum size of keys in bytes
+ * @param value_size Maximum size of values in bytes
+ * @return 0 on success, nonzero on error
+ */
+extern int LSMDB_open(
+	LSMDB *db,
+	const char *path,
+	int mode,
+	unsigned long memtable_bytes,
+	unsigned long key_size,
+	unsigned long value_size);
+
+/**
+ * Write out the memtable and close database
+ *
+ * A merge in progress is finished first.
+ *
+ * @param db Database struct
+ */
+extern void LSMDB_close(LSMDB *db);
+
+/**
+ * Get an entry
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @param vlen If not NULL, set to the length of the value on success
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int LSMDB_get(LSMDB *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+/**
+ * Put an entry (overwriting it if it already exists)
+ *
+ * The entry is written to the log, but the log is only synced by
+ * LSMDB_sync(). Waits if the memtable is full and the previous one is
+ * still being written out.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @param value Value (vlen bytes)
+ * @param vlen Length of value, at most value_size
+ * @return -1 on I/O error, 0 on success
+ */
+extern int LSMDB_put(LSMDB *db,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Delete an entry
+ *
+ * A delete is a put of a tombstone, which hides the key in older runs
+ * until a merge that includes the oldest run drops both.
+ *
+ * @param db Database struct
+ * @param key Key (klen bytes)
+ * @param klen Length of key, at most key_size
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int LSMDB_delete(LSMDB *db,const void *key,unsigned long klen);
+
+/**
+ * Called by LSMDB_range_scan() for each entry in the range
+ *
+ * The key and value are only valid until the callback returns. The
+ * callback may call into the same database; what it puts or deletes is
+ * not seen by the scan.
+ *
+ * @return 0 to continue, nonzero to stop the scan
+ */
+typedef int (*LSMDB_Range_Callback)(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * Visit all entries with start <= key <= end, in key order
+ *
+ * The range of the memtables is copied and the runs are held as they
+ * are, then merged as they are read without the database's mutex, so the
+ * scan sees the database as it was when it started while puts and
+ * deletes go on.
+ *
+ * @param db Database struct
+ * @param start First key of the range, or NULL to start at the smallest key
+ * @param slen Length of start
+ * @param end Last key of the range, or NULL to go on to the largest key
+ * @param elen Length of end
+ * @param cb Function called for each entry
+ * @param arg Passed to cb
+ * @return Negative on error, 0 if the whole range was visited, or the nonzero value cb stopped with
+ */
+extern int LSMDB_range_scan(LSMDB *db,const void *start,unsigned long slen,const void *end,unsigned long elen,LSMDB_Range_Callback cb,void *arg);
+
+/**
+ * Sync the log, making all puts and deletes so far durable
+ *
+ * @param db Database struct
+ * @return 0 on success, negative on error
+ */
+extern int LSMDB_sync(LSMDB *db);
+
+/**
+ * Get counters
+ *
+ * @param db Database struct
+ * @param st Filled with the counters
+ */
+extern void LSMDB_stats(LSMDB *db,LSMDB_Stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,25 +11,27 @@
 
 
 #include "utils.h"
-#include "kissdb.h"
+#include "storage.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #define MY_PORT                 6767
 #define BUF_SIZE                1160
 #define KEY_SIZE                 128
-#define HASH_SIZE               1024
 #define VALUE_SIZE              1024
 #define MAX_PENDING_CONNECTIONS   10
 #define QUEUE_SIZE			10
 #define THREADS                 10
+#define COMPACT_INTERVAL          60  // seconds between checks for dead space
 
 // Definition of the operation type.
 typedef enum operation {
   PUT,
-  GET
+  GET,
+  DEL
 } Operation; 
 
 // Definition of the request.
@@ -56,6 +58,12 @@ int tail; //tail ouras
 int plithos=0; //plithos stoixeiwn ouras
 struct oura Q[QUEUE_SIZE]; // h oura, krataei oles tis aitiseis
 pthread_t tid[THREADS]; 
+pthread_t compactor_tid;
+
+// stamatima tou compactor: 0 trexei, 1 stamataei, 2 stamatise (join egine)
+int compactor_state = 2;
+pthread_mutex_t compactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compactor_cond = PTHREAD_COND_INITIALIZER;
 
 int total_service_time=0;
 pthread_mutex_t tst = PTHREAD_MUTEX_INITIALIZER; 
@@ -69,23 +77,19 @@ pthread_mutex_t Q_mutex = PTHREAD_MUTEX_INITIALIZER; //mutex gia oura kai non_em
 pthread_cond_t non_empty_Queue = PTHREAD_COND_INITIALIZER; 
 pthread_cond_t non_full_Queue = PTHREAD_COND_INITIALIZER; 
 
-// metavlites gia anagnostes grafeis
-int reader_count = 0;
-int writer_count = 0;
-
-pthread_mutex_t reader_count_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-
-
 // Definition of the database.
-KISSDB *db = NULL;
+// i vasi einai mia apo tis mixanes tou storage.c (epilegetai me -e), kai
+// oles oi klhseis pernane apo ton pinaka sinartisewn tis
+const STORAGE_Engine *engine;
+void *db;
 
 // sinartiseis
 void enQ(int new_connection);
 struct oura * deQ();
 void create_threads();
 void *katanalotis(void  *x);
+void *compactor(void *x);
+void stop_compactor();
 static void sig_handler(int signo);
 void join_threads();
 void ypologismos();
@@ -116,6 +120,8 @@ Request *parse_request(char *buffer) {
     req->operation = PUT;
   } else if (!strcmp(token, "GET")) {
     req->operation = GET;
+  } else if (!strcmp(token, "DEL")) {
+    req->operation = DEL;
   } else {
     free(req);
     return NULL;
@@ -174,40 +180,38 @@ void readerr(Request *request,char response_str[BUF_SIZE])
 {
 	
 	
-	pthread_mutex_lock(&reader_count_mutex);
-    reader_count++;
-    if(reader_count==1)
-    	pthread_mutex_lock(&db_mutex);
-    pthread_mutex_unlock(&reader_count_mutex);
-    if (KISSDB_get(db, request->key, request->value))
+	int r;
+
+	r = engine->get(db, request->key, strnlen(request->key, KEY_SIZE), request->value, NULL);
+    if (r)
       sprintf(response_str, "GET ERROR\n");
     else
       sprintf(response_str, "GET OK: %s\n", request->value);
-     
-	pthread_mutex_lock(&reader_count_mutex);
-    reader_count--;
-    if(reader_count==0)
-    	pthread_mutex_unlock(&db_mutex);
-    pthread_mutex_unlock(&reader_count_mutex); 
 }
 
 void writerr(Request *request, char response_str[BUF_SIZE])
 {
-	
-	
-	pthread_mutex_lock(&db_mutex);
-	 
-			
-    if (KISSDB_put(db, request->key, request->value)) 
+	int r;
+
+    r = engine->put(db, request->key, strnlen(request->key, KEY_SIZE), request->value, strnlen(request->value, VALUE_SIZE));
+    if (r) 
       sprintf(response_str, "PUT ERROR\n");
     else
       sprintf(response_str, "PUT OK\n");
-	           
-            
-	pthread_mutex_unlock(&db_mutex);
 	
 }
 
+void deleterr(Request *request, char response_str[BUF_SIZE])
+{
+	int r;
+
+    r = engine->del(db, request->key, strnlen(request->key, KEY_SIZE));
+    if (r)
+      sprintf(response_str, "DEL ERROR\n");
+    else
+      sprintf(response_str, "DEL OK\n");
+}
+
 /*
  * @name process_request - Process a client request.
  * @param socket_fd: The accept descriptor.
@@ -247,6 +251,11 @@ void process_request(const int socket_fd, struct timeval tv) {
 		
             writerr(request,response_str);
       
+            break;
+          case DEL:
+            // Delete the given key from the database.
+            deleterr(request,response_str);
+
             break;
           default:
             // Unsupported operation.
@@ -274,12 +283,28 @@ void process_request(const int socket_fd, struct timeval tv) {
 
 
 
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+  int i;
+
+  fprintf(stderr, "Usage: server [OPTION]...\n\n");
+  fprintf(stderr, "Available Options:\n");
+  fprintf(stderr, "-h:             Print this help message.\n");
+  fprintf(stderr, "-e <engine>:    Storage engine to use.\n");
+  fprintf(stderr, "                <engine>:\n");
+  for (i = 0; STORAGE_engines[i]; i++)
+    fprintf(stderr, "                %s%s: %s\n", STORAGE_engines[i]->name, i ? "" : " (default)", STORAGE_engines[i]->description);
+}
+
 /*
  * @name main - The main routine.
  *
  * @return 0 on success, 1 on error.
  */
-int main() {
+int main(int argc, char **argv) {
 
 
   
@@ -288,7 +313,28 @@ int main() {
   socklen_t clen;
   struct sockaddr_in server_addr,  // my address information
                      client_addr;  // connector's address information
-
+  int option = 0;
+
+  engine = STORAGE_engines[0];
+
+  // Parse user parameters.
+  while ((option = getopt(argc, argv,"he:")) != -1) {
+    switch (option) {
+      case 'h':
+        print_usage();
+        exit(0);
+      case 'e':
+        if (!(engine = STORAGE_find(optarg))) {
+          fprintf(stderr, "Error: Unknown engine '%s'.\n\n", optarg);
+          print_usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+  }
 
 
 
@@ -323,16 +369,8 @@ int main() {
   clen = sizeof(client_addr);
 
 
-  // Allocate memory for the database.
-  if (!(db = (KISSDB *)malloc(sizeof(KISSDB)))) {
-    fprintf(stderr, "(Error) main: Cannot allocate memory for the database.\n");
-    return 1;
-  }
-  
-
-
   // Open the database.
-  if (KISSDB_open(db, "mydb.db", KISSDB_OPEN_MODE_RWCREAT, HASH_SIZE, KEY_SIZE, VALUE_SIZE)) {
+  if (engine->open(&db, engine->path, KEY_SIZE, VALUE_SIZE)) {
     fprintf(stderr, "(Error) main: Cannot open the database.\n");
     return 1;
   }
@@ -340,6 +378,13 @@ int main() {
 	// dimiourgia nimatwn katanalwtwn
 	create_threads();
 
+	// background compaction of dead space, gia tis mixanes pou to xreiazontai
+	if (engine->maintain) {
+		compactor_state = 0;
+		if (pthread_create(&compactor_tid, NULL, compactor, NULL))
+			compactor_state = 2;
+	}
+
   // main loop: wait for new connection/requests
   while (1) { 
 	
@@ -380,14 +425,15 @@ static void sig_handler(int signo)
 
 	// termatismos katanalwtwn
 	join_threads();
-	
+
+	// o compactor prepei na exei teleiwsei prin kleisei i vasi
+	stop_compactor();
+
+	// statistika prin kleisei i vasi
+	engine->stats(db, stdout);
+
 	// kleisimo vasis
-	KISSDB_close(db);
-	
-	  // Free memory.
-	  if (db)
-	    free(db);
-	  db = NULL;
+	engine->close(db);
 
 	// ypologismos kai typwma statistikwn apotelesmatwn
 	ypologismos();
@@ -493,3 +539,51 @@ void *katanalotis(void  *x)
 			process_request(xx->connection_fd,xx->start_time);
 	}
 }
+
+
+// Periodically runs the engine's upkeep, e.g. for kissdb reclaiming the
+// space of overwritten and deleted entries one shard at a time, until
+// stop_compactor() wakes it up.
+void *compactor(void *x)
+{
+	struct timespec deadline;
+	sigset_t set;
+
+	// to SIGTSTP to xeirizontai ta alla nimata, oxi o compactor
+	sigemptyset(&set);
+	sigaddset(&set, SIGTSTP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&compactor_mutex);
+	while(compactor_state == 0){
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += COMPACT_INTERVAL;
+		while((compactor_state == 0) && (pthread_cond_timedwait(&compactor_cond, &compactor_mutex, &deadline) != ETIMEDOUT));
+		if(compactor_state != 0)
+			break;
+		pthread_mutex_unlock(&compactor_mutex);
+		engine->maintain(db);
+		pthread_mutex_lock(&compactor_mutex);
+	}
+	pthread_mutex_unlock(&compactor_mutex);
+	return NULL;
+}
+
+// Stops the compactor and waits for it, letting a compaction in progress
+// finish first. Callers after the first wait until it has been joined.
+void stop_compactor()
+{
+	pthread_mutex_lock(&compactor_mutex);
+	if(compactor_state == 0){
+		compactor_state = 1;
+		pthread_cond_broadcast(&compactor_cond);
+		pthread_mutex_unlock(&compactor_mutex);
+		pthread_join(compactor_tid, NULL);
+		pthread_mutex_lock(&compactor_mutex);
+		compactor_state = 2;
+		pthread_cond_broadcast(&compactor_cond);
+	}
+	while(compactor_state != 2)
+		pthread_cond_wait(&compactor_cond, &compactor_mutex);
+	pthread_mutex_unlock(&compactor_mutex);
+}
@@ -0,0 +1,404 @@
+/* storage.c
+
+   The storage engines of the key-value server: the sharded KISSDB hash
+   table, the B+tree and the log-structured merge tree, each wrapped in a
+   STORAGE_Engine.
+
+*/
+
+#include "storage.h"
+#include "kissdb_shard.h"
+#include "bptree.h"
+#include "lsmdb.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define HASH_SIZE               1024
+#define COMPACT_MIN_DEAD     1048576  // compact once this much is dead...
+                                      // ...and at least as much as is live
+#define WAL_SYNC   KISSDB_WAL_SYNC_COMMIT  // durability of PUT/DEL replies
+#define WAL_INTERVAL             100  // ms between log syncs if not per commit
+#define CACHE_BUDGET        16777216  // bytes of values kept in memory
+#define BLOOM_FP_RATE           0.01  // GET gia kleidi pou den yparxei: 1% pane sto index
+#define SHARDS                     8  // database files, each with its own lock
+#define BPTREE_CACHE_PAGES      4096  // 4 KB pages of the B+tree kept in memory
+#define LSM_MEMTABLE_BYTES   4194304  // writes buffered in memory before a sorted run
+
+/* Byte order, shorter key first on a common prefix, as the ordered engines keep keys */
+static int STORAGE_compare(const void *a,unsigned long alen,const void *b,unsigned long blen)
+{
+	int c = memcmp(a,b,(alen < blen) ? alen : blen);
+	if (c)
+		return c;
+	return (alen < blen) ? -1 : ((alen > blen) ? 1 : 0);
+}
+
+/* ---- kissdb: sharded hash table ---- */
+
+/* i vasi xwrizetai se SHARDS kommatia me vasi to hash tou kleidiou. Kathe
+ * kommati exei ti diki tou kleidaria anagnwstwn/grafewn, opote PUT se
+ * diaforetika kommatia den perimenoun to ena to allo. */
+typedef struct {
+	KISSDB_Sharded sdb;
+	unsigned long key_size;
+	unsigned long value_size;
+} STORAGE_Kissdb;
+
+static int STORAGE_kissdb_open(void **db,const char *path,unsigned long key_size,unsigned long value_size)
+{
+	STORAGE_Kissdb *k;
+
+	if (!(k = malloc(sizeof(STORAGE_Kissdb))))
+		return KISSDB_ERROR_MALLOC;
+	k->key_size = key_size;
+	k->value_size = value_size;
+	if (KISSDB_Sharded_open(&k->sdb,path,KISSDB_OPEN_MODE_RWCREAT | KISSDB_OPEN_FLAG_MMAP | KISSDB_OPEN_FLAG_VARLEN,SHARDS,HASH_SIZE,key_size,value_size)) {
+		free(k);
+		return KISSDB_ERROR_IO;
+	}
+
+	/* cache timwn gia ta GET */
+	if (KISSDB_Sharded_cache_enable(&k->sdb,CACHE_BUDGET)) {
+		fprintf(stderr,"(Error) storage: Cannot allocate the value cache.\n");
+		goto kissdb_open_fail;
+	}
+
+	/* bloom filter: ta GET gia kleidia pou den yparxoun den agizoun to index */
+	if (KISSDB_Sharded_bloom_enable(&k->sdb,BLOOM_FP_RATE)) {
+		fprintf(stderr,"(Error) storage: Cannot build the Bloom filter.\n");
+		goto kissdb_open_fail;
+	}
+
+	/* write-ahead log mprosta apo ti vasi. To KISSDB_Sharded_put_len
+	 * perimenei to sync tou log ektos kleidarias, wste oi PUT pou
+	 * perimenoun mazi na ginoun sync me mia fora (group commit) */
+	if (KISSDB_Sharded_wal_enable(&k->sdb,WAL_SYNC,WAL_INTERVAL)) {
+		fprintf(stderr,"(Error) storage: Cannot open the write-ahead log.\n");
+		goto kissdb_open_fail;
+	}
+
+	*db = (void *)k;
+	return 0;
+
+kissdb_open_fail:
+	KISSDB_Sharded_close(&k->sdb);
+	free(k);
+	return KISSDB_ERROR_IO;
+}
+
+static int STORAGE_kissdb_get(void *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	return KISSDB_Sharded_get_len(&((STORAGE_Kissdb *)db)->sdb,key,klen,vbuf,vlen);
+}
+
+static int STORAGE_kissdb_put(void *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	return KISSDB_Sharded_put_len(&((STORAGE_Kissdb *)db)->sdb,key,klen,value,vlen);
+}
+
+static int STORAGE_kissdb_del(void *db,const void *key,unsigned long klen)
+{
+	return KISSDB_Sharded_delete(&((STORAGE_Kissdb *)db)->sdb,key,klen);
+}
+
+/* The hash table has no key order, so this walks every entry */
+static int STORAGE_kissdb_scan(void *db,const void *start,unsigned long slen,const void *end,unsigned long elen,STORAGE_Scan_Callback cb,void *arg)
+{
+	STORAGE_Kissdb *k = (STORAGE_Kissdb *)db;
+	KISSDB_Sharded_Iterator dbi;
+	uint8_t *kbuf,*vbuf;
+	unsigned long klen,vlen;
+	int r;
+
+	kbuf = malloc(k->key_size);
+	vbuf = malloc(k->value_size);
+	if ((!kbuf)||(!vbuf)) {
+		free(kbuf);
+		free(vbuf);
+		return KISSDB_ERROR_MALLOC;
+	}
+	KISSDB_Sharded_Iterator_init(&k->sdb,&dbi);
+	while ((r = KISSDB_Sharded_Iterator_next_len(&dbi,kbuf,&klen,vbuf,&vlen)) > 0) {
+		if ((start)&&(STORAGE_compare(kbuf,klen,start,slen) < 0))
+			continue;
+		if ((end)&&(STORAGE_compare(kbuf,klen,end,elen) > 0))
+			continue;
+		if ((r = cb(arg,kbuf,klen,vbuf,vlen)))
+			break;
+	}
+	free(kbuf);
+	free(vbuf);
+	return r;
+}
+
+static void STORAGE_kissdb_stats(void *db,FILE *out)
+{
+	KISSDB_Sharded *sdb = &((STORAGE_Kissdb *)db)->sdb;
+	KISSDB_Cache_Stats cst;
+	KISSDB_Stats st;
+	unsigned long i;
+	int r;
+
+	KISSDB_Sharded_cache_stats(sdb,&cst);
+	fprintf(out," cache hits: %llu misses: %llu evictions: %llu\n",(unsigned long long)cst.hits,(unsigned long long)cst.misses,(unsigned long long)cst.evictions);
+
+	/* ana kommati: selides tou hash table, vathos, nekra bytes kai I/O */
+	for(i=0;i<sdb->num_shards;++i) {
+		pthread_rwlock_rdlock(&sdb->shards[i].lock);
+		r = KISSDB_stats(&sdb->shards[i].db,&st,(uint64_t *)0,0);
+		pthread_rwlock_unlock(&sdb->shards[i].lock);
+		if (r)
+			continue;
+		fprintf(out," shard %lu: %lu pages load %.2f probe %.2f/%.2f max %lu, live %llu dead %llu bytes, %llu gets %llu puts %llu deletes, %llu reads %llu writes %llu syncs\n",
+			i,st.num_hash_tables,st.load_factor,st.avg_probe,st.avg_probe_miss,st.max_probe,
+			(unsigned long long)st.live_bytes,(unsigned long long)st.dead_bytes,
+			(unsigned long long)st.counters.gets,(unsigned long long)st.counters.puts,(unsigned long long)st.counters.deletes,
+			(unsigned long long)st.counters.reads,(unsigned long long)st.counters.writes,(unsigned long long)st.counters.syncs);
+	}
+}
+
+/* Reclaim the space of overwritten and deleted entries, one shard at a
+ * time. The copy is made from a snapshot without the shard's lock, so
+ * gets, puts and deletes carry on; only taking the snapshot and the final
+ * catch-up and file swap hold out readers and writers, and only those of
+ * that shard. */
+static int STORAGE_kissdb_maintain(void *db)
+{
+	KISSDB_Sharded *sdb = &((STORAGE_Kissdb *)db)->sdb;
+	KISSDB_Compaction c;
+	KISSDB_Shard *s;
+	uint64_t dead;
+	unsigned long i;
+	int r,err = 0;
+
+	for(i=0;i<sdb->num_shards;++i) {
+		s = &sdb->shards[i];
+		pthread_rwlock_wrlock(&s->lock);
+		dead = KISSDB_dead_bytes(&s->db);
+		if ((dead < COMPACT_MIN_DEAD)||(dead < s->db.live_bytes)) {
+			pthread_rwlock_unlock(&s->lock);
+			continue;
+		}
+		r = KISSDB_compact_begin(&s->db,&c);
+		pthread_rwlock_unlock(&s->lock);
+		if (r) {
+			fprintf(stderr,"(Error) compactor: Cannot compact shard %lu (%d).\n",i,r);
+			err = r;
+			continue;
+		}
+
+		r = KISSDB_compact_copy(&c);
+
+		pthread_rwlock_wrlock(&s->lock);
+		if (r)
+			KISSDB_compact_abort(&s->db,&c);
+		else r = KISSDB_compact_finish(&s->db,&c);
+		pthread_rwlock_unlock(&s->lock);
+		if (r) {
+			fprintf(stderr,"(Error) compactor: Cannot compact shard %lu (%d).\n",i,r);
+			err = r;
+		}
+	}
+	return err;
+}
+
+static void STORAGE_kissdb_close(void *db)
+{
+	KISSDB_Sharded_close(&((STORAGE_Kissdb *)db)->sdb);
+	free(db);
+}
+
+static const STORAGE_Engine STORAGE_kissdb = {
+	"kissdb",
+	"sharded hash table",
+	"mydb.shards",
+	STORAGE_kissdb_open,
+	STORAGE_kissdb_get,
+	STORAGE_kissdb_put,
+	STORAGE_kissdb_del,
+	STORAGE_kissdb_scan,
+	STORAGE_kissdb_stats,
+	STORAGE_kissdb_maintain,
+	STORAGE_kissdb_close
+};
+
+/* ---- bptree: B+tree ---- */
+
+static int STORAGE_bptree_open(void **db,const char *path,unsigned long key_size,unsigned long value_size)
+{
+	BPTREE *bt;
+	int r;
+
+	if (!(bt = malloc(sizeof(BPTREE))))
+		return BPTREE_ERROR_MALLOC;
+	if ((r = BPTREE_open(bt,path,BPTREE_OPEN_MODE_RWCREAT,BPTREE_CACHE_PAGES,key_size,value_size))) {
+		free(bt);
+		return r;
+	}
+	*db = (void *)bt;
+	return 0;
+}
+
+static int STORAGE_bptree_get(void *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	return BPTREE_get((BPTREE *)db,key,klen,vbuf,vlen);
+}
+
+/* o B+tree den exei log: oi allagmenes selides kai i kefalida grafontai
+ * kai ginontai sync prin tin apantisi */
+static int STORAGE_bptree_put(void *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	int r;
+
+	if ((r = BPTREE_put((BPTREE *)db,key,klen,value,vlen)))
+		return r;
+	return BPTREE_sync((BPTREE *)db);
+}
+
+static int STORAGE_bptree_del(void *db,const void *key,unsigned long klen)
+{
+	int r;
+
+	if ((r = BPTREE_delete((BPTREE *)db,key,klen)))
+		return r;
+	return BPTREE_sync((BPTREE *)db);
+}
+
+static int STORAGE_bptree_scan(void *db,const void *start,unsigned long slen,const void *end,unsigned long elen,STORAGE_Scan_Callback cb,void *arg)
+{
+	return BPTREE_range_scan((BPTREE *)db,start,slen,end,elen,cb,arg);
+}
+
+static void STORAGE_bptree_stats(void *db,FILE *out)
+{
+	fprintf(out," entries: %llu pages: %llu\n",(unsigned long long)((BPTREE *)db)->count,(unsigned long long)((BPTREE *)db)->num_pages);
+}
+
+/* kleisimo vasis, grafontai oi allagmenes selides */
+static void STORAGE_bptree_close(void *db)
+{
+	BPTREE_close((BPTREE *)db);
+	free(db);
+}
+
+/* o B+tree den afinei nekro xwro, opote den xreiazetai compaction */
+static const STORAGE_Engine STORAGE_bptree = {
+	"bptree",
+	"B+tree, keeps keys in order",
+	"mydb.bpt",
+	STORAGE_bptree_open,
+	STORAGE_bptree_get,
+	STORAGE_bptree_put,
+	STORAGE_bptree_del,
+	STORAGE_bptree_scan,
+	STORAGE_bptree_stats,
+	NULL,
+	STORAGE_bptree_close
+};
+
+/* ---- lsm: log-structured merge tree ---- */
+
+static int STORAGE_lsm_open(void **db,const char *path,unsigned long key_size,unsigned long value_size)
+{
+	LSMDB *l;
+	int r;
+
+	if (!(l = malloc(sizeof(LSMDB))))
+		return LSMDB_ERROR_MALLOC;
+	if ((r = LSMDB_open(l,path,LSMDB_OPEN_MODE_RWCREAT,LSM_MEMTABLE_BYTES,key_size,value_size))) {
+		free(l);
+		return r;
+	}
+	*db = (void *)l;
+	return 0;
+}
+
+static int STORAGE_lsm_get(void *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen)
+{
+	return LSMDB_get((LSMDB *)db,key,klen,vbuf,vlen);
+}
+
+/* sto LSM to PUT grafetai sto log kai sto memtable, kai to log ginetai
+ * sync prin tin apantisi */
+static int STORAGE_lsm_put(void *db,const void *key,unsigned long klen,const void *value,unsigned long vlen)
+{
+	int r;
+
+	if ((r = LSMDB_put((LSMDB *)db,key,klen,value,vlen)))
+		return r;
+	return LSMDB_sync((LSMDB *)db);
+}
+
+static int STORAGE_lsm_del(void *db,const void *key,unsigned long klen)
+{
+	int r;
+
+	if ((r = LSMDB_delete((LSMDB *)db,key,klen)))
+		return r;
+	return LSMDB_sync((LSMDB *)db);
+}
+
+static int STORAGE_lsm_scan(void *db,const void *start,unsigned long slen,const void *end,unsigned long elen,STORAGE_Scan_Callback cb,void *arg)
+{
+	return LSMDB_range_scan((LSMDB *)db,start,slen,end,elen,cb,arg);
+}
+
+static void STORAGE_lsm_stats(void *db,FILE *out)
+{
+	LSMDB_Stats lst;
+
+	LSMDB_stats((LSMDB *)db,&lst);
+	fprintf(out," runs: %llu flushes: %llu merges: %llu bloom skips: %llu\n",(unsigned long long)lst.runs,(unsigned long long)lst.flushes,(unsigned long long)lst.compactions,(unsigned long long)lst.bloom_skips);
+}
+
+/* kleisimo vasis, to memtable grafetai se run */
+static void STORAGE_lsm_close(void *db)
+{
+	LSMDB_close((LSMDB *)db);
+	free(db);
+}
+
+/* ta runs ta enwnei to idio to LSMDB se diko tou nima */
+static const STORAGE_Engine STORAGE_lsm = {
+	"lsm",
+	"log-structured merge tree, for write-heavy loads",
+	"mydb.lsm",
+	STORAGE_lsm_open,
+	STORAGE_lsm_get,
+	STORAGE_lsm_put,
+	STORAGE_lsm_del,
+	STORAGE_lsm_scan,
+	STORAGE_lsm_stats,
+	NULL,
+	STORAGE_lsm_close
+};
+
+/* Durability of a PUT or DEL once the server has replied OK:
+ *
+ * kissdb  in the shard's write-ahead log, synced per commit (WAL_SYNC), and
+ *         replayed on open after a crash.
+ * bptree  every changed page, then the header, written and synced. There
+ *         is no log and pages are rewritten in place, so a crash in the
+ *         middle of a put or its sync can still leave that put's pages
+ *         half written; every earlier reply stands.
+ * lsm     in the log, synced, and replayed on open after a crash. */
+const STORAGE_Engine *const STORAGE_engines[] = {
+	&STORAGE_kissdb,
+	&STORAGE_bptree,
+	&STORAGE_lsm,
+	NULL
+};
+
+const STORAGE_Engine *STORAGE_find(const char *name)
+{
+	unsigned long i;
+
+	for(i=0;STORAGE_engines[i];++i) {
+		if (!strcmp(STORAGE_engines[i]->name,name))
+			return STORAGE_engines[i];
+	}
+	return (const STORAGE_Engine *)0;
+}
@@ -0,0 +1,122 @@
+/* storage.h
+
+   Storage engines behind the key-value server. Each engine is a table of
+   functions, so the server reaches every database the same way and the
+   engine is picked by name when it starts.
+
+*/
+
+#ifndef ___STORAGE_H
+#define ___STORAGE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Called by an engine's scan function for each entry in the range
+ *
+ * The key and value are only valid until the callback returns.
+ *
+ * @return 0 to continue, nonzero to stop the scan
+ */
+typedef int (*STORAGE_Scan_Callback)(void *arg,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+/**
+ * A storage engine
+ *
+ * The functions take the handle open returned. They may be called from
+ * several threads at once; each engine does its own locking.
+ */
+typedef struct {
+	/**
+	 * Name to select the engine by, and a line about it for -h
+	 */
+	const char *name;
+	const char *description;
+
+	/**
+	 * Path of the database, created if it does not exist
+	 */
+	const char *path;
+
+	/**
+	 * Open the database at path
+	 *
+	 * @param db Set to the engine's handle
+	 * @param path Path of the database
+	 * @param key_size Maximum size of keys in bytes
+	 * @param value_size Maximum size of values in bytes
+	 * @return 0 on success, nonzero on error
+	 */
+	int (*open)(void **db,const char *path,unsigned long key_size,unsigned long value_size);
+
+	/**
+	 * Get an entry
+	 *
+	 * @return 0 on success, 1 on not found, negative on error
+	 */
+	int (*get)(void *db,const void *key,unsigned long klen,void *vbuf,unsigned long *vlen);
+
+	/**
+	 * Put an entry
+	 *
+	 * @return 0 on success, nonzero on error
+	 */
+	int (*put)(void *db,const void *key,unsigned long klen,const void *value,unsigned long vlen);
+
+	/**
+	 * Delete an entry
+	 *
+	 * @return 0 on success, 1 on not found, negative on error
+	 */
+	int (*del)(void *db,const void *key,unsigned long klen);
+
+	/**
+	 * Visit all entries with start <= key <= end (by bytes, shorter keys
+	 * first); a NULL start or end leaves that side open. Ordered engines
+	 * visit them in key order, the others in no particular order.
+	 *
+	 * @return Negative on error, 0 if the whole range was visited, or the nonzero value cb stopped with
+	 */
+	int (*scan)(void *db,const void *start,unsigned long slen,const void *end,unsigned long elen,STORAGE_Scan_Callback cb,void *arg);
+
+	/**
+	 * Print the engine's counters
+	 */
+	void (*stats)(void *db,FILE *out);
+
+	/**
+	 * Periodic upkeep, e.g. reclaiming dead space; NULL if the engine
+	 * needs none
+	 *
+	 * @return 0 on success, nonzero on error
+	 */
+	int (*maintain)(void *db);
+
+	/**
+	 * Close the database, writing out anything held in memory
+	 */
+	void (*close)(void *db);
+} STORAGE_Engine;
+
+/**
+ * The engines, the first being the default, ending with NULL
+ */
+extern const STORAGE_Engine *const STORAGE_engines[];
+
+/**
+ * Look up an engine by name
+ *
+ * @param name Engine name
+ * @return The engine, or NULL if there is none by that name
+ */
+extern const STORAGE_Engine *STORAGE_find(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif